@@ -99,7 +99,7 @@ struct _daq_module
      int (*dp_add_dc) (void *handle, const DAQ_PktHdr_t * hdr, DAQ_DP_key_t * dp_key, const uint8_t * packet_data);
 };
 
-#define DAQ_API_VERSION    0x00010002
+#define DAQ_API_VERSION    0x00010003
 
 #define DAQ_ERRBUF_SIZE 256
 /* This is a convenience macro for safely printing to DAQ error buffers.  It must be called on a known-size character array. */
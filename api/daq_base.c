@@ -432,6 +432,8 @@ DAQ_LINKAGE void daq_print_stats(DAQ_Stats_t *stats, FILE *fp)
     fprintf(fp, "*DAQ Module Statistics*\n");
     fprintf(fp, "  Hardware Packets Received:  %" PRIu64 "\n", stats->hw_packets_received);
     fprintf(fp, "  Hardware Packets Dropped:   %" PRIu64 "\n", stats->hw_packets_dropped);
+    if (stats->hw_packets_rolled_over)
+        fprintf(fp, "  Hardware Packets Rolled Over: %" PRIu64 "\n", stats->hw_packets_rolled_over);
     fprintf(fp, "  Packets Received:   %" PRIu64 "\n", stats->packets_received);
     fprintf(fp, "  Packets Filtered:   %" PRIu64 "\n", stats->packets_filtered);
     fprintf(fp, "  Packets Passed:     %" PRIu64 "\n", stats->verdicts[DAQ_VERDICT_PASS]);
@@ -91,6 +91,12 @@
 #define DAQ_PKT_FLAG_SSL_SHELLO	    0x20 /* Packet is ssl server hello */
 #define DAQ_PKT_FLAG_SSL_SERVER_KEYX	0x40 /* Packet is ssl server keyx */
 #define DAQ_PKT_FLAG_SSL_CLIENT_KEYX	0x80 /* Packet is ssl client keyx */
+#define DAQ_PKT_FLAG_VLAN_STRIPPED      0x100 /* The outermost VLAN tag was removed from the packet data and
+                                                is reported in the vlan_tpid and vlan_tci fields instead. */
+#define DAQ_PKT_FLAG_TS_NSEC            0x200 /* The ts_nsec field holds the timestamp's nanoseconds. */
+#define DAQ_PKT_FLAG_HW_TIMESTAMP       0x400 /* The timestamp was taken by the network adapter. */
+#define DAQ_PKT_FLAG_CLASSIFIED         0x800 /* The DAQ module ran its class filters on the packet and
+                                                put the result in class_id. */
 
 /* The DAQ packet header structure passed to DAQ Analysis Functions.
  * This should NEVER be modified by user applications. */
@@ -111,6 +117,11 @@ typedef struct _daq_pkthdr
     void *priv_ptr;         /* Private data pointer */
     uint32_t flow_id;
     uint16_t address_space_id; /* Unique ID of the address space */
+    uint16_t vlan_tpid;     /* TPID of the stripped VLAN tag (valid with DAQ_PKT_FLAG_VLAN_STRIPPED) */
+    uint16_t vlan_tci;      /* TCI of the stripped VLAN tag (valid with DAQ_PKT_FLAG_VLAN_STRIPPED) */
+    uint32_t ts_nsec;       /* Nanoseconds within ts.tv_sec (valid with DAQ_PKT_FLAG_TS_NSEC) */
+    uint32_t class_id;      /* Number of the first class filter the packet matched, or 0 for none
+                               (valid with DAQ_PKT_FLAG_CLASSIFIED) */
 } DAQ_PktHdr_t;
 
 #define DAQ_METAHDR_TYPE_SOF        0
@@ -228,9 +239,13 @@ typedef struct _daq_stats
     uint64_t hw_packets_received;       /* Packets received by the hardware */
     uint64_t hw_packets_dropped;        /* Packets dropped by the hardware */
     uint64_t packets_received;          /* Packets received by this instance */
-    uint64_t packets_filtered;          /* Packets filtered by this instance's BPF */
+    uint64_t packets_filtered;          /* Packets filtered by this instance's BPF (not those dropped by a kernel filter) */
     uint64_t packets_injected;          /* Packets injected by this instance */
     uint64_t verdicts[MAX_DAQ_VERDICT]; /* Counters of packets handled per-verdict. */
+    uint64_t hw_packets_rolled_over;    /* Packets steered to another fanout group member by rollover */
+    uint64_t hw_flows_offloaded;        /* Flows whose verdict was installed as hardware rules */
+    uint64_t hw_flows_expired;          /* Offloaded flows whose hardware rules were removed after going idle */
+    uint64_t hw_packets_offloaded;      /* Packets handled by hardware flow rules without reaching the DAQ */
 } DAQ_Stats_t;
 
 #define DAQ_DP_TUNNEL_TYPE_NON_TUNNEL 0
@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <net/if.h>
@@ -38,6 +39,10 @@
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#ifdef PACKET_FANOUT_EBPF
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#endif
 
 #include "daq_api.h"
 #include "sfbpf.h"
@@ -45,11 +50,65 @@
 #define DAQ_AFPACKET_VERSION 5
 
 #define AF_PACKET_DEFAULT_BUFFER_SIZE   128
+#define AF_PACKET_DEFAULT_TX_BATCH  32
 #define AF_PACKET_MAX_INTERFACES    32
 
+#ifdef TPACKET3_HDRLEN
+#define HAVE_TPACKET3
+/* Default TPACKET_V3 block size (in KB) and retire timeout (in milliseconds, 0 lets the kernel pick). */
+#define AF_PACKET_V3_DEFAULT_BLOCK_SIZE 1024
+#define AF_PACKET_V3_DEFAULT_RETIRE_TOV 0
+#endif
+
+#ifdef PACKET_FANOUT
+typedef struct _af_packet_fanout_name
+{
+    const char *name;
+    uint16_t value;
+} AFPacketFanoutName;
+
+static const AFPacketFanoutName fanout_types[] = {
+    { "hash", PACKET_FANOUT_HASH },
+    { "lb", PACKET_FANOUT_LB },
+#ifdef PACKET_FANOUT_CPU
+    { "cpu", PACKET_FANOUT_CPU },
+#endif
+#ifdef PACKET_FANOUT_ROLLOVER
+    { "rollover", PACKET_FANOUT_ROLLOVER },
+#endif
+#ifdef PACKET_FANOUT_RND
+    { "rnd", PACKET_FANOUT_RND },
+#endif
+#ifdef PACKET_FANOUT_QM
+    { "qm", PACKET_FANOUT_QM },
+#endif
+#ifdef PACKET_FANOUT_CBPF
+    { "cbpf", PACKET_FANOUT_CBPF },
+#endif
+#ifdef PACKET_FANOUT_EBPF
+    { "ebpf", PACKET_FANOUT_EBPF },
+#endif
+    { NULL, 0 }
+};
+
+static const AFPacketFanoutName fanout_flags[] = {
+#ifdef PACKET_FANOUT_FLAG_ROLLOVER
+    { "rollover", PACKET_FANOUT_FLAG_ROLLOVER },
+#endif
+#ifdef PACKET_FANOUT_FLAG_DEFRAG
+    { "defrag", PACKET_FANOUT_FLAG_DEFRAG },
+#endif
+    { NULL, 0 }
+};
+#endif
+
 union thdr
 {
     struct tpacket2_hdr *h2;
+#ifdef HAVE_TPACKET3
+    struct tpacket3_hdr *h3;
+    struct tpacket_block_desc *bd;
+#endif
     uint8_t *raw;
 };
 
@@ -66,6 +125,11 @@ typedef struct _af_packet_ring
     void *start;
     AFPacketEntry *entries;
     AFPacketEntry *cursor;
+#ifdef HAVE_TPACKET3
+    /* TPACKET_V3 entries are whole blocks; track our position within the current one. */
+    union thdr frame;
+    uint32_t frames_left;
+#endif
 } AFPacketRing;
 
 typedef struct _af_packet_instance
@@ -81,6 +145,11 @@ typedef struct _af_packet_instance
     int index;
     struct _af_packet_instance *peer;
     struct sockaddr_ll sll;
+    uint32_t tx_pending;
+    int kernel_filter;
+#ifdef PACKET_ROLLOVER_STATS
+    uint64_t rollover_seen;
+#endif
 } AFPacketInstance;
 
 typedef struct _afpacket_context
@@ -91,9 +160,27 @@ typedef struct _afpacket_context
     int timeout;
     uint32_t size;
     int debug;
+    uint32_t tx_batch;
+    int qdisc_bypass;
+    int acquiring;
+    int vlan_metadata;
+    int no_kernel_filter;
+    int use_tpacket_v3;
+    uint32_t block_size;
+    uint32_t retire_tov;
+#ifdef PACKET_FANOUT
+    int use_fanout;
+    uint16_t fanout_type;
+    uint16_t fanout_flags;
+    uint16_t fanout_id;
+    char *fanout_prog;
+    struct sock_fprog fanout_cbpf;
+    int fanout_ebpf_fd;
+#endif
     AFPacketInstance *instances;
     uint32_t intf_count;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
     volatile int break_loop;
     DAQ_Stats_t stats;
     DAQ_State state;
@@ -137,10 +224,96 @@ static int bind_instance_interface(AFPacket_Context_t *afpc, AFPacketInstance *i
     return DAQ_SUCCESS;
 }
 
+/* Translate the compiled filter into a kernel socket filter so that unwanted traffic never makes
+    it into the ring.  The kernel runs socket filters after hardware VLAN acceleration has stripped
+    the tag, so unless the filter was compiled to look for the tag in the ancillary data, those
+    packets are accepted as-is and left to the userspace filter once the tag has been put back.
+    If the kernel won't take the program, userspace filtering is all we get. */
+static int attach_kernel_filter(AFPacket_Context_t *afpc, AFPacketInstance *instance)
+{
+#ifdef SKF_AD_VLAN_TAG_PRESENT
+    static const struct sock_filter vlan_guard[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    };
+    const unsigned int guard_len = afpc->vlan_metadata ? 0 : sizeof(vlan_guard) / sizeof(vlan_guard[0]);
+    struct sock_filter *insns;
+    struct sock_fprog fprog;
+    unsigned int i;
+    int rval;
+
+    /* Start from a clean slate in case we're replacing an earlier filter. */
+    if (instance->kernel_filter)
+    {
+        setsockopt(instance->fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+        instance->kernel_filter = 0;
+    }
+
+    /* Inline interfaces still forward the packets they filter out, so they can't drop them early.
+        The kernel has no equivalent of the table lookups used for sets, either. */
+    if (afpc->no_kernel_filter || instance->peer || !afpc->fcode.bf_insns || afpc->fcode.bf_ntables ||
+        afpc->fcode.bf_len + guard_len > BPF_MAXINSNS)
+        return DAQ_SUCCESS;
+
+    insns = calloc(afpc->fcode.bf_len + guard_len, sizeof(struct sock_filter));
+    if (!insns)
+    {
+        DPE(afpc->errbuf, "%s: Couldn't allocate memory for the kernel filter!", __FUNCTION__);
+        return DAQ_ERROR_NOMEM;
+    }
+    memcpy(insns, vlan_guard, guard_len * sizeof(struct sock_filter));
+    /* SFBPF shares the classic BPF instruction encoding (ancillary loads included), and jumps
+        are relative, so the compiled program carries over unchanged behind the guard. */
+    for (i = 0; i < afpc->fcode.bf_len; i++)
+    {
+        insns[guard_len + i].code = afpc->fcode.bf_insns[i].code;
+        insns[guard_len + i].jt = afpc->fcode.bf_insns[i].jt;
+        insns[guard_len + i].jf = afpc->fcode.bf_insns[i].jf;
+        insns[guard_len + i].k = afpc->fcode.bf_insns[i].k;
+    }
+    fprog.len = afpc->fcode.bf_len + guard_len;
+    fprog.filter = insns;
+
+    rval = setsockopt(instance->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    free(insns);
+    if (rval == 0)
+        instance->kernel_filter = 1;
+    else if (afpc->debug)
+        printf("%s: Kernel rejected the socket filter (%s), filtering in userspace\n", instance->name, strerror(errno));
+#endif
+
+    return DAQ_SUCCESS;
+}
+
 static int set_up_ring(AFPacket_Context_t *afpc, AFPacketInstance *instance, AFPacketRing *ring)
 {
     unsigned int idx, block, block_offset, frame, frame_offset;
 
+#ifdef HAVE_TPACKET3
+    /* TPACKET_V3 rings are handed back and forth with the kernel a block at a time. */
+    if (instance->tp_version == TPACKET_V3 && ring == &instance->rx_ring)
+    {
+        ring->entries = calloc(ring->layout.tp_block_nr, sizeof(AFPacketEntry));
+        if (!ring->entries)
+        {
+            DPE(afpc->errbuf, "%s: Could not allocate ring buffer entries for device %s!", __FUNCTION__, instance->name);
+            return DAQ_ERROR_NOMEM;
+        }
+        for (block = 0; block < ring->layout.tp_block_nr; block++)
+        {
+            ring->entries[block].hdr.raw = (uint8_t *) ring->start + block * ring->layout.tp_block_size;
+            ring->entries[block].next = &ring->entries[block + 1];
+        }
+        ring->entries[ring->layout.tp_block_nr - 1].next = &ring->entries[0];
+        ring->cursor = &ring->entries[0];
+        ring->frame.raw = NULL;
+        ring->frames_left = 0;
+
+        return DAQ_SUCCESS;
+    }
+#endif
+
     /* Allocate a ring to hold packet pointers. */
     ring->entries = calloc(ring->layout.tp_frame_nr, sizeof(AFPacketEntry));
     if (!ring->entries)
@@ -173,7 +346,12 @@ static int set_up_ring(AFPacket_Context_t *afpc, AFPacketInstance *instance, AFP
 static void destroy_instance(AFPacketInstance *instance)
 {
     unsigned int ringsize;
+#ifdef HAVE_TPACKET3
+    /* TPACKET_V3 sockets insist on the larger request structure, even to tear down. */
+    struct tpacket_req3 req;
+#else
     struct tpacket_req req;
+#endif
 
     if (instance)
     {
@@ -288,6 +466,28 @@ static int determine_version(AFPacket_Context_t *afpc, AFPacketInstance *instanc
     socklen_t len;
     int val;
 
+#ifdef HAVE_TPACKET3
+    /* TPACKET_V3 is only used for the RX ring of passive interfaces; inline pairs need
+        fixed-size V2 frames for their TX rings.  Fall back to V2 if the kernel says no. */
+    if (afpc->use_tpacket_v3 && !instance->peer)
+    {
+        val = TPACKET_V3;
+        len = sizeof(val);
+        if (getsockopt(instance->fd, SOL_PACKET, PACKET_HDRLEN, &val, &len) == 0)
+        {
+            instance->tp_hdrlen = val;
+            val = TPACKET_V3;
+            if (setsockopt(instance->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) == 0)
+            {
+                instance->tp_version = TPACKET_V3;
+                goto reserve;
+            }
+        }
+        if (afpc->debug)
+            printf("%s: TPACKET_V3 is unavailable (%s), falling back to TPACKET_V2\n", instance->name, strerror(errno));
+    }
+#endif
+
     /* Probe whether kernel supports TPACKET_V2 */
     val = TPACKET_V2;
     len = sizeof(val);
@@ -307,6 +507,9 @@ static int determine_version(AFPacket_Context_t *afpc, AFPacketInstance *instanc
     }
     instance->tp_version = TPACKET_V2;
 
+#ifdef HAVE_TPACKET3
+reserve:
+#endif
     /* Reserve space for VLAN tag reconstruction */
     val = VLAN_TAG_LEN;
     if (setsockopt(instance->fd, SOL_PACKET, PACKET_RESERVE, &val, sizeof(val)) < 0)
@@ -328,7 +531,8 @@ static int calculate_layout(AFPacket_Context_t *afpc, struct tpacket_req *layout
 {
     unsigned int tp_hdrlen_sll, netoff, frames_per_block;
 
-    /* Calculate the frame size and minimum block size required. */
+    /* Calculate the frame size and minimum block size required.  For TPACKET_V3 rings the
+        frame size is only the upper bound on a single packet; frames are packed into blocks. */
     tp_hdrlen_sll = TPACKET_ALIGN(tp_hdrlen) + sizeof(struct sockaddr_ll);
     netoff = TPACKET_ALIGN(tp_hdrlen_sll + ETH_HLEN) + VLAN_TAG_LEN;
     layout->tp_frame_size = TPACKET_ALIGN(netoff - ETH_HLEN + afpc->snaplen);
@@ -364,15 +568,40 @@ static int calculate_layout(AFPacket_Context_t *afpc, struct tpacket_req *layout
 #define DEFAULT_ORDER 3
 static int create_ring(AFPacket_Context_t *afpc, AFPacketInstance *instance, AFPacketRing *ring, int optname)
 {
-    int rc, order;
+    int rc, order, start_order;
+#ifdef HAVE_TPACKET3
+    struct tpacket_req3 req3;
+#endif
+
+    start_order = DEFAULT_ORDER;
+#ifdef HAVE_TPACKET3
+    /* V3 blocks are sized from the configured block size rather than the default order. */
+    if (instance->tp_version == TPACKET_V3 && optname == PACKET_RX_RING)
+    {
+        for (start_order = 0; ((unsigned) getpagesize() << (start_order + 1)) <= afpc->block_size; start_order++);
+    }
+#endif
 
     /* Starting with page allocations of order 3, try to allocate an RX ring in the kernel. */
-    for (order = DEFAULT_ORDER; order >= 0; order--)
+    for (order = start_order; order >= 0; order--)
     {
         if (calculate_layout(afpc, &ring->layout, instance->tp_hdrlen, order))
             return DAQ_ERROR;
 
         /* Ask the kernel to create the ring. */
+#ifdef HAVE_TPACKET3
+        if (instance->tp_version == TPACKET_V3 && optname == PACKET_RX_RING)
+        {
+            memset(&req3, 0, sizeof(req3));
+            req3.tp_block_size = ring->layout.tp_block_size;
+            req3.tp_block_nr = ring->layout.tp_block_nr;
+            req3.tp_frame_size = ring->layout.tp_frame_size;
+            req3.tp_frame_nr = ring->layout.tp_frame_nr;
+            req3.tp_retire_blk_tov = afpc->retire_tov;
+            rc = setsockopt(instance->fd, SOL_PACKET, optname, (void*) &req3, sizeof(req3));
+        }
+        else
+#endif
         rc = setsockopt(instance->fd, SOL_PACKET, optname, (void*) &ring->layout, sizeof(struct tpacket_req));
         if (rc)
         {
@@ -411,16 +640,199 @@ static int mmap_rings(AFPacket_Context_t *afpc, AFPacketInstance *instance)
         return DAQ_ERROR;
     }
     instance->rx_ring.start = instance->buffer;
-    instance->tx_ring.start = (uint8_t *) instance->buffer + instance->tx_ring.size;
+    instance->tx_ring.start = (uint8_t *) instance->buffer + instance->rx_ring.size;
+
+    return DAQ_SUCCESS;
+}
+
+#ifdef PACKET_FANOUT
+static int lookup_fanout_name(const AFPacketFanoutName *names, const char *name)
+{
+    for (; name && names->name; names++)
+    {
+        if (!strcmp(names->name, name))
+            return names->value;
+    }
+    return -1;
+}
+
+#ifdef PACKET_FANOUT_CBPF
+/* Load a classic BPF steering program in the format produced by 'tcpdump -ddd': an
+    instruction count followed by one "code jt jf k" line per instruction. */
+static int load_fanout_cbpf(AFPacket_Context_t *afpc, char *errbuf, size_t errlen)
+{
+    struct sock_filter *insns;
+    unsigned int code, jt, jf, k, count, i;
+    FILE *fp;
+
+    fp = fopen(afpc->fanout_prog, "r");
+    if (!fp)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't open fanout program '%s': %s", __FUNCTION__, afpc->fanout_prog, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    if (fscanf(fp, "%u", &count) != 1 || count == 0 || count > BPF_MAXINSNS)
+    {
+        snprintf(errbuf, errlen, "%s: Invalid instruction count in fanout program '%s'!", __FUNCTION__, afpc->fanout_prog);
+        fclose(fp);
+        return DAQ_ERROR;
+    }
+
+    insns = calloc(count, sizeof(struct sock_filter));
+    if (!insns)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the fanout program!", __FUNCTION__);
+        fclose(fp);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (fscanf(fp, "%u %u %u %u", &code, &jt, &jf, &k) != 4 || code > 0xFFFF || jt > 0xFF || jf > 0xFF)
+        {
+            snprintf(errbuf, errlen, "%s: Invalid instruction %u in fanout program '%s'!", __FUNCTION__, i, afpc->fanout_prog);
+            free(insns);
+            fclose(fp);
+            return DAQ_ERROR;
+        }
+        insns[i].code = code;
+        insns[i].jt = jt;
+        insns[i].jf = jf;
+        insns[i].k = k;
+    }
+    fclose(fp);
+
+    afpc->fanout_cbpf.len = count;
+    afpc->fanout_cbpf.filter = insns;
+
+    return DAQ_SUCCESS;
+}
+#endif
+
+#if defined(PACKET_FANOUT_EBPF) && defined(__NR_bpf)
+/* Fetch an eBPF steering program that has already been loaded and pinned to the BPF filesystem. */
+static int load_fanout_ebpf(AFPacket_Context_t *afpc, char *errbuf, size_t errlen)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uint64_t) (unsigned long) afpc->fanout_prog;
+    afpc->fanout_ebpf_fd = syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+    if (afpc->fanout_ebpf_fd < 0)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't get pinned eBPF fanout program '%s': %s", __FUNCTION__, afpc->fanout_prog, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+#endif
+
+static int load_fanout_prog(AFPacket_Context_t *afpc, char *errbuf, size_t errlen)
+{
+    switch (afpc->fanout_type)
+    {
+#ifdef PACKET_FANOUT_CBPF
+        case PACKET_FANOUT_CBPF:
+            if (!afpc->fanout_prog)
+                break;
+            return load_fanout_cbpf(afpc, errbuf, errlen);
+#endif
+
+#ifdef PACKET_FANOUT_EBPF
+        case PACKET_FANOUT_EBPF:
+            if (!afpc->fanout_prog)
+                break;
+#ifdef __NR_bpf
+            return load_fanout_ebpf(afpc, errbuf, errlen);
+#else
+            snprintf(errbuf, errlen, "%s: eBPF fanout programs are not supported on this system!", __FUNCTION__);
+            return DAQ_ERROR;
+#endif
+#endif
+
+        default:
+            if (afpc->fanout_prog)
+            {
+                snprintf(errbuf, errlen, "%s: A fanout program requires a fanout type of cbpf or ebpf!", __FUNCTION__);
+                return DAQ_ERROR;
+            }
+            return DAQ_SUCCESS;
+    }
+
+    snprintf(errbuf, errlen, "%s: The selected fanout type requires a fanout program!", __FUNCTION__);
+    return DAQ_ERROR;
+}
+
+static void free_fanout_prog(AFPacket_Context_t *afpc)
+{
+    if (afpc->fanout_cbpf.filter)
+    {
+        free(afpc->fanout_cbpf.filter);
+        afpc->fanout_cbpf.filter = NULL;
+        afpc->fanout_cbpf.len = 0;
+    }
+    if (afpc->fanout_ebpf_fd >= 0)
+    {
+        close(afpc->fanout_ebpf_fd);
+        afpc->fanout_ebpf_fd = -1;
+    }
+    if (afpc->fanout_prog)
+    {
+        free(afpc->fanout_prog);
+        afpc->fanout_prog = NULL;
+    }
+}
+
+static int join_fanout_group(AFPacket_Context_t *afpc, AFPacketInstance *instance)
+{
+    uint32_t fanout_arg;
+    uint16_t group_id;
+
+    /* The kernel ties a fanout group to a single interface, so each interface gets its own
+        group based on its index.  fanout_id offsets that to keep independent deployments apart. */
+    group_id = (afpc->fanout_id + instance->index) & 0xFFFF;
+    fanout_arg = ((uint32_t) (afpc->fanout_type | afpc->fanout_flags) << 16) | group_id;
+    if (setsockopt(instance->fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) == -1)
+    {
+        DPE(afpc->errbuf, "%s: Couldn't join fanout group %u on %s: %s",
+                __FUNCTION__, group_id, instance->name, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+#ifdef PACKET_FANOUT_DATA
+    /* The steering program can only be attached once the socket is a member of the group. */
+    if (afpc->fanout_cbpf.filter &&
+        setsockopt(instance->fd, SOL_PACKET, PACKET_FANOUT_DATA, &afpc->fanout_cbpf, sizeof(afpc->fanout_cbpf)) == -1)
+    {
+        DPE(afpc->errbuf, "%s: Couldn't attach the cBPF fanout program on %s: %s", __FUNCTION__, instance->name, strerror(errno));
+        return DAQ_ERROR;
+    }
+    if (afpc->fanout_ebpf_fd >= 0 &&
+        setsockopt(instance->fd, SOL_PACKET, PACKET_FANOUT_DATA, &afpc->fanout_ebpf_fd, sizeof(afpc->fanout_ebpf_fd)) == -1)
+    {
+        DPE(afpc->errbuf, "%s: Couldn't attach the eBPF fanout program on %s: %s", __FUNCTION__, instance->name, strerror(errno));
+        return DAQ_ERROR;
+    }
+#endif
+
+    if (afpc->debug)
+        printf("%s: Joined fanout group %u (type %u, flags 0x%x)\n", instance->name, group_id, afpc->fanout_type, afpc->fanout_flags);
 
     return DAQ_SUCCESS;
 }
+#endif
 
 static int start_instance(AFPacket_Context_t *afpc, AFPacketInstance *instance)
 {
     struct packet_mreq mr;
     int arptype;
 
+    /* Filter in the kernel where possible before any packets start flowing into the ring. */
+    if (attach_kernel_filter(afpc, instance) != DAQ_SUCCESS)
+        return -1;
+
     /* Bind the RX ring to this interface. */
     if (bind_instance_interface(afpc, instance) != 0)
         return -1;
@@ -471,6 +883,26 @@ static int start_instance(AFPacket_Context_t *afpc, AFPacketInstance *instance)
     if (instance->peer && set_up_ring(afpc, instance, &instance->tx_ring) != DAQ_SUCCESS)
         return -1;
 
+#ifdef PACKET_QDISC_BYPASS
+    /* Hand transmitted frames straight to the driver rather than going through the qdisc layer. */
+    if (instance->peer && afpc->qdisc_bypass)
+    {
+        int val = 1;
+
+        if (setsockopt(instance->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &val, sizeof(val)) == -1)
+        {
+            DPE(afpc->errbuf, "%s: Couldn't enable qdisc bypass on %s: %s", __FUNCTION__, instance->name, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
+#ifdef PACKET_FANOUT
+    /* Join the fanout group last so no traffic is steered to us before the rings exist. */
+    if (afpc->use_fanout && join_fanout_group(afpc, instance) != DAQ_SUCCESS)
+        return -1;
+#endif
+
     return 0;
 }
 
@@ -479,6 +911,10 @@ static void update_hw_stats(AFPacket_Context_t *afpc)
     AFPacketInstance *instance;
     struct tpacket_stats kstats;
     socklen_t len = sizeof (struct tpacket_stats);
+#ifdef PACKET_ROLLOVER_STATS
+    struct tpacket_rollover_stats rstats;
+    socklen_t rlen;
+#endif
 
     if (afpc->state != DAQ_STATE_STARTED)
         return;
@@ -494,6 +930,16 @@ static void update_hw_stats(AFPacket_Context_t *afpc)
         }
         else
             fprintf(stderr, "Failed to get stats for %s: %d %s\n", instance->name, errno, strerror(errno));
+#ifdef PACKET_ROLLOVER_STATS
+        /* Rollover counters only exist when rollover is in play and, unlike PACKET_STATISTICS,
+            are never cleared by reading them. */
+        rlen = sizeof(rstats);
+        if (afpc->use_fanout && getsockopt(instance->fd, SOL_PACKET, PACKET_ROLLOVER_STATS, &rstats, &rlen) == 0)
+        {
+            afpc->stats.hw_packets_rolled_over += rstats.tp_all - instance->rollover_seen;
+            instance->rollover_seen = rstats.tp_all;
+        }
+#endif
     }
 }
 
@@ -514,6 +960,12 @@ static int af_packet_close(AFPacket_Context_t *afpc)
     }
 
     sfbpf_freecode(&afpc->fcode);
+    sfbpf_jit_free(afpc->fjit);
+    afpc->fjit = NULL;
+
+#ifdef PACKET_FANOUT
+    free_fanout_prog(afpc);
+#endif
 
     afpc->state = DAQ_STATE_STOPPED;
 
@@ -547,11 +999,23 @@ static void reset_stats(AFPacket_Context_t *afpc)
     AFPacketInstance *instance;
     struct tpacket_stats kstats;
     socklen_t len = sizeof (struct tpacket_stats);
+#ifdef PACKET_ROLLOVER_STATS
+    struct tpacket_rollover_stats rstats;
+    socklen_t rlen;
+#endif
 
     memset(&afpc->stats, 0, sizeof(DAQ_Stats_t));
     /* Just call PACKET_STATISTICS to clear each instance's stats. */
     for (instance = afpc->instances; instance; instance = instance->next)
+    {
         getsockopt(instance->fd, SOL_PACKET, PACKET_STATISTICS, &kstats, &len);
+#ifdef PACKET_ROLLOVER_STATS
+        /* The rollover counters can't be cleared, so remember where they stand instead. */
+        rlen = sizeof(rstats);
+        if (afpc->use_fanout && getsockopt(instance->fd, SOL_PACKET, PACKET_ROLLOVER_STATS, &rstats, &rlen) == 0)
+            instance->rollover_seen = rstats.tp_all;
+#endif
+    }
 }
 
 static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
@@ -559,6 +1023,11 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
     AFPacket_Context_t *afpc;
     AFPacketInstance *instance;
     const char *size_str = NULL;
+    char *endptr;
+#ifdef PACKET_FANOUT
+    unsigned long fanout_id;
+    int fanout_val;
+#endif
     char *name1, *name2, *dev;
     char intf[IFNAMSIZ];
     uint32_t size;
@@ -574,6 +1043,9 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
         rval = DAQ_ERROR_NOMEM;
         goto err;
     }
+#ifdef PACKET_FANOUT
+    afpc->fanout_ebpf_fd = -1;
+#endif
 
     afpc->device = strdup(config->name);
     if (!afpc->device)
@@ -585,6 +1057,11 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
 
     afpc->snaplen = config->snaplen;
     afpc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+    afpc->tx_batch = AF_PACKET_DEFAULT_TX_BATCH;
+#ifdef HAVE_TPACKET3
+    afpc->block_size = AF_PACKET_V3_DEFAULT_BLOCK_SIZE * 1024;
+    afpc->retire_tov = AF_PACKET_V3_DEFAULT_RETIRE_TOV;
+#endif
 
     dev = afpc->device;
     if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') || (config->mode == DAQ_MODE_PASSIVE && strstr(dev, "::")))
@@ -657,7 +1134,101 @@ static int afpacket_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
             size_str = entry->value;
         else if (!strcmp(entry->key, "debug"))
             afpc->debug = 1;
+        else if (!strcmp(entry->key, "tx_batch_size"))
+        {
+            size = entry->value ? strtoul(entry->value, &endptr, 10) : 0;
+            if (size == 0 || *endptr != '\0')
+            {
+                snprintf(errbuf, errlen, "%s: Invalid TX batch size: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            afpc->tx_batch = size;
+        }
+        else if (!strcmp(entry->key, "vlan_metadata"))
+            afpc->vlan_metadata = 1;
+        else if (!strcmp(entry->key, "no_kernel_filter"))
+            afpc->no_kernel_filter = 1;
+#ifdef PACKET_QDISC_BYPASS
+        else if (!strcmp(entry->key, "qdisc_bypass"))
+            afpc->qdisc_bypass = 1;
+#endif
+#ifdef HAVE_TPACKET3
+        else if (!strcmp(entry->key, "tpacket_v3"))
+            afpc->use_tpacket_v3 = 1;
+        else if (!strcmp(entry->key, "block_size_kb"))
+        {
+            size = entry->value ? strtoul(entry->value, &endptr, 10) : 0;
+            if (size == 0 || *endptr != '\0')
+            {
+                snprintf(errbuf, errlen, "%s: Invalid TPACKET_V3 block size: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            afpc->block_size = size * 1024;
+        }
+        else if (!strcmp(entry->key, "block_timeout_ms"))
+        {
+            endptr = NULL;
+            if (entry->value)
+                size = strtoul(entry->value, &endptr, 10);
+            if (!endptr || endptr == entry->value || *endptr != '\0')
+            {
+                snprintf(errbuf, errlen, "%s: Invalid TPACKET_V3 block timeout: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            afpc->retire_tov = size;
+        }
+#endif
+#ifdef PACKET_FANOUT
+        else if (!strcmp(entry->key, "fanout_type"))
+        {
+            if ((fanout_val = lookup_fanout_name(fanout_types, entry->value)) < 0)
+            {
+                snprintf(errbuf, errlen, "%s: Unknown fanout type: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            afpc->fanout_type = fanout_val;
+            afpc->use_fanout = 1;
+        }
+        else if (!strcmp(entry->key, "fanout_flag"))
+        {
+            if ((fanout_val = lookup_fanout_name(fanout_flags, entry->value)) < 0)
+            {
+                snprintf(errbuf, errlen, "%s: Unknown fanout flag: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            afpc->fanout_flags |= fanout_val;
+        }
+        else if (!strcmp(entry->key, "fanout_id"))
+        {
+            endptr = NULL;
+            if (entry->value)
+                fanout_id = strtoul(entry->value, &endptr, 0);
+            if (!endptr || endptr == entry->value || *endptr != '\0' || fanout_id > 0xFFFF)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid fanout ID: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            afpc->fanout_id = fanout_id;
+        }
+        else if (!strcmp(entry->key, "fanout_prog"))
+        {
+            if (!entry->value || afpc->fanout_prog || !(afpc->fanout_prog = strdup(entry->value)))
+            {
+                snprintf(errbuf, errlen, "%s: Invalid fanout program: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+#endif
+    }
+#ifdef PACKET_FANOUT
+    if (!afpc->use_fanout && (afpc->fanout_flags || afpc->fanout_id || afpc->fanout_prog))
+    {
+        snprintf(errbuf, errlen, "%s: Fanout options require a fanout_type!", __FUNCTION__);
+        goto err;
     }
+    if (afpc->use_fanout && (rval = load_fanout_prog(afpc, errbuf, errlen)) != DAQ_SUCCESS)
+        goto err;
+#endif
     /* Fall back to the environment variable. */
     if (!size_str)
         size_str = getenv("AF_PACKET_BUFFER_SIZE");
@@ -693,7 +1264,11 @@ err:
 static int afpacket_daq_set_filter(void *handle, const char *filter)
 {
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    AFPacketInstance *instance;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    struct sfbpf_deps deps;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
 
     if (afpc->filter)
         free(afpc->filter);
@@ -705,15 +1280,47 @@ static int afpacket_daq_set_filter(void *handle, const char *filter)
         return DAQ_ERROR;
     }
 
-    if (sfbpf_compile(afpc->snaplen, DLT_EN10MB, &fcode, afpc->filter, 1, 0) < 0)
+    if (sfbpf_compile_cached(NULL, afpc->snaplen, DLT_EN10MB, &fcode, afpc->filter, 1, 0,
+                                   afpc->vlan_metadata ? SFBPF_COMPILE_VLAN_AUX : 0, bpf_errbuf) < 0)
+    {
+        DPE(afpc->errbuf, "%s: BPF state machine compilation failed: %.*s", __FUNCTION__,
+                (int) sizeof(afpc->errbuf) / 2, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if (!fjit)
     {
-        DPE(afpc->errbuf, "%s: BPF state machine compilation failed!", __FUNCTION__);
+        DPE(afpc->errbuf, "%s: Couldn't prepare the BPF state machine!", __FUNCTION__);
+        sfbpf_freecode(&fcode);
         return DAQ_ERROR;
     }
 
+    /* Frames only hold snaplen bytes, and the filter rejects packets it can't read far enough into. */
+    if (sfbpf_analyze(&fcode, &deps) == 0 && deps.max_offset > (sfbpf_u_int32) afpc->snaplen)
+    {
+        if (deps.flags & SFBPF_DEPS_UNBOUNDED)
+            fprintf(stderr, "%s: Filter may read arbitrarily far into packets, but the snaplen is %d\n",
+                    __FUNCTION__, afpc->snaplen);
+        else
+            fprintf(stderr, "%s: Filter may read up to %u bytes into packets, but the snaplen is %d\n",
+                    __FUNCTION__, deps.max_offset, afpc->snaplen);
+    }
+
     sfbpf_freecode(&afpc->fcode);
-    afpc->fcode.bf_len = fcode.bf_len;
-    afpc->fcode.bf_insns = fcode.bf_insns;
+    afpc->fcode = fcode;
+    sfbpf_jit_free(afpc->fjit);
+    afpc->fjit = fjit;
+
+    /* Instances pick up the filter when they start; update any that already have. */
+    if (afpc->state == DAQ_STATE_STARTED)
+    {
+        for (instance = afpc->instances; instance; instance = instance->next)
+        {
+            if (attach_kernel_filter(afpc, instance) != DAQ_SUCCESS)
+                return DAQ_ERROR;
+        }
+    }
 
     return DAQ_SUCCESS;
 }
@@ -746,19 +1353,142 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
 };
 
-static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+/* Return the next frame the kernel has handed to us on the RX ring, if any. */
+static inline uint8_t *afpacket_next_rx_frame(AFPacketInstance *instance)
+{
+    AFPacketRing *ring = &instance->rx_ring;
+    union thdr hdr;
+
+    hdr = ring->cursor->hdr;
+#ifdef HAVE_TPACKET3
+    if (instance->tp_version == TPACKET_V3)
+    {
+        if (ring->frames_left == 0)
+        {
+            if (!(hdr.bd->hdr.bh1.block_status & TP_STATUS_USER))
+                return NULL;
+            /* Don't hold on to an empty block that the kernel retired. */
+            if (hdr.bd->hdr.bh1.num_pkts == 0)
+            {
+                hdr.bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+                ring->cursor = ring->cursor->next;
+                return NULL;
+            }
+            ring->frames_left = hdr.bd->hdr.bh1.num_pkts;
+            ring->frame.raw = hdr.raw + hdr.bd->hdr.bh1.offset_to_first_pkt;
+        }
+        return ring->frame.raw;
+    }
+#endif
+    if (!(hdr.h2->tp_status & TP_STATUS_USER))
+        return NULL;
+
+    return hdr.raw;
+}
+
+/* Release the current RX frame.  TPACKET_V3 blocks go back to the kernel once all of their
+    frames have been processed. */
+static inline void afpacket_release_rx_frame(AFPacketInstance *instance)
+{
+    AFPacketRing *ring = &instance->rx_ring;
+
+    switch (instance->tp_version)
+    {
+        case TPACKET_V2:
+            ring->cursor->hdr.h2->tp_status = TP_STATUS_KERNEL;
+            ring->cursor = ring->cursor->next;
+            break;
+
+#ifdef HAVE_TPACKET3
+        case TPACKET_V3:
+            if (--ring->frames_left > 0)
+            {
+                ring->frame.raw += ring->frame.h3->tp_next_offset;
+                break;
+            }
+            ring->cursor->hdr.bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+            ring->cursor = ring->cursor->next;
+            break;
+#endif
+    }
+}
+
+/* Kick the kernel to transmit any frames queued on an instance's TX ring. */
+static inline int afpacket_flush_tx(AFPacketInstance *instance)
+{
+    if (!instance->tx_pending)
+        return 0;
+
+    instance->tx_pending = 0;
+    return send(instance->fd, NULL, 0, MSG_DONTWAIT);
+}
+
+static inline void afpacket_flush_all_tx(AFPacket_Context_t *afpc)
+{
+    AFPacketInstance *instance;
+
+    for (instance = afpc->instances; instance; instance = instance->next)
+        afpacket_flush_tx(instance);
+}
+
+/* Copy a packet into the next TX frame, putting back the VLAN tag if one is given.  The kernel
+    is only told about it once tx_batch frames have been queued or the caller flushes, saving a
+    syscall per packet. */
+static inline int afpacket_queue_tx(AFPacket_Context_t *afpc, AFPacketInstance *instance, const uint8_t *data,
+                                    unsigned int len, const struct vlan_tag *tag)
+{
+    AFPacketEntry *entry = instance->tx_ring.cursor;
+    uint8_t *frame;
+
+    if (len < (unsigned int) vlan_offset)
+        tag = NULL;
+
+    if (len + (tag ? VLAN_TAG_LEN : 0) > instance->tx_ring.layout.tp_frame_size - TPACKET_ALIGN(instance->tp_hdrlen))
+        return DAQ_ERROR;
+
+    /* If the ring is full, push what we have queued and hope the kernel frees something up. */
+    if (entry->hdr.h2->tp_status != TP_STATUS_AVAILABLE)
+    {
+        afpacket_flush_tx(instance);
+        if (entry->hdr.h2->tp_status != TP_STATUS_AVAILABLE)
+            return DAQ_ERROR_AGAIN;
+    }
+
+    frame = entry->hdr.raw + TPACKET_ALIGN(instance->tp_hdrlen);
+    if (tag)
+    {
+        memcpy(frame, data, vlan_offset);
+        memcpy(frame + vlan_offset, tag, VLAN_TAG_LEN);
+        memcpy(frame + vlan_offset + VLAN_TAG_LEN, data + vlan_offset, len - vlan_offset);
+        len += VLAN_TAG_LEN;
+    }
+    else
+        memcpy(frame, data, len);
+    entry->hdr.h2->tp_len = len;
+    entry->hdr.h2->tp_status = TP_STATUS_SEND_REQUEST;
+    instance->tx_ring.cursor = entry->next;
+
+    if (++instance->tx_pending >= afpc->tx_batch)
+        afpacket_flush_tx(instance);
+
+    return DAQ_SUCCESS;
+}
+
+static int afpacket_acquire_packets(AFPacket_Context_t *afpc, int cnt, DAQ_Analysis_Func_t callback, void *user)
 {
-    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
     AFPacketInstance *instance;
     DAQ_PktHdr_t daqhdr;
     DAQ_Verdict verdict;
     union thdr hdr;
     struct pollfd pfd[AF_PACKET_MAX_INTERFACES];
+    struct sfbpf_aux_data aux_data;
+    struct vlan_tag tx_tag;
+    const struct vlan_tag *tx_tagp;
     const uint8_t *data;
     uint32_t i;
-    int got_one, ignored_one;
+    int got_one, ignored_one, vlan_stripped;
     int ret, c = 0;
-    unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec;
+    unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec, tp_vlan_tci, tp_vlan_tpid, tp_status, frame_space;
 
     while (c < cnt || cnt <= 0)
     {
@@ -773,8 +1503,8 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                 return 0;
             }
 
-            hdr = instance->rx_ring.cursor->hdr;
-            if (instance->tp_version == TPACKET_V2 && (hdr.h2->tp_status & TP_STATUS_USER))
+            hdr.raw = afpacket_next_rx_frame(instance);
+            if (hdr.raw)
             {
                 switch (instance->tp_version)
                 {
@@ -784,28 +1514,68 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                         tp_snaplen = hdr.h2->tp_snaplen;
                         tp_sec = hdr.h2->tp_sec;
                         tp_usec = hdr.h2->tp_nsec / 1000;
+                        tp_vlan_tci = hdr.h2->tp_vlan_tci;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+                        tp_vlan_tpid = hdr.h2->tp_vlan_tpid;
+#endif
+                        tp_status = hdr.h2->tp_status;
+                        frame_space = instance->rx_ring.layout.tp_frame_size;
                         break;
 
+#ifdef HAVE_TPACKET3
+                    case TPACKET_V3:
+                        tp_len = hdr.h3->tp_len;
+                        tp_mac = hdr.h3->tp_mac;
+                        tp_snaplen = hdr.h3->tp_snaplen;
+                        tp_sec = hdr.h3->tp_sec;
+                        tp_usec = hdr.h3->tp_nsec / 1000;
+                        tp_vlan_tci = hdr.h3->hv1.tp_vlan_tci;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+                        tp_vlan_tpid = hdr.h3->hv1.tp_vlan_tpid;
+#endif
+                        tp_status = hdr.h3->tp_status;
+                        /* Frames are packed, so the only hard limit is the end of the block. */
+                        frame_space = instance->rx_ring.layout.tp_block_size -
+                                        (hdr.raw - instance->rx_ring.cursor->hdr.raw);
+                        break;
+#endif
+
                     default:
                         DPE(afpc->errbuf, "%s: Unknown TPACKET version: %u!", __FUNCTION__, instance->tp_version);
                         return DAQ_ERROR;
                 }
-                if (tp_mac + tp_snaplen > instance->rx_ring.layout.tp_frame_size)
+                if (tp_mac + tp_snaplen > frame_space)
                 {
-                    DPE(afpc->errbuf, "%s: Corrupted frame on kernel ring (MAC offset %u + CapLen %u > FrameSize %d)",
-                        __FUNCTION__, tp_mac, tp_snaplen, instance->rx_ring.layout.tp_frame_size);
+                    DPE(afpc->errbuf, "%s: Corrupted frame on kernel ring (MAC offset %u + CapLen %u > FrameSize %u)",
+                        __FUNCTION__, tp_mac, tp_snaplen, frame_space);
                     return DAQ_ERROR;
                 }
-                data = instance->rx_ring.cursor->hdr.raw + tp_mac;
+                data = hdr.raw + tp_mac;
 
-                /* Make a valiant attempt at reconstructing the VLAN tag if it has been stripped.  This really sucks. :( */
-                if ((instance->tp_version == TPACKET_V2) &&
 #if defined(TP_STATUS_VLAN_VALID)
-                    (hdr.h2->tp_vlan_tci || (hdr.h2->tp_status & TP_STATUS_VLAN_VALID)) &&
+                vlan_stripped = (tp_vlan_tci || (tp_status & TP_STATUS_VLAN_VALID));
 #else
-                    hdr.h2->tp_vlan_tci &&
+                vlan_stripped = (tp_vlan_tci != 0);
+#endif
+#ifdef TP_STATUS_VLAN_TPID_VALID
+                if (!(tp_status & TP_STATUS_VLAN_TPID_VALID))
 #endif
-                    tp_snaplen >= (unsigned int) vlan_offset)
+                    tp_vlan_tpid = ETH_P_8021Q;
+                tx_tagp = NULL;
+                if (afpc->vlan_metadata)
+                {
+                    /* Leave the packet alone and describe the tag to the filter and the caller instead. */
+                    aux_data.vlan_tag = tp_vlan_tci;
+                    aux_data.vlan_tag_present = vlan_stripped;
+                    if (vlan_stripped && instance->peer)
+                    {
+                        tx_tag.vlan_tpid = htons(tp_vlan_tpid);
+                        tx_tag.vlan_tci = htons(tp_vlan_tci);
+                        tx_tagp = &tx_tag;
+                    }
+                }
+                /* Make a valiant attempt at reconstructing the VLAN tag if it has been stripped.  This really sucks. :( */
+                else if (vlan_stripped && tp_snaplen >= (unsigned int) vlan_offset)
                 {
                     struct vlan_tag *tag;
 
@@ -813,15 +1583,18 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                     memmove((void *) data, data + VLAN_TAG_LEN, vlan_offset);
 
                     tag = (struct vlan_tag *) (data + vlan_offset);
-                    tag->vlan_tpid = htons(ETH_P_8021Q);
-                    tag->vlan_tci = htons(hdr.h2->tp_vlan_tci);
+                    tag->vlan_tpid = htons(tp_vlan_tpid);
+                    tag->vlan_tci = htons(tp_vlan_tci);
 
                     tp_snaplen += VLAN_TAG_LEN;
                     tp_len += VLAN_TAG_LEN;
                 }
 
                 verdict = DAQ_VERDICT_PASS;
-                if (afpc->fcode.bf_insns && sfbpf_filter(afpc->fcode.bf_insns, data, tp_len, tp_snaplen) == 0)
+                /* The kernel has already filtered everything but packets with a reconstructed VLAN tag. */
+                if (afpc->fjit && (!instance->kernel_filter || (vlan_stripped && !afpc->vlan_metadata)) &&
+                    sfbpf_filter_jit_with_aux_data(afpc->fjit, data, tp_len, tp_snaplen,
+                                                   afpc->vlan_metadata ? &aux_data : NULL) == 0)
                 {
                     ignored_one = 1;
                     afpc->stats.packets_filtered++;
@@ -841,6 +1614,14 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                 daqhdr.opaque = 0;
                 daqhdr.priv_ptr = NULL;
                 daqhdr.address_space_id = 0;
+                daqhdr.vlan_tpid = 0;
+                daqhdr.vlan_tci = 0;
+                if (afpc->vlan_metadata && vlan_stripped)
+                {
+                    daqhdr.flags |= DAQ_PKT_FLAG_VLAN_STRIPPED;
+                    daqhdr.vlan_tpid = tp_vlan_tpid;
+                    daqhdr.vlan_tci = tp_vlan_tci;
+                }
 
                 if (callback)
                 {
@@ -853,29 +1634,11 @@ static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                 afpc->stats.packets_received++;
                 c++;
 send_packet:
+                /* If the peer's TX ring is full, don't forward the packet... */
                 if (verdict == DAQ_VERDICT_PASS && instance->peer)
-                {
-                    AFPacketEntry *entry = instance->peer->tx_ring.cursor;
-                    int rc;
-
-                    if (entry->hdr.h2->tp_status == TP_STATUS_AVAILABLE)
-                    {
-                        memcpy(entry->hdr.raw + TPACKET_ALIGN(instance->peer->tp_hdrlen), data, tp_snaplen);
-                        entry->hdr.h2->tp_len = tp_snaplen;
-                        entry->hdr.h2->tp_status = TP_STATUS_SEND_REQUEST;
-                        rc = send(instance->peer->fd, NULL, 0, 0);
-                        instance->peer->tx_ring.cursor = entry->next;
-                    }
-                    /* Else, don't forward the packet... */
-                }
+                    afpacket_queue_tx(afpc, instance->peer, data, tp_snaplen, tx_tagp);
                 /* Release the TPACKET buffer back to the kernel. */
-                switch (instance->tp_version)
-                {
-                    case TPACKET_V2:
-                        hdr.h2->tp_status = TP_STATUS_KERNEL;
-                        break;
-                }
-                instance->rx_ring.cursor = instance->rx_ring.cursor->next;
+                afpacket_release_rx_frame(instance);
             }
         }
         if (!got_one && !ignored_one)
@@ -886,6 +1649,8 @@ send_packet:
                 pfd[i].revents = 0;
                 pfd[i].events = POLLIN;
             }
+            /* Don't leave forwarded packets sitting in the TX rings while we wait. */
+            afpacket_flush_all_tx(afpc);
             ret = poll(pfd, afpc->intf_count, afpc->timeout);
             /* If we were interrupted by a signal, start the loop over.  The user should call daq_breakloop to actually exit. */
             if (ret < 0 && errno != EINTR)
@@ -918,11 +1683,26 @@ send_packet:
     return 0;
 }
 
+static int afpacket_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
+    int rval;
+
+    afpc->acquiring = 1;
+    rval = afpacket_acquire_packets(afpc, cnt, callback, user);
+    /* Send whatever was queued for transmission during this batch. */
+    afpacket_flush_all_tx(afpc);
+    afpc->acquiring = 0;
+
+    return rval;
+}
+
 static int afpacket_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
 {
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
     AFPacketInstance *instance;
-    AFPacketEntry *entry;
+    struct vlan_tag tag;
+    int rval;
 
     /* Find the instance that the packet was received on. */
     for (instance = afpc->instances; instance; instance = instance->next)
@@ -931,23 +1711,33 @@ static int afpacket_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint
             break;
     }
 
-    if (!instance || (!reverse && !(instance = instance->peer)))
+    if (!instance || (!reverse && !(instance = instance->peer)) || !instance->tx_ring.entries)
         return DAQ_ERROR;
 
-    entry = instance->tx_ring.cursor;
-    if (entry->hdr.h2->tp_status == TP_STATUS_AVAILABLE)
+    /* Put back the VLAN tag if we handed the packet up without it. */
+    if (hdr->flags & DAQ_PKT_FLAG_VLAN_STRIPPED)
     {
-        memcpy(entry->hdr.raw + TPACKET_ALIGN(instance->tp_hdrlen), packet_data, len);
-        entry->hdr.h2->tp_len = len;
-        entry->hdr.h2->tp_status = TP_STATUS_SEND_REQUEST;
-        instance->tx_ring.cursor = entry->next;
-        if (send(instance->fd, NULL, 0, 0) < 0)
-        {
-            DPE(afpc->errbuf, "%s: Error sending packet: %s (%d)", __FUNCTION__, strerror(errno), errno);
-            return DAQ_ERROR;
-        }
-        afpc->stats.packets_injected++;
+        tag.vlan_tpid = htons(hdr->vlan_tpid);
+        tag.vlan_tci = htons(hdr->vlan_tci);
+        rval = afpacket_queue_tx(afpc, instance, packet_data, len, &tag);
+    }
+    else
+        rval = afpacket_queue_tx(afpc, instance, packet_data, len, NULL);
+    /* As before, quietly drop the packet if the TX ring is full. */
+    if (rval == DAQ_ERROR_AGAIN)
+        return DAQ_SUCCESS;
+    if (rval != DAQ_SUCCESS)
+    {
+        DPE(afpc->errbuf, "%s: Packet too large to send on %s (%u)", __FUNCTION__, instance->name, len);
+        return DAQ_ERROR;
+    }
+    /* Injections made from within the acquire loop go out with the rest of the batch. */
+    if (!afpc->acquiring && afpacket_flush_tx(instance) < 0 && errno != EAGAIN && errno != ENOBUFS)
+    {
+        DPE(afpc->errbuf, "%s: Error sending packet: %s (%d)", __FUNCTION__, strerror(errno), errno);
+        return DAQ_ERROR;
     }
+    afpc->stats.packets_injected++;
 
     return DAQ_SUCCESS;
 }
@@ -0,0 +1,1290 @@
+/*
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "daq_api.h"
+#include "sfbpf.h"
+
+#define DAQ_AFXDP_VERSION 1
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define AF_XDP_MAX_INTERFACES   32
+#define AF_XDP_FRAME_SIZE       4096
+#define AF_XDP_DEFAULT_RING_SIZE    2048
+#define AF_XDP_RX_BATCH         64
+
+#define AF_XDP_INVALID_FRAME    ((uint64_t) -1)
+
+/* A producer/consumer ring shared with the kernel. */
+typedef struct _af_xdp_ring
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t mask;
+    uint32_t size;
+    void *map;
+    size_t map_len;
+} AFXDPRing;
+
+typedef struct _af_xdp_interface
+{
+    struct _af_xdp_interface *next;
+    char *name;
+    int index;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    struct _af_xdp_interface *peer;
+} AFXDPInterface;
+
+typedef struct _af_xdp_instance
+{
+    struct _af_xdp_instance *next;
+    int fd;
+    AFXDPInterface *intf;
+    uint32_t queue;
+    AFXDPRing rx;
+    AFXDPRing tx;
+    AFXDPRing fill;
+    AFXDPRing comp;
+    uint32_t tx_pending;
+    uint64_t drops_seen;
+    struct _af_xdp_instance *peer;
+} AFXDPInstance;
+
+typedef struct _afxdp_context
+{
+    char *device;
+    char *filter;
+    int snaplen;
+    int timeout;
+    int debug;
+    uint32_t start_queue;
+    uint32_t num_queues;
+    uint32_t ring_size;
+    uint32_t xdp_flags;
+    uint16_t bind_flags;
+    AFXDPInterface *intfs;
+    uint32_t intf_count;
+    AFXDPInstance *instances;
+    uint32_t instance_count;
+    struct pollfd *pfds;
+    /* Every socket shares a single UMEM so that forwarding a packet is just a matter of handing
+        its frame to the peer's TX ring. */
+    uint8_t *umem;
+    size_t umem_size;
+    uint64_t *free_frames;
+    uint32_t free_count;
+    struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    volatile int break_loop;
+    int acquiring;
+    DAQ_Stats_t stats;
+    DAQ_State state;
+    char errbuf[256];
+} AFXDP_Context_t;
+
+static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_PASS */
+    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLOCK */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_REPLACE */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_WHITELIST */
+    DAQ_VERDICT_BLOCK,      /* DAQ_VERDICT_BLACKLIST */
+    DAQ_VERDICT_PASS,       /* DAQ_VERDICT_IGNORE */
+    DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
+};
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Ring helpers.  We own the producer index of the fill and TX rings and the consumer index of
+ * the RX and completion rings; the kernel owns the other halves.
+ */
+static inline uint32_t ring_entries(AFXDPRing *ring)
+{
+    return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer;
+}
+
+static inline uint32_t ring_free(AFXDPRing *ring)
+{
+    return ring->size - (*ring->producer - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+static inline void ring_release(AFXDPRing *ring, uint32_t n)
+{
+    __atomic_store_n(ring->consumer, *ring->consumer + n, __ATOMIC_RELEASE);
+}
+
+static inline void ring_submit(AFXDPRing *ring, uint32_t n)
+{
+    __atomic_store_n(ring->producer, *ring->producer + n, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t frame_alloc(AFXDP_Context_t *afxdpc)
+{
+    if (afxdpc->free_count == 0)
+        return AF_XDP_INVALID_FRAME;
+    return afxdpc->free_frames[--afxdpc->free_count];
+}
+
+static inline void frame_free(AFXDP_Context_t *afxdpc, uint64_t addr)
+{
+    /* Descriptors may point past the start of a frame; hand back the frame itself. */
+    afxdpc->free_frames[afxdpc->free_count++] = addr & ~((uint64_t) AF_XDP_FRAME_SIZE - 1);
+}
+
+/* Give the kernel as many empty frames as will fit to receive into. */
+static void refill_fill_ring(AFXDP_Context_t *afxdpc, AFXDPInstance *instance)
+{
+    AFXDPRing *ring = &instance->fill;
+    uint64_t *addrs = ring->descs;
+    uint32_t i, n, prod;
+
+    n = ring_free(ring);
+    if (n > afxdpc->free_count)
+        n = afxdpc->free_count;
+    if (n == 0)
+        return;
+
+    prod = *ring->producer;
+    for (i = 0; i < n; i++)
+        addrs[(prod + i) & ring->mask] = frame_alloc(afxdpc);
+    ring_submit(ring, n);
+
+    if (*ring->flags & XDP_RING_NEED_WAKEUP)
+        recvfrom(instance->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* Reclaim the frames the kernel has finished transmitting. */
+static void drain_completion_ring(AFXDP_Context_t *afxdpc, AFXDPInstance *instance)
+{
+    AFXDPRing *ring = &instance->comp;
+    uint64_t *addrs = ring->descs;
+    uint32_t i, n, cons;
+
+    n = ring_entries(ring);
+    if (n == 0)
+        return;
+
+    cons = *ring->consumer;
+    for (i = 0; i < n; i++)
+        frame_free(afxdpc, addrs[(cons + i) & ring->mask]);
+    ring_release(ring, n);
+}
+
+static inline int tx_enqueue(AFXDPInstance *instance, uint64_t addr, uint32_t len)
+{
+    AFXDPRing *ring = &instance->tx;
+    struct xdp_desc *desc;
+
+    if (ring_free(ring) == 0)
+        return DAQ_ERROR_AGAIN;
+
+    desc = &((struct xdp_desc *) ring->descs)[*ring->producer & ring->mask];
+    desc->addr = addr;
+    desc->len = len;
+    desc->options = 0;
+    ring_submit(ring, 1);
+    instance->tx_pending++;
+
+    return DAQ_SUCCESS;
+}
+
+/* Kick the kernel to transmit queued frames, but only if it has asked us to. */
+static inline void tx_flush(AFXDPInstance *instance)
+{
+    if (!instance->tx_pending)
+        return;
+
+    instance->tx_pending = 0;
+    if (*instance->tx.flags & XDP_RING_NEED_WAKEUP)
+        sendto(instance->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static void tx_flush_all(AFXDP_Context_t *afxdpc)
+{
+    AFXDPInstance *instance;
+
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+        tx_flush(instance);
+}
+
+static int map_ring(AFXDP_Context_t *afxdpc, AFXDPInstance *instance, AFXDPRing *ring,
+                    const struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+    ring->map_len = off->desc + afxdpc->ring_size * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, instance->fd, pgoff);
+    if (ring->map == MAP_FAILED)
+    {
+        DPE(afxdpc->errbuf, "%s: Could not MMAP the ring for %s queue %u: %s",
+                __FUNCTION__, instance->intf->name, instance->queue, strerror(errno));
+        ring->map = NULL;
+        return DAQ_ERROR;
+    }
+    ring->producer = (uint32_t *) ((uint8_t *) ring->map + off->producer);
+    ring->consumer = (uint32_t *) ((uint8_t *) ring->map + off->consumer);
+    ring->flags = (uint32_t *) ((uint8_t *) ring->map + off->flags);
+    ring->descs = (uint8_t *) ring->map + off->desc;
+    ring->size = afxdpc->ring_size;
+    ring->mask = afxdpc->ring_size - 1;
+
+    return DAQ_SUCCESS;
+}
+
+static void unmap_ring(AFXDPRing *ring)
+{
+    if (ring->map)
+    {
+        munmap(ring->map, ring->map_len);
+        ring->map = NULL;
+    }
+}
+
+static AFXDPInterface *create_interface(const char *device, char *errbuf, size_t errlen)
+{
+    AFXDPInterface *intf;
+
+    intf = calloc(1, sizeof(AFXDPInterface));
+    if (!intf)
+    {
+        snprintf(errbuf, errlen, "%s: Could not allocate a new interface structure.", __FUNCTION__);
+        return NULL;
+    }
+    intf->map_fd = intf->prog_fd = intf->link_fd = -1;
+
+    if ((intf->name = strdup(device)) == NULL)
+    {
+        snprintf(errbuf, errlen, "%s: Could not allocate a copy of the device name.", __FUNCTION__);
+        free(intf);
+        return NULL;
+    }
+
+    intf->index = if_nametoindex(device);
+    if (intf->index == 0)
+    {
+        snprintf(errbuf, errlen, "%s: Could not find index for device %s", __FUNCTION__, device);
+        free(intf->name);
+        free(intf);
+        return NULL;
+    }
+
+    return intf;
+}
+
+static void destroy_interface(AFXDPInterface *intf)
+{
+    /* Closing the link detaches the XDP program from the interface. */
+    if (intf->link_fd != -1)
+        close(intf->link_fd);
+    if (intf->prog_fd != -1)
+        close(intf->prog_fd);
+    if (intf->map_fd != -1)
+        close(intf->map_fd);
+    free(intf->name);
+    free(intf);
+}
+
+static void destroy_instance(AFXDPInstance *instance)
+{
+    unmap_ring(&instance->rx);
+    unmap_ring(&instance->tx);
+    unmap_ring(&instance->fill);
+    unmap_ring(&instance->comp);
+    if (instance->fd != -1)
+        close(instance->fd);
+    free(instance);
+}
+
+/*
+ * Load and attach the XDP program that steers each receive queue to the socket registered for
+ * it in the interface's XSKMAP.  Queues without a socket are passed on to the kernel stack.
+ */
+static int attach_xdp_program(AFXDP_Context_t *afxdpc, AFXDPInterface *intf)
+{
+#define XDP_INSN(c, d, s, o, i) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+    struct bpf_insn prog[] = {
+        /* r2 = ctx->rx_queue_index; *(u32 *)(r10 - 4) = r2 */
+        XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0),
+        XDP_INSN(BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_2, -4, 0),
+        /* r0 = bpf_map_lookup_elem(xsks_map, r10 - 4) */
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, intf->map_fd),
+        XDP_INSN(0, 0, 0, 0, 0),
+        XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /* if (!r0) return XDP_PASS */
+        XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_0, 0, 0),
+        XDP_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        XDP_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, 5, 0),
+        /* return bpf_redirect_map(xsks_map, rx_queue_index, 0) */
+        XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_10, -4, 0),
+        XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, intf->map_fd),
+        XDP_INSN(0, 0, 0, 0, 0),
+        XDP_INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0),
+        XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+#undef XDP_INSN
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = afxdpc->start_queue + afxdpc->num_queues;
+    intf->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (intf->map_fd < 0)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't create the XSK map for %s: %s", __FUNCTION__, intf->name, strerror(errno));
+        return DAQ_ERROR;
+    }
+    prog[4].imm = prog[11].imm = intf->map_fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t) (unsigned long) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t) (unsigned long) "GPL";
+    intf->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (intf->prog_fd < 0)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't load the XDP program for %s: %s", __FUNCTION__, intf->name, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = intf->prog_fd;
+    attr.link_create.target_ifindex = intf->index;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = afxdpc->xdp_flags;
+    intf->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (intf->link_fd < 0)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't attach the XDP program to %s: %s", __FUNCTION__, intf->name, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int create_umem(AFXDP_Context_t *afxdpc)
+{
+    uint32_t num_frames, i;
+
+    /* Enough frames to fill every socket's fill ring with the same again in flight. */
+    num_frames = afxdpc->instance_count * afxdpc->ring_size * 2;
+    afxdpc->umem_size = (size_t) num_frames * AF_XDP_FRAME_SIZE;
+    afxdpc->umem = mmap(NULL, afxdpc->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (afxdpc->umem == MAP_FAILED)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't allocate %zu bytes of UMEM: %s", __FUNCTION__, afxdpc->umem_size, strerror(errno));
+        afxdpc->umem = NULL;
+        return DAQ_ERROR_NOMEM;
+    }
+
+    afxdpc->free_frames = calloc(num_frames, sizeof(uint64_t));
+    if (!afxdpc->free_frames)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't allocate the UMEM frame list!", __FUNCTION__);
+        return DAQ_ERROR_NOMEM;
+    }
+    for (i = 0; i < num_frames; i++)
+        afxdpc->free_frames[i] = (uint64_t) (num_frames - i - 1) * AF_XDP_FRAME_SIZE;
+    afxdpc->free_count = num_frames;
+
+    if (afxdpc->debug)
+        printf("AF_XDP UMEM: %u frames of %u bytes\n", num_frames, AF_XDP_FRAME_SIZE);
+
+    return DAQ_SUCCESS;
+}
+
+static int start_instance(AFXDP_Context_t *afxdpc, AFXDPInstance *instance, int umem_fd)
+{
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen;
+    int ring_size = afxdpc->ring_size;
+    int fd = instance->fd;
+
+    /* The first socket registers the UMEM; the rest share it. */
+    if (umem_fd == -1)
+    {
+        struct xdp_umem_reg mr;
+
+        memset(&mr, 0, sizeof(mr));
+        mr.addr = (uint64_t) (unsigned long) afxdpc->umem;
+        mr.len = afxdpc->umem_size;
+        mr.chunk_size = AF_XDP_FRAME_SIZE;
+        if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) == -1)
+        {
+            DPE(afxdpc->errbuf, "%s: Couldn't register the UMEM: %s", __FUNCTION__, strerror(errno));
+            return DAQ_ERROR;
+        }
+    }
+
+    /* Sockets sharing a UMEM across queues and devices each need their own fill and completion rings. */
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) == -1 ||
+        setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) == -1 ||
+        setsockopt(fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) == -1 ||
+        setsockopt(fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) == -1)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't create the rings for %s queue %u: %s",
+                __FUNCTION__, instance->intf->name, instance->queue, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    optlen = sizeof(off);
+    if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't get the ring offsets: %s", __FUNCTION__, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    if (map_ring(afxdpc, instance, &instance->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != DAQ_SUCCESS ||
+        map_ring(afxdpc, instance, &instance->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != DAQ_SUCCESS ||
+        map_ring(afxdpc, instance, &instance->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != DAQ_SUCCESS ||
+        map_ring(afxdpc, instance, &instance->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != DAQ_SUCCESS)
+    {
+        return DAQ_ERROR;
+    }
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = instance->intf->index;
+    sxdp.sxdp_queue_id = instance->queue;
+    /* Sockets sharing a UMEM inherit the bind flags of its owner. */
+    if (umem_fd == -1)
+        sxdp.sxdp_flags = afxdpc->bind_flags | XDP_USE_NEED_WAKEUP;
+    else
+    {
+        sxdp.sxdp_flags = XDP_SHARED_UMEM;
+        sxdp.sxdp_shared_umem_fd = umem_fd;
+    }
+    if (bind(fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) == -1)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't bind to %s queue %u: %s",
+                __FUNCTION__, instance->intf->name, instance->queue, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    refill_fill_ring(afxdpc, instance);
+
+    return DAQ_SUCCESS;
+}
+
+static int register_instance(AFXDP_Context_t *afxdpc, AFXDPInstance *instance)
+{
+    union bpf_attr attr;
+    uint32_t key = instance->queue;
+    int value = instance->fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = instance->intf->map_fd;
+    attr.key = (uint64_t) (unsigned long) &key;
+    attr.value = (uint64_t) (unsigned long) &value;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't add %s queue %u to the XSK map: %s",
+                __FUNCTION__, instance->intf->name, instance->queue, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int create_instances(AFXDP_Context_t *afxdpc)
+{
+    AFXDPInterface *intf;
+    AFXDPInstance *instance, *peer;
+    uint32_t q;
+
+    for (intf = afxdpc->intfs; intf; intf = intf->next)
+    {
+        for (q = afxdpc->start_queue; q < afxdpc->start_queue + afxdpc->num_queues; q++)
+        {
+            instance = calloc(1, sizeof(AFXDPInstance));
+            if (!instance)
+            {
+                DPE(afxdpc->errbuf, "%s: Could not allocate a new instance structure.", __FUNCTION__);
+                return DAQ_ERROR_NOMEM;
+            }
+            instance->intf = intf;
+            instance->queue = q;
+            instance->next = afxdpc->instances;
+            afxdpc->instances = instance;
+            afxdpc->instance_count++;
+
+            instance->fd = socket(AF_XDP, SOCK_RAW, 0);
+            if (instance->fd == -1)
+            {
+                DPE(afxdpc->errbuf, "%s: Could not open the AF_XDP socket: %s", __FUNCTION__, strerror(errno));
+                return DAQ_ERROR;
+            }
+        }
+    }
+
+    /* Pair up each queue of a bridged interface with the same queue of its peer. */
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+    {
+        if (!instance->intf->peer)
+            continue;
+        for (peer = afxdpc->instances; peer; peer = peer->next)
+        {
+            if (peer->intf == instance->intf->peer && peer->queue == instance->queue)
+            {
+                instance->peer = peer;
+                break;
+            }
+        }
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static void update_hw_stats(AFXDP_Context_t *afxdpc)
+{
+    AFXDPInstance *instance;
+    struct xdp_statistics xstats;
+    socklen_t len;
+    uint64_t drops;
+
+    if (afxdpc->state != DAQ_STATE_STARTED)
+        return;
+
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+    {
+        memset(&xstats, 0, sizeof(xstats));
+        len = sizeof(xstats);
+        if (getsockopt(instance->fd, SOL_XDP, XDP_STATISTICS, &xstats, &len) == -1)
+        {
+            fprintf(stderr, "Failed to get stats for %s queue %u: %d %s\n", instance->intf->name, instance->queue, errno, strerror(errno));
+            continue;
+        }
+        /* These counters are cumulative, so only add what's new since we last looked. */
+        drops = xstats.rx_dropped + xstats.rx_ring_full;
+        afxdpc->stats.hw_packets_dropped += drops - instance->drops_seen;
+        instance->drops_seen = drops;
+    }
+}
+
+static void reset_stats(AFXDP_Context_t *afxdpc)
+{
+    AFXDPInstance *instance;
+    struct xdp_statistics xstats;
+    socklen_t len;
+
+    memset(&afxdpc->stats, 0, sizeof(DAQ_Stats_t));
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+    {
+        memset(&xstats, 0, sizeof(xstats));
+        len = sizeof(xstats);
+        if (getsockopt(instance->fd, SOL_XDP, XDP_STATISTICS, &xstats, &len) == 0)
+            instance->drops_seen = xstats.rx_dropped + xstats.rx_ring_full;
+    }
+}
+
+static int af_xdp_close(AFXDP_Context_t *afxdpc)
+{
+    AFXDPInstance *instance;
+    AFXDPInterface *intf;
+
+    if (!afxdpc)
+        return -1;
+
+    /* Cache the latest hardware stats before stopping. */
+    update_hw_stats(afxdpc);
+
+    while ((instance = afxdpc->instances) != NULL)
+    {
+        afxdpc->instances = instance->next;
+        destroy_instance(instance);
+    }
+    afxdpc->instance_count = 0;
+
+    while ((intf = afxdpc->intfs) != NULL)
+    {
+        afxdpc->intfs = intf->next;
+        destroy_interface(intf);
+    }
+
+    if (afxdpc->umem)
+    {
+        munmap(afxdpc->umem, afxdpc->umem_size);
+        afxdpc->umem = NULL;
+    }
+    if (afxdpc->free_frames)
+    {
+        free(afxdpc->free_frames);
+        afxdpc->free_frames = NULL;
+    }
+    if (afxdpc->pfds)
+    {
+        free(afxdpc->pfds);
+        afxdpc->pfds = NULL;
+    }
+
+    sfbpf_freecode(&afxdpc->fcode);
+    sfbpf_jit_free(afxdpc->fjit);
+    afxdpc->fjit = NULL;
+
+    afxdpc->state = DAQ_STATE_STOPPED;
+
+    return 0;
+}
+
+static int create_bridge(AFXDP_Context_t *afxdpc, const char *device_name1, const char *device_name2)
+{
+    AFXDPInterface *intf, *peer1, *peer2;
+
+    peer1 = peer2 = NULL;
+    for (intf = afxdpc->intfs; intf; intf = intf->next)
+    {
+        if (!strcmp(intf->name, device_name1))
+            peer1 = intf;
+        else if (!strcmp(intf->name, device_name2))
+            peer2 = intf;
+    }
+
+    if (!peer1 || !peer2)
+        return DAQ_ERROR_NODEV;
+
+    peer1->peer = peer2;
+    peer2->peer = peer1;
+
+    return DAQ_SUCCESS;
+}
+
+static int parse_uint(const char *value, uint32_t *result)
+{
+    unsigned long val;
+    char *endptr;
+
+    if (!value || *value == '\0')
+        return -1;
+    errno = 0;
+    val = strtoul(value, &endptr, 10);
+    if (errno || *endptr != '\0' || val > UINT32_MAX)
+        return -1;
+    *result = val;
+
+    return 0;
+}
+
+static int afxdp_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
+{
+    AFXDP_Context_t *afxdpc;
+    AFXDPInterface *intf;
+    char *name1, *name2, *dev;
+    char intf_name[IFNAMSIZ];
+    size_t len;
+    int num_intfs = 0;
+    int rval = DAQ_ERROR;
+    DAQ_Dict *entry;
+
+    afxdpc = calloc(1, sizeof(AFXDP_Context_t));
+    if (!afxdpc)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the new AF_XDP context!", __FUNCTION__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afxdpc->device = strdup(config->name);
+    if (!afxdpc->device)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the device string!", __FUNCTION__);
+        rval = DAQ_ERROR_NOMEM;
+        goto err;
+    }
+
+    afxdpc->snaplen = config->snaplen;
+    afxdpc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
+    afxdpc->num_queues = 1;
+    afxdpc->ring_size = AF_XDP_DEFAULT_RING_SIZE;
+
+    dev = afxdpc->device;
+    if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') || (config->mode == DAQ_MODE_PASSIVE && strstr(dev, "::")))
+    {
+        snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __FUNCTION__, afxdpc->device);
+        goto err;
+    }
+
+    while (*dev != '\0')
+    {
+        len = strcspn(dev, ":");
+        if (len >= IFNAMSIZ)
+        {
+            snprintf(errbuf, errlen, "%s: Interface name too long! (%zu)", __FUNCTION__, len);
+            goto err;
+        }
+        if (len != 0)
+        {
+            afxdpc->intf_count++;
+            if (afxdpc->intf_count >= AF_XDP_MAX_INTERFACES)
+            {
+                snprintf(errbuf, errlen, "%s: Using more than %d interfaces is not supported!", __FUNCTION__, AF_XDP_MAX_INTERFACES);
+                goto err;
+            }
+            snprintf(intf_name, len + 1, "%s", dev);
+            intf = create_interface(intf_name, errbuf, errlen);
+            if (!intf)
+                goto err;
+
+            intf->next = afxdpc->intfs;
+            afxdpc->intfs = intf;
+            num_intfs++;
+            if (config->mode != DAQ_MODE_PASSIVE)
+            {
+                if (num_intfs == 2)
+                {
+                    name1 = afxdpc->intfs->next->name;
+                    name2 = afxdpc->intfs->name;
+
+                    if (create_bridge(afxdpc, name1, name2) != DAQ_SUCCESS)
+                    {
+                        snprintf(errbuf, errlen, "%s: Couldn't create the bridge between %s and %s!", __FUNCTION__, name1, name2);
+                        goto err;
+                    }
+                    num_intfs = 0;
+                }
+                else if (num_intfs > 2)
+                    break;
+            }
+        }
+        else
+            len = 1;
+        dev += len;
+    }
+
+    /* If there are any leftover unbridged interfaces and we're not in Passive mode, error out. */
+    if (!afxdpc->intfs || (config->mode != DAQ_MODE_PASSIVE && num_intfs != 0))
+    {
+        snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __FUNCTION__, afxdpc->device);
+        goto err;
+    }
+
+    for (entry = config->values; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->key, "debug"))
+            afxdpc->debug = 1;
+        else if (!strcmp(entry->key, "start_queue"))
+        {
+            if (parse_uint(entry->value, &afxdpc->start_queue))
+            {
+                snprintf(errbuf, errlen, "%s: Invalid start queue: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "num_queues"))
+        {
+            if (parse_uint(entry->value, &afxdpc->num_queues) || afxdpc->num_queues == 0)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid number of queues: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "ring_size"))
+        {
+            /* The kernel insists on power-of-2 ring sizes. */
+            if (parse_uint(entry->value, &afxdpc->ring_size) || afxdpc->ring_size == 0 ||
+                (afxdpc->ring_size & (afxdpc->ring_size - 1)))
+            {
+                snprintf(errbuf, errlen, "%s: Invalid ring size: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "xdp_mode"))
+        {
+            if (entry->value && !strcmp(entry->value, "native"))
+                afxdpc->xdp_flags = XDP_FLAGS_DRV_MODE;
+            else if (entry->value && !strcmp(entry->value, "generic"))
+                afxdpc->xdp_flags = XDP_FLAGS_SKB_MODE;
+            else
+            {
+                snprintf(errbuf, errlen, "%s: Unknown XDP mode: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "xsk_mode"))
+        {
+            if (entry->value && !strcmp(entry->value, "copy"))
+                afxdpc->bind_flags = XDP_COPY;
+            else if (entry->value && !strcmp(entry->value, "zerocopy"))
+                afxdpc->bind_flags = XDP_ZEROCOPY;
+            else
+            {
+                snprintf(errbuf, errlen, "%s: Unknown XSK mode: '%s'!", __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+    }
+
+    afxdpc->state = DAQ_STATE_INITIALIZED;
+
+    *ctxt_ptr = afxdpc;
+    return DAQ_SUCCESS;
+
+err:
+    if (afxdpc)
+    {
+        af_xdp_close(afxdpc);
+        if (afxdpc->device)
+            free(afxdpc->device);
+        free(afxdpc);
+    }
+    return rval;
+}
+
+static int afxdp_daq_set_filter(void *handle, const char *filter)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+    struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
+
+    if (afxdpc->filter)
+        free(afxdpc->filter);
+
+    afxdpc->filter = strdup(filter);
+    if (!afxdpc->filter)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't allocate memory for the filter string!", __FUNCTION__);
+        return DAQ_ERROR;
+    }
+
+    if (sfbpf_compile_cached(NULL, afxdpc->snaplen, DLT_EN10MB, &fcode, afxdpc->filter, 1, 0, 0, bpf_errbuf) < 0)
+    {
+        DPE(afxdpc->errbuf, "%s: BPF state machine compilation failed: %.*s", __FUNCTION__,
+                (int) sizeof(afxdpc->errbuf) / 2, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if (!fjit)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't prepare the BPF state machine!", __FUNCTION__);
+        sfbpf_freecode(&fcode);
+        return DAQ_ERROR;
+    }
+
+    sfbpf_freecode(&afxdpc->fcode);
+    afxdpc->fcode = fcode;
+    sfbpf_jit_free(afxdpc->fjit);
+    afxdpc->fjit = fjit;
+
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_daq_start(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+    AFXDPInterface *intf;
+    AFXDPInstance *instance;
+    int umem_fd = -1;
+    int rval;
+
+    if ((rval = create_instances(afxdpc)) != DAQ_SUCCESS)
+        return rval;
+
+    afxdpc->pfds = calloc(afxdpc->instance_count, sizeof(struct pollfd));
+    if (!afxdpc->pfds)
+    {
+        DPE(afxdpc->errbuf, "%s: Couldn't allocate memory for the poll descriptors!", __FUNCTION__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    if ((rval = create_umem(afxdpc)) != DAQ_SUCCESS)
+        return rval;
+
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+    {
+        if (start_instance(afxdpc, instance, umem_fd) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+        if (umem_fd == -1)
+            umem_fd = instance->fd;
+    }
+
+    /* Only start steering traffic to the sockets once they're all ready for it. */
+    for (intf = afxdpc->intfs; intf; intf = intf->next)
+    {
+        if (attach_xdp_program(afxdpc, intf) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+    }
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+    {
+        if (register_instance(afxdpc, instance) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+    }
+
+    reset_stats(afxdpc);
+
+    afxdpc->state = DAQ_STATE_STARTED;
+
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_acquire_packets(AFXDP_Context_t *afxdpc, int cnt, DAQ_Analysis_Func_t callback, void *user)
+{
+    AFXDPInstance *instance;
+    DAQ_PktHdr_t daqhdr;
+    DAQ_Verdict verdict;
+    struct xdp_desc *desc;
+    struct timeval ts;
+    uint8_t *data;
+    uint32_t i, n, cons;
+    int got_one, ignored_one;
+    int ret, c = 0;
+
+    while (c < cnt || cnt <= 0)
+    {
+        got_one = 0;
+        ignored_one = 0;
+        for (instance = afxdpc->instances; instance; instance = instance->next)
+        {
+            /* Has breakloop() been called? */
+            if (afxdpc->break_loop)
+            {
+                afxdpc->break_loop = 0;
+                return 0;
+            }
+
+            drain_completion_ring(afxdpc, instance);
+
+            n = ring_entries(&instance->rx);
+            if (n > AF_XDP_RX_BATCH)
+                n = AF_XDP_RX_BATCH;
+            if (cnt > 0 && n > (uint32_t) (cnt - c))
+                n = cnt - c;
+            if (n == 0)
+            {
+                refill_fill_ring(afxdpc, instance);
+                continue;
+            }
+
+            /* The kernel doesn't timestamp AF_XDP frames, so stamp the whole batch at once. */
+            gettimeofday(&ts, NULL);
+            cons = *instance->rx.consumer;
+            for (i = 0; i < n; i++)
+            {
+                desc = &((struct xdp_desc *) instance->rx.descs)[(cons + i) & instance->rx.mask];
+                data = afxdpc->umem + desc->addr;
+                afxdpc->stats.hw_packets_received++;
+
+                verdict = DAQ_VERDICT_PASS;
+                if (afxdpc->fjit && sfbpf_filter_jit(afxdpc->fjit, data, desc->len, desc->len) == 0)
+                {
+                    ignored_one = 1;
+                    afxdpc->stats.packets_filtered++;
+                    goto send_packet;
+                }
+                got_one = 1;
+
+                daqhdr.ts = ts;
+                daqhdr.caplen = (desc->len > (uint32_t) afxdpc->snaplen) ? (uint32_t) afxdpc->snaplen : desc->len;
+                daqhdr.pktlen = desc->len;
+                daqhdr.ingress_index = instance->intf->index;
+                daqhdr.egress_index = instance->peer ? instance->peer->intf->index : DAQ_PKTHDR_UNKNOWN;
+                daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.flags = 0;
+                daqhdr.opaque = 0;
+                daqhdr.priv_ptr = NULL;
+                daqhdr.address_space_id = 0;
+
+                if (callback)
+                {
+                    verdict = callback(user, &daqhdr, data);
+                    if (verdict >= MAX_DAQ_VERDICT)
+                        verdict = DAQ_VERDICT_PASS;
+                    afxdpc->stats.verdicts[verdict]++;
+                    verdict = verdict_translation_table[verdict];
+                }
+                afxdpc->stats.packets_received++;
+                c++;
+send_packet:
+                /* Forwarding is just a matter of moving the descriptor to the peer's TX ring. */
+                if (verdict == DAQ_VERDICT_PASS && instance->peer &&
+                    tx_enqueue(instance->peer, desc->addr, desc->len) == DAQ_SUCCESS)
+                {
+                    continue;
+                }
+                frame_free(afxdpc, desc->addr);
+            }
+            ring_release(&instance->rx, n);
+            refill_fill_ring(afxdpc, instance);
+        }
+        if (!got_one && !ignored_one)
+        {
+            /* Don't leave forwarded packets sitting in the TX rings while we wait. */
+            tx_flush_all(afxdpc);
+            for (i = 0, instance = afxdpc->instances; instance; i++, instance = instance->next)
+            {
+                afxdpc->pfds[i].fd = instance->fd;
+                afxdpc->pfds[i].revents = 0;
+                afxdpc->pfds[i].events = POLLIN;
+            }
+            ret = poll(afxdpc->pfds, afxdpc->instance_count, afxdpc->timeout);
+            /* If we were interrupted by a signal, start the loop over.  The user should call daq_breakloop to actually exit. */
+            if (ret < 0 && errno != EINTR)
+            {
+                DPE(afxdpc->errbuf, "%s: Poll failed: %s (%d)", __FUNCTION__, strerror(errno), errno);
+                return DAQ_ERROR;
+            }
+            /* If the poll times out, return control to the caller. */
+            if (ret == 0)
+                break;
+            /* If some number of of sockets have events returned, check them all for badness. */
+            if (ret > 0)
+            {
+                for (i = 0; i < afxdpc->instance_count; i++)
+                {
+                    if (afxdpc->pfds[i].revents & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL))
+                    {
+                        if (afxdpc->pfds[i].revents & (POLLHUP | POLLRDHUP))
+                            DPE(afxdpc->errbuf, "%s: Hang-up on an AF_XDP socket", __FUNCTION__);
+                        else if (afxdpc->pfds[i].revents & POLLERR)
+                            DPE(afxdpc->errbuf, "%s: Encountered error condition on an AF_XDP socket", __FUNCTION__);
+                        else if (afxdpc->pfds[i].revents & POLLNVAL)
+                            DPE(afxdpc->errbuf, "%s: Invalid polling request on an AF_XDP socket", __FUNCTION__);
+                        return DAQ_ERROR;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int afxdp_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+    int rval;
+
+    afxdpc->acquiring = 1;
+    rval = afxdp_acquire_packets(afxdpc, cnt, callback, user);
+    /* Send whatever was queued for transmission during this batch. */
+    tx_flush_all(afxdpc);
+    afxdpc->acquiring = 0;
+
+    return rval;
+}
+
+static int afxdp_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t *packet_data, uint32_t len, int reverse)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+    AFXDPInstance *instance;
+    uint64_t addr;
+
+    /* Find the instance that the packet was received on. */
+    for (instance = afxdpc->instances; instance; instance = instance->next)
+    {
+        if (instance->intf->index == hdr->ingress_index)
+            break;
+    }
+
+    if (!instance || (!reverse && !(instance = instance->peer)))
+        return DAQ_ERROR;
+
+    if (len > AF_XDP_FRAME_SIZE)
+    {
+        DPE(afxdpc->errbuf, "%s: Packet too large to send on %s (%u)", __FUNCTION__, instance->intf->name, len);
+        return DAQ_ERROR;
+    }
+
+    /* As with AFPacket, quietly drop the packet if there's no room for it. */
+    drain_completion_ring(afxdpc, instance);
+    if ((addr = frame_alloc(afxdpc)) == AF_XDP_INVALID_FRAME)
+        return DAQ_SUCCESS;
+    memcpy(afxdpc->umem + addr, packet_data, len);
+    if (tx_enqueue(instance, addr, len) != DAQ_SUCCESS)
+    {
+        frame_free(afxdpc, addr);
+        return DAQ_SUCCESS;
+    }
+    /* Injections made from within the acquire loop go out with the rest of the batch. */
+    if (!afxdpc->acquiring)
+        tx_flush(instance);
+    afxdpc->stats.packets_injected++;
+
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_daq_breakloop(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    afxdpc->break_loop = 1;
+
+    return DAQ_SUCCESS;
+}
+
+static int afxdp_daq_stop(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    af_xdp_close(afxdpc);
+
+    return DAQ_SUCCESS;
+}
+
+static void afxdp_daq_shutdown(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    af_xdp_close(afxdpc);
+    if (afxdpc->device)
+        free(afxdpc->device);
+    if (afxdpc->filter)
+        free(afxdpc->filter);
+    free(afxdpc);
+}
+
+static DAQ_State afxdp_daq_check_status(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    return afxdpc->state;
+}
+
+static int afxdp_daq_get_stats(void *handle, DAQ_Stats_t *stats)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    update_hw_stats(afxdpc);
+    memcpy(stats, &afxdpc->stats, sizeof(DAQ_Stats_t));
+
+    return DAQ_SUCCESS;
+}
+
+static void afxdp_daq_reset_stats(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    reset_stats(afxdpc);
+}
+
+static int afxdp_daq_get_snaplen(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    return afxdpc->snaplen;
+}
+
+static uint32_t afxdp_daq_get_capabilities(void *handle)
+{
+    return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF | DAQ_CAPA_DEVICE_INDEX;
+}
+
+static int afxdp_daq_get_datalink_type(void *handle)
+{
+    return DLT_EN10MB;
+}
+
+static const char *afxdp_daq_get_errbuf(void *handle)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    return afxdpc->errbuf;
+}
+
+static void afxdp_daq_set_errbuf(void *handle, const char *string)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+
+    if (!string)
+        return;
+
+    DPE(afxdpc->errbuf, "%s", string);
+}
+
+static int afxdp_daq_get_device_index(void *handle, const char *device)
+{
+    AFXDP_Context_t *afxdpc = (AFXDP_Context_t *) handle;
+    AFXDPInterface *intf;
+
+    for (intf = afxdpc->intfs; intf; intf = intf->next)
+    {
+        if (!strcmp(device, intf->name))
+            return intf->index;
+    }
+
+    return DAQ_ERROR_NODEV;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC const DAQ_Module_t DAQ_MODULE_DATA =
+#else
+const DAQ_Module_t afxdp_daq_module_data =
+#endif
+{
+    .api_version = DAQ_API_VERSION,
+    .module_version = DAQ_AFXDP_VERSION,
+    .name = "afxdp",
+    .type = DAQ_TYPE_INTF_CAPABLE | DAQ_TYPE_INLINE_CAPABLE | DAQ_TYPE_MULTI_INSTANCE,
+    .initialize = afxdp_daq_initialize,
+    .set_filter = afxdp_daq_set_filter,
+    .start = afxdp_daq_start,
+    .acquire = afxdp_daq_acquire,
+    .inject = afxdp_daq_inject,
+    .breakloop = afxdp_daq_breakloop,
+    .stop = afxdp_daq_stop,
+    .shutdown = afxdp_daq_shutdown,
+    .check_status = afxdp_daq_check_status,
+    .get_stats = afxdp_daq_get_stats,
+    .reset_stats = afxdp_daq_reset_stats,
+    .get_snaplen = afxdp_daq_get_snaplen,
+    .get_capabilities = afxdp_daq_get_capabilities,
+    .get_datalink_type = afxdp_daq_get_datalink_type,
+    .get_errbuf = afxdp_daq_get_errbuf,
+    .set_errbuf = afxdp_daq_set_errbuf,
+    .get_device_index = afxdp_daq_get_device_index,
+    .modify_flow = NULL,
+    .hup_prep = NULL,
+    .hup_apply = NULL,
+    .hup_post = NULL,
+};
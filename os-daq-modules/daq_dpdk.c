@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <getopt.h>
 #include <net/if.h>
+#include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,16 +17,28 @@
 
 #include "daq_dpdk.h"
 
+#include <rte_ether.h>
+#include <rte_flow.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+
+/* Defaults, all of which can be changed with dictionary entries. */
 #define NUM_MBUFS 8192
 #define MBUF_CACHE_SIZE 256
-
-#define RX_RING_NUM 1
-#define TX_RING_NUM 1
+#define MBUF_DATA_ROOM 2048
 
 #define RX_RING_SIZE 256
 #define TX_RING_SIZE 1024
 
+#define RSS_KEY_MAX_LEN 64
+#define RETA_MAX_SIZE 512
 
+#define FLOW_IDLE_TIMEOUT 30
+#define MAX_OFFLOADED_FLOWS 4096
+#define FLOW_TABLE_SIZE 4096
+
+#define MAX_CLASSES 1024
 
 static const struct rte_eth_conf port_conf_default = {
     .rxmode = { .max_rx_pkt_len = ETHER_MAX_LEN }
@@ -38,13 +52,32 @@ typedef struct _dpdk_port
     int rx_rings;
     int tx_rings;
     int port;
-    int tx_start;
-    int tx_end;
     int refcnt;
+    int hw_timestamps;
+    /* Ring and pool settings of the context that opened the port. */
+    int rx_ring_size;
+    int tx_ring_size;
+    int num_mbufs;
+    int mbuf_cache_size;
+    int mbuf_data_room;
+    int shared_pool;
+    /* Whether the port gets an extra RX queue for whitelisted flows, and its index once started. */
+    int bypass;
+    int bypass_queue;
+    /* The inline instance forwarding the bypass queue, whichever got to it first. */
+    struct _dpdk_instance *bypass_owner;
+    /* Whether rte_flow rules can be installed on the port: 0 if not known yet, -1 if not. */
+    int flow_state;
     struct rte_mempool *mbuf_pool;
-    struct rte_mbuf *tx_burst[BURST_SIZE * RX_RING_NUM];
 } DpdkPort;
 
+/* Ports (and the EAL) are shared by every DAQ context in the process, so that each queue of a
+    port can be driven by a separate context from its own thread. */
+static pthread_mutex_t dpdk_lock = PTHREAD_MUTEX_INITIALIZER;
+static DpdkPort *dpdk_ports = NULL;
+static int dpdk_eal_initialized = 0;
+static int dpdk_instance_index = 0;
+
 #define FOR_EACH_PORTS(list,v) \
     DpdkPort* v; \
     for (v = list; v; v = v->next)
@@ -56,8 +89,40 @@ typedef struct _dpdk_instance
     DpdkPort* port;
     int index;
     int queue;
+    /* Packets waiting to go out of this instance's TX queue. */
+    struct rte_eth_dev_tx_buffer *tx_buffer;
+    uint64_t tx_dropped;
+    DpdkHwClock hw_clock;
 } DpdkInstance;
 
+/* One direction of a TCP or UDP flow, with addresses and ports in network byte order.  A port of 0
+    matches any port. */
+typedef struct _dpdk_flow_key
+{
+    uint8_t af;
+    uint8_t proto;
+    uint16_t vlan_id;           /* 0 if untagged */
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+} DpdkFlowKey;
+
+typedef struct _dpdk_flow_rule
+{
+    struct _dpdk_flow_rule *next;
+    struct _dpdk_flow_rule *pair;   /* Rule for the other direction of an offloaded flow */
+    DpdkFlowKey key;
+    DpdkPort *port;
+    struct rte_flow *flow;
+    int queue;                  /* Queue the packets are steered to, or -1 if they are dropped */
+    uint32_t mark;
+    int offloaded;              /* The rule handles the packets itself rather than steering them to us */
+    int counted;                /* The rule has a COUNT action */
+    uint64_t hits;
+    uint64_t last_seen_ns;
+} DpdkFlowRule;
+
 typedef struct _dpdk_context
 {
     char *device;
@@ -65,10 +130,32 @@ typedef struct _dpdk_context
     int snaplen;
     int timeout;
     int debug;
+    int rx_queues;
+    int tx_queues;
+    int hw_timestamps;
+    int rx_ring_size;
+    int tx_ring_size;
+    int num_mbufs;
+    int mbuf_cache_size;
+    int mbuf_data_room;
+    int shared_pool;
+    int flow_offload;
+    int flow_idle_timeout;
+    int max_offloaded_flows;
+    DpdkFlowRule **flow_table;
+    unsigned flow_count;
+    uint64_t flow_aging_ns;
+    /* The packet being analyzed, which modify_flow() applies to. */
+    const DAQ_PktHdr_t *cur_hdr;
+    const uint8_t *cur_data;
+    uint32_t cur_len;
+    DpdkClock clock;
     DpdkInstance *instances;
-    DpdkPort *ports;
     int intf_count;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    struct sfbpf_program ccode;
+    struct sfbpf_jit_program *cjit;
     volatile int break_loop;
     int promisc_flag;
     DAQ_Stats_t stats;
@@ -78,15 +165,172 @@ typedef struct _dpdk_context
 
 static void dpdk_daq_reset_stats(void *handle);
 
+/* Fill in a Toeplitz key made of a repeated 16-bit pattern.  With such a key the hash of a flow is the
+    same when its source and destination are swapped, so both directions of a flow land on the same
+    queue. */
+static void set_symmetric_rss(struct rte_eth_conf *port_conf, const struct rte_eth_dev_info *dev_info, uint8_t *key)
+{
+    int key_len, i;
+
+    key_len = dev_info->hash_key_size ? dev_info->hash_key_size : 40;
+    if (key_len > RSS_KEY_MAX_LEN)
+        key_len = RSS_KEY_MAX_LEN;
+    for (i = 0; i < key_len; i += 2)
+    {
+        key[i] = 0x6d;
+        key[i + 1] = 0x5a;
+    }
+
+    port_conf->rxmode.mq_mode = ETH_MQ_RX_RSS;
+    port_conf->rx_adv_conf.rss_conf.rss_key = key;
+    port_conf->rx_adv_conf.rss_conf.rss_key_len = key_len;
+    port_conf->rx_adv_conf.rss_conf.rss_hf = (ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) & dev_info->flow_type_rss_offloads;
+}
+
+static unsigned port_mbufs_needed(const DpdkPort *port)
+{
+    return (port->rx_rings + (port->bypass ? 1 : 0)) * (port->rx_ring_size + BURST_SIZE) +
+        port->tx_rings * (port->tx_ring_size + BURST_SIZE) + rte_lcore_count() * port->mbuf_cache_size;
+}
+
+/* Find or create the pool that a port receives into, on the NIC's own socket.  Without an explicit
+    size, the pool is made large enough to fill every ring of the ports that will use it. */
+static struct rte_mempool *get_port_pool(Dpdk_Context_t *dpdkc, DpdkPort *port)
+{
+    struct rte_mempool *pool;
+    char poolname[64];
+    unsigned num_mbufs;
+    int socket;
+
+    socket = rte_eth_dev_socket_id(port->port);
+    if (socket < 0)
+        socket = rte_socket_id();
+
+    if (port->shared_pool)
+        snprintf(poolname, sizeof(poolname), "MBUF_POOL_S%d", socket);
+    else
+        snprintf(poolname, sizeof(poolname), "MBUF_POOL%d", port->port);
+
+    /* Secondary processes use the pools of the primary.  Pools can't be freed, so a pool left over
+        from an earlier context is reused as well. */
+    pool = rte_mempool_lookup(poolname);
+    if (pool || rte_eal_process_type() != RTE_PROC_PRIMARY)
+        return pool;
+
+    num_mbufs = port->num_mbufs;
+    if (!num_mbufs)
+    {
+        num_mbufs = port_mbufs_needed(port);
+        if (port->shared_pool)
+        {
+            FOR_EACH_PORTS(dpdk_ports, other)
+            {
+                if (other != port && other->shared_pool && rte_eth_dev_socket_id(other->port) == socket)
+                    num_mbufs += port_mbufs_needed(other);
+            }
+        }
+        if (num_mbufs < NUM_MBUFS)
+            num_mbufs = NUM_MBUFS;
+    }
+
+    if (dpdkc->debug)
+        printf("Creating pool %s with %u mbufs on socket %d for port %d\n", poolname, num_mbufs, socket, port->port);
+
+    return rte_pktmbuf_pool_create(poolname, num_mbufs, port->mbuf_cache_size, 0,
+            port->mbuf_data_room + RTE_PKTMBUF_HEADROOM, socket);
+}
+
+/* Spread the RSS redirection table over the first rx_rings queues only, keeping the bypass queue
+    out of it. */
+static int set_rss_reta(int port, const struct rte_eth_dev_info *dev_info, int rx_rings)
+{
+    struct rte_eth_rss_reta_entry64 reta_conf[RETA_MAX_SIZE / RTE_RETA_GROUP_SIZE];
+    int i;
+
+    memset(reta_conf, 0, sizeof(reta_conf));
+    for (i = 0; i < dev_info->reta_size; i++)
+    {
+        reta_conf[i / RTE_RETA_GROUP_SIZE].mask |= 1ULL << (i % RTE_RETA_GROUP_SIZE);
+        reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] = i % rx_rings;
+    }
+
+    return rte_eth_dev_rss_reta_update(port, reta_conf, dev_info->reta_size);
+}
+
 static int start_port(Dpdk_Context_t *dpdkc, DpdkPort *instance)
 {
-    int rx_rings = RX_RING_NUM, tx_rings = TX_RING_NUM;
+    int rx_rings = instance->rx_rings, tx_rings = instance->tx_rings;
     int rx_ring_start = 0, tx_ring_start = 0;
     struct rte_eth_conf port_conf = port_conf_default;
+    struct rte_eth_dev_info dev_info;
+    uint8_t rss_key[RSS_KEY_MAX_LEN];
+    uint16_t rx_ring_size, tx_ring_size;
     int port, queue, ret;
 
     port = instance->port;
 
+    rte_eth_dev_info_get(port, &dev_info);
+
+    /* A secondary process can only use the queues that the primary set up. */
+    if (rte_eal_process_type() != RTE_PROC_PRIMARY)
+    {
+        instance->rx_rings = dev_info.nb_rx_queues;
+        instance->tx_rings = dev_info.nb_tx_queues;
+    }
+
+    instance->mbuf_pool = get_port_pool(dpdkc, instance);
+    if (!instance->mbuf_pool)
+    {
+        DPE(dpdkc->errbuf, "%s: Cannot create the mbuf pool for port %d\n", __FUNCTION__, port);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    instance->bypass_queue = -1;
+
+    if (rte_eal_process_type() != RTE_PROC_PRIMARY)
+    {
+        instance->flags |= DPDKINST_STARTED;
+        return DAQ_SUCCESS;
+    }
+
+    if (rx_rings > dev_info.max_rx_queues || tx_rings > dev_info.max_tx_queues)
+    {
+        DPE(dpdkc->errbuf, "%s: Port %d supports at most %u RX and %u TX queues\n", __FUNCTION__,
+                port, dev_info.max_rx_queues, dev_info.max_tx_queues);
+        return DAQ_ERROR;
+    }
+
+    /* Whitelisted flows are steered to a queue of their own, which is forwarded without being
+        analyzed. */
+    if (instance->bypass)
+    {
+        /* With RSS, the bypass queue has to be kept out of the redirection table. */
+        if (rx_rings < dev_info.max_rx_queues &&
+                (rx_rings == 1 || (dev_info.reta_size > 0 && dev_info.reta_size <= RETA_MAX_SIZE)))
+            instance->bypass_queue = rx_rings++;
+        else if (dpdkc->debug)
+            printf("Port %d cannot have a separate RX queue for whitelisted flows\n", port);
+    }
+
+    if (instance->rx_rings > 1)
+        set_symmetric_rss(&port_conf, &dev_info, rss_key);
+
+    if (instance->hw_timestamps)
+    {
+#ifdef DEV_RX_OFFLOAD_TIMESTAMP
+        if (dev_info.rx_offload_capa & DEV_RX_OFFLOAD_TIMESTAMP)
+        {
+            port_conf.rxmode.offloads |= DEV_RX_OFFLOAD_TIMESTAMP;
+#if RTE_VERSION < RTE_VERSION_NUM(18,8,0,0)
+            port_conf.rxmode.ignore_offload_bitfield = 1;
+#endif
+        }
+        else
+#endif
+        if (dpdkc->debug)
+            printf("Port %d doesn't support RX timestamps, using software timestamps\n", port);
+    }
+
     ret = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
     if (ret != 0)
     {
@@ -94,12 +338,16 @@ static int start_port(Dpdk_Context_t *dpdkc, DpdkPort *instance)
         return DAQ_ERROR;
     }
 
-    instance->rx_rings = rx_rings;
-    instance->tx_rings = tx_rings;
+    rx_ring_size = instance->rx_ring_size;
+    tx_ring_size = instance->tx_ring_size;
+#if RTE_VERSION >= RTE_VERSION_NUM(17,5,0,0)
+    /* Round the ring sizes to what the NIC supports. */
+    rte_eth_dev_adjust_nb_rx_tx_desc(port, &rx_ring_size, &tx_ring_size);
+#endif
 
     for (queue = rx_ring_start; queue < rx_ring_start + rx_rings; queue++)
     {
-        ret = rte_eth_rx_queue_setup(port, queue, RX_RING_SIZE,
+        ret = rte_eth_rx_queue_setup(port, queue, rx_ring_size,
                 rte_eth_dev_socket_id(port),
                 NULL, instance->mbuf_pool);
         if (ret != 0)
@@ -111,7 +359,7 @@ static int start_port(Dpdk_Context_t *dpdkc, DpdkPort *instance)
 
     for (queue = tx_ring_start; queue < tx_ring_start + tx_rings; queue++)
     {
-        ret = rte_eth_tx_queue_setup(port, queue, TX_RING_SIZE,
+        ret = rte_eth_tx_queue_setup(port, queue, tx_ring_size,
                 rte_eth_dev_socket_id(port),
                 NULL);
         if (ret != 0)
@@ -130,32 +378,68 @@ static int start_port(Dpdk_Context_t *dpdkc, DpdkPort *instance)
 
     instance->flags |= DPDKINST_STARTED;
 
+    if (instance->bypass_queue > 0 && instance->rx_rings > 1 &&
+            set_rss_reta(port, &dev_info, instance->rx_rings) != 0)
+    {
+        DPE(dpdkc->errbuf, "%s: Cannot update the RSS redirection table of port %d\n", __FUNCTION__, port);
+        return DAQ_ERROR;
+    }
+
     if (dpdkc->promisc_flag)
         rte_eth_promiscuous_enable(instance->port);
 
     return DAQ_SUCCESS;
 }
 
-static void destroy_instance(DpdkInstance *instance)
+static int start_instance(Dpdk_Context_t *dpdkc, DpdkInstance *instance)
 {
-    if (instance)
+    DpdkPort *port = instance->port;
+
+    if (instance->queue >= port->rx_rings || instance->queue >= port->tx_rings)
     {
-        free(instance);
+        DPE(dpdkc->errbuf, "%s: Queue %d is not configured on port %d (%d RX and %d TX queues)", __FUNCTION__,
+                instance->queue, port->port, port->rx_rings, port->tx_rings);
+        return DAQ_ERROR;
+    }
+
+    if (!instance->tx_buffer)
+    {
+        instance->tx_buffer = rte_zmalloc_socket("tx_buffer", RTE_ETH_TX_BUFFER_SIZE(BURST_SIZE), 0,
+                rte_eth_dev_socket_id(port->port));
+        if (!instance->tx_buffer)
+        {
+            DPE(dpdkc->errbuf, "%s: Cannot allocate the TX buffer for port %d queue %d", __FUNCTION__,
+                    port->port, instance->queue);
+            return DAQ_ERROR_NOMEM;
+        }
+        rte_eth_tx_buffer_init(instance->tx_buffer, BURST_SIZE);
+        /* Packets that still don't fit in the TX ring after a flush are dropped. */
+        rte_eth_tx_buffer_set_err_callback(instance->tx_buffer, rte_eth_tx_buffer_count_callback,
+                &instance->tx_dropped);
     }
+
+    return DAQ_SUCCESS;
 }
 
 static void destroy_port(DpdkPort *port)
 {
-    int i;
+    DpdkPort **pp;
 
     if (port)
     {
-        if (port->flags & DPDKINST_STARTED)
+        for (pp = &dpdk_ports; *pp; pp = &(*pp)->next)
         {
-            for (i = port->tx_start; i < port->tx_end; i++)
-                rte_pktmbuf_free(port->tx_burst[i]);
+            if (*pp == port)
+            {
+                *pp = port->next;
+                break;
+            }
+        }
 
-            rte_eth_dev_stop(port->port);
+        if (port->flags & DPDKINST_STARTED)
+        {
+            if (rte_eal_process_type() == RTE_PROC_PRIMARY)
+                rte_eth_dev_stop(port->port);
             port->flags &= ~DPDKINST_STARTED;
         }
 
@@ -163,13 +447,53 @@ static void destroy_port(DpdkPort *port)
     }
 }
 
-static DpdkInstance *create_instance(const char *device, DpdkInstance **instances_ptr, DpdkPort **ports_ptr, char *errbuf, size_t errlen)
+/* Drop an instance's reference on its port, stopping the port once nobody is left using it.
+    Must be called with dpdk_lock held. */
+static void destroy_instance(DpdkInstance *instance)
+{
+    if (instance)
+    {
+        if (instance->tx_buffer)
+        {
+            if (instance->port && (instance->port->flags & DPDKINST_STARTED))
+                rte_eth_tx_buffer_flush(instance->port->port, instance->queue, instance->tx_buffer);
+            rte_free(instance->tx_buffer);
+        }
+        /* Let another instance take over the port's bypass queue. */
+        if (instance->port && instance->port->bypass_owner == instance)
+            instance->port->bypass_owner = NULL;
+        if (instance->port && --instance->port->refcnt == 0)
+            destroy_port(instance->port);
+        free(instance);
+    }
+}
+
+/* Whether an instance is the one forwarding its port's bypass queue, claiming the queue if nobody
+    is.  Any inline instance on the port will do, whatever queue it reads, so that the whitelisted
+    flows are forwarded however the port's queues are split between contexts. */
+static int own_bypass_queue(DpdkInstance *instance)
+{
+    DpdkPort *port = instance->port;
+
+    if (port->bypass_owner == instance)
+        return 1;
+    if (port->bypass_owner)
+        return 0;
+
+    pthread_mutex_lock(&dpdk_lock);
+    if (!port->bypass_owner)
+        port->bypass_owner = instance;
+    pthread_mutex_unlock(&dpdk_lock);
+
+    return port->bypass_owner == instance;
+}
+
+/* Must be called with dpdk_lock held. */
+static DpdkInstance *create_instance(Dpdk_Context_t *dpdkc, const char *device, char *errbuf, size_t errlen)
 {
     DpdkInstance *instance = NULL;
     DpdkPort *dpdk_port;
     int port;
-    char poolname[64];
-    static int index = 0;
 
     if (strncmp(device, "dpdk", 4) != 0 || sscanf(&device[4], "%d", &port) != 1)
     {
@@ -184,8 +508,8 @@ static DpdkInstance *create_instance(const char *device, DpdkInstance **instance
         goto err;
     }
 
-    instance->index = index;
-    index++;
+    instance->index = dpdk_instance_index;
+    dpdk_instance_index++;
 
     //Search for a given queue index in the port def
     const char* queue_str = &device[4];
@@ -202,12 +526,13 @@ static DpdkInstance *create_instance(const char *device, DpdkInstance **instance
     }
 
     //Search if that DPDK port is already opened
-    FOR_EACH_PORTS(*ports_ptr,existing_port)
+    FOR_EACH_PORTS(dpdk_ports,existing_port)
     {
         if (existing_port->port == port) {
             instance->port = existing_port;
             instance->port->refcnt++;
-            printf("Port %d already opened !\n",port);
+            if (dpdkc->debug)
+                printf("Port %d already opened !\n",port);
             goto found;
         }
     }
@@ -222,25 +547,34 @@ static DpdkInstance *create_instance(const char *device, DpdkInstance **instance
 
     dpdk_port->port = port;
     dpdk_port->refcnt = 1;
-
-    snprintf(poolname, sizeof(poolname), "MBUF_POOL%d", port);
-    dpdk_port->mbuf_pool = rte_pktmbuf_pool_create(poolname, NUM_MBUFS,
-                MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-    if (dpdk_port->mbuf_pool == NULL)
-    {
-        snprintf(errbuf, errlen, "%s: Cannot create mbuf pool!\n",
-                __FUNCTION__);
-        goto err;
-    }
-
-    dpdk_port->next = *ports_ptr;
-    *ports_ptr = dpdk_port;
+    dpdk_port->rx_rings = 1;
+    dpdk_port->tx_rings = 1;
+    dpdk_port->rx_ring_size = dpdkc->rx_ring_size;
+    dpdk_port->tx_ring_size = dpdkc->tx_ring_size;
+    dpdk_port->num_mbufs = dpdkc->num_mbufs;
+    dpdk_port->mbuf_cache_size = dpdkc->mbuf_cache_size;
+    dpdk_port->mbuf_data_room = dpdkc->mbuf_data_room;
+    dpdk_port->shared_pool = dpdkc->shared_pool;
+
+    dpdk_port->next = dpdk_ports;
+    dpdk_ports = dpdk_port;
     instance->port = dpdk_port;
 
 found:
-
-    instance->next = *instances_ptr;
-    *instances_ptr = instance;
+    if (dpdkc->hw_timestamps)
+        instance->port->hw_timestamps = 1;
+
+    /* The port needs enough queues for every context that uses it; the first one to start
+        the port configures it with the largest count requested so far. */
+    if (instance->port->rx_rings < dpdkc->rx_queues)
+        instance->port->rx_rings = dpdkc->rx_queues;
+    if (instance->port->rx_rings <= instance->queue)
+        instance->port->rx_rings = instance->queue + 1;
+    if (instance->port->tx_rings < (dpdkc->tx_queues ? dpdkc->tx_queues : instance->port->rx_rings))
+        instance->port->tx_rings = dpdkc->tx_queues ? dpdkc->tx_queues : instance->port->rx_rings;
+
+    instance->next = dpdkc->instances;
+    dpdkc->instances = instance;
     return instance;
 
 err:
@@ -248,19 +582,8 @@ err:
     return NULL;
 }
 
-static int create_bridge(Dpdk_Context_t *dpdkc, const int port1, const int port2)
+static int create_bridge(DpdkInstance *peer1, DpdkInstance *peer2)
 {
-    DpdkInstance *peer1, *peer2;
-
-    peer1 = peer2 = NULL;
-    FOR_EACH_INSTANCES(dpdkc->instances, instance) {
-        printf("Instance id %d, port %d, port 1 %d, port2 %d",instance->index, instance->port->port, port1, port1);
-        if (!peer1 && instance->port->port == port1)
-            peer1 = instance;
-        else if (instance->port->port == port2)
-            peer2 = instance;
-    }
-
     if (!peer1 || !peer2)
         return DAQ_ERROR_NODEV;
 
@@ -270,29 +593,430 @@ static int create_bridge(Dpdk_Context_t *dpdkc, const int port1, const int port2
     return DAQ_SUCCESS;
 }
 
+/* Extract the TCP or UDP flow a packet belongs to.  Fragments and IPv6 extension headers are not
+    handled. */
+static int parse_flow_key(const uint8_t *data, uint32_t len, DpdkFlowKey *key)
+{
+    uint16_t ether_type;
+    uint32_t offset = ETHER_HDR_LEN;
+    uint32_t ihl;
+
+    memset(key, 0, sizeof(*key));
+
+    if (len < ETHER_HDR_LEN)
+        return -1;
+    ether_type = (data[12] << 8) | data[13];
+    if (ether_type == ETHER_TYPE_VLAN)
+    {
+        if (len < offset + 4)
+            return -1;
+        key->vlan_id = ((data[offset] << 8) | data[offset + 1]) & 0x0fff;
+        ether_type = (data[offset + 2] << 8) | data[offset + 3];
+        offset += 4;
+    }
+
+    if (ether_type == ETHER_TYPE_IPv4)
+    {
+        if (len < offset + 20)
+            return -1;
+        ihl = (data[offset] & 0x0f) * 4;
+        if (ihl < 20 || ((data[offset + 6] & 0x3f) | data[offset + 7]) != 0)
+            return -1;
+        key->af = AF_INET;
+        key->proto = data[offset + 9];
+        memcpy(key->src_addr, &data[offset + 12], 4);
+        memcpy(key->dst_addr, &data[offset + 16], 4);
+        offset += ihl;
+    }
+    else if (ether_type == ETHER_TYPE_IPv6)
+    {
+        if (len < offset + 40)
+            return -1;
+        key->af = AF_INET6;
+        key->proto = data[offset + 6];
+        memcpy(key->src_addr, &data[offset + 8], 16);
+        memcpy(key->dst_addr, &data[offset + 24], 16);
+        offset += 40;
+    }
+    else
+        return -1;
+
+    if ((key->proto != IPPROTO_TCP && key->proto != IPPROTO_UDP) || len < offset + 4)
+        return -1;
+    memcpy(&key->src_port, &data[offset], 2);
+    memcpy(&key->dst_port, &data[offset + 2], 2);
+
+    return 0;
+}
+
+static void reverse_flow_key(const DpdkFlowKey *key, DpdkFlowKey *rkey)
+{
+    *rkey = *key;
+    memcpy(rkey->src_addr, key->dst_addr, sizeof(rkey->src_addr));
+    memcpy(rkey->dst_addr, key->src_addr, sizeof(rkey->dst_addr));
+    rkey->src_port = key->dst_port;
+    rkey->dst_port = key->src_port;
+}
+
+static unsigned flow_hash(const DpdkPort *port, const DpdkFlowKey *key)
+{
+    const uint8_t *p = (const uint8_t *) key;
+    uint32_t hash = 2166136261U ^ port->port;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++)
+        hash = (hash ^ p[i]) * 16777619U;
+
+    return hash % FLOW_TABLE_SIZE;
+}
+
+static int query_flow_hits(DpdkFlowRule *rule, uint64_t *hits)
+{
+    struct rte_flow_query_count count;
+    struct rte_flow_error error;
+#if RTE_VERSION >= RTE_VERSION_NUM(18,5,0,0)
+    const struct rte_flow_action action = { .type = RTE_FLOW_ACTION_TYPE_COUNT };
+#endif
+
+    memset(&count, 0, sizeof(count));
+#if RTE_VERSION >= RTE_VERSION_NUM(18,5,0,0)
+    if (rte_flow_query(rule->port->port, rule->flow, &action, &count, &error) != 0 || !count.hits_set)
+#else
+    if (rte_flow_query(rule->port->port, rule->flow, RTE_FLOW_ACTION_TYPE_COUNT, &count, &error) != 0 || !count.hits_set)
+#endif
+        return -1;
+    *hits = count.hits;
+
+    return 0;
+}
+
+/* Remove a rule that has been unlinked from the flow table.  Must be called with dpdk_lock held. */
+static void destroy_flow_rule(Dpdk_Context_t *dpdkc, DpdkFlowRule *rule)
+{
+    struct rte_flow_error error;
+    uint64_t hits;
+
+    if (rule->offloaded && rule->counted && query_flow_hits(rule, &hits) == 0 && hits > rule->hits)
+        dpdkc->stats.hw_packets_offloaded += hits - rule->hits;
+    if (rule->pair)
+        rule->pair->pair = NULL;
+    rte_flow_destroy(rule->port->port, rule->flow, &error);
+    dpdkc->flow_count--;
+    free(rule);
+}
+
+/* Find the link to the rule for one direction of a flow on a port, which points to NULL if there is
+    none.  Must be called with dpdk_lock held. */
+static DpdkFlowRule **find_flow_rule(Dpdk_Context_t *dpdkc, DpdkPort *port, const DpdkFlowKey *key)
+{
+    DpdkFlowRule **pp;
+
+    for (pp = &dpdkc->flow_table[flow_hash(port, key)]; *pp; pp = &(*pp)->next)
+    {
+        if ((*pp)->port == port && !memcmp(&(*pp)->key, key, sizeof(*key)))
+            break;
+    }
+
+    return pp;
+}
+
+/* Install a rule on a port for one direction of a flow, replacing any other rule for it.  The flow's
+    packets are dropped if queue is negative, and otherwise steered to that RX queue and tagged with
+    mark if it isn't 0.  Must be called with dpdk_lock held. */
+static int install_flow_rule(Dpdk_Context_t *dpdkc, DpdkPort *port, const DpdkFlowKey *key, uint32_t priority,
+        int queue, uint32_t mark, int offloaded, uint64_t now_ns)
+{
+    struct rte_flow_attr attr;
+    struct rte_flow_item pattern[5];
+    struct rte_flow_action actions[5];
+    struct rte_flow_item_vlan vlan_spec, vlan_mask;
+    struct rte_flow_item_ipv4 ip4_spec, ip4_mask;
+    struct rte_flow_item_ipv6 ip6_spec, ip6_mask;
+    struct rte_flow_item_tcp tcp_spec, tcp_mask;
+    struct rte_flow_item_udp udp_spec, udp_mask;
+    struct rte_flow_action_queue queue_conf;
+    struct rte_flow_action_mark mark_conf;
+    struct rte_flow_error error;
+    struct rte_flow *flow;
+    DpdkFlowRule *rule, **pp;
+    int np = 0, na = 0, count_action, counted;
+
+    if (port->flow_state < 0)
+        return DAQ_ERROR_NOTSUP;
+
+    pp = find_flow_rule(dpdkc, port, key);
+    if ((rule = *pp) != NULL)
+    {
+        if (rule->queue == queue && rule->mark == mark)
+            return DAQ_SUCCESS;
+        *pp = rule->next;
+        destroy_flow_rule(dpdkc, rule);
+    }
+
+    if (dpdkc->flow_count >= (unsigned) dpdkc->max_offloaded_flows)
+        return DAQ_ERROR_AGAIN;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.ingress = 1;
+    attr.priority = priority;
+
+    memset(pattern, 0, sizeof(pattern));
+    pattern[np++].type = RTE_FLOW_ITEM_TYPE_ETH;
+    if (key->vlan_id)
+    {
+        memset(&vlan_spec, 0, sizeof(vlan_spec));
+        memset(&vlan_mask, 0, sizeof(vlan_mask));
+        vlan_spec.tci = rte_cpu_to_be_16(key->vlan_id);
+        vlan_mask.tci = rte_cpu_to_be_16(0x0fff);
+        pattern[np].type = RTE_FLOW_ITEM_TYPE_VLAN;
+        pattern[np].spec = &vlan_spec;
+        pattern[np++].mask = &vlan_mask;
+    }
+    if (key->af == AF_INET)
+    {
+        memset(&ip4_spec, 0, sizeof(ip4_spec));
+        memset(&ip4_mask, 0, sizeof(ip4_mask));
+        memcpy(&ip4_spec.hdr.src_addr, key->src_addr, 4);
+        memcpy(&ip4_spec.hdr.dst_addr, key->dst_addr, 4);
+        ip4_mask.hdr.src_addr = ip4_mask.hdr.dst_addr = 0xffffffff;
+        pattern[np].type = RTE_FLOW_ITEM_TYPE_IPV4;
+        pattern[np].spec = &ip4_spec;
+        pattern[np++].mask = &ip4_mask;
+    }
+    else
+    {
+        memset(&ip6_spec, 0, sizeof(ip6_spec));
+        memset(&ip6_mask, 0, sizeof(ip6_mask));
+        memcpy(ip6_spec.hdr.src_addr, key->src_addr, 16);
+        memcpy(ip6_spec.hdr.dst_addr, key->dst_addr, 16);
+        memset(ip6_mask.hdr.src_addr, 0xff, 16);
+        memset(ip6_mask.hdr.dst_addr, 0xff, 16);
+        pattern[np].type = RTE_FLOW_ITEM_TYPE_IPV6;
+        pattern[np].spec = &ip6_spec;
+        pattern[np++].mask = &ip6_mask;
+    }
+    if (key->proto == IPPROTO_TCP)
+    {
+        memset(&tcp_spec, 0, sizeof(tcp_spec));
+        memset(&tcp_mask, 0, sizeof(tcp_mask));
+        tcp_spec.hdr.src_port = key->src_port;
+        tcp_spec.hdr.dst_port = key->dst_port;
+        tcp_mask.hdr.src_port = key->src_port ? 0xffff : 0;
+        tcp_mask.hdr.dst_port = key->dst_port ? 0xffff : 0;
+        pattern[np].type = RTE_FLOW_ITEM_TYPE_TCP;
+        pattern[np].spec = &tcp_spec;
+        pattern[np++].mask = &tcp_mask;
+    }
+    else
+    {
+        memset(&udp_spec, 0, sizeof(udp_spec));
+        memset(&udp_mask, 0, sizeof(udp_mask));
+        udp_spec.hdr.src_port = key->src_port;
+        udp_spec.hdr.dst_port = key->dst_port;
+        udp_mask.hdr.src_port = key->src_port ? 0xffff : 0;
+        udp_mask.hdr.dst_port = key->dst_port ? 0xffff : 0;
+        pattern[np].type = RTE_FLOW_ITEM_TYPE_UDP;
+        pattern[np].spec = &udp_spec;
+        pattern[np++].mask = &udp_mask;
+    }
+    pattern[np].type = RTE_FLOW_ITEM_TYPE_END;
+
+    memset(actions, 0, sizeof(actions));
+    if (mark)
+    {
+        mark_conf.id = mark;
+        actions[na].type = RTE_FLOW_ACTION_TYPE_MARK;
+        actions[na++].conf = &mark_conf;
+    }
+    if (queue < 0)
+        actions[na++].type = RTE_FLOW_ACTION_TYPE_DROP;
+    else
+    {
+        queue_conf.index = queue;
+        actions[na].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+        actions[na++].conf = &queue_conf;
+    }
+    count_action = na;
+    actions[na++].type = RTE_FLOW_ACTION_TYPE_COUNT;
+    actions[na].type = RTE_FLOW_ACTION_TYPE_END;
+
+    counted = 1;
+    flow = rte_flow_create(port->port, &attr, pattern, actions, &error);
+    if (!flow)
+    {
+        /* Not every device can count the packets matching a rule. */
+        actions[count_action].type = RTE_FLOW_ACTION_TYPE_END;
+        counted = 0;
+        flow = rte_flow_create(port->port, &attr, pattern, actions, &error);
+    }
+    if (!flow)
+    {
+        if (dpdkc->debug)
+            printf("Cannot install a flow rule on port %d: %s\n", port->port,
+                    error.message ? error.message : "unknown error");
+        /* A device that never accepted a rule most likely doesn't support them at all. */
+        if (port->flow_state == 0)
+            port->flow_state = -1;
+        return DAQ_ERROR;
+    }
+    port->flow_state = 1;
+
+    rule = calloc(1, sizeof(DpdkFlowRule));
+    if (!rule)
+    {
+        rte_flow_destroy(port->port, flow, &error);
+        return DAQ_ERROR_NOMEM;
+    }
+    rule->key = *key;
+    rule->port = port;
+    rule->flow = flow;
+    rule->queue = queue;
+    rule->mark = mark;
+    rule->offloaded = offloaded;
+    rule->counted = counted;
+    rule->last_seen_ns = now_ns;
+    rule->next = dpdkc->flow_table[flow_hash(port, key)];
+    dpdkc->flow_table[flow_hash(port, key)] = rule;
+    dpdkc->flow_count++;
+
+    return DAQ_SUCCESS;
+}
+
+/* Let the NIC apply a whitelist or blacklist verdict to the rest of both directions of a flow.
+    Blacklisted flows are dropped.  Whitelisted flows are dropped as well on passive interfaces, and on
+    inline pairs they are steered to the bypass queue of each port, which is forwarded without being
+    analyzed. */
+static void offload_verdict(Dpdk_Context_t *dpdkc, DpdkInstance *instance, const uint8_t *data, uint32_t len,
+        DAQ_Verdict verdict, uint64_t now_ns)
+{
+    DpdkInstance *peer = instance->peer;
+    DpdkPort *rport = peer ? peer->port : instance->port;
+    DpdkFlowRule *rule, *rrule, **pp;
+    DpdkFlowKey key, rkey;
+    int queue = -1, rqueue = -1;
+
+    if (parse_flow_key(data, len, &key) != 0)
+        return;
+    reverse_flow_key(&key, &rkey);
+
+    if (verdict == DAQ_VERDICT_WHITELIST && peer)
+    {
+        queue = instance->port->bypass_queue;
+        rqueue = peer->port->bypass_queue;
+        if (queue < 0 || rqueue < 0)
+            return;
+    }
+
+    pthread_mutex_lock(&dpdk_lock);
+    if (install_flow_rule(dpdkc, instance->port, &key, 0, queue, 0, 1, now_ns) != DAQ_SUCCESS)
+    {
+        pthread_mutex_unlock(&dpdk_lock);
+        return;
+    }
+    rule = *find_flow_rule(dpdkc, instance->port, &key);
+    if (install_flow_rule(dpdkc, rport, &rkey, 0, rqueue, 0, 1, now_ns) != DAQ_SUCCESS)
+    {
+        /* Don't let one direction of the flow bypass Snort on its own. */
+        pp = find_flow_rule(dpdkc, instance->port, &key);
+        *pp = rule->next;
+        destroy_flow_rule(dpdkc, rule);
+    }
+    else if ((rrule = *find_flow_rule(dpdkc, rport, &rkey)) != rule->pair)
+    {
+        /* The rules of the two directions make up one offloaded flow, which is counted once. */
+        rule->pair = rrule;
+        rrule->pair = rule;
+        dpdkc->stats.hw_flows_offloaded++;
+    }
+    pthread_mutex_unlock(&dpdk_lock);
+}
+
+/* Remove the rules of flows that have been idle for flow_idle_timeout seconds.  Rules that can't
+    count their packets are removed that long after being installed. */
+static void age_flow_rules(Dpdk_Context_t *dpdkc, uint64_t now_ns)
+{
+    uint64_t timeout_ns = (uint64_t) dpdkc->flow_idle_timeout * NS_PER_SEC;
+    DpdkFlowRule *rule, **pp;
+    uint64_t hits;
+    unsigned i;
+
+    dpdkc->flow_aging_ns = now_ns;
+
+    pthread_mutex_lock(&dpdk_lock);
+    for (i = 0; i < FLOW_TABLE_SIZE; i++)
+    {
+        pp = &dpdkc->flow_table[i];
+        while ((rule = *pp) != NULL)
+        {
+            if (now_ns - rule->last_seen_ns >= timeout_ns)
+            {
+                if (rule->counted && query_flow_hits(rule, &hits) == 0 && hits != rule->hits)
+                {
+                    if (rule->offloaded)
+                        dpdkc->stats.hw_packets_offloaded += hits - rule->hits;
+                    rule->hits = hits;
+                    rule->last_seen_ns = now_ns;
+                }
+                else
+                {
+                    *pp = rule->next;
+                    /* A flow has expired once the rules of both of its directions are gone. */
+                    if (rule->offloaded && (!rule->pair || rule->pair == rule))
+                        dpdkc->stats.hw_flows_expired++;
+                    destroy_flow_rule(dpdkc, rule);
+                    continue;
+                }
+            }
+            pp = &rule->next;
+        }
+    }
+    pthread_mutex_unlock(&dpdk_lock);
+}
+
+/* Must be called with dpdk_lock held. */
+static void flush_flow_rules(Dpdk_Context_t *dpdkc)
+{
+    DpdkFlowRule *rule;
+    unsigned i;
+
+    for (i = 0; i < FLOW_TABLE_SIZE; i++)
+    {
+        while ((rule = dpdkc->flow_table[i]) != NULL)
+        {
+            dpdkc->flow_table[i] = rule->next;
+            destroy_flow_rule(dpdkc, rule);
+        }
+    }
+}
+
 static int dpdk_close(Dpdk_Context_t *dpdkc)
 {
     DpdkInstance *instance;
-    DpdkPort *port;
 
     if (!dpdkc)
         return -1;
 
-    /* Free all of the device instances. */
+    /* Free all of the device instances, and with them any ports no other context is using. */
+    pthread_mutex_lock(&dpdk_lock);
+    if (dpdkc->flow_table)
+    {
+        flush_flow_rules(dpdkc);
+        free(dpdkc->flow_table);
+        dpdkc->flow_table = NULL;
+    }
     while ((instance = dpdkc->instances) != NULL)
     {
         dpdkc->instances = instance->next;
         destroy_instance(instance);
     }
-
-    /* Free all of the device instances. */
-    while ((port = dpdkc->ports) != NULL)
-    {
-        dpdkc->ports = port->next;
-        destroy_port(port);
-    }
+    pthread_mutex_unlock(&dpdk_lock);
 
     sfbpf_freecode(&dpdkc->fcode);
+    sfbpf_jit_free(dpdkc->fjit);
+    dpdkc->fjit = NULL;
+    sfbpf_freecode(&dpdkc->ccode);
+    sfbpf_jit_free(dpdkc->cjit);
+    dpdkc->cjit = NULL;
 	
     dpdkc->state = DAQ_STATE_STOPPED;
 
@@ -313,6 +1037,95 @@ static int parse_args(char *inputstring, char **argv)
     return ap - argv;
 }
 
+/* Parse the integer value of a dictionary entry, which must lie within [min, max]. */
+static int parse_int_var(const DAQ_Dict *entry, int min, int max, int *value, char *errbuf, size_t errlen)
+{
+    char *endptr;
+    long val;
+
+    val = entry->value ? strtol(entry->value, &endptr, 10) : min - 1;
+    if (!entry->value || *endptr != '\0' || val < min || val > max)
+    {
+        snprintf(errbuf, errlen, "%s: Invalid value for %s: '%s' (must be between %d and %d)!",
+                __FUNCTION__, entry->key, entry->value ? entry->value : "", min, max);
+        return DAQ_ERROR_INVAL;
+    }
+    *value = val;
+
+    return DAQ_SUCCESS;
+}
+
+/* Compile the class<N> variables, numbered from 1 up, into one program that gives the first class
+    a packet matches. */
+static int compile_classes(Dpdk_Context_t *dpdkc, const DAQ_Config_t *config, char *errbuf, size_t errlen)
+{
+    DAQ_Dict *entry;
+    const char **filters;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
+    char *endptr;
+    long num, max = 0;
+    int rval = DAQ_ERROR;
+
+    for (entry = config->values; entry; entry = entry->next)
+    {
+        if (strncmp(entry->key, "class", 5) != 0 || entry->key[5] == '\0')
+            continue;
+        num = strtol(entry->key + 5, &endptr, 10);
+        if (*endptr != '\0' || num < 1 || num > MAX_CLASSES)
+        {
+            snprintf(errbuf, errlen, "%s: Invalid class variable: '%s' (classes are numbered from 1 to %d)!",
+                    __FUNCTION__, entry->key, MAX_CLASSES);
+            return DAQ_ERROR_INVAL;
+        }
+        if (num > max)
+            max = num;
+    }
+    if (max == 0)
+        return DAQ_SUCCESS;
+
+    filters = calloc(max, sizeof(*filters));
+    if (!filters)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the class filters!", __FUNCTION__);
+        return DAQ_ERROR_NOMEM;
+    }
+    for (entry = config->values; entry; entry = entry->next)
+    {
+        if (strncmp(entry->key, "class", 5) == 0 && entry->key[5] != '\0')
+            filters[strtol(entry->key + 5, NULL, 10) - 1] = entry->value ? entry->value : "";
+    }
+    for (num = 0; num < max; num++)
+    {
+        if (!filters[num])
+        {
+            snprintf(errbuf, errlen, "%s: Missing class%ld (classes must be numbered consecutively)!",
+                    __FUNCTION__, num + 1);
+            rval = DAQ_ERROR_INVAL;
+            goto out;
+        }
+    }
+
+    if (sfbpf_compile_set(dpdkc->snaplen, DLT_EN10MB, &dpdkc->ccode, filters, max, 1, 0, 0, bpf_errbuf) < 0)
+    {
+        snprintf(errbuf, errlen, "%s: BPF state machine compilation failed for the classes: %s",
+                __FUNCTION__, bpf_errbuf);
+        rval = DAQ_ERROR_INVAL;
+        goto out;
+    }
+    dpdkc->cjit = sfbpf_jit_compile(&dpdkc->ccode);
+    if (!dpdkc->cjit)
+    {
+        snprintf(errbuf, errlen, "%s: Couldn't prepare the BPF state machine for the classes!", __FUNCTION__);
+        sfbpf_freecode(&dpdkc->ccode);
+        goto out;
+    }
+    rval = DAQ_SUCCESS;
+
+out:
+    free(filters);
+    return rval;
+}
+
 static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char *errbuf, size_t errlen)
 {
     Dpdk_Context_t *dpdkc;
@@ -348,39 +1161,100 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
     dpdkc->snaplen = config->snaplen;
     dpdkc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
     dpdkc->promisc_flag = (config->flags & DAQ_CFG_PROMISC);
+    dpdkc->rx_ring_size = RX_RING_SIZE;
+    dpdkc->tx_ring_size = TX_RING_SIZE;
+    dpdkc->mbuf_cache_size = MBUF_CACHE_SIZE;
+    dpdkc->mbuf_data_room = MBUF_DATA_ROOM;
+    dpdkc->flow_idle_timeout = FLOW_IDLE_TIMEOUT;
+    dpdkc->max_offloaded_flows = MAX_OFFLOADED_FLOWS;
 
-    /* Import the DPDK arguments */
+    /* Import the configuration dictionary requests. */
     for (entry = config->values; entry; entry = entry->next)
     {
         if (!strcmp(entry->key, "dpdk_args"))
             dpdk_args = entry->value;
+        else if (!strcmp(entry->key, "debug"))
+            dpdkc->debug = 1;
+        else if (!strcmp(entry->key, "hw_timestamps"))
+            dpdkc->hw_timestamps = 1;
+        else if (!strcmp(entry->key, "shared_pool"))
+            dpdkc->shared_pool = 1;
+        else if (!strcmp(entry->key, "flow_offload"))
+            dpdkc->flow_offload = 1;
+        else
+        {
+            if (!strcmp(entry->key, "rx_queues"))
+                rval = parse_int_var(entry, 1, UINT16_MAX, &dpdkc->rx_queues, errbuf, errlen);
+            else if (!strcmp(entry->key, "tx_queues"))
+                rval = parse_int_var(entry, 1, UINT16_MAX, &dpdkc->tx_queues, errbuf, errlen);
+            else if (!strcmp(entry->key, "rx_ring_size"))
+                rval = parse_int_var(entry, 1, UINT16_MAX, &dpdkc->rx_ring_size, errbuf, errlen);
+            else if (!strcmp(entry->key, "tx_ring_size"))
+                rval = parse_int_var(entry, 1, UINT16_MAX, &dpdkc->tx_ring_size, errbuf, errlen);
+            else if (!strcmp(entry->key, "mbufs"))
+                rval = parse_int_var(entry, 1, INT32_MAX, &dpdkc->num_mbufs, errbuf, errlen);
+            else if (!strcmp(entry->key, "mbuf_cache_size"))
+                rval = parse_int_var(entry, 0, RTE_MEMPOOL_CACHE_MAX_SIZE, &dpdkc->mbuf_cache_size, errbuf, errlen);
+            else if (!strcmp(entry->key, "mbuf_data_room"))
+                rval = parse_int_var(entry, 64, UINT16_MAX - RTE_PKTMBUF_HEADROOM, &dpdkc->mbuf_data_room, errbuf, errlen);
+            else if (!strcmp(entry->key, "flow_idle_timeout"))
+                rval = parse_int_var(entry, 1, INT32_MAX, &dpdkc->flow_idle_timeout, errbuf, errlen);
+            else if (!strcmp(entry->key, "max_offloaded_flows"))
+                rval = parse_int_var(entry, 1, INT32_MAX, &dpdkc->max_offloaded_flows, errbuf, errlen);
+            else
+                continue;
+            if (rval != DAQ_SUCCESS)
+                goto err;
+            rval = DAQ_ERROR;
+        }
     }
 
-    if (!dpdk_args)
-    {
-        snprintf(errbuf, errlen, "%s: Missing EAL arguments!", __FUNCTION__);
-        rval = DAQ_ERROR_INVAL;
+    rval = compile_classes(dpdkc, config, errbuf, errlen);
+    if (rval != DAQ_SUCCESS)
         goto err;
-    }
+    rval = DAQ_ERROR;
 
-    argv[0] = argv0;
-    argc = parse_args(dpdk_args, &argv[1]) + 1;
-    optind = 1;
-    snprintf(errbuf, errlen, "%s: Hello!\n",
-             __FUNCTION__);
+    pthread_mutex_lock(&dpdk_lock);
 
-    ret = rte_eal_init(argc, argv);
-    if (ret < 0)
+    /* The EAL can only be brought up once per process; later contexts share it. */
+    if (!dpdk_eal_initialized)
     {
-        snprintf(errbuf, errlen, "%s: Invalid EAL arguments!\n",
-                __FUNCTION__);
-        rval = DAQ_ERROR_INVAL;
-        goto err;
+        if (!dpdk_args)
+        {
+            pthread_mutex_unlock(&dpdk_lock);
+            snprintf(errbuf, errlen, "%s: Missing EAL arguments!", __FUNCTION__);
+            rval = DAQ_ERROR_INVAL;
+            goto err;
+        }
+
+        argv[0] = argv0;
+        argc = parse_args(dpdk_args, &argv[1]) + 1;
+        optind = 1;
+
+        ret = rte_eal_init(argc, argv);
+        if (ret < 0)
+        {
+            pthread_mutex_unlock(&dpdk_lock);
+            snprintf(errbuf, errlen, "%s: Invalid EAL arguments!\n",
+                    __FUNCTION__);
+            rval = DAQ_ERROR_INVAL;
+            goto err;
+        }
+        dpdk_eal_initialized = 1;
+    }
+
+    /* Flow rules are left to the primary process. */
+    if (dpdkc->flow_offload && rte_eal_process_type() != RTE_PROC_PRIMARY)
+    {
+        if (dpdkc->debug)
+            printf("Flow offload is not available in secondary processes\n");
+        dpdkc->flow_offload = 0;
     }
 
     ports = rte_eth_dev_count();
     if (ports == 0)
     {
+        pthread_mutex_unlock(&dpdk_lock);
         snprintf(errbuf, errlen, "%s: No Ethernet ports!\n", __FUNCTION__);
         rval = DAQ_ERROR_NODEV;
         goto err;
@@ -390,6 +1264,7 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
     if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') ||
             (config->mode == DAQ_MODE_PASSIVE && strstr(dev, "::")))
     {
+        pthread_mutex_unlock(&dpdk_lock);
         snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __FUNCTION__, dpdkc->device);
         goto err;
     }
@@ -399,22 +1274,27 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
         len = strcspn(dev, ":");
         if (len >= sizeof(intf))
         {
+            pthread_mutex_unlock(&dpdk_lock);
             snprintf(errbuf, errlen, "%s: Interface name too long! (%zu)", __FUNCTION__, len);
             goto err;
         }
         if (len != 0)
         {
             dpdkc->intf_count++;
-            if (dpdkc->intf_count > ports)
+            snprintf(intf, len + 1, "%s", dev);
+            instance = create_instance(dpdkc, intf, errbuf, errlen);
+            if (!instance)
             {
-                snprintf(errbuf, errlen, "%s: Using more than %d interfaces is not valid!",
-                        __FUNCTION__, ports);
+                pthread_mutex_unlock(&dpdk_lock);
                 goto err;
             }
-            snprintf(intf, len + 1, "%s", dev);
-            instance = create_instance(intf, &dpdkc->instances, &dpdkc->ports, errbuf, errlen);
-            if (!instance)
+            if (instance->port->port >= ports)
+            {
+                pthread_mutex_unlock(&dpdk_lock);
+                snprintf(errbuf, errlen, "%s: Port %d doesn't exist (%d ports available)!",
+                        __FUNCTION__, instance->port->port, ports);
                 goto err;
+            }
 
             num_intfs++;
             if (config->mode != DAQ_MODE_PASSIVE)
@@ -424,11 +1304,17 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
                     port1 = dpdkc->instances->next->port->port;
                     port2 = dpdkc->instances->port->port;
 
-                    if (create_bridge(dpdkc, port1, port2) != DAQ_SUCCESS)
+                    if (create_bridge(dpdkc->instances->next, dpdkc->instances) != DAQ_SUCCESS)
                     {
+                        pthread_mutex_unlock(&dpdk_lock);
                         snprintf(errbuf, errlen, "%s: Couldn't create the bridge between dpdk%d and dpdk%d!", __FUNCTION__, port1, port2);
                         goto err;
                     }
+                    if (dpdkc->flow_offload)
+                    {
+                        dpdkc->instances->port->bypass = 1;
+                        dpdkc->instances->next->port->bypass = 1;
+                    }
                     num_intfs = 0;
                 } else if (num_intfs > 2)
                     break;
@@ -438,6 +1324,8 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
         dev += len;
     }
 
+    pthread_mutex_unlock(&dpdk_lock);
+
     /* If there are any leftover unbridged interfaces and we're not in Passive mode, error out. */
     if (!dpdkc->instances || (config->mode != DAQ_MODE_PASSIVE && num_intfs != 0))
     {
@@ -446,14 +1334,15 @@ static int dpdk_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr, char
         goto err;
     }
 
-    /* Initialize other default configuration values. */
-    dpdkc->debug = 0;
-
-    /* Import the configuration dictionary requests. */
-    for (entry = config->values; entry; entry = entry->next)
+    if (dpdkc->flow_offload)
     {
-        if (!strcmp(entry->key, "debug"))
-            dpdkc->debug = 1;
+        dpdkc->flow_table = calloc(FLOW_TABLE_SIZE, sizeof(DpdkFlowRule *));
+        if (!dpdkc->flow_table)
+        {
+            snprintf(errbuf, errlen, "%s: Couldn't allocate memory for the flow table!", __FUNCTION__);
+            rval = DAQ_ERROR_NOMEM;
+            goto err;
+        }
     }
 
     dpdkc->state = DAQ_STATE_INITIALIZED;
@@ -476,6 +1365,8 @@ static int dpdk_daq_set_filter(void *handle, const char *filter)
 {
     Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
 
     if (dpdkc->filter)
         free(dpdkc->filter);
@@ -487,16 +1378,26 @@ static int dpdk_daq_set_filter(void *handle, const char *filter)
         return DAQ_ERROR;
     }
 
-    if (sfbpf_compile(dpdkc->snaplen, DLT_EN10MB, &fcode, dpdkc->filter, 1, 0) < 0)
+    if (sfbpf_compile_cached(NULL, dpdkc->snaplen, DLT_EN10MB, &fcode, dpdkc->filter, 1, 0, 0, bpf_errbuf) < 0)
+    {
+        DPE(dpdkc->errbuf, "%s: BPF state machine compilation failed: %.*s", __FUNCTION__,
+                (int) sizeof(dpdkc->errbuf) / 2, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if (!fjit)
     {
-        DPE(dpdkc->errbuf, "%s: BPF state machine compilation failed!", __FUNCTION__);
+        DPE(dpdkc->errbuf, "%s: Couldn't prepare the BPF state machine!", __FUNCTION__);
+        sfbpf_freecode(&fcode);
         return DAQ_ERROR;
     }
 
     sfbpf_freecode(&dpdkc->fcode);
 
-    dpdkc->fcode.bf_len = fcode.bf_len;
-    dpdkc->fcode.bf_insns = fcode.bf_insns;
+    dpdkc->fcode = fcode;
+    sfbpf_jit_free(dpdkc->fjit);
+    dpdkc->fjit = fjit;
 
     return DAQ_SUCCESS;
 }
@@ -504,18 +1405,30 @@ static int dpdk_daq_set_filter(void *handle, const char *filter)
 static int dpdk_daq_start(void *handle)
 {
     Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
+    int rval = DAQ_SUCCESS;
 
-    FOR_EACH_PORTS(dpdkc->ports, port)
+    /* Ports shared with other contexts may already be running. */
+    pthread_mutex_lock(&dpdk_lock);
+    FOR_EACH_INSTANCES(dpdkc->instances, instance)
     {
-        if (start_port(dpdkc, port) != DAQ_SUCCESS)
-            return DAQ_ERROR;
+        if (!(instance->port->flags & DPDKINST_STARTED) && start_port(dpdkc, instance->port) != DAQ_SUCCESS)
+        {
+            rval = DAQ_ERROR;
+            break;
+        }
+        if (start_instance(dpdkc, instance) != DAQ_SUCCESS)
+        {
+            rval = DAQ_ERROR;
+            break;
+        }
+        memset(&instance->hw_clock, 0, sizeof(instance->hw_clock));
     }
+    pthread_mutex_unlock(&dpdk_lock);
 
-/*    FOR_EACH_INSTANCES(dpdkc->instances, instance)
-    {
-        if (start_instance(dpdkc, instance) != DAQ_SUCCESS)
-            return DAQ_ERROR;
-    }*/
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    dpdk_clock_init(&dpdkc->clock);
 
     dpdk_daq_reset_stats(handle);
 
@@ -530,30 +1443,37 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
     Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
     DpdkInstance *peer;
     DpdkPort* port;
-    DpdkPort* peer_port = NULL;
     DAQ_PktHdr_t daqhdr;
     DAQ_Verdict verdict;
     const uint8_t *data;
     uint16_t len;
     int c = 0, burst_size;
     int i, got_one, ignored_one, sent_one;
-    int queue;
-    struct timeval ts;
+    uint16_t nb_bypass;
+    uint64_t start_ns, now_ns;
 
-    gettimeofday(&ts, NULL);
+    start_ns = dpdk_clock_now(&dpdkc->clock);
 
     while (c < cnt || cnt <= 0)
     {
         struct rte_mbuf *bufs[BURST_SIZE];
+        const u_char *pkts[BURST_SIZE];
+        u_int lens[BURST_SIZE], results[BURST_SIZE], classes[BURST_SIZE];
 
         got_one = 0;
         ignored_one = 0;
         sent_one = 0;
 
+        if (dpdkc->flow_count > 0)
+        {
+            now_ns = dpdk_clock_now(&dpdkc->clock);
+            if (now_ns - dpdkc->flow_aging_ns >= NS_PER_SEC)
+                age_flow_rules(dpdkc, now_ns);
+        }
+
         FOR_EACH_INSTANCES(dpdkc->instances, instance) {
             port = instance->port;
 
-
             /* Has breakloop() been called? */
             if (dpdkc->break_loop)
             {
@@ -562,124 +1482,136 @@ static int dpdk_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback,
             }
 
             peer = instance->peer;
-            if (peer)
+
+            /* Forward the whitelisted flows that the NIC steered to the port's bypass queue. */
+            if (peer && port->bypass_queue >= 0 && own_bypass_queue(instance))
             {
-                peer_port = peer->port;
-                burst_size = peer_port->tx_end - peer_port->tx_start;
-                if (burst_size > 0)
-                    goto do_send_packet;
+                nb_bypass = rte_eth_rx_burst(port->port, port->bypass_queue, bufs, BURST_SIZE);
+                for (i = 0; i < nb_bypass; i++)
+                    rte_eth_tx_buffer(peer->port->port, peer->queue, peer->tx_buffer, bufs[i]);
+                if (nb_bypass > 0)
+                {
+                    rte_eth_tx_buffer_flush(peer->port->port, peer->queue, peer->tx_buffer);
+                    sent_one = 1;
+                }
             }
 
-            for (queue = 0; queue < port->rx_rings; queue++)
-            {
-                if (cnt <= 0 || cnt - c >= BURST_SIZE)
-                    burst_size = BURST_SIZE;
-                else
-                    burst_size = cnt - c;
+            if (cnt <= 0 || cnt - c >= BURST_SIZE)
+                burst_size = BURST_SIZE;
+            else
+                burst_size = cnt - c;
 
-		//printf("2 port %d, queue %d, bufs %p, burst_size %d\n",instance->port,queue,bufs,burst_size);
+            const uint16_t nb_rx =
+                rte_eth_rx_burst(port->port, instance->queue,
+                        bufs, burst_size);
 
-                const uint16_t nb_rx =
-                    rte_eth_rx_burst(port->port, instance->queue,
-                            bufs, burst_size);
+            if (unlikely(nb_rx == 0))
+                continue;
 
-                if (unlikely(nb_rx == 0))
-                    continue;
+            /* One clock read stamps the whole burst. */
+            now_ns = dpdk_clock_now(&dpdkc->clock);
 
+            /* Filter and classify the whole burst in one go. */
+            if (dpdkc->fjit || dpdkc->cjit)
+            {
                 for (i = 0; i < nb_rx; i++)
                 {
-                    verdict = DAQ_VERDICT_PASS;
-
-                    data = rte_pktmbuf_mtod(bufs[i], void *);
-                    len = rte_pktmbuf_data_len(bufs[i]);
-
-                    dpdkc->stats.hw_packets_received++;
-
-                    if (dpdkc->fcode.bf_insns &&
-                            sfbpf_filter(dpdkc->fcode.bf_insns,
-                                data, len, len) == 0)
-                    {
-                        ignored_one = 1;
-                        dpdkc->stats.packets_filtered++;
-                        goto send_packet;
-                    }
-                    got_one = 1;
-
-                    daqhdr.ts = ts;
-                    daqhdr.caplen = len;
-                    daqhdr.pktlen = len;
-                    daqhdr.ingress_index = instance->index;
-                    daqhdr.egress_index = peer ? peer->index : DAQ_PKTHDR_UNKNOWN;
-                    daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
-                    daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
-                    daqhdr.flags = 0;
-                    daqhdr.opaque = 0;
-                    daqhdr.priv_ptr = NULL;
-                    daqhdr.address_space_id = 0;
-
-                    if (callback)
-                    {
-                        verdict = callback(user, &daqhdr, data);
-                        if (verdict >= MAX_DAQ_VERDICT)
-                            verdict = DAQ_VERDICT_PASS;
-                        dpdkc->stats.verdicts[verdict]++;
-                        verdict = verdict_translation_table[verdict];
-                    }
-                    dpdkc->stats.packets_received++;
-                    c++;
-send_packet:
-                    if (verdict == DAQ_VERDICT_PASS && instance->peer)
-                    {
-                        peer_port->tx_burst[peer_port->tx_end] = bufs[i];
-                        peer_port->tx_end++;
-                    }
-                    else
-                    {
-                        rte_pktmbuf_free(bufs[i]);
-                    }
+                    pkts[i] = rte_pktmbuf_mtod(bufs[i], const u_char *);
+                    lens[i] = rte_pktmbuf_data_len(bufs[i]);
                 }
+                if (dpdkc->fjit)
+                    sfbpf_filter_burst(dpdkc->fjit, pkts, lens, lens, NULL, nb_rx, results);
+                if (dpdkc->cjit)
+                    sfbpf_filter_burst(dpdkc->cjit, pkts, lens, lens, NULL, nb_rx, classes);
             }
 
-            if (peer)
+            for (i = 0; i < nb_rx; i++)
             {
-                burst_size = peer_port->tx_end - peer_port->tx_start;
-                if (unlikely(burst_size == 0))
-                    continue;
-do_send_packet:
-                for (queue = 0; burst_size != 0 && queue < peer_port->tx_rings; queue++)
-                {
-                    const uint16_t nb_tx = rte_eth_tx_burst(peer_port->port,
-                            peer->queue,
-                            &peer_port->tx_burst[peer_port->tx_start],
-                            burst_size);
+                verdict = DAQ_VERDICT_PASS;
 
-                    if (unlikely(nb_tx == 0))
-                        continue;
+                data = rte_pktmbuf_mtod(bufs[i], void *);
+                len = rte_pktmbuf_data_len(bufs[i]);
 
-                    sent_one = 1;
-                    burst_size -= nb_tx;
-                    peer_port->tx_start += nb_tx;
+                dpdkc->stats.hw_packets_received++;
+
+                if (dpdkc->fjit && results[i] == 0)
+                {
+                    ignored_one = 1;
+                    dpdkc->stats.packets_filtered++;
+                    goto send_packet;
+                }
+                got_one = 1;
+
+                daqhdr.caplen = len;
+                daqhdr.pktlen = len;
+                daqhdr.ingress_index = instance->index;
+                daqhdr.egress_index = peer ? peer->index : DAQ_PKTHDR_UNKNOWN;
+                daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
+                daqhdr.flags = 0;
+#ifdef PKT_RX_TIMESTAMP
+                if (dpdkc->hw_timestamps && (bufs[i]->ol_flags & PKT_RX_TIMESTAMP))
+                {
+                    dpdk_set_pkthdr_ts(&daqhdr, dpdk_hw_clock_ns(&instance->hw_clock, bufs[i]->timestamp, now_ns));
+                    daqhdr.flags |= DAQ_PKT_FLAG_HW_TIMESTAMP;
+                }
+                else
+#endif
+                dpdk_set_pkthdr_ts(&daqhdr, now_ns);
+                daqhdr.opaque = 0;
+                daqhdr.priv_ptr = NULL;
+                daqhdr.address_space_id = 0;
+                daqhdr.class_id = 0;
+                if (dpdkc->cjit)
+                {
+                    daqhdr.class_id = classes[i];
+                    daqhdr.flags |= DAQ_PKT_FLAG_CLASSIFIED;
                 }
 
-                if (burst_size == 0)
+                /* The flow was tagged through modify_flow(). */
+                if (dpdkc->flow_table && (bufs[i]->ol_flags & PKT_RX_FDIR_ID))
                 {
-                    peer_port->tx_start = 0;
-                    peer_port->tx_end = 0;
+                    daqhdr.opaque = bufs[i]->hash.fdir.hi;
+                    daqhdr.flags |= DAQ_PKT_FLAG_OPAQUE_IS_VALID;
                 }
+
+                if (callback)
+                {
+                    dpdkc->cur_hdr = &daqhdr;
+                    dpdkc->cur_data = data;
+                    dpdkc->cur_len = len;
+                    verdict = callback(user, &daqhdr, data);
+                    dpdkc->cur_hdr = NULL;
+                    if (verdict >= MAX_DAQ_VERDICT)
+                        verdict = DAQ_VERDICT_PASS;
+                    dpdkc->stats.verdicts[verdict]++;
+                    if (dpdkc->flow_table && (verdict == DAQ_VERDICT_WHITELIST || verdict == DAQ_VERDICT_BLACKLIST))
+                        offload_verdict(dpdkc, instance, data, len, verdict, now_ns);
+                    verdict = verdict_translation_table[verdict];
+                }
+                dpdkc->stats.packets_received++;
+                c++;
+send_packet:
+                /* Forwarded packets collect in the peer's TX buffer, which goes out on its own
+                    once it fills up. */
+                if (verdict == DAQ_VERDICT_PASS && peer)
+                    rte_eth_tx_buffer(peer->port->port, peer->queue, peer->tx_buffer, bufs[i]);
+                else
+                    rte_pktmbuf_free(bufs[i]);
             }
+
+            /* Send whatever is left over from this burst. */
+            if (peer && rte_eth_tx_buffer_flush(peer->port->port, peer->queue, peer->tx_buffer) > 0)
+                sent_one = 1;
         }
 
         if ((!got_one && !ignored_one && !sent_one))
         {
-            struct timeval now;
-
             if (dpdkc->timeout == -1)
                 continue;
 
             /* If time out, return control to the caller. */
-            gettimeofday(&now, NULL);
-            if (now.tv_sec > ts.tv_sec ||
-                    (now.tv_usec - ts.tv_usec) > dpdkc->timeout * 1000)
+            if (dpdk_clock_now(&dpdkc->clock) - start_ns > (uint64_t) dpdkc->timeout * 1000000)
                 return 0;
         }
     }
@@ -723,6 +1655,13 @@ static int dpdk_daq_inject(void *handle, const DAQ_PktHdr_t *hdr, const uint8_t
         return DAQ_ERROR_NOMEM;
     }
 
+    if (!rte_pktmbuf_append(m, len))
+    {
+        DPE(dpdkc->errbuf, "%s: Packet too large to inject (%u).",
+                __FUNCTION__, len);
+        rte_pktmbuf_free(m);
+        return DAQ_ERROR;
+    }
     rte_memcpy(rte_pktmbuf_mtod(m, void *), packet_data, len);
 
     const uint16_t nb_tx = rte_eth_tx_burst(instance->port->port, instance->queue, &m, 1);
@@ -795,9 +1734,15 @@ static int dpdk_daq_get_snaplen(void *handle)
 
 static uint32_t dpdk_daq_get_capabilities(void *handle)
 {
-    return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT |
+    Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
+    uint32_t capa = DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_INJECT |
         DAQ_CAPA_UNPRIV_START | DAQ_CAPA_BREAKLOOP | DAQ_CAPA_BPF |
         DAQ_CAPA_DEVICE_INDEX;
+
+    if (dpdkc->flow_offload)
+        capa |= DAQ_CAPA_WHITELIST | DAQ_CAPA_BLACKLIST;
+
+    return capa;
 }
 
 static int dpdk_daq_get_datalink_type(void *handle)
@@ -839,6 +1784,109 @@ static int dpdk_daq_get_device_index(void *handle, const char *device)
     return DAQ_ERROR_NODEV;
 }
 
+static DpdkInstance *find_instance(Dpdk_Context_t *dpdkc, int index)
+{
+    FOR_EACH_INSTANCES(dpdkc->instances, instance)
+    {
+        if (instance->index == index)
+            return instance;
+    }
+
+    return NULL;
+}
+
+/* Tag the rest of the flow of the packet being analyzed with the given opaque value, which is then
+    reported in the header of each of its packets. */
+static int dpdk_daq_modify_flow(void *handle, const DAQ_PktHdr_t *hdr, DAQ_ModFlow_t *modify)
+{
+    Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
+    DpdkInstance *instance, *peer;
+    DpdkFlowKey key, rkey;
+    uint64_t now_ns;
+    int rval;
+
+    if (!dpdkc->flow_table)
+        return DAQ_ERROR_NOTSUP;
+
+    if (!hdr || hdr != dpdkc->cur_hdr)
+    {
+        DPE(dpdkc->errbuf, "%s: Only the flow of the packet being analyzed can be modified", __FUNCTION__);
+        return DAQ_ERROR_INVAL;
+    }
+
+    instance = find_instance(dpdkc, hdr->ingress_index);
+    if (!instance || parse_flow_key(dpdkc->cur_data, dpdkc->cur_len, &key) != 0)
+        return DAQ_ERROR_NOTSUP;
+    reverse_flow_key(&key, &rkey);
+    peer = instance->peer ? instance->peer : instance;
+    now_ns = dpdk_clock_now(&dpdkc->clock);
+
+    pthread_mutex_lock(&dpdk_lock);
+    rval = install_flow_rule(dpdkc, instance->port, &key, 0, instance->queue, modify->opaque, 0, now_ns);
+    if (rval == DAQ_SUCCESS)
+        rval = install_flow_rule(dpdkc, peer->port, &rkey, 0, peer->queue, modify->opaque, 0, now_ns);
+    pthread_mutex_unlock(&dpdk_lock);
+
+    return rval;
+}
+
+/* Keep an expected flow, such as an FTP data channel, on the queues of the packet that announced it
+    so that it reaches the same context, whichever way RSS would have hashed it. */
+static int dpdk_daq_dp_add_dc(void *handle, const DAQ_PktHdr_t *hdr, DAQ_DP_key_t *dp_key, const uint8_t *packet_data)
+{
+    Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
+    DpdkInstance *instance, *sides[2];
+    DpdkFlowKey key, rkey;
+    uint64_t now_ns;
+    int i, rval = DAQ_SUCCESS;
+
+    if (!dpdkc->flow_table)
+        return DAQ_ERROR_NOTSUP;
+
+    instance = find_instance(dpdkc, hdr->ingress_index);
+    if (!instance || (dp_key->protocol != IPPROTO_TCP && dp_key->protocol != IPPROTO_UDP))
+        return DAQ_ERROR_NOTSUP;
+
+    memset(&key, 0, sizeof(key));
+    key.af = dp_key->af;
+    key.proto = dp_key->protocol;
+    key.vlan_id = dp_key->vlan_id & 0x0fff;
+    key.src_port = htons(dp_key->src_port);
+    key.dst_port = htons(dp_key->dst_port);
+    if (dp_key->af == AF_INET)
+    {
+        memcpy(key.src_addr, &dp_key->sa.src_ip4, 4);
+        memcpy(key.dst_addr, &dp_key->da.dst_ip4, 4);
+    }
+    else if (dp_key->af == AF_INET6)
+    {
+        memcpy(key.src_addr, &dp_key->sa.src_ip6, 16);
+        memcpy(key.dst_addr, &dp_key->da.dst_ip6, 16);
+    }
+    else
+        return DAQ_ERROR_NOTSUP;
+    reverse_flow_key(&key, &rkey);
+
+    sides[0] = instance;
+    sides[1] = instance->peer;
+    now_ns = dpdk_clock_now(&dpdkc->clock);
+
+    /* Either end of the expected flow may open it, so steer both directions on both ports.  Exact
+        rules for established flows take precedence. */
+    pthread_mutex_lock(&dpdk_lock);
+    for (i = 0; i < 2 && rval == DAQ_SUCCESS; i++)
+    {
+        if (!sides[i] || sides[i]->port->rx_rings < 2)
+            continue;
+        rval = install_flow_rule(dpdkc, sides[i]->port, &key, 1, sides[i]->queue, 0, 0, now_ns);
+        if (rval == DAQ_SUCCESS)
+            rval = install_flow_rule(dpdkc, sides[i]->port, &rkey, 1, sides[i]->queue, 0, 0, now_ns);
+    }
+    pthread_mutex_unlock(&dpdk_lock);
+
+    return rval;
+}
+
 #ifdef BUILDING_SO
 DAQ_SO_PUBLIC const DAQ_Module_t DAQ_MODULE_DATA =
 #else
@@ -866,9 +1914,9 @@ const DAQ_Module_t dpdk_daq_module_data =
     /* .get_errbuf = */ dpdk_daq_get_errbuf,
     /* .set_errbuf = */ dpdk_daq_set_errbuf,
     /* .get_device_index = */ dpdk_daq_get_device_index,
-    /* .modify_flow = */ NULL,
+    /* .modify_flow = */ dpdk_daq_modify_flow,
     /* .hup_prep = */ NULL,
     /* .hup_apply = */ NULL,
     /* .hup_post = */ NULL,
-    /* .dp_add_dc = */ NULL
+    /* .dp_add_dc = */ dpdk_daq_dp_add_dc
 };
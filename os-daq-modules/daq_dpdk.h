@@ -1,6 +1,10 @@
+#include <time.h>
+
 #include <rte_config.h>
+#include <rte_cycles.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
+#include <rte_malloc.h>
 #include <rte_version.h>
 
 #define DAQ_DPDK_VERSION 3
@@ -9,6 +13,100 @@
 
 #define BURST_SIZE 32
 
+#define NS_PER_SEC 1000000000ULL
+
+/* Wall clock time derived from the TSC, so that packets can be stamped without a system call.
+    It is anchored to CLOCK_REALTIME and re-anchored about once a second, which bounds both the
+    drift against the system clock and the range of the fixed point conversion. */
+typedef struct _dpdk_clock
+{
+    uint64_t tsc_hz;
+    uint64_t mult;          /* Nanoseconds per TSC cycle, 32.32 fixed point */
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    uint64_t last_ns;
+} DpdkClock;
+
+/* Maps a port's RX timestamps, whose unit and origin are driver specific, onto the clock above.
+    The tick rate is measured against it over intervals of about a second. */
+typedef struct _dpdk_hw_clock
+{
+    uint64_t mult;          /* Nanoseconds per hardware tick, 32.32 fixed point (0 until measured) */
+    uint64_t base_hw;
+    uint64_t base_ns;
+} DpdkHwClock;
+
+static inline void dpdk_clock_sync(DpdkClock *clock, uint64_t tsc)
+{
+    struct timespec now;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ns = (uint64_t) now.tv_sec * NS_PER_SEC + now.tv_nsec;
+    /* Never step backwards, timestamps handed out must stay ordered. */
+    if (ns < clock->last_ns)
+        ns = clock->last_ns;
+    clock->base_tsc = tsc;
+    clock->base_ns = ns;
+}
+
+static inline void dpdk_clock_init(DpdkClock *clock)
+{
+    clock->tsc_hz = rte_get_tsc_hz();
+    clock->mult = (NS_PER_SEC << 32) / clock->tsc_hz;
+    clock->last_ns = 0;
+    dpdk_clock_sync(clock, rte_rdtsc());
+}
+
+static inline uint64_t dpdk_clock_now(DpdkClock *clock)
+{
+    uint64_t tsc, delta;
+
+    tsc = rte_rdtsc();
+    delta = tsc - clock->base_tsc;
+    if (unlikely(delta >= clock->tsc_hz))
+    {
+        dpdk_clock_sync(clock, tsc);
+        delta = 0;
+    }
+    clock->last_ns = clock->base_ns + ((delta * clock->mult) >> 32);
+
+    return clock->last_ns;
+}
+
+/* Convert a hardware RX timestamp, given the software time at which its burst was received. */
+static inline uint64_t dpdk_hw_clock_ns(DpdkHwClock *hw, uint64_t stamp, uint64_t now_ns)
+{
+    uint64_t elapsed, ns;
+
+    elapsed = now_ns - hw->base_ns;
+    if (hw->base_ns == 0 || stamp < hw->base_hw || elapsed >= NS_PER_SEC)
+    {
+        /* Measure the rate over the interval that just ended, unless the queue sat idle for so long
+            that the anchor is useless, and start a new interval from this packet. */
+        if (hw->base_ns != 0 && stamp > hw->base_hw && elapsed < 4 * NS_PER_SEC)
+            hw->mult = (elapsed << 32) / (stamp - hw->base_hw);
+        hw->base_hw = stamp;
+        hw->base_ns = now_ns;
+        return now_ns;
+    }
+
+    if (hw->mult == 0)
+        return now_ns;
+
+    ns = hw->base_ns + (((stamp - hw->base_hw) * hw->mult) >> 32);
+    /* The packet can't have arrived after it was received from the queue. */
+    return ns < now_ns ? ns : now_ns;
+}
+
+static inline void dpdk_set_pkthdr_ts(DAQ_PktHdr_t *hdr, uint64_t ns)
+{
+    hdr->ts.tv_sec = ns / NS_PER_SEC;
+    hdr->ts_nsec = ns % NS_PER_SEC;
+    hdr->ts.tv_usec = hdr->ts_nsec / 1000;
+    hdr->flags |= DAQ_PKT_FLAG_TS_NSEC;
+}
+
 
 #define FOR_EACH_INSTANCES(list,v) \
     DpdkInstance* v; \
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <net/if.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,13 +16,30 @@
 
 #include "daq_dpdk.h"
 
+#include <rte_errno.h>
 #include <rte_mempool.h>
 #include <rte_mbuf.h>
 #include <rte_memcpy.h>
+#include <rte_memzone.h>
 #include <rte_ring.h>
 #include <rte_prefetch.h>
 
+/* Most rings in a ring group, and most consumers sharing one. */
+#define DPDKRING_MAX_GROUP  64
 
+/* Counters each consumer of a ring group keeps in a memzone shared by the whole group, one
+    cache line per consumer, so that the producer and operators can see how the load is spread. */
+typedef struct _dpdkring_consumer_stats
+{
+    uint64_t packets_received;      /* Dequeued from any ring of the group */
+    uint64_t packets_stolen;        /* Of those, dequeued from rings owned by other consumers */
+    uint64_t packets_filtered;
+    uint64_t packets_blocked;
+} __rte_cache_aligned DpdkRingConsumerStats;
+
+/* The EAL is shared by every DAQ context in the process, so that consumers can run as threads. */
+static pthread_mutex_t dpdkring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int dpdkring_eal_initialized = 0;
 
 typedef struct _dpdk_instance
 {
@@ -30,7 +48,14 @@ typedef struct _dpdk_instance
     uint32_t flags;
     int ingress_index;
     int egress_index;
-    struct rte_ring *rx_ring;
+    /* RX rings: those of the group this consumer owns come first, followed by the others */
+    struct rte_ring *rx_rings[DPDKRING_MAX_GROUP];
+    int rx_owned;
+    int rx_count;
+    int rx_cur;
+    int steal_cur;
+    DpdkRingConsumerStats *group_stats;
+    DpdkRingConsumerStats local_stats;
     struct rte_ring *tx_ring_peer;
     struct rte_ring *tx_ring_reverse;
     struct rte_mempool *mbuf_pool;
@@ -38,8 +63,10 @@ typedef struct _dpdk_instance
     int tx_peer_end;
     struct rte_mbuf *tx_peer_burst[BURST_SIZE];
     char rx_name[64];
+    char rx_pattern[64];
     char tx_name[64];
     char tx_reverse_name[64];
+    DpdkHwClock hw_clock;
 } DpdkInstance;
 
 typedef struct _dpdk_context
@@ -49,10 +76,17 @@ typedef struct _dpdk_context
     int snaplen;
     int timeout;
     int debug;
+    int hw_timestamps;
+    DpdkClock clock;
     DpdkInstance *instances;
     int peer_mode;
     int intf_count;
+    int consumer;
+    int consumers;
+    int steal;
+    unsigned steal_threshold;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
     volatile int break_loop;
     int promisc_flag;
     DAQ_Stats_t stats;
@@ -62,16 +96,135 @@ typedef struct _dpdk_context
 
 static void dpdkring_daq_reset_stats(void *handle);
 
-static int start_instance(Dpdk_Context_t *dpdkc, DpdkInstance *instance)
+static inline uint16_t ring_dequeue_burst(struct rte_ring *ring, struct rte_mbuf **burst, int burst_size)
 {
-    /* No matter which mode is selected, we must find an RX ring */
-    instance->rx_ring = rte_ring_lookup(instance->rx_name);
+#if RTE_VERSION >= RTE_VERSION_NUM(17,5,0,0)
+    return rte_ring_dequeue_burst(ring, (void *)burst, burst_size, 0);
+#else
+    return rte_ring_dequeue_burst(ring, (void *)burst, burst_size);
+#endif
+}
 
-    if (instance->rx_ring == NULL)
+/* Find the counters of this consumer in the memzone of its ring group, which is named after the
+    group's pattern with "stats" in place of the ring number. */
+static DpdkRingConsumerStats *find_group_stats(Dpdk_Context_t *dpdkc, DpdkInstance *instance)
+{
+    const struct rte_memzone *mz;
+    char name[RTE_MEMZONE_NAMESIZE];
+    const char *num = strstr(instance->rx_pattern, "%d");
+    size_t len = DPDKRING_MAX_GROUP * sizeof(DpdkRingConsumerStats);
+
+    if ((size_t) snprintf(name, sizeof(name), "%.*sstats%s", (int) (num - instance->rx_pattern),
+                instance->rx_pattern, num + 2) >= sizeof(name))
+        return NULL;
+
+    mz = rte_memzone_reserve(name, len, SOCKET_ID_ANY, 0);
+    if (!mz && rte_errno == EEXIST)
+        mz = rte_memzone_lookup(name);
+    if (!mz || mz->len < len)
+        return NULL;
+
+    return (DpdkRingConsumerStats *) mz->addr + dpdkc->consumer;
+}
+
+/* Look up the RX ring of the instance, or the rings of its group.  The producer spreads packets
+    over rings named after the group's pattern, numbered from 0, and each consumer owns the rings
+    whose number modulo the number of consumers is its own. */
+static int find_rx_rings(Dpdk_Context_t *dpdkc, DpdkInstance *instance)
+{
+    struct rte_ring *others[DPDKRING_MAX_GROUP];
+    struct rte_ring *ring;
+    char name[RTE_RING_NAMESIZE];
+    int i, num_others = 0;
+
+    instance->rx_owned = 0;
+    instance->rx_cur = 0;
+    instance->steal_cur = 0;
+    instance->group_stats = &instance->local_stats;
+
+    if (!instance->rx_pattern[0])
+    {
+        instance->rx_rings[0] = rte_ring_lookup(instance->rx_name);
+        if (instance->rx_rings[0] == NULL)
+        {
+            DPE(dpdkc->errbuf, "%s: Cannot get RX ring (%s)\n", __FUNCTION__, instance->rx_name);
+            return DAQ_ERROR;
+        }
+        instance->rx_owned = instance->rx_count = 1;
+        return DAQ_SUCCESS;
+    }
+
+    for (i = 0; i < DPDKRING_MAX_GROUP; i++)
+    {
+        snprintf(name, sizeof(name), instance->rx_pattern, i);
+        if ((ring = rte_ring_lookup(name)) == NULL)
+            break;
+        /* Stolen packets are dequeued concurrently with the ring's owner. */
+        if (dpdkc->steal && (ring->flags & RING_F_SC_DEQ))
+        {
+            DPE(dpdkc->errbuf, "%s: RX ring %s is single-consumer and can't be shared for work stealing",
+                    __FUNCTION__, name);
+            return DAQ_ERROR;
+        }
+        if (i % dpdkc->consumers == dpdkc->consumer)
+            instance->rx_rings[instance->rx_owned++] = ring;
+        else
+            others[num_others++] = ring;
+    }
+
+    if (i == 0)
+    {
+        DPE(dpdkc->errbuf, "%s: Cannot get any RX ring of group %s", __FUNCTION__, instance->rx_pattern);
+        return DAQ_ERROR;
+    }
+    if (instance->rx_owned == 0 && !dpdkc->steal)
     {
-        DPE(dpdkc->errbuf, "%s: Cannot get RX ring (%s)\n", __FUNCTION__, instance->rx_name);
+        DPE(dpdkc->errbuf, "%s: Consumer %d of %d has none of the %d RX rings of group %s",
+                __FUNCTION__, dpdkc->consumer, dpdkc->consumers, i, instance->rx_pattern);
         return DAQ_ERROR;
     }
+    memcpy(&instance->rx_rings[instance->rx_owned], others, num_others * sizeof(*others));
+    instance->rx_count = instance->rx_owned + num_others;
+
+    instance->group_stats = find_group_stats(dpdkc, instance);
+    if (!instance->group_stats)
+    {
+        fprintf(stderr, "%s: Cannot share the statistics of ring group %s, keeping them locally\n",
+                __FUNCTION__, instance->rx_pattern);
+        instance->group_stats = &instance->local_stats;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+/* When a consumer's own rings are empty, take a burst from the first of the other rings in its
+    group holding more than steal_threshold packets. */
+static uint16_t steal_burst(Dpdk_Context_t *dpdkc, DpdkInstance *instance, struct rte_mbuf **burst, int burst_size)
+{
+    struct rte_ring *ring;
+    int i, num_others = instance->rx_count - instance->rx_owned;
+    uint16_t nb_read;
+
+    for (i = 0; i < num_others; i++)
+    {
+        ring = instance->rx_rings[instance->rx_owned + instance->steal_cur];
+        if (++instance->steal_cur == num_others)
+            instance->steal_cur = 0;
+        if (rte_ring_count(ring) <= dpdkc->steal_threshold)
+            continue;
+        nb_read = ring_dequeue_burst(ring, burst, burst_size);
+        if (nb_read > 0)
+            return nb_read;
+    }
+
+    return 0;
+}
+
+static int start_instance(Dpdk_Context_t *dpdkc, DpdkInstance *instance)
+{
+    /* No matter which mode is selected, we must find an RX ring */
+    if (find_rx_rings(dpdkc, instance) != DAQ_SUCCESS)
+        return DAQ_ERROR;
 
     if (!dpdkc->peer_mode)
     {
@@ -178,10 +331,19 @@ static int dpdk_close(Dpdk_Context_t *dpdkc)
     while((instance = dpdkc->instances) != NULL)
     {
         dpdkc->instances = instance->next;
+        if (dpdkc->debug && instance->rx_pattern[0] && (instance->flags & DPDKINST_STARTED))
+        {
+            printf("Ring group %s: consumer %d of %d owning %d of %d rings, %llu packets received, %llu stolen\n",
+                    instance->rx_pattern, dpdkc->consumer, dpdkc->consumers, instance->rx_owned, instance->rx_count,
+                    (unsigned long long) instance->group_stats->packets_received,
+                    (unsigned long long) instance->group_stats->packets_stolen);
+        }
         destroy_instance(instance);
     }
 
     sfbpf_freecode(&dpdkc->fcode);
+    sfbpf_jit_free(dpdkc->fjit);
+    dpdkc->fjit = NULL;
 	
     dpdkc->state = DAQ_STATE_STOPPED;
 
@@ -218,6 +380,10 @@ static int dpdkring_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
     int argc;
     int called_instance_creation;
     char poolname[64];
+    char *ring_group = NULL;
+    int use_ring_group = 0;
+    char *end;
+    long val;
 
     dpdkc = calloc(1, sizeof(Dpdk_Context_t));
     if (!dpdkc)
@@ -250,25 +416,35 @@ static int dpdkring_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
     }
 
 
-    if (!dpdk_args)
-    {
-        snprintf(errbuf, errlen, "%s: Missing EAL arguments!", __FUNCTION__);
-        rval = DAQ_ERROR_INVAL;
-        goto err;
-    }
+    pthread_mutex_lock(&dpdkring_lock);
 
-    argv[0] = argv0;
-    argc = parse_args(dpdk_args, &argv[1]) + 1;
+    /* The EAL can only be brought up once per process; later contexts share it. */
+    if (!dpdkring_eal_initialized)
+    {
+        if (!dpdk_args)
+        {
+            pthread_mutex_unlock(&dpdkring_lock);
+            snprintf(errbuf, errlen, "%s: Missing EAL arguments!", __FUNCTION__);
+            rval = DAQ_ERROR_INVAL;
+            goto err;
+        }
 
+        argv[0] = argv0;
+        argc = parse_args(dpdk_args, &argv[1]) + 1;
 
-    ret = rte_eal_init(argc, argv);
-    if (ret < 0)
-    {
-        snprintf(errbuf, errlen, "%s: Invalid EAL arguments!\n", __FUNCTION__);
-        rval = DAQ_ERROR_INVAL;
-        goto err;
+        ret = rte_eal_init(argc, argv);
+        if (ret < 0)
+        {
+            pthread_mutex_unlock(&dpdkring_lock);
+            snprintf(errbuf, errlen, "%s: Invalid EAL arguments!\n", __FUNCTION__);
+            rval = DAQ_ERROR_INVAL;
+            goto err;
+        }
+        dpdkring_eal_initialized = 1;
     }
 
+    pthread_mutex_unlock(&dpdkring_lock);
+
     dpdkc->peer_mode = (config->mode == DAQ_MODE_PASSIVE) ? 0 : 1;
 
     dev = dpdkc->device;
@@ -360,12 +536,86 @@ static int dpdkring_daq_initialize(const DAQ_Config_t *config, void **ctxt_ptr,
 
     /* Initialize other default configuration values. */
     dpdkc->debug = 0;
+    dpdkc->consumer = 0;
+    dpdkc->consumers = 1;
+    dpdkc->steal = 0;
 
     /* Import the configuration dictionary requests. */
     for (entry = config->values; entry; entry = entry->next)
     {
         if (!strcmp(entry->key, "debug"))
             dpdkc->debug = 1;
+        else if (!strcmp(entry->key, "hw_timestamps"))
+            dpdkc->hw_timestamps = 1;
+        else if (!strcmp(entry->key, "ring_group"))
+        {
+            use_ring_group = 1;
+            ring_group = entry->value;
+        }
+        else if (!strcmp(entry->key, "consumer") || !strcmp(entry->key, "consumers") ||
+                 !strcmp(entry->key, "steal"))
+        {
+            errno = 0;
+            val = entry->value ? strtol(entry->value, &end, 10) : -1;
+            if (!strcmp(entry->key, "steal") && !entry->value)
+                val = BURST_SIZE;
+            else if (!entry->value || *end != '\0' || errno != 0 || val < 0 || val > INT32_MAX)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid value for %s: \"%s\"", __FUNCTION__,
+                        entry->key, entry->value ? entry->value : "");
+                rval = DAQ_ERROR_INVAL;
+                goto err;
+            }
+            if (!strcmp(entry->key, "consumer"))
+                dpdkc->consumer = val;
+            else if (!strcmp(entry->key, "consumers"))
+                dpdkc->consumers = val;
+            else
+            {
+                dpdkc->steal = 1;
+                dpdkc->steal_threshold = val;
+            }
+        }
+    }
+
+    if (dpdkc->consumers < 1 || dpdkc->consumers > DPDKRING_MAX_GROUP || dpdkc->consumer >= dpdkc->consumers)
+    {
+        snprintf(errbuf, errlen, "%s: Invalid consumer %d of %d (at most %d consumers)", __FUNCTION__,
+                dpdkc->consumer, dpdkc->consumers, DPDKRING_MAX_GROUP);
+        rval = DAQ_ERROR_INVAL;
+        goto err;
+    }
+
+    /* A ring group pattern must number the rings with a single %d, and name the rings of one
+        interface only.  By default, each interface has the group of its usual RX ring name. */
+    if (use_ring_group)
+    {
+        if (ring_group && (!strstr(ring_group, "%d") || strchr(ring_group, '%') != strstr(ring_group, "%d") ||
+                strchr(strstr(ring_group, "%d") + 2, '%') || strlen(ring_group) >= sizeof(instance->rx_pattern)))
+        {
+            snprintf(errbuf, errlen, "%s: Invalid ring group pattern: \"%s\"", __FUNCTION__, ring_group);
+            rval = DAQ_ERROR_INVAL;
+            goto err;
+        }
+        if (ring_group && dpdkc->intf_count > 1)
+        {
+            snprintf(errbuf, errlen, "%s: A ring group pattern can only be used with a single interface", __FUNCTION__);
+            rval = DAQ_ERROR_INVAL;
+            goto err;
+        }
+        for (instance = dpdkc->instances; instance; instance = instance->next)
+        {
+            if (ring_group)
+                snprintf(instance->rx_pattern, sizeof(instance->rx_pattern), "%s", ring_group);
+            else
+                snprintf(instance->rx_pattern, sizeof(instance->rx_pattern), "%s_%%d", instance->rx_name);
+        }
+    }
+    else if (dpdkc->consumers > 1 || dpdkc->steal)
+    {
+        snprintf(errbuf, errlen, "%s: consumers and steal only apply to ring groups", __FUNCTION__);
+        rval = DAQ_ERROR_INVAL;
+        goto err;
     }
 
     dpdkc->state = DAQ_STATE_INITIALIZED;
@@ -388,6 +638,8 @@ static int dpdkring_daq_set_filter(void *handle, const char *filter)
 {
     Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
 
     if (dpdkc->filter)
         free(dpdkc->filter);
@@ -399,16 +651,26 @@ static int dpdkring_daq_set_filter(void *handle, const char *filter)
         return DAQ_ERROR;
     }
 
-    if (sfbpf_compile(dpdkc->snaplen, DLT_EN10MB, &fcode, dpdkc->filter, 1, 0) < 0)
+    if (sfbpf_compile_cached(NULL, dpdkc->snaplen, DLT_EN10MB, &fcode, dpdkc->filter, 1, 0, 0, bpf_errbuf) < 0)
+    {
+        DPE(dpdkc->errbuf, "%s: BPF state machine compilation failed: %.*s", __FUNCTION__,
+                (int) sizeof(dpdkc->errbuf) / 2, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if (!fjit)
     {
-        DPE(dpdkc->errbuf, "%s: BPF state machine compilation failed!", __FUNCTION__);
+        DPE(dpdkc->errbuf, "%s: Couldn't prepare the BPF state machine!", __FUNCTION__);
+        sfbpf_freecode(&fcode);
         return DAQ_ERROR;
     }
 
     sfbpf_freecode(&dpdkc->fcode);
 
-    dpdkc->fcode.bf_len = fcode.bf_len;
-    dpdkc->fcode.bf_insns = fcode.bf_insns;
+    dpdkc->fcode = fcode;
+    sfbpf_jit_free(dpdkc->fjit);
+    dpdkc->fjit = fjit;
 
     return DAQ_SUCCESS;
 }
@@ -422,8 +684,11 @@ static int dpdkring_daq_start(void *handle)
     {
         if (start_instance(dpdkc, instance) != DAQ_SUCCESS)
             return DAQ_ERROR;
+        memset(&instance->hw_clock, 0, sizeof(instance->hw_clock));
     }
 
+    dpdk_clock_init(&dpdkc->clock);
+
     dpdkring_daq_reset_stats(handle);
     dpdkc->state = DAQ_STATE_STARTED;
 
@@ -440,14 +705,17 @@ static int dpdkring_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
     const uint8_t *data;
     uint16_t len;
     int c = 0, burst_size;
-    int i, got_one, ignored_one, sent_one;
-    struct timeval ts;
+    int i, r, got_one, ignored_one, sent_one;
+    uint16_t nb_read;
+    uint64_t start_ns, now_ns;
 
-    gettimeofday(&ts, NULL);
+    start_ns = dpdk_clock_now(&dpdkc->clock);
 
     while (cnt == 0 || c < cnt)
     {
         struct rte_mbuf *rx_burst[BURST_SIZE];
+        const u_char *pkts[BURST_SIZE];
+        u_int lens[BURST_SIZE], results[BURST_SIZE];
 
         got_one = 0;
         ignored_one = 0;
@@ -476,14 +744,36 @@ static int dpdkring_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
             else
                 burst_size = cnt - c;
 
-            // Read RX ring
-#if RTE_VERSION >= RTE_VERSION_NUM(17,5,0,0)
-            const uint16_t nb_read = rte_ring_dequeue_burst(instance->rx_ring, (void *)rx_burst, burst_size, 0);
-#else
-            const uint16_t nb_read = rte_ring_dequeue_burst(instance->rx_ring, (void *)rx_burst, burst_size);
-#endif
+            // Read the next owned RX ring that has packets, in turn, or steal from a backed up one
+            nb_read = 0;
+            for (r = 0; r < instance->rx_owned && nb_read == 0; r++)
+            {
+                nb_read = ring_dequeue_burst(instance->rx_rings[instance->rx_cur], rx_burst, burst_size);
+                if (++instance->rx_cur == instance->rx_owned)
+                    instance->rx_cur = 0;
+            }
+            if (nb_read == 0 && dpdkc->steal)
+            {
+                nb_read = steal_burst(dpdkc, instance, rx_burst, burst_size);
+                instance->group_stats->packets_stolen += nb_read;
+            }
             if (unlikely(nb_read == 0))
                 continue;
+            instance->group_stats->packets_received += nb_read;
+
+            // One clock read stamps the whole burst
+            now_ns = dpdk_clock_now(&dpdkc->clock);
+
+            // Filter the whole burst in one go
+            if (dpdkc->fjit)
+            {
+                for (i = 0; i < nb_read; i++)
+                {
+                    pkts[i] = rte_pktmbuf_mtod(rx_burst[i], const u_char *);
+                    lens[i] = rte_pktmbuf_data_len(rx_burst[i]);
+                }
+                sfbpf_filter_burst(dpdkc->fjit, pkts, lens, lens, NULL, nb_read, results);
+            }
 
             // Process each read packet
             for (i = 0; i < nb_read; i++)
@@ -496,16 +786,16 @@ static int dpdkring_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
 
                 dpdkc->stats.hw_packets_received++;
 
-                if (dpdkc->fcode.bf_insns && sfbpf_filter(dpdkc->fcode.bf_insns, data, len, len) == 0)
+                if (dpdkc->fjit && results[i] == 0)
                 {
                     ignored_one = 1;
                     dpdkc->stats.packets_filtered++;
+                    instance->group_stats->packets_filtered++;
                 }
                 else
                 {
                     got_one = 1;
 
-                    daqhdr.ts = ts;
                     daqhdr.caplen = len;
                     daqhdr.pktlen = len;
                     daqhdr.ingress_index = instance->ingress_index;
@@ -513,6 +803,16 @@ static int dpdkring_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                     daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
                     daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
                     daqhdr.flags = 0;
+#ifdef PKT_RX_TIMESTAMP
+                    // Use the timestamp the NIC put in the mbuf, if the process feeding the ring enabled them
+                    if (dpdkc->hw_timestamps && (rx_burst[i]->ol_flags & PKT_RX_TIMESTAMP))
+                    {
+                        dpdk_set_pkthdr_ts(&daqhdr, dpdk_hw_clock_ns(&instance->hw_clock, rx_burst[i]->timestamp, now_ns));
+                        daqhdr.flags |= DAQ_PKT_FLAG_HW_TIMESTAMP;
+                    }
+                    else
+#endif
+                    dpdk_set_pkthdr_ts(&daqhdr, now_ns);
                     daqhdr.opaque = 0;
                     daqhdr.priv_ptr = rx_burst[i]->userdata;
                     daqhdr.flow_id = (uint32_t)(uintptr_t) rx_burst[i]->userdata;
@@ -538,6 +838,8 @@ static int dpdkring_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callb
                 }
                 else
                 {
+                    if (verdict == DAQ_VERDICT_BLOCK)
+                        instance->group_stats->packets_blocked++;
                     rte_pktmbuf_free(rx_burst[i]);
                 }
             }
@@ -573,15 +875,11 @@ send_packets:
 
         if ((!got_one && !ignored_one && !sent_one))
         {
-            struct timeval now;
-
             if (dpdkc->timeout == -1)
                 continue;
 
             /* If time out, return control to the caller. */
-            gettimeofday(&now, NULL);
-            if (now.tv_sec > ts.tv_sec ||
-                    (now.tv_usec - ts.tv_usec) > dpdkc->timeout * 1000)
+            if (dpdk_clock_now(&dpdkc->clock) - start_ns > (uint64_t) dpdkc->timeout * 1000000)
                 return 0;
         }
     }
@@ -683,6 +981,12 @@ static void dpdkring_daq_reset_stats(void *handle)
 {
     Dpdk_Context_t *dpdkc = (Dpdk_Context_t *) handle;
     memset(&dpdkc->stats, 0, sizeof(DAQ_Stats_t));
+
+    FOR_EACH_INSTANCES(dpdkc->instances, instance)
+    {
+        if (instance->group_stats)
+            memset(instance->group_stats, 0, sizeof(DpdkRingConsumerStats));
+    }
 }
 
 static int dpdkring_daq_get_snaplen(void *handle)
@@ -61,6 +61,7 @@ typedef struct {
     char error[DAQ_ERRBUF_SIZE];
 
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program* fjit;
     struct sockaddr_in sin;
 
     DAQ_State state;
@@ -167,6 +168,9 @@ static void ipfw_daq_shutdown (void* handle)
     if ( impl->filter )
         free(impl->filter);
 
+    if ( impl->fjit )
+        sfbpf_jit_free(impl->fjit);
+
     if ( impl->buf )
         free(impl->buf);
 
@@ -179,23 +183,35 @@ static int ipfw_daq_set_filter (void* handle, const char* filter)
 {
     IpfwImpl* impl = (IpfwImpl*)handle;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program* fjit;
 
-    if ( sfbpf_compile(impl->snaplen, DLT_IPV4, &fcode, filter, 1, 0) < 0 )
+    if ( sfbpf_compile_cached(NULL, impl->snaplen, DLT_IPV4, &fcode, filter, 1, 0, 0, NULL) < 0 )
     {
         // FIXTHIS is errno set?
         // XICHE: No, which is why relying on strerror for everything is bad.
         return DAQ_ERROR;
     }
 
+    fjit = sfbpf_jit_compile(&fcode);
+    if ( !fjit )
+    {
+        sfbpf_freecode(&fcode);
+        return DAQ_ERROR;
+    }
+
     if ( impl->filter )
         free((void *)impl->filter);
 
     if ( impl->fcode.bf_insns )
-        free(impl->fcode.bf_insns);
+        sfbpf_freecode(&impl->fcode);
 
     impl->filter = strdup(filter);
     impl->fcode = fcode;
 
+    if ( impl->fjit )
+        sfbpf_jit_free(impl->fjit);
+    impl->fjit = fjit;
+
     return DAQ_SUCCESS;
 }
 
@@ -340,8 +356,8 @@ static int ipfw_daq_acquire (
             impl->stats.hw_packets_received++;
 
             if (
-                impl->fcode.bf_insns &&
-                sfbpf_filter(impl->fcode.bf_insns, impl->buf,
+                impl->fjit &&
+                sfbpf_filter_jit(impl->fjit, impl->buf,
                     hdr.caplen, hdr.caplen) == 0
             ) {
                 verdict = DAQ_VERDICT_PASS;
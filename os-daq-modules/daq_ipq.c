@@ -59,6 +59,7 @@ typedef struct {
 
     char* filter;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program* fjit;
 
     uint8_t* buf;
     char error[DAQ_ERRBUF_SIZE];
@@ -250,6 +251,9 @@ static void ipq_daq_shutdown (void* handle)
     if ( impl->filter )
         free(impl->filter);
 
+    if ( impl->fjit )
+        sfbpf_jit_free(impl->fjit);
+
     if ( impl->buf )
         free(impl->buf);
 
@@ -326,8 +330,8 @@ static int ipq_daq_acquire (
             impl->stats.hw_packets_received++;
 
             if (
-                impl->fcode.bf_insns &&
-                sfbpf_filter(impl->fcode.bf_insns, ipqm->payload,
+                impl->fjit &&
+                sfbpf_filter_jit(impl->fjit, ipqm->payload,
                     hdr.caplen, hdr.caplen) == 0
             ) {
                 verdict = DAQ_VERDICT_PASS;
@@ -419,12 +423,23 @@ static int ipq_daq_set_filter (void* handle, const char* filter)
 {
     IpqImpl* impl = (IpqImpl*)handle;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program* fjit;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
     int dlt = (impl->proto == PF_INET) ? DLT_IPV4 : DLT_IPV6;
 
-    if (sfbpf_compile(impl->snaplen, dlt, &fcode, filter, 1, 0) < 0)
+    if (sfbpf_compile_cached(NULL, impl->snaplen, dlt, &fcode, filter, 1, 0, 0, bpf_errbuf) < 0)
+    {
+        DPE(impl->error, "%s: failed to compile '%s': %s",
+            __FUNCTION__, filter, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if ( !fjit )
     {
-        DPE(impl->error, "%s: failed to compile '%s'",
+        DPE(impl->error, "%s: failed to prepare bpf '%s'",
             __FUNCTION__, filter);
+        sfbpf_freecode(&fcode);
         return DAQ_ERROR;
     }
 
@@ -432,11 +447,15 @@ static int ipq_daq_set_filter (void* handle, const char* filter)
         free((void *)impl->filter);
 
     if ( impl->fcode.bf_insns )
-        free(impl->fcode.bf_insns);
+        sfbpf_freecode(&impl->fcode);
 
     impl->filter = strdup(filter);
     impl->fcode = fcode;
 
+    if ( impl->fjit )
+        sfbpf_jit_free(impl->fjit);
+    impl->fjit = fjit;
+
     return DAQ_SUCCESS;
 }
 
@@ -22,6 +22,7 @@
 #include "config.h"
 #endif
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <net/if.h>
@@ -44,10 +45,17 @@
 /* Hi! I'm completely arbitrary! */
 #define NETMAP_MAX_INTERFACES       32
 
+/* Slots taken from an RX ring before moving on to the next one. */
+#define NETMAP_DEFAULT_BURST        64
+
+/* Extra buffers requested per instance for injected packets. */
+#define NETMAP_DEFAULT_INJECT_BUFS  128
+
 /* FreeBSD 10.0 uses an old version of netmap, so work around it accordingly. */
 #if NETMAP_API < 10
 #define nm_ring_next(r, i)      NETMAP_RING_NEXT(r, i)
 #define nm_ring_empty(r)        ((r)->avail == 0)
+#define nm_ring_space(r)        ((r)->avail)
 #endif
 
 typedef struct _netmap_instance
@@ -59,6 +67,7 @@ typedef struct _netmap_instance
 #define NMINST_TX_BLOCKED      0x2
     uint32_t flags;
     int index;
+    char name[IFNAMSIZ];
     struct netmap_if *nifp;
     /* TX ring info */
     uint16_t first_tx_ring;
@@ -68,6 +77,25 @@ typedef struct _netmap_instance
     uint16_t first_rx_ring;
     uint16_t last_rx_ring;
     uint16_t cur_rx_ring;
+    /* TX batch: slots filled in tx_ring but not yet handed to the kernel */
+    struct netmap_ring *tx_ring;
+    uint32_t tx_cur;
+    uint32_t tx_space;
+    uint32_t tx_pending;
+    /* Slots handed back since the last TX/RX sync */
+    uint32_t tx_unsynced;
+    uint32_t rx_unsynced;
+    /* Extra buffers holding injected packets until there is room to swap
+        them into a TX slot; the free ones are linked through their first word */
+    struct
+    {
+        uint32_t buf_idx;
+        uint16_t len;
+    } *inj_queue;
+    uint32_t inj_size;
+    uint32_t inj_head;
+    uint32_t inj_count;
+    uint32_t free_buf;
     /* MMAP'd memory */
     void *mem;
     uint32_t memsize;
@@ -82,9 +110,12 @@ typedef struct _netmap_context
     int snaplen;
     int timeout;
     int debug;
+    uint32_t burst;
+    uint32_t inject_bufs;
     NetmapInstance *instances;
     uint32_t intf_count;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
     volatile int break_loop;
     DAQ_Stats_t stats;
     DAQ_State state;
@@ -105,16 +136,117 @@ static inline void nminst_inc_tx_ring(NetmapInstance *instance)
         instance->cur_tx_ring = instance->first_tx_ring;
 }
 
+/* Hand the slots filled in the current TX ring over to the kernel. */
+static inline void nminst_tx_flush(NetmapInstance *instance)
+{
+    if (instance->tx_pending)
+    {
+        instance->tx_ring->cur = instance->tx_cur;
+#if NETMAP_API >= 10
+        instance->tx_ring->head = instance->tx_cur;
+#else
+        instance->tx_ring->avail -= instance->tx_pending;
+#endif
+        instance->tx_unsynced += instance->tx_pending;
+        instance->tx_pending = 0;
+    }
+}
+
+/*
+ * Return the next free TX slot, filling one ring until it is full before
+ * moving on to the next ring with space, or NULL if they are all full.
+ */
+static inline struct netmap_slot *nminst_next_tx_slot(NetmapInstance *instance)
+{
+    struct netmap_ring *tx_ring;
+    struct netmap_slot *tx_slot;
+    uint16_t start_tx_ring;
+
+    if (!instance->tx_space)
+    {
+        nminst_tx_flush(instance);
+        start_tx_ring = instance->cur_tx_ring;
+        do
+        {
+            tx_ring = NETMAP_TXRING(instance->nifp, instance->cur_tx_ring);
+            nminst_inc_tx_ring(instance);
+            if (nm_ring_empty(tx_ring))
+                continue;
+            instance->tx_ring = tx_ring;
+            instance->tx_cur = tx_ring->cur;
+            instance->tx_space = nm_ring_space(tx_ring);
+        } while (instance->cur_tx_ring != start_tx_ring && !instance->tx_space);
+
+        if (!instance->tx_space)
+            return NULL;
+    }
+
+    tx_slot = &instance->tx_ring->slot[instance->tx_cur];
+    instance->tx_cur = nm_ring_next(instance->tx_ring, instance->tx_cur);
+    instance->tx_space--;
+    instance->tx_pending++;
+
+    return tx_slot;
+}
+
+static inline char *nminst_buf(NetmapInstance *instance, uint32_t buf_idx)
+{
+    return NETMAP_BUF(NETMAP_TXRING(instance->nifp, instance->first_tx_ring), buf_idx);
+}
+
+/* Swap queued injected packets into TX slots for as long as there is room. */
+static void nminst_drain_injects(NetmapInstance *instance)
+{
+    struct netmap_slot *tx_slot;
+    uint32_t buf_idx;
+
+    while (instance->inj_count && (tx_slot = nminst_next_tx_slot(instance)))
+    {
+        buf_idx = instance->inj_queue[instance->inj_head].buf_idx;
+        tx_slot->len = instance->inj_queue[instance->inj_head].len;
+        instance->inj_head = (instance->inj_head + 1) % instance->inj_size;
+        instance->inj_count--;
+
+        /* The slot's old buffer takes the injected one's place in the pool. */
+        *(uint32_t *) nminst_buf(instance, tx_slot->buf_idx) = instance->free_buf;
+        instance->free_buf = tx_slot->buf_idx;
+        tx_slot->buf_idx = buf_idx;
+        tx_slot->flags |= NS_BUF_CHANGED;
+    }
+}
+
+/* Give the extra buffers back to netmap, which frees them on unregister. */
+static void nminst_release_bufs(NetmapInstance *instance)
+{
+    uint32_t buf_idx;
+
+    if (!instance->inj_queue)
+        return;
+    if (instance->mem != MAP_FAILED)
+    {
+        for (; instance->inj_count; instance->inj_count--)
+        {
+            buf_idx = instance->inj_queue[instance->inj_head].buf_idx;
+            instance->inj_head = (instance->inj_head + 1) % instance->inj_size;
+            *(uint32_t *) nminst_buf(instance, buf_idx) = instance->free_buf;
+            instance->free_buf = buf_idx;
+        }
+        instance->nifp->ni_bufs_head = instance->free_buf;
+    }
+    free(instance->inj_queue);
+    instance->inj_queue = NULL;
+}
+
 static void destroy_instance(NetmapInstance *instance)
 {
     if (instance)
     {
-        /* Unmap the packet memory region.  If we had a peer, notify them that
-            the shared mapping has been freed and that we no longer exist. */
-        if (instance->mem)
+        /* Unmap the packet memory region.  If we had a peer sharing it, notify
+            them that the shared mapping has been freed and that we no longer exist. */
+        if (instance->mem != MAP_FAILED)
         {
             munmap(instance->mem, instance->memsize);
-            if (instance->peer)
+            if (instance->peer && instance->peer->mem == instance->mem)
             {
                 instance->peer->mem = MAP_FAILED;
                 instance->peer->memsize = 0;
@@ -135,6 +267,10 @@ static int netmap_close(Netmap_Context_t *nmc)
     if (!nmc)
         return -1;
 
+    /* Hand back extra buffers while every instance's memory is still mapped. */
+    for (instance = nmc->instances; instance; instance = instance->next)
+        nminst_release_bufs(instance);
+
     /* Free all of the device instances. */
     while ((instance = nmc->instances) != NULL)
     {
@@ -142,22 +278,117 @@ static int netmap_close(Netmap_Context_t *nmc)
         if (nmc->debug)
         {
             printf("Netmap instance %s (%d) blocked %llu times on TX while forwarding.\n",
-                    instance->req.nr_name, instance->index, instance->fwd_tx_blocked);
+                    instance->name, instance->index, instance->fwd_tx_blocked);
         }
         destroy_instance(instance);
     }
 
     sfbpf_freecode(&nmc->fcode);
+    sfbpf_jit_free(nmc->fjit);
+    nmc->fjit = NULL;
 
     nmc->state = DAQ_STATE_STOPPED;
 
     return 0;
 }
 
-static NetmapInstance *create_instance(const char *device, NetmapInstance *parent, char *errbuf, size_t errlen)
+/*
+ * Fill in the registration request for a device.  As with nm_open(), the
+ * device may end in a suffix choosing the rings to attach to:
+ *
+ *   -<ring>    a single hardware ring pair
+ *   ^          the host stack rings only
+ *   *          the hardware rings and the host stack rings
+ *   {<id>      the master end of netmap pipe <id> on the device
+ *   }<id>      the slave end of netmap pipe <id> on the device
+ *
+ * Without a suffix, the hardware ring pair ring is used, or all of them if
+ * ring is -1.  VALE ports (vale<switch>:<port>) take the same suffixes.
+ */
+static int parse_device(const char *device, int ring, struct nmreq *req)
+{
+    size_t len = strlen(device), digits = 0;
+    long id = ring;
+    int type = 0;
+
+    if (len > 1 && (device[len - 1] == '^' || device[len - 1] == '*'))
+        type = device[--len];
+    else
+    {
+        while (digits < len && isdigit((unsigned char) device[len - 1 - digits]))
+            digits++;
+        if (digits && digits + 1 < len && strchr("-{}", device[len - 1 - digits]))
+        {
+            id = strtol(device + len - digits, NULL, 10);
+            if (id > NETMAP_RING_MASK)
+                return -1;
+            len -= digits + 1;
+            type = device[len];
+        }
+    }
+    if (len >= sizeof(req->nr_name))
+        return -1;
+
+    snprintf(req->nr_name, sizeof(req->nr_name), "%.*s", (int) len, device);
+    req->nr_version = NETMAP_API;
+    req->nr_ringid = 0;
+#if NETMAP_API >= 11
+    switch (type)
+    {
+        case '^':
+            req->nr_flags = NR_REG_SW;
+            break;
+
+        case '*':
+            req->nr_flags = NR_REG_NIC_SW;
+            break;
+
+        case '{':
+            req->nr_flags = NR_REG_PIPE_MASTER;
+            req->nr_ringid = id;
+            break;
+
+        case '}':
+            req->nr_flags = NR_REG_PIPE_SLAVE;
+            req->nr_ringid = id;
+            break;
+
+        default:
+            if (id >= 0)
+            {
+                req->nr_flags = NR_REG_ONE_NIC;
+                req->nr_ringid = id;
+            }
+            else
+                req->nr_flags = NR_REG_ALL_NIC;
+            break;
+    }
+#else
+    switch (type)
+    {
+        case '^':
+            req->nr_ringid = NETMAP_SW_RING;
+            break;
+
+        /* Pipes and opening the hardware and host rings together need API 11. */
+        case '*':
+        case '{':
+        case '}':
+            return -1;
+
+        default:
+            if (id >= 0)
+                req->nr_ringid = NETMAP_HW_RING | id;
+            break;
+    }
+#endif
+
+    return 0;
+}
+
+static NetmapInstance *create_instance(const char *device, int ring, char *errbuf, size_t errlen)
 {
     NetmapInstance *instance;
-    struct nmreq *req;
     static int index = 0;
 
     instance = calloc(1, sizeof(NetmapInstance));
@@ -171,6 +402,7 @@ static NetmapInstance *create_instance(const char *device, NetmapInstance *paren
     instance->mem = MAP_FAILED;
     instance->index = index;
     index++;
+    snprintf(instance->name, sizeof(instance->name), "%s", device);
 
     /* Open /dev/netmap for communications to the driver. */
     instance->fd = open("/dev/netmap", O_RDWR);
@@ -182,13 +414,11 @@ static NetmapInstance *create_instance(const char *device, NetmapInstance *paren
     }
 
     /* Initialize the netmap request object. */
-    req = &instance->req;
-    strncpy(req->nr_name, device, sizeof(req->nr_name));
-    req->nr_version = NETMAP_API;
-    req->nr_ringid = 0;
-#if NETMAP_API >= 11
-    req->nr_flags = NR_REG_ALL_NIC;
-#endif
+    if (parse_device(device, ring, &instance->req) != 0)
+    {
+        snprintf(errbuf, errlen, "%s: Invalid interface specification: '%s'!", __FUNCTION__, device);
+        goto err;
+    }
 
     return instance;
 
@@ -201,12 +431,14 @@ static int create_bridge(Netmap_Context_t *nmc, const char *device_name1, const
 {
     NetmapInstance *instance, *peer1, *peer2;
 
+    /* Match on the device as given, since several instances may share an
+       interface on different rings. */
     peer1 = peer2 = NULL;
     for (instance = nmc->instances; instance; instance = instance->next)
     {
-        if (!strcmp(instance->req.nr_name, device_name1))
+        if (!peer1 && !strcmp(instance->name, device_name1))
             peer1 = instance;
-        else if (!strcmp(instance->req.nr_name, device_name2))
+        else if (!peer2 && !strcmp(instance->name, device_name2))
             peer2 = instance;
     }
 
@@ -221,6 +453,9 @@ static int create_bridge(Netmap_Context_t *nmc, const char *device_name1, const
 
 static int start_instance(Netmap_Context_t *nmc, NetmapInstance *instance)
 {
+#if NETMAP_API >= 11
+    instance->req.nr_arg3 = nmc->inject_bufs;
+#endif
     if (ioctl(instance->fd, NIOCREGIF, &instance->req))
     {
         DPE(nmc->errbuf, "%s: Netmap registration for %s failed: %s (%d)",
@@ -228,8 +463,13 @@ static int start_instance(Netmap_Context_t *nmc, NetmapInstance *instance)
         return DAQ_ERROR;
     }
 
-    /* Only mmap the packet memory region for the first interface in a pair. */
-    if (instance->peer && instance->peer->mem != MAP_FAILED)
+    /* Only mmap the packet memory region for the first interface in a pair,
+        unless the second lives in a different one (like a VALE port). */
+    if (instance->peer && instance->peer->mem != MAP_FAILED
+#if NETMAP_API >= 11
+            && instance->peer->req.nr_arg2 == instance->req.nr_arg2
+#endif
+       )
     {
         instance->memsize = instance->peer->memsize;
         instance->mem = instance->peer->mem;
@@ -248,17 +488,71 @@ static int start_instance(Netmap_Context_t *nmc, NetmapInstance *instance)
 
     instance->nifp = NETMAP_IF(instance->mem, instance->req.nr_offset);
 
+    /* Work out which rings the registration gave us.  The host stack rings
+        come after the hardware ones. */
     instance->first_tx_ring = 0;
     instance->first_rx_ring = 0;
     instance->last_tx_ring = instance->req.nr_tx_rings - 1;
     instance->last_rx_ring = instance->req.nr_rx_rings - 1;
+#if NETMAP_API >= 11
+    switch (instance->req.nr_flags & NR_REG_MASK)
+    {
+        case NR_REG_ONE_NIC:
+            instance->first_tx_ring = instance->last_tx_ring = instance->req.nr_ringid & NETMAP_RING_MASK;
+            instance->first_rx_ring = instance->last_rx_ring = instance->req.nr_ringid & NETMAP_RING_MASK;
+            break;
+
+        case NR_REG_SW:
+            instance->first_tx_ring = instance->last_tx_ring = instance->req.nr_tx_rings;
+            instance->first_rx_ring = instance->last_rx_ring = instance->req.nr_rx_rings;
+            break;
+
+        case NR_REG_NIC_SW:
+            instance->last_tx_ring = instance->req.nr_tx_rings;
+            instance->last_rx_ring = instance->req.nr_rx_rings;
+            break;
+    }
+#else
+    if (instance->req.nr_ringid & NETMAP_HW_RING)
+    {
+        instance->first_tx_ring = instance->last_tx_ring = instance->req.nr_ringid & NETMAP_RING_MASK;
+        instance->first_rx_ring = instance->last_rx_ring = instance->req.nr_ringid & NETMAP_RING_MASK;
+    }
+    else if (instance->req.nr_ringid & NETMAP_SW_RING)
+    {
+        instance->first_tx_ring = instance->last_tx_ring = instance->req.nr_tx_rings;
+        instance->first_rx_ring = instance->last_rx_ring = instance->req.nr_rx_rings;
+    }
+#endif
+    instance->cur_tx_ring = instance->first_tx_ring;
+    instance->cur_rx_ring = instance->first_rx_ring;
+    instance->tx_ring = NULL;
+    instance->tx_space = instance->tx_pending = 0;
+    instance->tx_unsynced = instance->rx_unsynced = 0;
+
+#if NETMAP_API >= 11
+    /* netmap may grant fewer extra buffers than asked for, or none at all. */
+    if (instance->req.nr_arg3 > 0)
+    {
+        instance->inj_queue = calloc(instance->req.nr_arg3, sizeof(*instance->inj_queue));
+        if (!instance->inj_queue)
+        {
+            DPE(nmc->errbuf, "%s: Could not allocate the injection queue for %s!", __FUNCTION__, instance->name);
+            return DAQ_ERROR_NOMEM;
+        }
+        instance->inj_size = instance->req.nr_arg3;
+        instance->inj_head = instance->inj_count = 0;
+        instance->free_buf = instance->nifp->ni_bufs_head;
+        instance->nifp->ni_bufs_head = 0;
+    }
+#endif
 
     if (nmc->debug)
     {
         struct netmap_ring *ring;
         int i;
 
-        printf("[%s]\n", instance->req.nr_name);
+        printf("[%s]\n", instance->name);
         printf("  nr_tx_slots: %u\n", instance->req.nr_tx_slots);
         printf("  nr_rx_slots: %u\n", instance->req.nr_rx_slots);
         printf("  nr_tx_rings: %hu\n", instance->req.nr_tx_rings);
@@ -282,6 +576,7 @@ static int start_instance(Netmap_Context_t *nmc, NetmapInstance *instance)
             printf("    flags = 0x%x\n", ring->flags);
         }
         printf("  memsize:     %u\n", instance->memsize);
+        printf("  extra bufs:  %u\n", instance->inj_size);
         printf("  index:       %d\n", instance->index);
     }
 
@@ -296,8 +591,9 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
     char intf[IFNAMSIZ];
     uint32_t num_intfs = 0;
     size_t len;
-    char *name1, *name2, *dev;
+    char *name1, *name2, *dev, *end;
     int rval = DAQ_ERROR;
+    long ring = -1, burst, inject_bufs;
 
     nmc = calloc(1, sizeof(Netmap_Context_t));
     if (!nmc)
@@ -318,6 +614,53 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
     nmc->snaplen = config->snaplen;
     nmc->timeout = (config->timeout > 0) ? (int) config->timeout : -1;
 
+    /* Initialize other default configuration values. */
+    nmc->debug = 0;
+    nmc->burst = NETMAP_DEFAULT_BURST;
+    nmc->inject_bufs = NETMAP_DEFAULT_INJECT_BUFS;
+
+    /* Import the configuration dictionary requests. */
+    for (entry = config->values; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->key, "debug"))
+            nmc->debug = 1;
+        else if (!strcmp(entry->key, "ring"))
+        {
+            errno = 0;
+            ring = entry->value ? strtol(entry->value, &end, 10) : -1;
+            if (!entry->value || *end != '\0' || errno != 0 || ring < 0 || ring > NETMAP_RING_MASK)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid ring specified: '%s'!",
+                            __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+        }
+        else if (!strcmp(entry->key, "burst"))
+        {
+            errno = 0;
+            burst = entry->value ? strtol(entry->value, &end, 10) : 0;
+            if (!entry->value || *end != '\0' || errno != 0 || burst <= 0 || burst > UINT16_MAX)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid burst size specified: '%s'!",
+                            __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            nmc->burst = burst;
+        }
+        else if (!strcmp(entry->key, "inject_bufs"))
+        {
+            errno = 0;
+            inject_bufs = entry->value ? strtol(entry->value, &end, 10) : -1;
+            if (!entry->value || *end != '\0' || errno != 0 || inject_bufs < 0 || inject_bufs > UINT16_MAX)
+            {
+                snprintf(errbuf, errlen, "%s: Invalid number of inject buffers specified: '%s'!",
+                            __FUNCTION__, entry->value ? entry->value : "");
+                goto err;
+            }
+            nmc->inject_bufs = inject_bufs;
+        }
+    }
+
     dev = nmc->device;
     if (*dev == ':' || ((len = strlen(dev)) > 0 && *(dev + len - 1) == ':') || 
             (config->mode == DAQ_MODE_PASSIVE && strstr(dev, "::")))
@@ -329,6 +672,9 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
     while (*dev != '\0')
     {
         len = strcspn(dev, ":");
+        /* VALE port names have a colon of their own (vale<switch>:<port>). */
+        if (!strncmp(dev, "vale", 4) && dev[len] == ':' && dev[len + 1] != ':' && dev[len + 1] != '\0')
+            len += 1 + strcspn(dev + len + 1, ":");
         if (len >= sizeof(intf))
         {
             snprintf(errbuf, errlen, "%s: Interface name too long! (%zu)", __FUNCTION__, len);
@@ -344,7 +690,7 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
                 goto err;
             }
             snprintf(intf, len + 1, "%s", dev);
-            instance = create_instance(intf, nmc->instances, errbuf, errlen);
+            instance = create_instance(intf, ring, errbuf, errlen);
             if (!instance)
                 goto err;
 
@@ -355,8 +701,8 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
             {
                 if (num_intfs == 2)
                 {
-                    name1 = nmc->instances->next->req.nr_name;
-                    name2 = nmc->instances->req.nr_name;
+                    name1 = nmc->instances->next->name;
+                    name2 = nmc->instances->name;
 
                     if (create_bridge(nmc, name1, name2) != DAQ_SUCCESS)
                     {
@@ -383,16 +729,6 @@ static int netmap_daq_initialize(const DAQ_Config_t * config, void **ctxt_ptr, c
         goto err;
     }
 
-    /* Initialize other default configuration values. */
-    nmc->debug = 0;
-
-    /* Import the configuration dictionary requests. */
-    for (entry = config->values; entry; entry = entry->next)
-    {
-        if (!strcmp(entry->key, "debug"))
-            nmc->debug = 1;
-    }
-
     nmc->state = DAQ_STATE_INITIALIZED;
 
     *ctxt_ptr = nmc;
@@ -413,6 +749,8 @@ static int netmap_daq_set_filter(void *handle, const char *filter)
 {
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program *fjit;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
 
     if (nmc->filter)
         free(nmc->filter);
@@ -424,15 +762,25 @@ static int netmap_daq_set_filter(void *handle, const char *filter)
         return DAQ_ERROR;
     }
 
-    if (sfbpf_compile(nmc->snaplen, DLT_EN10MB, &fcode, nmc->filter, 1, 0) < 0)
+    if (sfbpf_compile_cached(NULL, nmc->snaplen, DLT_EN10MB, &fcode, nmc->filter, 1, 0, 0, bpf_errbuf) < 0)
     {
-        DPE(nmc->errbuf, "%s: BPF state machine compilation failed!", __FUNCTION__);
+        DPE(nmc->errbuf, "%s: BPF state machine compilation failed: %.*s", __FUNCTION__,
+                (int) sizeof(nmc->errbuf) / 2, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if (!fjit)
+    {
+        DPE(nmc->errbuf, "%s: Couldn't prepare the BPF state machine!", __FUNCTION__);
+        sfbpf_freecode(&fcode);
         return DAQ_ERROR;
     }
 
     sfbpf_freecode(&nmc->fcode);
-    nmc->fcode.bf_len = fcode.bf_len;
-    nmc->fcode.bf_insns = fcode.bf_insns;
+    nmc->fcode = fcode;
+    sfbpf_jit_free(nmc->fjit);
+    nmc->fjit = fjit;
 
     return DAQ_SUCCESS;
 }
@@ -465,27 +813,68 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_BLOCK       /* DAQ_VERDICT_RETRY */
 };
 
+/*
+ * Hand batched TX slots over to the kernel.  With sync set, also issue the
+ * TX and RX syncs that start transmission and return consumed RX slots;
+ * otherwise the poll() that follows will do that.
+ */
+static int netmap_sync(Netmap_Context_t *nmc, int sync)
+{
+    NetmapInstance *instance;
+
+    for (instance = nmc->instances; instance; instance = instance->next)
+    {
+        nminst_drain_injects(instance);
+        nminst_tx_flush(instance);
+        if (!sync)
+            continue;
+        if (instance->tx_unsynced)
+        {
+            if (ioctl(instance->fd, NIOCTXSYNC, NULL) < 0)
+            {
+                DPE(nmc->errbuf, "%s: TX sync on %s failed: %s (%d)",
+                        __FUNCTION__, instance->name, strerror(errno), errno);
+                return DAQ_ERROR;
+            }
+            instance->tx_unsynced = 0;
+        }
+        if (instance->rx_unsynced)
+        {
+            if (ioctl(instance->fd, NIOCRXSYNC, NULL) < 0)
+            {
+                DPE(nmc->errbuf, "%s: RX sync on %s failed: %s (%d)",
+                        __FUNCTION__, instance->name, strerror(errno), errno);
+                return DAQ_ERROR;
+            }
+            instance->rx_unsynced = 0;
+        }
+    }
+
+    return DAQ_SUCCESS;
+}
+
 static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callback, DAQ_Meta_Func_t metaback, void *user)
 {
     struct pollfd pfd[NETMAP_MAX_INTERFACES];
-    struct netmap_ring *rx_ring, *tx_ring;
+    struct netmap_ring *rx_ring;
     struct netmap_slot *rx_slot, *tx_slot;
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
     NetmapInstance *instance, *peer;
     DAQ_PktHdr_t daqhdr;
     DAQ_Verdict verdict;
     const uint8_t *data;
-    uint32_t i, rx_cur, tx_cur;
-    uint16_t len, start_rx_ring, start_tx_ring;
-    int got_one, ignored_one;
+    uint32_t i, rx_cur, tx_buf_idx, avail, done;
+    uint16_t len, start_rx_ring;
+    int got_one, ignored_one, blocked;
     int ret, c = 0;
 
     while (c < cnt || cnt <= 0)
     {
         got_one = 0;
         ignored_one = 0;
+        blocked = 0;
 
-        for (instance = nmc->instances; instance; instance = instance->next)
+        for (instance = nmc->instances; instance && !blocked; instance = instance->next)
         {
             start_rx_ring = instance->cur_rx_ring;
             do
@@ -494,171 +883,184 @@ static int netmap_daq_acquire(void *handle, int cnt, DAQ_Analysis_Func_t callbac
                 if (nmc->break_loop)
                 {
                     nmc->break_loop = 0;
-                    return 0;
+                    return netmap_sync(nmc, 1) == DAQ_SUCCESS ? 0 : DAQ_ERROR;
                 }
 
+                /* Take up to a burst of packets from this ring and only
+                    publish the new head once they have all been handled. */
                 rx_ring = NETMAP_RXRING(instance->nifp, instance->cur_rx_ring);
-                if (nm_ring_empty(rx_ring))
-                {
-                    nminst_inc_rx_ring(instance);
-                    continue;
-                }
-
+                avail = nm_ring_space(rx_ring);
+                if (avail > nmc->burst)
+                    avail = nmc->burst;
                 rx_cur = rx_ring->cur;
-                rx_slot = &rx_ring->slot[rx_cur];
-                len = rx_slot->len;
 
-                data = (uint8_t *) NETMAP_BUF(rx_ring, rx_slot->buf_idx);
-
-                verdict = DAQ_VERDICT_PASS;
-
-                /* If we blocked on forwarding previously, it means we know we
-                    already want to send this packet, so attempt to do so
-                    immediately. */
-                if (instance->flags & NMINST_FWD_BLOCKED)
+                for (done = 0; done < avail && (c < cnt || cnt <= 0); done++)
                 {
-                    instance->flags &= ~NMINST_FWD_BLOCKED;
-                    got_one = 1;
-                    goto send_packet;
-                }
+                    rx_slot = &rx_ring->slot[rx_cur];
+                    len = rx_slot->len;
 
-                nmc->stats.hw_packets_received++;
+                    data = (uint8_t *) NETMAP_BUF(rx_ring, rx_slot->buf_idx);
 
-                if (nmc->fcode.bf_insns && sfbpf_filter(nmc->fcode.bf_insns, data, len, len) == 0)
-                {
-                    ignored_one = 1;
-                    nmc->stats.packets_filtered++;
-                    goto send_packet;
-                }
-                got_one = 1;
-
-                daqhdr.ts = rx_ring->ts;
-                daqhdr.caplen = len;
-                daqhdr.pktlen = len;
-                daqhdr.ingress_index = instance->index;
-                daqhdr.egress_index = instance->peer ? instance->peer->index : DAQ_PKTHDR_UNKNOWN;
-                daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
-                daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
-                daqhdr.flags = 0;
-                daqhdr.opaque = 0;
-                daqhdr.priv_ptr = NULL;
-                daqhdr.address_space_id = 0;
-
-                if (callback)
-                {
-                    verdict = callback(user, &daqhdr, data);
-                    if (verdict >= MAX_DAQ_VERDICT)
-                        verdict = DAQ_VERDICT_PASS;
-                    nmc->stats.verdicts[verdict]++;
-                    verdict = verdict_translation_table[verdict];
-                }
-                nmc->stats.packets_received++;
-                c++;
-send_packet:
-                if (verdict == DAQ_VERDICT_PASS && instance->peer)
-                {
-                    uint32_t tx_buf_idx;
-                    int sent = 0;
+                    verdict = DAQ_VERDICT_PASS;
 
-                    peer = instance->peer;
-                    start_tx_ring = peer->cur_tx_ring;
+                    /* If we blocked on forwarding previously, it means we know we
+                        already want to send this packet, so attempt to do so
+                        immediately. */
+                    if (instance->flags & NMINST_FWD_BLOCKED)
+                    {
+                        instance->flags &= ~NMINST_FWD_BLOCKED;
+                        got_one = 1;
+                        goto send_packet;
+                    }
+
+                    nmc->stats.hw_packets_received++;
 
-                    do
+                    if (nmc->fjit && sfbpf_filter_jit(nmc->fjit, data, len, len) == 0)
                     {
-                        tx_ring = NETMAP_TXRING(peer->nifp, peer->cur_tx_ring);
-                        nminst_inc_tx_ring(peer);
-                        if (nm_ring_empty(tx_ring))
-                            continue;
-                        /* Swap the RX buffer we want to forward with the next
-                           unused buffer in the peer's TX ring. */
-                        tx_cur = tx_ring->cur;
-                        tx_slot = &tx_ring->slot[tx_cur];
-                        tx_buf_idx = tx_slot->buf_idx;
-                        tx_slot->len = len;
-                        tx_slot->buf_idx = rx_slot->buf_idx;
-                        rx_slot->buf_idx = tx_buf_idx;
-                        /* Report the buffer change. */
-                        tx_slot->flags |= NS_BUF_CHANGED;
-                        rx_slot->flags |= NS_BUF_CHANGED;
-
-                        tx_ring->cur = nm_ring_next(tx_ring, tx_cur);
-#if NETMAP_API >= 10
-                        tx_ring->head = tx_ring->cur;
-#else
-                        tx_ring->avail--;
-#endif
-                        sent = 1;
-                    } while (peer->cur_tx_ring != start_tx_ring && !sent);
+                        ignored_one = 1;
+                        nmc->stats.packets_filtered++;
+                        goto send_packet;
+                    }
+                    got_one = 1;
 
-                    /* If we couldn't find a TX slot to use, hold on to this packet and
-                        wait for TX slots to become available. */
-                    if (sent == 0)
+                    daqhdr.ts = rx_ring->ts;
+                    daqhdr.caplen = len;
+                    daqhdr.pktlen = len;
+                    daqhdr.ingress_index = instance->index;
+                    daqhdr.egress_index = instance->peer ? instance->peer->index : DAQ_PKTHDR_UNKNOWN;
+                    daqhdr.ingress_group = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr.egress_group = DAQ_PKTHDR_UNKNOWN;
+                    daqhdr.flags = 0;
+                    daqhdr.opaque = 0;
+                    daqhdr.priv_ptr = NULL;
+                    daqhdr.address_space_id = 0;
+
+                    if (callback)
                     {
-                        instance->fwd_tx_blocked++;
-                        instance->flags |= NMINST_FWD_BLOCKED;
-                        peer->flags |= NMINST_TX_BLOCKED;
-                        goto poll;
+                        verdict = callback(user, &daqhdr, data);
+                        if (verdict >= MAX_DAQ_VERDICT)
+                            verdict = DAQ_VERDICT_PASS;
+                        nmc->stats.verdicts[verdict]++;
+                        verdict = verdict_translation_table[verdict];
                     }
-                    else
+                    nmc->stats.packets_received++;
+                    c++;
+send_packet:
+                    if (verdict == DAQ_VERDICT_PASS && instance->peer)
+                    {
+                        peer = instance->peer;
+
+                        /* If we couldn't find a TX slot to use, hold on to this packet and
+                            wait for TX slots to become available. */
+                        if (!(tx_slot = nminst_next_tx_slot(peer)))
+                        {
+                            instance->fwd_tx_blocked++;
+                            instance->flags |= NMINST_FWD_BLOCKED;
+                            peer->flags |= NMINST_TX_BLOCKED;
+                            blocked = 1;
+                            break;
+                        }
                         peer->flags &= ~NMINST_TX_BLOCKED;
+
+                        if (peer->mem == instance->mem)
+                        {
+                            /* Swap the RX buffer we want to forward with the next
+                               unused buffer in the peer's TX ring. */
+                            tx_buf_idx = tx_slot->buf_idx;
+                            tx_slot->len = len;
+                            tx_slot->buf_idx = rx_slot->buf_idx;
+                            rx_slot->buf_idx = tx_buf_idx;
+                            /* Report the buffer change. */
+                            tx_slot->flags |= NS_BUF_CHANGED;
+                            rx_slot->flags |= NS_BUF_CHANGED;
+                        }
+                        else
+                        {
+                            /* The peer's buffers are in another memory region, so copy. */
+                            if (len > peer->tx_ring->nr_buf_size)
+                                len = peer->tx_ring->nr_buf_size;
+                            memcpy(NETMAP_BUF(peer->tx_ring, tx_slot->buf_idx), data, len);
+                            tx_slot->len = len;
+                        }
+                    }
+
+                    rx_cur = nm_ring_next(rx_ring, rx_cur);
                 }
 
-                rx_ring->cur = nm_ring_next(rx_ring, rx_cur);
+                if (done)
+                {
+                    rx_ring->cur = rx_cur;
 #if NETMAP_API >= 10
-                rx_ring->head = rx_ring->cur;
+                    rx_ring->head = rx_cur;
 #else
-                rx_ring->avail--;
+                    rx_ring->avail -= done;
 #endif
+                    instance->rx_unsynced += done;
+                }
+
+                /* Stay on this ring if its next packet is waiting to be forwarded. */
+                if (blocked)
+                    break;
 
-                /* Increment the current RX ring pointer on successfully completed processing. */
                 nminst_inc_rx_ring(instance);
 
             } while (instance->cur_rx_ring != start_rx_ring);
         }
 
-        if (!got_one && !ignored_one)
+        /* After a productive pass, sync explicitly so the next one sees new
+            packets without waiting in poll(). */
+        if (!blocked && (got_one || ignored_one))
         {
-poll:
-            for (i = 0, instance = nmc->instances; instance; i++, instance = instance->next)
-            {
-                pfd[i].fd = instance->fd;
-                pfd[i].events = 0;
-                pfd[i].revents = 0;
-
-                /* If I blocked on TX, wait for some TX to complete, otherwise,
-                    if I didn't block on forwarding, wait for new packets to arrive. */
-                if (instance->flags & NMINST_TX_BLOCKED)
-                    pfd[i].events |= POLLOUT;
-                else if (!(instance->flags & NMINST_FWD_BLOCKED))
-                    pfd[i].events |= POLLIN;
-            }
-            ret = poll(pfd, nmc->intf_count, nmc->timeout);
-
-            /* If we were interrupted by a signal, start the loop over.
-                The user should call daq_breakloop to actually exit. */
-            if (ret < 0 && errno != EINTR)
-            {
-                DPE(nmc->errbuf, "%s: Poll failed: %s (%d)", __FUNCTION__, strerror(errno), errno);
+            if (netmap_sync(nmc, 1) != DAQ_SUCCESS)
                 return DAQ_ERROR;
-            }
-            /* If the poll times out, return control to the caller. */
-            if (ret == 0)
-                break;
-            /* If some number of of sockets have events returned, check them all for badness. */
-            if (ret > 0)
+            continue;
+        }
+
+        if (netmap_sync(nmc, 0) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+
+        for (i = 0, instance = nmc->instances; instance; i++, instance = instance->next)
+        {
+            pfd[i].fd = instance->fd;
+            pfd[i].events = 0;
+            pfd[i].revents = 0;
+
+            /* If I blocked on TX, wait for some TX to complete, otherwise,
+                if I didn't block on forwarding, wait for new packets to arrive. */
+            if (instance->flags & NMINST_TX_BLOCKED)
+                pfd[i].events |= POLLOUT;
+            else if (!(instance->flags & NMINST_FWD_BLOCKED))
+                pfd[i].events |= POLLIN;
+            /* Also wake up when there is room for queued injected packets. */
+            if (instance->inj_count)
+                pfd[i].events |= POLLOUT;
+        }
+        ret = poll(pfd, nmc->intf_count, nmc->timeout);
+
+        /* If we were interrupted by a signal, start the loop over.
+            The user should call daq_breakloop to actually exit. */
+        if (ret < 0 && errno != EINTR)
+        {
+            DPE(nmc->errbuf, "%s: Poll failed: %s (%d)", __FUNCTION__, strerror(errno), errno);
+            return DAQ_ERROR;
+        }
+        /* If the poll times out, return control to the caller. */
+        if (ret == 0)
+            break;
+        /* If some number of of sockets have events returned, check them all for badness. */
+        if (ret > 0)
+        {
+            for (i = 0; i < nmc->intf_count; i++)
             {
-                for (i = 0; i < nmc->intf_count; i++)
+                if (pfd[i].revents & (POLLHUP | POLLERR | POLLNVAL))
                 {
-                    if (pfd[i].revents & (POLLHUP | POLLERR | POLLNVAL))
-                    {
-                        if (pfd[i].revents & POLLHUP)
-                            DPE(nmc->errbuf, "%s: Hang-up on a packet socket", __FUNCTION__);
-                        else if (pfd[i].revents & POLLERR)
-                            DPE(nmc->errbuf, "%s: Encountered error condition on a packet socket", __FUNCTION__);
-                        else if (pfd[i].revents & POLLNVAL)
-                            DPE(nmc->errbuf, "%s: Invalid polling request on a packet socket", __FUNCTION__);
-                        return DAQ_ERROR;
-                    }
+                    if (pfd[i].revents & POLLHUP)
+                        DPE(nmc->errbuf, "%s: Hang-up on a packet socket", __FUNCTION__);
+                    else if (pfd[i].revents & POLLERR)
+                        DPE(nmc->errbuf, "%s: Encountered error condition on a packet socket", __FUNCTION__);
+                    else if (pfd[i].revents & POLLNVAL)
+                        DPE(nmc->errbuf, "%s: Invalid polling request on a packet socket", __FUNCTION__);
+                    return DAQ_ERROR;
                 }
             }
         }
@@ -673,10 +1075,8 @@ static int netmap_daq_inject(void *handle, const DAQ_PktHdr_t *hdr,
 {
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
     NetmapInstance *instance;
-    struct netmap_ring *tx_ring;
     struct netmap_slot *tx_slot;
-    uint32_t tx_buf_idx, tx_cur;
-    uint16_t start_tx_ring;
+    uint32_t buf_idx, i;
 
     /* Find the instance that the packet was received on. */
     for (instance = nmc->instances; instance; instance = instance->next)
@@ -699,35 +1099,45 @@ static int netmap_daq_inject(void *handle, const DAQ_PktHdr_t *hdr,
         return DAQ_ERROR_NODEV;
     }
 
-    /* Find a TX ring with space to send on. */
-    start_tx_ring = instance->cur_tx_ring;
-    do
+    if (len > NETMAP_TXRING(instance->nifp, instance->first_tx_ring)->nr_buf_size)
     {
-        tx_ring = NETMAP_TXRING(instance->nifp, instance->cur_tx_ring);
-        nminst_inc_tx_ring(instance);
-        if (nm_ring_empty(tx_ring))
-            continue;
+        DPE(nmc->errbuf, "%s: Packet too large to inject (%u).", __FUNCTION__, len);
+        return DAQ_ERROR_INVAL;
+    }
 
-        tx_cur = tx_ring->cur;
-        tx_slot = &tx_ring->slot[tx_cur];
-        tx_buf_idx = tx_slot->buf_idx;
+    /* Copy the packet straight into a TX slot from the same batch that
+        forwarded packets use if there is room and nothing queued ahead of it,
+        otherwise into an extra buffer that will be swapped into a TX slot
+        once one frees up.  Either way, hand over what we can right away
+        since we may not be inside acquire(). */
+    nminst_drain_injects(instance);
+    if (!instance->inj_count && (tx_slot = nminst_next_tx_slot(instance)) != NULL)
+    {
         tx_slot->len = len;
-        memcpy(NETMAP_BUF(tx_ring, tx_buf_idx), packet_data, len);
-
-        tx_ring->cur = nm_ring_next(tx_ring, tx_cur);
-#if NETMAP_API >= 10
-        tx_ring->head = tx_ring->cur;
-#else
-        tx_ring->avail--;
-#endif
-        nmc->stats.packets_injected++;
+        memcpy(NETMAP_BUF(instance->tx_ring, tx_slot->buf_idx), packet_data, len);
+    }
+    else if (instance->free_buf)
+    {
+        buf_idx = instance->free_buf;
+        instance->free_buf = *(uint32_t *) nminst_buf(instance, buf_idx);
+        memcpy(nminst_buf(instance, buf_idx), packet_data, len);
+        i = (instance->inj_head + instance->inj_count) % instance->inj_size;
+        instance->inj_queue[i].buf_idx = buf_idx;
+        instance->inj_queue[i].len = len;
+        instance->inj_count++;
+    }
+    else
+    {
+        nminst_tx_flush(instance);
+        /* If we got here, it means we couldn't find an available TX slot, so tell the user to try again. */
+        DPE(nmc->errbuf, "%s: Could not find an available TX slot.  Try again.", __FUNCTION__);
+        return DAQ_ERROR_AGAIN;
+    }
+    nminst_tx_flush(instance);
 
-        return DAQ_SUCCESS;
-    } while (instance->cur_tx_ring != start_tx_ring);
+    nmc->stats.packets_injected++;
 
-    /* If we got here, it means we couldn't find an available TX slot, so tell the user to try again. */
-    DPE(nmc->errbuf, "%s: Could not find an available TX slot.  Try again.", __FUNCTION__);
-    return DAQ_ERROR_AGAIN;
+    return DAQ_SUCCESS;
 }
 
 static int netmap_daq_breakloop(void *handle)
@@ -826,7 +1236,7 @@ static int netmap_daq_get_device_index(void *handle, const char *device)
 
     for (instance = nmc->instances; instance; instance = instance->next)
     {
-        if (!strcmp(device, instance->req.nr_name))
+        if (!strcmp(device, instance->name))
             return instance->index;
     }
 
@@ -66,6 +66,7 @@ typedef struct
     const char* device;
     char* filter;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program* fjit;
 
     ip_t* net;
     eth_t* link;
@@ -77,6 +78,7 @@ typedef struct
     volatile int count;
     int passive;
     uint32_t snaplen;
+    uint32_t copy_range;
     unsigned timeout;
 
     char error[DAQ_ERRBUF_SIZE];
@@ -186,6 +188,7 @@ static int nfq_daq_get_setup (
     }
 
     impl->snaplen = cfg->snaplen ? cfg->snaplen : IP_MAXPACKET;
+    impl->copy_range = ( impl->snaplen < IP_MAXPACKET ) ? impl->snaplen : IP_MAXPACKET;
     impl->timeout = cfg->timeout / 1000;    // convert ms to secs
     impl->passive = ( cfg->mode == DAQ_MODE_PASSIVE );
 
@@ -287,8 +290,9 @@ static int nfq_daq_initialize (
         return DAQ_ERROR;
     }
 
-    // 5. configure copying for maximum overhead
-    if ( nfq_set_mode(impl->nf_queue, NFQNL_COPY_PACKET, IP_MAXPACKET) < 0 )
+    // 5. configure copying of as much of each packet as we will look at;
+    //    set_filter() widens this if the filter reads further
+    if ( nfq_set_mode(impl->nf_queue, NFQNL_COPY_PACKET, impl->copy_range) < 0 )
     {
         snprintf(errBuf, errMax, "%s: unable to set packet copy mode\n",
             __FUNCTION__);
@@ -377,6 +381,9 @@ static void nfq_daq_shutdown (void* handle)
     if ( impl->filter )
         free(impl->filter);
 
+    if ( impl->fjit )
+        sfbpf_jit_free(impl->fjit);
+
     if ( impl->buf )
         free(impl->buf);
 
@@ -389,15 +396,28 @@ static inline int SetPktHdr (
     NfqImpl* impl,
     struct nfq_data* nfad,
     DAQ_PktHdr_t* hdr,
-    uint8_t** pkt
+    uint8_t** pkt,
+    uint32_t* buflen
 ) {
     int len = nfq_get_payload(nfad, (char**)pkt);
+    uint32_t wire_len = len;
 
     if ( len <= 0 )
         return -1;
 
+    // the payload stops at the copy range; the ip header has the real length
+    if ( len >= 4 && ((*pkt)[0] >> 4) == 4 )
+        wire_len = ((*pkt)[2] << 8) | (*pkt)[3];
+
+    else if ( len >= 6 && ((*pkt)[0] >> 4) == 6 )
+        wire_len = 40 + (((*pkt)[4] << 8) | (*pkt)[5]);
+
+    if ( wire_len < (uint32_t)len )
+        wire_len = len;
+
     hdr->caplen = ((uint32_t)len <= impl->snaplen) ? (uint32_t)len : impl->snaplen;
-    hdr->pktlen = len;
+    hdr->pktlen = wire_len;
+    *buflen = len;
     hdr->flags = 0;
     hdr->address_space_id = 0;
 
@@ -431,12 +451,12 @@ static int daq_nfq_callback(
     DAQ_PktHdr_t hdr;
     uint8_t* pkt;
     int nf_verdict;
-    uint32_t data_len;
+    uint32_t data_len, buflen;
 
     if ( impl->state != DAQ_STATE_STARTED )
         return -1;
 
-    if ( !ph || SetPktHdr(impl, nfad, &hdr, &pkt) )
+    if ( !ph || SetPktHdr(impl, nfad, &hdr, &pkt, &buflen) )
     {
         DPE(impl->error, "%s: can't setup packet header",
             __FUNCTION__);
@@ -444,8 +464,8 @@ static int daq_nfq_callback(
     }
 
     if (
-        impl->fcode.bf_insns &&
-        sfbpf_filter(impl->fcode.bf_insns, pkt, hdr.caplen, hdr.caplen) == 0
+        impl->fjit &&
+        sfbpf_filter_jit(impl->fjit, pkt, hdr.pktlen, buflen) == 0
     ) {
         verdict = DAQ_VERDICT_PASS;
         impl->stats.packets_filtered++;
@@ -576,24 +596,64 @@ static int nfq_daq_set_filter (void* handle, const char* filter)
 {
     NfqImpl* impl = (NfqImpl*)handle;
     struct sfbpf_program fcode;
+    struct sfbpf_jit_program* fjit;
+    struct sfbpf_deps deps;
+    char bpf_errbuf[SFBPF_ERRBUF_SIZE];
     int dlt = IP4(impl) ? DLT_IPV4 : DLT_IPV6;
+    uint32_t copy_range = impl->snaplen;
 
-    if (sfbpf_compile(impl->snaplen, dlt, &fcode, filter, 1, 0) < 0)
+    if (sfbpf_compile_cached(NULL, impl->snaplen, dlt, &fcode, filter, 1, 0, 0, bpf_errbuf) < 0)
     {
-        DPE(impl->error, "%s: failed to compile bpf '%s'",
+        DPE(impl->error, "%s: failed to compile bpf '%s': %s",
+            __FUNCTION__, filter, bpf_errbuf);
+        return DAQ_ERROR;
+    }
+
+    fjit = sfbpf_jit_compile(&fcode);
+    if ( !fjit )
+    {
+        DPE(impl->error, "%s: failed to prepare bpf '%s'",
             __FUNCTION__, filter);
+        sfbpf_freecode(&fcode);
         return DAQ_ERROR;
     }
 
+    // copy whatever the filter can read, even past the snaplen
+    if ( sfbpf_analyze(&fcode, &deps) < 0 )
+        copy_range = IP_MAXPACKET;
+
+    else if ( deps.max_offset > copy_range )
+        copy_range = deps.max_offset;
+
+    if ( copy_range > IP_MAXPACKET )
+        copy_range = IP_MAXPACKET;
+
+    if ( impl->nf_queue && copy_range != impl->copy_range )
+    {
+        if ( nfq_set_mode(impl->nf_queue, NFQNL_COPY_PACKET, copy_range) < 0 )
+        {
+            DPE(impl->error, "%s: unable to set packet copy range %u",
+                __FUNCTION__, copy_range);
+            sfbpf_jit_free(fjit);
+            sfbpf_freecode(&fcode);
+            return DAQ_ERROR;
+        }
+        impl->copy_range = copy_range;
+    }
+
     if ( impl->filter )
         free((void *)impl->filter);
 
     if ( impl->fcode.bf_insns )
-        free(impl->fcode.bf_insns);
+        sfbpf_freecode(&impl->fcode);
 
     impl->filter = strdup(filter);
     impl->fcode = fcode;
 
+    if ( impl->fjit )
+        sfbpf_jit_free(impl->fjit);
+    impl->fjit = fjit;
+
     return DAQ_SUCCESS;
 }
 
@@ -26,6 +26,9 @@ const DAQ_Module_t *static_modules[] =
 #ifdef BUILD_AFPACKET_MODULE
     &afpacket_daq_module_data,
 #endif
+#ifdef BUILD_AFXDP_MODULE
+    &afxdp_daq_module_data,
+#endif
 #ifdef BUILD_DPDK_MODULE
     &dpdk_daq_module_data,
     &dpdkring_daq_module_data,
@@ -24,6 +24,9 @@
 #ifdef BUILD_AFPACKET_MODULE
 extern const DAQ_Module_t afpacket_daq_module_data;
 #endif
+#ifdef BUILD_AFXDP_MODULE
+extern const DAQ_Module_t afxdp_daq_module_data;
+#endif
 #ifdef BUILD_DPDK_MODULE
 extern const DAQ_Module_t dpdk_daq_module_data;
 #endif
@@ -212,9 +212,19 @@ typedef bpf_u_int32 atomset;
 #define ATOMELEM(d, n) (d & ATOMMASK(n))
 
 /*
- * An unbounded set.
+ * A node of a dominator tree.  Besides its immediate dominator, each node
+ * points to an ancestor further up, chosen so that any ancestor is reached
+ * in a logarithmic number of steps; see sf_optimize.c.
  */
-typedef bpf_u_int32 *uset;
+struct domnode
+{
+    struct domnode *parent;     /* Immediate dominator */
+    struct domnode *jump;
+    int depth;
+    struct domnode *child;      /* First node it immediately dominates */
+    struct domnode *sibling;
+    int pre, post;              /* Preorder number of it and of its last descendant */
+};
 
 /*
  * Total number of atomic entities, including accumulator (A) and index (X).
@@ -226,7 +236,7 @@ struct edge
 {
     int id;
     int code;
-    uset edom;
+    struct domnode edom;
     struct block *succ;
     struct block *pred;
     struct edge *next;          /* link list of incoming edges for a node */
@@ -247,8 +257,7 @@ struct block
     struct edge ef;
     struct block *head;
     struct block *link;         /* link field used by optimizer */
-    uset dom;
-    uset closure;
+    struct domnode dom;
     struct edge *in_edges;
     atomset def, kill;
     atomset in_use;
@@ -272,6 +281,21 @@ struct qual
     unsigned char pad;
 };
 
+/* Member of a set, as in "host in {...}"; see gen_set(). */
+struct set_elem
+{
+    int type;                   /* SET_ELEM_* */
+    const char *s;              /* Address or name, as written */
+    bpf_u_int32 v;              /* Number */
+    int masklen;                /* Mask length after '/', or -1 */
+    struct set_elem *next;
+};
+
+#define SET_ELEM_NUM    0
+#define SET_ELEM_ADDR   1       /* IPv4 address */
+#define SET_ELEM_ADDR6  2       /* IPv6 address */
+#define SET_ELEM_NAME   3       /* Host or service name */
+
 struct arth *gen_loadi(int);
 struct arth *gen_load(int, struct arth *, int);
 struct arth *gen_loadlen(void);
@@ -290,6 +314,8 @@ struct block *gen_mcode(const char *, const char *, int, struct qual);
 struct block *gen_mcode6(const char *, const char *, int, struct qual);
 #endif
 struct block *gen_ncode(const char *, bpf_u_int32, struct qual);
+struct set_elem *gen_set_elem(int, const char *, bpf_u_int32, int);
+struct block *gen_set(struct set_elem *, struct qual);
 struct block *gen_proto_abbrev(int);
 struct block *gen_relation(int, struct arth *, struct arth *, int);
 struct block *gen_less(int);
@@ -324,6 +350,7 @@ struct block *gen_p80211_type(int, int);
 struct block *gen_p80211_fcdir(int);
 
 void bpf_optimize(struct block **);
+void bpf_optimize_abort(void);
 #ifndef WIN32
 void bpf_error(const char *, ...) __attribute__ ((noreturn, format(printf, 1, 2)));
 #else
@@ -334,13 +361,14 @@ void finish_parse(struct block *);
 char *sdup(const char *);
 
 struct bpf_insn *icode_to_fcode(struct block *, int *);
-int pcap_parse(void);
-void lex_init(const char *);
-void lex_cleanup(void);
+int pcap_parse(void *);
+void *lex_init(const char *);
+void lex_cleanup(void *);
 void sappend(struct slist *, struct slist *);
 
 /* XXX */
 #define JT(b)  ((b)->et.succ)
 #define JF(b)  ((b)->ef.succ)
 
-extern int no_optimize;
+extern SFBPF_TLS int no_optimize;
+extern SFBPF_TLS int n_errors;
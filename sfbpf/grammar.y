@@ -144,12 +144,12 @@ str2tok(const char *str, const struct tok *toks)
 	return (-1);
 }
 
-int n_errors = 0;
+SFBPF_TLS int n_errors = 0;
 
 static struct qual qerr = { Q_UNDEF, Q_UNDEF, Q_UNDEF, Q_UNDEF };
 
 static void
-yyerror(const char *msg)
+yyerror(void *yyscanner, const char *msg)
 {
 	++n_errors;
 	bpf_error("%s", msg);
@@ -157,12 +157,12 @@ yyerror(const char *msg)
 }
 
 #ifndef YYBISON
-int yyparse(void);
+int yyparse(void *);
 
 int
-sfbpf_parse()
+sfbpf_parse(void *yyscanner)
 {
-	return (yyparse());
+	return (yyparse(yyscanner));
 }
 #endif
 
@@ -242,8 +242,21 @@ pfaction_to_num(const char *action)
 		struct block *b;
 	} blk;
 	struct block *rblk;
+	struct set_elem *set;
 }
 
+/*
+ * Pure parser: the scanner for this compile is passed in by the caller
+ * and handed on to yylex().
+ */
+%define api.pure
+%parse-param { void *yyscanner }
+%lex-param   { void *yyscanner }
+
+%{
+int yylex(YYSTYPE *, void *);
+%}
+
 %type	<blk>	expr id nid pid term rterm qid
 %type	<blk>	head
 %type	<i>	pqual dqual aqual ndaqual
@@ -257,6 +270,7 @@ pfaction_to_num(const char *action)
 %type	<i>	mtp2type
 %type	<blk>	mtp3field
 %type	<blk>	mtp3fieldvalue mtp3value mtp3listvalue
+%type	<set>	setlist setelem
 
 
 %token  DST SRC HOST GATEWAY
@@ -264,7 +278,7 @@ pfaction_to_num(const char *action)
 %token  ARP RARP IP SCTP TCP UDP ICMP IGMP IGRP PIM VRRP
 %token  ATALK AARP DECNET LAT SCA MOPRC MOPDL
 %token  TK_BROADCAST TK_MULTICAST
-%token  NUM INBOUND OUTBOUND
+%token  NUM INBOUND OUTBOUND IN
 %token  PF_IFNAME PF_RSET PF_RNR PF_SRNR PF_REASON PF_ACTION
 %token	TYPE SUBTYPE DIR ADDR1 ADDR2 ADDR3 ADDR4
 %token  LINK
@@ -403,6 +417,7 @@ head:	  pqual dqual aqual	{ QSET($$.q, $1, $2, $3); }
 	| pqual ndaqual		{ QSET($$.q, $1, Q_DEFAULT, $2); }
 	;
 rterm:	  head id		{ $$ = $2; }
+	| head IN '{' setlist '}'	{ $$.b = gen_set($4, $$.q = $1.q); }
 	| paren expr ')'	{ $$.b = $2.b; $$.q = $1.q; }
 	| pname			{ $$.b = gen_proto_abbrev($1); $$.q = qerr; }
 	| arth relop arth	{ $$.b = gen_relation($2, $1, $3, 0);
@@ -680,4 +695,14 @@ mtp3fieldvalue: NUM {
 mtp3listvalue: mtp3fieldvalue
 	| mtp3listvalue or mtp3fieldvalue { gen_or($1.b, $3.b); $$ = $3; }
 	;
+setlist:  setelem
+	| setlist ',' setelem	{ $3->next = $1; $$ = $3; }
+	;
+setelem:  NUM			{ $$ = gen_set_elem(SET_ELEM_NUM, NULL, (sfbpf_u_int32)$1, -1); }
+	| HID			{ $$ = gen_set_elem(SET_ELEM_ADDR, $1, 0, -1); }
+	| HID '/' NUM		{ $$ = gen_set_elem(SET_ELEM_ADDR, $1, 0, $3); }
+	| HID6			{ $$ = gen_set_elem(SET_ELEM_ADDR6, $1, 0, -1); }
+	| HID6 '/' NUM		{ $$ = gen_set_elem(SET_ELEM_ADDR6, $1, 0, $3); }
+	| ID			{ $$ = gen_set_elem(SET_ELEM_NAME, $1, 0, -1); }
+	;
 %%
@@ -19,6 +19,8 @@
 #define gen_mcode6 sf_gen_mcode6
 #endif
 #define gen_ncode sf_gen_ncode
+#define gen_set_elem sf_gen_set_elem
+#define gen_set sf_gen_set
 #define gen_proto_abbrev sf_gen_proto_abbrev
 #define gen_relation sf_gen_relation
 #define gen_less sf_gen_less
@@ -59,6 +61,9 @@
 #define n_errors sf_n_errors
 
 #define bpf_optimize sf_bpf_optimize
+#define bpf_optimize_abort sf_bpf_optimize_abort
+#define bpf_decode sf_bpf_decode
+#define bpf_filter_decoded sf_bpf_filter_decoded
 #define bpf_error sf_bpf_error
 
 #define finish_parse sf_finish_parse
@@ -79,7 +84,31 @@
 #define bpf_program sfbpf_program
 
 #define bpf_filter sfbpf_filter
+#define bpf_filter_with_aux_data sfbpf_filter_with_aux_data
+#define bpf_filter_tables sf_bpf_filter_tables
+#define bpf_aux_data sfbpf_aux_data
 #define bpf_validate sfbpf_validate
+#define bpf_validate_tables sf_bpf_validate_tables
+#define bpf_analyze sfbpf_analyze
+#define bpf_deps sfbpf_deps
+#define bpf_table sfbpf_table
+#define bpf_table_new sf_bpf_table_new
+#define bpf_table_insert sf_bpf_table_insert
+#define bpf_table_insert_prefix sf_bpf_table_insert_prefix
+#define bpf_table_lookup sf_bpf_table_lookup
+#define bpf_table_key_len sf_bpf_table_key_len
+#define bpf_table_ref sf_bpf_table_ref
+#define bpf_table_unref sf_bpf_table_unref
+#define bpf_table_intern sf_bpf_table_intern
+#define bpf_table_save sf_bpf_table_save
+#define bpf_table_restore sf_bpf_table_restore
+#define bpf_jit_program sfbpf_jit_program
+#define bpf_jit_compile sfbpf_jit_compile
+#define bpf_jit_native sfbpf_jit_native
+#define bpf_filter_jit sfbpf_filter_jit
+#define bpf_filter_jit_with_aux_data sfbpf_filter_jit_with_aux_data
+#define bpf_filter_burst sfbpf_filter_burst
+#define bpf_jit_free sfbpf_jit_free
 
 #define BPF_ALIGNMENT SFBPF_ALIGNMENT
 #define BPF_WORDALIGN SFBPF_WORDALIGN
@@ -136,15 +165,33 @@
 #define BPF_MISCOP SFBPF_MISCOP
 #define BPF_TAX SFBPF_TAX
 #define BPF_TXA SFBPF_TXA
+#define BPF_LOOKUP SFBPF_LOOKUP
 
 #define BPF_STMT SFBPF_STMT
 #define BPF_JUMP SFBPF_JUMP
 
 #define BPF_MEMWORDS SFBPF_MEMWORDS
 
+#define BPF_AUX_OFF SFBPF_AUX_OFF
+#define BPF_AUX_VLAN_TAG SFBPF_AUX_VLAN_TAG
+#define BPF_AUX_VLAN_TAG_PRESENT SFBPF_AUX_VLAN_TAG_PRESENT
+
+#define BPF_DEPS_FIXED_BYTES SFBPF_DEPS_FIXED_BYTES
+#define BPF_DEPS_UNBOUNDED SFBPF_DEPS_UNBOUNDED
+#define BPF_DEPS_VARIABLE SFBPF_DEPS_VARIABLE
+#define BPF_DEPS_LEN SFBPF_DEPS_LEN
+#define BPF_DEPS_AUX SFBPF_DEPS_AUX
+#define BPF_DEPS_TABLES SFBPF_DEPS_TABLES
+
+#define BPF_COMPILE_VLAN_AUX SFBPF_COMPILE_VLAN_AUX
+
 #define PCAP_NETMASK_UNKNOWN SFBPF_NETMASK_UNKNOWN
 
 #define pcap_compile sfbpf_compile
+#define pcap_compile_flags sfbpf_compile_flags
+#define pcap_compile_errbuf sfbpf_compile_errbuf
+#define pcap_compile_set sfbpf_compile_set
+#define pcap_compile_cached sfbpf_compile_cached
 #define pcap_compile_unsafe sfbpf_compile_unsafe
 #define pcap_freecode sfbpf_freecode
 
@@ -0,0 +1,332 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+ * On-disk cache of compiled filters.
+ *
+ * pcap_compile_cached() keeps each program it compiles in a file named
+ * after a hash of everything that went into the compile, and later calls
+ * with the same inputs load the program from there instead.  A cache file
+ * holds, in host byte order:
+ *
+ *   magic, version, code generator version,
+ *   length of the library version, the library version,
+ *   linktype, snaplen, netmask, optimize, flags,
+ *   length of the filter text, the filter text,
+ *   number of instructions, the instructions,
+ *   number of tables, the table images (see bpf_table_save()),
+ *   checksum of all of the above.
+ *
+ * Everything that keyed the compile is stored and compared, so a hash
+ * collision can't return the wrong program, and a loaded program has to
+ * pass bpf_validate_tables() like any other.  A file that is short,
+ * corrupt, from another byte order, or written by another version of the
+ * cache format, the compiler or the library is ignored and replaced.
+ * Files are written under a temporary name and renamed into place, so
+ * instances starting together never see one half written.
+ *
+ * Host names in a filter are resolved when it is compiled, so a cached
+ * program keeps the addresses they had then.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "sfbpf-int.h"
+
+#define CACHE_MAGIC         0x53464243  /* "SFBC" */
+#define CACHE_VERSION       2
+#define CACHE_MAX_SIZE      (256 * 1024 * 1024)
+
+#ifdef PACKAGE_VERSION
+#define CACHE_LIB_VERSION   PACKAGE_VERSION
+#else
+#define CACHE_LIB_VERSION   ""
+#endif
+
+#ifndef WIN32
+struct cache_image
+{
+    u_char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Returns room for len more bytes at the end of the image, or NULL. */
+static u_char *image_reserve(struct cache_image *im, size_t len)
+{
+    u_char *data;
+    size_t size;
+
+    if (im->size - im->len < len)
+    {
+        for (size = im->size ? im->size : 4096; size - im->len < len; size *= 2)
+            ;
+        if (!(data = realloc(im->data, size)))
+            return NULL;
+        im->data = data;
+        im->size = size;
+    }
+    data = im->data + im->len;
+    im->len += len;
+    return data;
+}
+
+static int image_put(struct cache_image *im, const void *p, size_t len)
+{
+    u_char *data = image_reserve(im, len);
+
+    if (!data)
+        return -1;
+    memcpy(data, p, len);
+    return 0;
+}
+
+static int image_put_word(struct cache_image *im, bpf_u_int32 w)
+{
+    return image_put(im, &w, sizeof(w));
+}
+
+/* FNV-1a, for the file name (64 bits) and the checksum (32 bits). */
+static unsigned long long cache_hash64(const u_char *p, size_t len)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    while (len--)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+static bpf_u_int32 cache_hash32(const u_char *p, size_t len)
+{
+    bpf_u_int32 h = 0x811c9dc5U;
+
+    while (len--)
+        h = (h ^ *p++) * 0x01000193U;
+    return h;
+}
+
+static int cache_key(struct cache_image *im, int snaplen_arg, int linktype_arg, const char *buf,
+                     int optimize, bpf_u_int32 mask, u_int flags)
+{
+    static const char lib_version[] = CACHE_LIB_VERSION;
+    size_t len = strlen(buf);
+
+    if (image_put_word(im, CACHE_MAGIC) < 0 || image_put_word(im, CACHE_VERSION) < 0 ||
+        image_put_word(im, BPF_CODEGEN_VERSION) < 0 || image_put_word(im, sizeof(lib_version) - 1) < 0 ||
+        image_put(im, lib_version, sizeof(lib_version) - 1) < 0 ||
+        image_put_word(im, linktype_arg) < 0 || image_put_word(im, snaplen_arg) < 0 ||
+        image_put_word(im, mask) < 0 || image_put_word(im, optimize != 0) < 0 ||
+        image_put_word(im, flags) < 0 || image_put_word(im, len) < 0 ||
+        image_put(im, buf, len) < 0)
+        return -1;
+    return 0;
+}
+
+static u_char *cache_read(const char *path, size_t *len)
+{
+    struct stat st;
+    u_char *data;
+    size_t n;
+    ssize_t r;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > CACHE_MAX_SIZE ||
+        !(data = malloc(st.st_size)))
+    {
+        close(fd);
+        return NULL;
+    }
+    for (n = 0; n < (size_t) st.st_size; n += r)
+    {
+        if ((r = read(fd, data + n, st.st_size - n)) <= 0)
+        {
+            free(data);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    *len = n;
+    return data;
+}
+
+/*
+ * Fill in program from the cache file image, which must start with key.
+ * Returns -1 if the file doesn't hold a valid program for the key.
+ */
+static int cache_load(const u_char *data, size_t len, const struct cache_image *key, struct bpf_program *program)
+{
+    struct bpf_insn *insns = NULL;
+    struct bpf_table **tables = NULL;
+    bpf_u_int32 ninsns, ntables, sum;
+    size_t off, used;
+    u_int i;
+
+    if (len < key->len + 3 * sizeof(bpf_u_int32) || memcmp(data, key->data, key->len))
+        return -1;
+    len -= sizeof(sum);
+    memcpy(&sum, data + len, sizeof(sum));
+    if (sum != cache_hash32(data, len))
+        return -1;
+
+    off = key->len;
+    memcpy(&ninsns, data + off, sizeof(ninsns));
+    off += sizeof(ninsns);
+    if (ninsns == 0 || (len - off) / sizeof(struct bpf_insn) < ninsns)
+        return -1;
+    if (!(insns = malloc(ninsns * sizeof(struct bpf_insn))))
+        return -1;
+    memcpy(insns, data + off, ninsns * sizeof(struct bpf_insn));
+    off += ninsns * sizeof(struct bpf_insn);
+
+    if (len - off < sizeof(ntables))
+        goto fail;
+    memcpy(&ntables, data + off, sizeof(ntables));
+    off += sizeof(ntables);
+    if (ntables > (len - off) / sizeof(bpf_u_int32))
+        goto fail;
+    if (ntables && !(tables = calloc(ntables, sizeof(*tables))))
+        goto fail;
+    for (i = 0; i < ntables; i++)
+    {
+        if (!(tables[i] = bpf_table_restore(data + off, len - off, &used)))
+            goto fail;
+        off += used;
+    }
+    if (off != len || !bpf_validate_tables(insns, ninsns, ntables))
+        goto fail;
+
+    for (i = 0; i < ntables; i++)
+        tables[i] = bpf_table_intern(tables[i]);
+    program->bf_len = ninsns;
+    program->bf_insns = insns;
+    program->bf_ntables = ntables;
+    program->bf_tables = tables;
+    return 0;
+
+fail:
+    if (tables)
+    {
+        for (i = 0; i < ntables; i++)
+            bpf_table_unref(tables[i]);
+        free(tables);
+    }
+    free(insns);
+    return -1;
+}
+
+/* Write the program after key to the cache; failure just means no caching. */
+static void cache_store(const char *dir, const char *path, struct cache_image *im, const struct bpf_program *program)
+{
+    char tmp[PATH_MAX];
+    u_char *data;
+    size_t n;
+    ssize_t r;
+    u_int i;
+    int fd;
+
+    if (image_put_word(im, program->bf_len) < 0 ||
+        image_put(im, program->bf_insns, program->bf_len * sizeof(struct bpf_insn)) < 0 ||
+        image_put_word(im, program->bf_ntables) < 0)
+        return;
+    for (i = 0; i < program->bf_ntables; i++)
+    {
+        if (!(data = image_reserve(im, bpf_table_save(program->bf_tables[i], NULL))))
+            return;
+        bpf_table_save(program->bf_tables[i], data);
+    }
+    if (image_put_word(im, cache_hash32(im->data, im->len)) < 0)
+        return;
+
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s/.sfbpf.XXXXXX", dir) >= sizeof(tmp) || (fd = mkstemp(tmp)) < 0)
+        return;
+    fchmod(fd, 0644);
+    for (n = 0; n < im->len; n += r)
+    {
+        if ((r = write(fd, im->data + n, im->len - n)) <= 0)
+            break;
+    }
+    if (close(fd) < 0 || n < im->len || rename(tmp, path) < 0)
+        unlink(tmp);
+}
+#endif /* !WIN32 */
+
+/*
+ * As pcap_compile_errbuf(), but keeping compiled programs in the directory
+ * cache_dir, or in the one named by the environment variable
+ * SFBPF_CACHE_DIR if cache_dir is NULL.  Without either it just compiles.
+ * Problems with the cache are not errors; the filter is compiled instead.
+ */
+DAQ_SO_PUBLIC int pcap_compile_cached(const char *cache_dir, int snaplen_arg, int linktype_arg, struct bpf_program *program,
+                                      const char *buf, int optimize, bpf_u_int32 mask, u_int flags, char *errbuf)
+{
+#ifndef WIN32
+    struct cache_image im = { NULL, 0, 0 };
+    char path[PATH_MAX];
+    u_char *data;
+    size_t len;
+    int rc;
+
+    if (!cache_dir)
+        cache_dir = getenv("SFBPF_CACHE_DIR");
+    if (!cache_dir || !*cache_dir || !buf ||
+        cache_key(&im, snaplen_arg, linktype_arg, buf, optimize, mask, flags) < 0 ||
+        (size_t) snprintf(path, sizeof(path), "%s/%016llx.sfbpf", cache_dir,
+                          cache_hash64(im.data, im.len)) >= sizeof(path))
+    {
+        free(im.data);
+        return pcap_compile_errbuf(snaplen_arg, linktype_arg, program, buf, optimize, mask, flags, errbuf);
+    }
+
+    if ((data = cache_read(path, &len)) != NULL)
+    {
+        rc = cache_load(data, len, &im, program);
+        free(data);
+        if (rc == 0)
+        {
+            free(im.data);
+            return 0;
+        }
+    }
+
+    rc = pcap_compile_errbuf(snaplen_arg, linktype_arg, program, buf, optimize, mask, flags, errbuf);
+    if (rc == 0)
+        cache_store(cache_dir, path, &im, program);
+    free(im.data);
+    return rc;
+#else
+    return pcap_compile_errbuf(snaplen_arg, linktype_arg, program, buf, optimize, mask, flags, errbuf);
+#endif
+}
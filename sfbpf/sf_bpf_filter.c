@@ -87,6 +87,7 @@ static const char rcsid[] =
 
 #if !defined(KERNEL) && !defined(_KERNEL)
 #include <stdlib.h>
+#include <string.h>
 #endif
 
 #define int32 bpf_int32
@@ -204,6 +205,28 @@ static int m_xhalf(m, k, err)
 }
 #endif
 
+/*
+ * Return the ancillary value at offset k (relative to BPF_AUX_OFF), or -1
+ * if there is no such value for this packet.
+ */
+static inline int bpf_load_aux(aux_data, k)
+     const struct bpf_aux_data *aux_data;
+     int k;
+{
+    if (aux_data == NULL)
+        return -1;
+
+    switch (k - BPF_AUX_OFF)
+    {
+        case BPF_AUX_VLAN_TAG:
+            return aux_data->vlan_tag;
+
+        case BPF_AUX_VLAN_TAG_PRESENT:
+            return (aux_data->vlan_tag_present != 0);
+    }
+    return -1;
+}
+
 /*
  * Execute the filter program starting at pc on the packet p
  * wirelen is the length of the original packet
@@ -216,6 +239,38 @@ DAQ_SO_PUBLIC u_int bpf_filter(pc, p, wirelen, buflen)
      register const u_char *p;
      u_int wirelen;
      register u_int buflen;
+{
+    return bpf_filter_with_aux_data(pc, p, wirelen, buflen, NULL);
+}
+
+/*
+ * As bpf_filter(), but absolute loads from the ancillary area are answered
+ * from aux_data, which describes things the capture layer removed from the
+ * packet (e.g., a stripped VLAN tag).  Programs that use ancillary loads
+ * reject every packet if aux_data is NULL.
+ */
+DAQ_SO_PUBLIC u_int bpf_filter_with_aux_data(pc, p, wirelen, buflen, aux_data)
+     register const struct bpf_insn *pc;
+     register const u_char *p;
+     u_int wirelen;
+     register u_int buflen;
+     const struct bpf_aux_data *aux_data;
+{
+    return bpf_filter_tables(pc, NULL, p, wirelen, buflen, aux_data);
+}
+
+/*
+ * As bpf_filter_with_aux_data(), with the lookup tables of the program for
+ * BPF_LOOKUP.  Programs that use lookups reject every packet if tables is
+ * NULL.
+ */
+DAQ_SO_PRIVATE u_int bpf_filter_tables(pc, tables, p, wirelen, buflen, aux_data)
+     register const struct bpf_insn *pc;
+     struct bpf_table * const *tables;
+     register const u_char *p;
+     u_int wirelen;
+     register u_int buflen;
+     const struct bpf_aux_data *aux_data;
 {
     register u_int32 A, X;
     register int k;
@@ -262,6 +317,13 @@ DAQ_SO_PUBLIC u_int bpf_filter(pc, p, wirelen, buflen)
 
             case BPF_LD | BPF_W | BPF_ABS:
                 k = pc->k;
+                if (k < 0)
+                {
+                    if ((k = bpf_load_aux(aux_data, k)) < 0)
+                        return 0;
+                    A = k;
+                    continue;
+                }
                 if (k + sizeof(int32) > buflen)
                 {
 #if defined(KERNEL) || defined(_KERNEL)
@@ -280,6 +342,13 @@ DAQ_SO_PUBLIC u_int bpf_filter(pc, p, wirelen, buflen)
 
             case BPF_LD | BPF_H | BPF_ABS:
                 k = pc->k;
+                if (k < 0)
+                {
+                    if ((k = bpf_load_aux(aux_data, k)) < 0)
+                        return 0;
+                    A = k;
+                    continue;
+                }
                 if (k + sizeof(short) > buflen)
                 {
 #if defined(KERNEL) || defined(_KERNEL)
@@ -298,6 +367,13 @@ DAQ_SO_PUBLIC u_int bpf_filter(pc, p, wirelen, buflen)
 
             case BPF_LD | BPF_B | BPF_ABS:
                 k = pc->k;
+                if (k < 0)
+                {
+                    if ((k = bpf_load_aux(aux_data, k)) < 0)
+                        return 0;
+                    A = k;
+                    continue;
+                }
                 if (k >= buflen)
                 {
 #if defined(KERNEL) || defined(_KERNEL)
@@ -531,6 +607,12 @@ DAQ_SO_PUBLIC u_int bpf_filter(pc, p, wirelen, buflen)
             case BPF_MISC | BPF_TXA:
                 A = X;
                 continue;
+
+            case BPF_MISC | BPF_LOOKUP:
+                if (tables == NULL || (k = bpf_table_lookup(tables[pc->k], A, p, buflen)) < 0)
+                    return 0;
+                A = k;
+                continue;
         }
     }
 }
@@ -549,6 +631,78 @@ DAQ_SO_PUBLIC u_int bpf_filter(pc, p, wirelen, buflen)
 DAQ_SO_PUBLIC int bpf_validate(f, len)
      const struct bpf_insn *f;
      int len;
+{
+    return bpf_validate_tables(f, len, 0);
+}
+
+/*
+ * Whether bpf_filter() knows the opcode.  The checks below only look at
+ * the fields that matter for each class, which would let a program with
+ * stray bits reach the interpreter's default case.
+ */
+static int bpf_known_code(code)
+     u_int code;
+{
+    switch (code)
+    {
+        case BPF_RET | BPF_K:
+        case BPF_RET | BPF_A:
+        case BPF_LD | BPF_W | BPF_ABS:
+        case BPF_LD | BPF_H | BPF_ABS:
+        case BPF_LD | BPF_B | BPF_ABS:
+        case BPF_LD | BPF_W | BPF_LEN:
+        case BPF_LDX | BPF_W | BPF_LEN:
+        case BPF_LD | BPF_W | BPF_IND:
+        case BPF_LD | BPF_H | BPF_IND:
+        case BPF_LD | BPF_B | BPF_IND:
+        case BPF_LDX | BPF_MSH | BPF_B:
+        case BPF_LD | BPF_IMM:
+        case BPF_LDX | BPF_IMM:
+        case BPF_LD | BPF_MEM:
+        case BPF_LDX | BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+        case BPF_JMP | BPF_JA:
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+        case BPF_JMP | BPF_JSET | BPF_X:
+        case BPF_ALU | BPF_ADD | BPF_X:
+        case BPF_ALU | BPF_SUB | BPF_X:
+        case BPF_ALU | BPF_MUL | BPF_X:
+        case BPF_ALU | BPF_DIV | BPF_X:
+        case BPF_ALU | BPF_AND | BPF_X:
+        case BPF_ALU | BPF_OR | BPF_X:
+        case BPF_ALU | BPF_LSH | BPF_X:
+        case BPF_ALU | BPF_RSH | BPF_X:
+        case BPF_ALU | BPF_ADD | BPF_K:
+        case BPF_ALU | BPF_SUB | BPF_K:
+        case BPF_ALU | BPF_MUL | BPF_K:
+        case BPF_ALU | BPF_DIV | BPF_K:
+        case BPF_ALU | BPF_AND | BPF_K:
+        case BPF_ALU | BPF_OR | BPF_K:
+        case BPF_ALU | BPF_LSH | BPF_K:
+        case BPF_ALU | BPF_RSH | BPF_K:
+        case BPF_ALU | BPF_NEG:
+        case BPF_MISC | BPF_TAX:
+        case BPF_MISC | BPF_TXA:
+        case BPF_MISC | BPF_LOOKUP:
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * As bpf_validate(), for a program with ntables lookup tables.
+ */
+DAQ_SO_PRIVATE int bpf_validate_tables(f, len, ntables)
+     const struct bpf_insn *f;
+     int len;
+     u_int ntables;
 {
     u_int i, from;
     const struct bpf_insn *p;
@@ -566,6 +720,8 @@ DAQ_SO_PUBLIC int bpf_validate(f, len)
     for (i = 0; i < len; ++i)
     {
         p = &f[i];
+        if (!bpf_known_code(p->code))
+            return 0;
         switch (BPF_CLASS(p->code))
         {
                 /*
@@ -684,6 +840,8 @@ DAQ_SO_PUBLIC int bpf_validate(f, len)
             case BPF_RET:
                 break;
             case BPF_MISC:
+                if (BPF_MISCOP(p->code) == BPF_LOOKUP && p->k >= ntables)
+                    return 0;
                 break;
             default:
                 return 0;
@@ -691,3 +849,857 @@ DAQ_SO_PUBLIC int bpf_validate(f, len)
     }
     return BPF_CLASS(f[len - 1].code) == BPF_RET;
 }
+
+#if !defined(KERNEL) && !defined(_KERNEL)
+/*
+ * Pre-decoded programs.
+ *
+ * bpf_decode() translates a validated program once into an array of
+ * bpf_decoded_insn, each naming its handler directly and carrying resolved
+ * jump targets and precomputed load bounds, so that running it involves no
+ * opcode decoding at all.  Where the compiler supports taking the address
+ * of a label, the handlers are dispatched with computed gotos (direct
+ * threading); elsewhere they are cases of a switch on the decoded op.
+ *
+ * A load from a fixed offset (or from X plus a fixed offset for halfwords)
+ * immediately followed by a conditional jump against a constant, e.g.
+ * "ldh [12]; jeq #0x800", is fused into a single instruction as long as
+ * nothing jumps to the comparison.  These pairs make up most of what the
+ * code generator emits for protocol, address and port tests.
+ */
+#if defined(__GNUC__)
+#define BPF_COMPUTED_GOTO
+#endif
+
+#define BPF_DECODED_OPS(X) \
+    X(RET_K) X(RET_A) X(REJECT) \
+    X(LD_W_ABS) X(LD_H_ABS) X(LD_B_ABS) \
+    X(LD_W_IND) X(LD_H_IND) X(LD_B_IND) \
+    X(LD_AUX_VLAN_TAG) X(LD_AUX_VLAN_TAG_PRESENT) \
+    X(LD_LEN) X(LDX_LEN) X(LD_IMM) X(LDX_IMM) X(LDX_MSH) \
+    X(LD_MEM) X(LDX_MEM) X(ST) X(STX) \
+    X(JA) \
+    X(JEQ_K) X(JGT_K) X(JGE_K) X(JSET_K) \
+    X(JEQ_X) X(JGT_X) X(JGE_X) X(JSET_X) \
+    X(ADD_K) X(SUB_K) X(MUL_K) X(DIV_K) X(AND_K) X(OR_K) X(LSH_K) X(RSH_K) \
+    X(ADD_X) X(SUB_X) X(MUL_X) X(DIV_X) X(AND_X) X(OR_X) X(LSH_X) X(RSH_X) \
+    X(NEG) X(TAX) X(TXA) X(LOOKUP) \
+    X(LD_W_ABS_JEQ) X(LD_W_ABS_JGT) X(LD_W_ABS_JGE) X(LD_W_ABS_JSET) \
+    X(LD_H_ABS_JEQ) X(LD_H_ABS_JGT) X(LD_H_ABS_JGE) X(LD_H_ABS_JSET) \
+    X(LD_B_ABS_JEQ) X(LD_B_ABS_JGT) X(LD_B_ABS_JGE) X(LD_B_ABS_JSET) \
+    X(LD_H_IND_JEQ) X(LD_H_IND_JGT) X(LD_H_IND_JGE) X(LD_H_IND_JSET)
+
+#define BDOP_ENUM(op) BDOP_##op,
+enum
+{
+    BPF_DECODED_OPS(BDOP_ENUM)
+    BDOP_COUNT
+};
+
+struct bpf_decoded_insn
+{
+#ifdef BPF_COMPUTED_GOTO
+    const void *handler;
+#endif
+    u_int op;
+    u_int32 k;
+    u_int32 end;        /* k plus the load size, for fixed-offset bounds checks */
+    u_int32 cmp;        /* Comparison operand of a fused load and jump */
+    const struct bpf_decoded_insn *jt;
+    const struct bpf_decoded_insn *jf;
+};
+
+#define EXTRACT_BYTE(p)     (*(const u_char *) (p))
+
+/*
+ * Label addresses and computed gotos are GNU C; __extension__ keeps
+ * -pedantic quiet about them.
+ */
+#ifdef BPF_COMPUTED_GOTO
+#define TARGET(op)          L_##op:
+#define DISPATCH()          __extension__ ({ goto *pc->handler; })
+#else
+#define TARGET(op)          case BDOP_##op:
+#define DISPATCH()          goto dispatch
+#endif
+#define NEXT()              do { pc++; DISPATCH(); } while (0)
+#define JUMP(cond)          do { pc = (cond) ? pc->jt : pc->jf; DISPATCH(); } while (0)
+
+/* Bounds check and load for X-relative loads. */
+#define LOAD_IND(size, extract) \
+    k = X + pc->k; \
+    if (k > buflen || buflen - k < (size)) \
+        return 0; \
+    A = extract(&p[k])
+
+#define FUSED_ABS(name, extract) \
+    TARGET(name##_JEQ) if (pc->end > buflen) return 0; A = extract(&p[pc->k]); JUMP(A == pc->cmp); \
+    TARGET(name##_JGT) if (pc->end > buflen) return 0; A = extract(&p[pc->k]); JUMP(A > pc->cmp); \
+    TARGET(name##_JGE) if (pc->end > buflen) return 0; A = extract(&p[pc->k]); JUMP(A >= pc->cmp); \
+    TARGET(name##_JSET) if (pc->end > buflen) return 0; A = extract(&p[pc->k]); JUMP(A & pc->cmp);
+
+/*
+ * Run a decoded program.  Called with handlers non-NULL, it instead
+ * returns its table of handler addresses for bpf_decode().
+ */
+static u_int bpf_run_decoded(const struct bpf_decoded_insn *pc, struct bpf_table * const *tables,
+                             const u_char *p, u_int wirelen, u_int buflen,
+                             const struct bpf_aux_data *aux_data, const void * const **handlers)
+{
+    u_int32 A = 0, X = 0, k;
+    int found;
+    int32 mem[BPF_MEMWORDS];
+#ifdef BPF_COMPUTED_GOTO
+#define BDOP_LABEL(op) __extension__ &&L_##op,
+    static const void * const handler_table[BDOP_COUNT] = { BPF_DECODED_OPS(BDOP_LABEL) };
+
+    if (handlers)
+    {
+        *handlers = handler_table;
+        return 0;
+    }
+    DISPATCH();
+#else
+dispatch:
+    switch (pc->op)
+    {
+#endif
+    TARGET(RET_K)
+        return pc->k;
+
+    TARGET(RET_A)
+        return A;
+
+    TARGET(REJECT)
+        return 0;
+
+    TARGET(LD_W_ABS)
+        if (pc->end > buflen)
+            return 0;
+        A = EXTRACT_LONG(&p[pc->k]);
+        NEXT();
+
+    TARGET(LD_H_ABS)
+        if (pc->end > buflen)
+            return 0;
+        A = EXTRACT_SHORT(&p[pc->k]);
+        NEXT();
+
+    TARGET(LD_B_ABS)
+        if (pc->end > buflen)
+            return 0;
+        A = p[pc->k];
+        NEXT();
+
+    TARGET(LD_W_IND)
+        LOAD_IND(sizeof(int32), EXTRACT_LONG);
+        NEXT();
+
+    TARGET(LD_H_IND)
+        LOAD_IND(sizeof(short), EXTRACT_SHORT);
+        NEXT();
+
+    TARGET(LD_B_IND)
+        LOAD_IND(1, EXTRACT_BYTE);
+        NEXT();
+
+    TARGET(LD_AUX_VLAN_TAG)
+        if (aux_data == NULL)
+            return 0;
+        A = aux_data->vlan_tag;
+        NEXT();
+
+    TARGET(LD_AUX_VLAN_TAG_PRESENT)
+        if (aux_data == NULL)
+            return 0;
+        A = (aux_data->vlan_tag_present != 0);
+        NEXT();
+
+    TARGET(LD_LEN)
+        A = wirelen;
+        NEXT();
+
+    TARGET(LDX_LEN)
+        X = wirelen;
+        NEXT();
+
+    TARGET(LD_IMM)
+        A = pc->k;
+        NEXT();
+
+    TARGET(LDX_IMM)
+        X = pc->k;
+        NEXT();
+
+    TARGET(LDX_MSH)
+        if (pc->k >= buflen)
+            return 0;
+        X = (p[pc->k] & 0xf) << 2;
+        NEXT();
+
+    TARGET(LD_MEM)
+        A = mem[pc->k];
+        NEXT();
+
+    TARGET(LDX_MEM)
+        X = mem[pc->k];
+        NEXT();
+
+    TARGET(ST)
+        mem[pc->k] = A;
+        NEXT();
+
+    TARGET(STX)
+        mem[pc->k] = X;
+        NEXT();
+
+    TARGET(JA)
+        pc = pc->jt;
+        DISPATCH();
+
+    TARGET(JEQ_K)
+        JUMP(A == pc->k);
+
+    TARGET(JGT_K)
+        JUMP(A > pc->k);
+
+    TARGET(JGE_K)
+        JUMP(A >= pc->k);
+
+    TARGET(JSET_K)
+        JUMP(A & pc->k);
+
+    TARGET(JEQ_X)
+        JUMP(A == X);
+
+    TARGET(JGT_X)
+        JUMP(A > X);
+
+    TARGET(JGE_X)
+        JUMP(A >= X);
+
+    TARGET(JSET_X)
+        JUMP(A & X);
+
+    TARGET(ADD_K)
+        A += pc->k;
+        NEXT();
+
+    TARGET(SUB_K)
+        A -= pc->k;
+        NEXT();
+
+    TARGET(MUL_K)
+        A *= pc->k;
+        NEXT();
+
+    TARGET(DIV_K)
+        A /= pc->k;
+        NEXT();
+
+    TARGET(AND_K)
+        A &= pc->k;
+        NEXT();
+
+    TARGET(OR_K)
+        A |= pc->k;
+        NEXT();
+
+    TARGET(LSH_K)
+        A <<= pc->k;
+        NEXT();
+
+    TARGET(RSH_K)
+        A >>= pc->k;
+        NEXT();
+
+    TARGET(ADD_X)
+        A += X;
+        NEXT();
+
+    TARGET(SUB_X)
+        A -= X;
+        NEXT();
+
+    TARGET(MUL_X)
+        A *= X;
+        NEXT();
+
+    TARGET(DIV_X)
+        if (X == 0)
+            return 0;
+        A /= X;
+        NEXT();
+
+    TARGET(AND_X)
+        A &= X;
+        NEXT();
+
+    TARGET(OR_X)
+        A |= X;
+        NEXT();
+
+    TARGET(LSH_X)
+        A <<= X;
+        NEXT();
+
+    TARGET(RSH_X)
+        A >>= X;
+        NEXT();
+
+    TARGET(NEG)
+        A = -A;
+        NEXT();
+
+    TARGET(TAX)
+        X = A;
+        NEXT();
+
+    TARGET(TXA)
+        A = X;
+        NEXT();
+
+    TARGET(LOOKUP)
+        if (tables == NULL || (found = bpf_table_lookup(tables[pc->k], A, p, buflen)) < 0)
+            return 0;
+        A = found;
+        NEXT();
+
+    FUSED_ABS(LD_W_ABS, EXTRACT_LONG)
+    FUSED_ABS(LD_H_ABS, EXTRACT_SHORT)
+    FUSED_ABS(LD_B_ABS, EXTRACT_BYTE)
+
+    TARGET(LD_H_IND_JEQ)
+        LOAD_IND(sizeof(short), EXTRACT_SHORT);
+        JUMP(A == pc->cmp);
+
+    TARGET(LD_H_IND_JGT)
+        LOAD_IND(sizeof(short), EXTRACT_SHORT);
+        JUMP(A > pc->cmp);
+
+    TARGET(LD_H_IND_JGE)
+        LOAD_IND(sizeof(short), EXTRACT_SHORT);
+        JUMP(A >= pc->cmp);
+
+    TARGET(LD_H_IND_JSET)
+        LOAD_IND(sizeof(short), EXTRACT_SHORT);
+        JUMP(A & pc->cmp);
+#ifndef BPF_COMPUTED_GOTO
+    }
+    return 0;
+#endif
+}
+
+/* Decode a single instruction; returns -1 if it has no decoded form. */
+static int bpf_decode_op(const struct bpf_insn *pc)
+{
+    switch (pc->code)
+    {
+        case BPF_RET | BPF_K:                   return BDOP_RET_K;
+        case BPF_RET | BPF_A:                   return BDOP_RET_A;
+        case BPF_LD | BPF_W | BPF_ABS:          return BDOP_LD_W_ABS;
+        case BPF_LD | BPF_H | BPF_ABS:          return BDOP_LD_H_ABS;
+        case BPF_LD | BPF_B | BPF_ABS:          return BDOP_LD_B_ABS;
+        case BPF_LD | BPF_W | BPF_IND:          return BDOP_LD_W_IND;
+        case BPF_LD | BPF_H | BPF_IND:          return BDOP_LD_H_IND;
+        case BPF_LD | BPF_B | BPF_IND:          return BDOP_LD_B_IND;
+        case BPF_LD | BPF_W | BPF_LEN:          return BDOP_LD_LEN;
+        case BPF_LDX | BPF_W | BPF_LEN:         return BDOP_LDX_LEN;
+        case BPF_LD | BPF_IMM:                  return BDOP_LD_IMM;
+        case BPF_LDX | BPF_IMM:                 return BDOP_LDX_IMM;
+        case BPF_LDX | BPF_MSH | BPF_B:         return BDOP_LDX_MSH;
+        case BPF_LD | BPF_MEM:                  return BDOP_LD_MEM;
+        case BPF_LDX | BPF_MEM:                 return BDOP_LDX_MEM;
+        case BPF_ST:                            return BDOP_ST;
+        case BPF_STX:                           return BDOP_STX;
+        case BPF_JMP | BPF_JA:                  return BDOP_JA;
+        case BPF_JMP | BPF_JEQ | BPF_K:         return BDOP_JEQ_K;
+        case BPF_JMP | BPF_JGT | BPF_K:         return BDOP_JGT_K;
+        case BPF_JMP | BPF_JGE | BPF_K:         return BDOP_JGE_K;
+        case BPF_JMP | BPF_JSET | BPF_K:        return BDOP_JSET_K;
+        case BPF_JMP | BPF_JEQ | BPF_X:         return BDOP_JEQ_X;
+        case BPF_JMP | BPF_JGT | BPF_X:         return BDOP_JGT_X;
+        case BPF_JMP | BPF_JGE | BPF_X:         return BDOP_JGE_X;
+        case BPF_JMP | BPF_JSET | BPF_X:        return BDOP_JSET_X;
+        case BPF_ALU | BPF_ADD | BPF_K:         return BDOP_ADD_K;
+        case BPF_ALU | BPF_SUB | BPF_K:         return BDOP_SUB_K;
+        case BPF_ALU | BPF_MUL | BPF_K:         return BDOP_MUL_K;
+        case BPF_ALU | BPF_DIV | BPF_K:         return (pc->k != 0) ? BDOP_DIV_K : BDOP_REJECT;
+        case BPF_ALU | BPF_AND | BPF_K:         return BDOP_AND_K;
+        case BPF_ALU | BPF_OR | BPF_K:          return BDOP_OR_K;
+        case BPF_ALU | BPF_LSH | BPF_K:         return BDOP_LSH_K;
+        case BPF_ALU | BPF_RSH | BPF_K:         return BDOP_RSH_K;
+        case BPF_ALU | BPF_ADD | BPF_X:         return BDOP_ADD_X;
+        case BPF_ALU | BPF_SUB | BPF_X:         return BDOP_SUB_X;
+        case BPF_ALU | BPF_MUL | BPF_X:         return BDOP_MUL_X;
+        case BPF_ALU | BPF_DIV | BPF_X:         return BDOP_DIV_X;
+        case BPF_ALU | BPF_AND | BPF_X:         return BDOP_AND_X;
+        case BPF_ALU | BPF_OR | BPF_X:          return BDOP_OR_X;
+        case BPF_ALU | BPF_LSH | BPF_X:         return BDOP_LSH_X;
+        case BPF_ALU | BPF_RSH | BPF_X:         return BDOP_RSH_X;
+        case BPF_ALU | BPF_NEG:                 return BDOP_NEG;
+        case BPF_MISC | BPF_TAX:                return BDOP_TAX;
+        case BPF_MISC | BPF_TXA:                return BDOP_TXA;
+        case BPF_MISC | BPF_LOOKUP:             return BDOP_LOOKUP;
+    }
+    return -1;
+}
+
+/*
+ * Return the fused form of a load followed by a conditional jump on K, or -1
+ * if there isn't one.  The fused ops of each load come in JEQ, JGT, JGE,
+ * JSET order.
+ */
+static int bpf_fuse_op(int load_op, const struct bpf_insn *jmp)
+{
+    int base, cond;
+
+    switch (load_op)
+    {
+        case BDOP_LD_W_ABS: base = BDOP_LD_W_ABS_JEQ; break;
+        case BDOP_LD_H_ABS: base = BDOP_LD_H_ABS_JEQ; break;
+        case BDOP_LD_B_ABS: base = BDOP_LD_B_ABS_JEQ; break;
+        case BDOP_LD_H_IND: base = BDOP_LD_H_IND_JEQ; break;
+        default: return -1;
+    }
+    switch (jmp->code)
+    {
+        case BPF_JMP | BPF_JEQ | BPF_K: cond = 0; break;
+        case BPF_JMP | BPF_JGT | BPF_K: cond = 1; break;
+        case BPF_JMP | BPF_JGE | BPF_K: cond = 2; break;
+        case BPF_JMP | BPF_JSET | BPF_K: cond = 3; break;
+        default: return -1;
+    }
+    return base + cond;
+}
+
+/*
+ * Build the decoded form of a program that has passed bpf_validate().
+ * The result is released with free().  Returns NULL if memory runs out or
+ * the program contains something that can't be decoded.
+ */
+DAQ_SO_PRIVATE struct bpf_decoded_insn *bpf_decode(const struct bpf_insn *insns, u_int len)
+{
+#ifdef BPF_COMPUTED_GOTO
+    const void * const *handlers;
+#endif
+    struct bpf_decoded_insn *code;
+    const struct bpf_insn *pc;
+    u_char *is_target;
+    u_int i, t;
+    int op, fused;
+
+#ifdef BPF_COMPUTED_GOTO
+    bpf_run_decoded(NULL, NULL, NULL, 0, 0, NULL, &handlers);
+#endif
+
+    code = calloc(len, sizeof(struct bpf_decoded_insn));
+    is_target = calloc(len, sizeof(u_char));
+    if (!code || !is_target)
+        goto fail;
+
+    /* Find the jump targets; a comparison that is one can't be fused. */
+    for (i = 0; i < len; i++)
+    {
+        pc = &insns[i];
+        if (BPF_CLASS(pc->code) != BPF_JMP)
+            continue;
+        if (BPF_OP(pc->code) == BPF_JA)
+            t = i + 1 + pc->k;
+        else
+        {
+            t = i + 1 + pc->jf;
+            if (t < len)
+                is_target[t] = 1;
+            t = i + 1 + pc->jt;
+        }
+        if (t >= len)
+            goto fail;
+        is_target[t] = 1;
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        pc = &insns[i];
+        op = bpf_decode_op(pc);
+        if (op < 0)
+            goto fail;
+        code[i].k = pc->k;
+        if (op == BDOP_LD_W_ABS || op == BDOP_LD_H_ABS || op == BDOP_LD_B_ABS)
+        {
+            if ((int) pc->k < 0)
+            {
+                switch ((int) pc->k - BPF_AUX_OFF)
+                {
+                    case BPF_AUX_VLAN_TAG:
+                        op = BDOP_LD_AUX_VLAN_TAG;
+                        break;
+                    case BPF_AUX_VLAN_TAG_PRESENT:
+                        op = BDOP_LD_AUX_VLAN_TAG_PRESENT;
+                        break;
+                    default:
+                        op = BDOP_REJECT;
+                        break;
+                }
+            }
+            else
+                code[i].end = pc->k + (op == BDOP_LD_W_ABS ? 4 : (op == BDOP_LD_H_ABS ? 2 : 1));
+        }
+        if (BPF_CLASS(pc->code) == BPF_JMP)
+        {
+            if (op == BDOP_JA)
+                code[i].jt = &code[i + 1 + pc->k];
+            else
+            {
+                code[i].jt = &code[i + 1 + pc->jt];
+                code[i].jf = &code[i + 1 + pc->jf];
+            }
+        }
+        else if (i + 1 < len && !is_target[i + 1] && (fused = bpf_fuse_op(op, &insns[i + 1])) >= 0)
+        {
+            /* The comparison is still decoded on its own below, but never reached. */
+            op = fused;
+            code[i].cmp = insns[i + 1].k;
+            code[i].jt = &code[i + 2 + insns[i + 1].jt];
+            code[i].jf = &code[i + 2 + insns[i + 1].jf];
+        }
+        code[i].op = op;
+#ifdef BPF_COMPUTED_GOTO
+        code[i].handler = handlers[op];
+#endif
+    }
+
+    free(is_target);
+    return code;
+
+fail:
+    free(is_target);
+    free(code);
+    return NULL;
+}
+
+DAQ_SO_PRIVATE u_int bpf_filter_decoded(const struct bpf_decoded_insn *code, struct bpf_table * const *tables,
+                                        const u_char *p, u_int wirelen, u_int buflen,
+                                        const struct bpf_aux_data *aux_data)
+{
+    return bpf_run_decoded(code, tables, p, wirelen, buflen, aux_data, NULL);
+}
+
+/*
+ * Dependency analysis.
+ *
+ * bpf_analyze() runs the program abstractly over all paths at once.  Each
+ * register and scratch word is described by an upper bound on its value,
+ * and whether it is known to equal that bound exactly; loads then tell how
+ * far into the packet they can reach.  Jumps only go forward, so a single
+ * pass in instruction order sees every predecessor of an instruction before
+ * the instruction itself.  States for jump targets are allocated as they
+ * are first reached and freed as soon as they have been consumed.
+ */
+#define BPF_VAL_ANY     0xffffffff
+
+struct bpf_val
+{
+    bpf_u_int32 max;
+    int exact;
+};
+
+struct bpf_deps_state
+{
+    struct bpf_val a, x;
+    struct bpf_val mem[BPF_MEMWORDS];
+};
+
+static void bpf_val_join(struct bpf_val *d, const struct bpf_val *s)
+{
+    if (!s->exact || s->max != d->max)
+        d->exact = 0;
+    if (s->max > d->max)
+        d->max = s->max;
+}
+
+static void bpf_state_join(struct bpf_deps_state *d, const struct bpf_deps_state *s)
+{
+    int i;
+
+    bpf_val_join(&d->a, &s->a);
+    bpf_val_join(&d->x, &s->x);
+    for (i = 0; i < BPF_MEMWORDS; i++)
+        bpf_val_join(&d->mem[i], &s->mem[i]);
+}
+
+/* Smallest all-ones value that is at least v. */
+static bpf_u_int32 bpf_val_smear(bpf_u_int32 v)
+{
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    return v;
+}
+
+static void bpf_val_alu(struct bpf_val *a, u_int op, const struct bpf_val *s)
+{
+    bpf_u_int32 m = BPF_VAL_ANY;
+
+    if (a->exact && s->exact)
+    {
+        switch (op)
+        {
+            case BPF_ADD: a->max += s->max; return;
+            case BPF_SUB: a->max -= s->max; return;
+            case BPF_MUL: a->max *= s->max; return;
+            case BPF_AND: a->max &= s->max; return;
+            case BPF_OR: a->max |= s->max; return;
+            case BPF_NEG: a->max = -a->max; return;
+            case BPF_DIV:
+                if (s->max == 0)
+                    break;
+                a->max /= s->max;
+                return;
+            case BPF_LSH:
+                if (s->max >= 32)
+                    break;
+                a->max <<= s->max;
+                return;
+            case BPF_RSH:
+                if (s->max >= 32)
+                    break;
+                a->max >>= s->max;
+                return;
+        }
+    }
+
+    /* Subtraction and negation can wrap around to anything. */
+    switch (op)
+    {
+        case BPF_ADD:
+            if (a->max <= BPF_VAL_ANY - s->max)
+                m = a->max + s->max;
+            break;
+        case BPF_MUL:
+            if (s->max == 0 || a->max <= BPF_VAL_ANY / s->max)
+                m = a->max * s->max;
+            break;
+        case BPF_DIV:
+            m = a->max;
+            break;
+        case BPF_AND:
+            m = (a->max < s->max) ? a->max : s->max;
+            break;
+        case BPF_OR:
+            m = bpf_val_smear(a->max | s->max);
+            break;
+        case BPF_LSH:
+            if (s->max < 32 && (a->max << s->max) >> s->max == a->max)
+                m = a->max << s->max;
+            break;
+        case BPF_RSH:
+            m = (s->exact && s->max < 32) ? a->max >> s->max : a->max;
+            break;
+    }
+    a->max = m;
+    a->exact = 0;
+}
+
+/*
+ * Account for a load of size bytes at off + k, where off (if not NULL) is
+ * the index register.
+ */
+static void bpf_deps_load(struct bpf_deps *deps, const struct bpf_val *off, bpf_u_int32 k, u_int size)
+{
+    bpf_u_int32 base = off ? off->max : 0;
+    bpf_u_int32 i;
+
+    if (base > BPF_VAL_ANY - k || base + k > BPF_VAL_ANY - size)
+    {
+        deps->flags |= BPF_DEPS_UNBOUNDED | BPF_DEPS_VARIABLE;
+        deps->max_offset = BPF_VAL_ANY;
+        return;
+    }
+    if (base + k + size > deps->max_offset)
+        deps->max_offset = base + k + size;
+    if (off && !off->exact)
+    {
+        deps->flags |= BPF_DEPS_VARIABLE;
+        return;
+    }
+    for (i = base + k; i < base + k + size && i < BPF_DEPS_FIXED_BYTES; i++)
+        deps->fixed[i / 8] |= 1 << (i % 8);
+}
+
+/*
+ * Work out what a program needs from the packet and its metadata.  Returns
+ * 0 on success and -1 if the program is invalid or memory runs out.
+ */
+DAQ_SO_PUBLIC int bpf_analyze(const struct bpf_program *program, struct bpf_deps *deps)
+{
+    struct bpf_deps_state **pending, *target, cur;
+    const struct bpf_insn *pc;
+    struct bpf_val *dst, src;
+    bpf_u_int32 k;
+    u_int i, len, size, t[2], nt, j;
+    int live, rc = -1;
+
+    memset(deps, 0, sizeof(*deps));
+    len = program->bf_len;
+    if (!bpf_validate_tables(program->bf_insns, len, program->bf_ntables))
+        return -1;
+    if ((pending = calloc(len, sizeof(*pending))) == NULL)
+        return -1;
+
+    /* A and X start out as zero; nothing is known about scratch memory. */
+    memset(&cur, 0, sizeof(cur));
+    cur.a.exact = cur.x.exact = 1;
+    for (j = 0; j < BPF_MEMWORDS; j++)
+        cur.mem[j].max = BPF_VAL_ANY;
+    live = 1;
+
+    for (i = 0; i < len; i++)
+    {
+        if (pending[i])
+        {
+            if (live)
+                bpf_state_join(&cur, pending[i]);
+            else
+                cur = *pending[i];
+            free(pending[i]);
+            pending[i] = NULL;
+            live = 1;
+        }
+        if (!live)
+            continue;
+
+        pc = &program->bf_insns[i];
+        k = pc->k;
+        dst = (BPF_CLASS(pc->code) == BPF_LDX) ? &cur.x : &cur.a;
+        size = (BPF_SIZE(pc->code) == BPF_W) ? 4 : (BPF_SIZE(pc->code) == BPF_H) ? 2 : 1;
+        switch (BPF_CLASS(pc->code))
+        {
+            case BPF_LD:
+            case BPF_LDX:
+                dst->exact = 0;
+                switch (BPF_MODE(pc->code))
+                {
+                    case BPF_ABS:
+                        if ((int) k < 0)
+                        {
+                            deps->flags |= BPF_DEPS_AUX;
+                            dst->max = ((int) k - BPF_AUX_OFF == BPF_AUX_VLAN_TAG_PRESENT) ? 1 : 0xffff;
+                            break;
+                        }
+                        bpf_deps_load(deps, NULL, k, size);
+                        dst->max = (size == 4) ? BPF_VAL_ANY : (size == 2) ? 0xffff : 0xff;
+                        break;
+                    case BPF_IND:
+                        bpf_deps_load(deps, &cur.x, k, size);
+                        dst->max = (size == 4) ? BPF_VAL_ANY : (size == 2) ? 0xffff : 0xff;
+                        break;
+                    case BPF_MSH:
+                        bpf_deps_load(deps, NULL, k, 1);
+                        dst->max = 60;
+                        break;
+                    case BPF_LEN:
+                        deps->flags |= BPF_DEPS_LEN;
+                        dst->max = BPF_VAL_ANY;
+                        break;
+                    case BPF_IMM:
+                        dst->max = k;
+                        dst->exact = 1;
+                        break;
+                    case BPF_MEM:
+                        *dst = cur.mem[k];
+                        break;
+                }
+                break;
+
+            case BPF_ST:
+                cur.mem[k] = cur.a;
+                break;
+
+            case BPF_STX:
+                cur.mem[k] = cur.x;
+                break;
+
+            case BPF_ALU:
+                if (BPF_SRC(pc->code) == BPF_X)
+                    src = cur.x;
+                else
+                {
+                    src.max = k;
+                    src.exact = 1;
+                }
+                bpf_val_alu(&cur.a, BPF_OP(pc->code), &src);
+                break;
+
+            case BPF_MISC:
+                if (BPF_MISCOP(pc->code) == BPF_TAX)
+                    cur.x = cur.a;
+                else if (BPF_MISCOP(pc->code) == BPF_TXA)
+                    cur.a = cur.x;
+                else if (BPF_MISCOP(pc->code) == BPF_LOOKUP)
+                {
+                    deps->flags |= BPF_DEPS_TABLES;
+                    if (program->bf_tables && bpf_table_key_len(program->bf_tables[k]) == 16)
+                        bpf_deps_load(deps, &cur.a, 0, 16);
+                    cur.a.max = 1;
+                    cur.a.exact = 0;
+                }
+                break;
+
+            case BPF_RET:
+                live = 0;
+                break;
+
+            case BPF_JMP:
+                if (BPF_OP(pc->code) == BPF_JA)
+                {
+                    t[0] = i + 1 + k;
+                    nt = 1;
+                }
+                else
+                {
+                    t[0] = i + 1 + pc->jt;
+                    t[1] = i + 1 + pc->jf;
+                    nt = (t[0] == t[1]) ? 1 : 2;
+                }
+                for (j = 0; j < nt; j++)
+                {
+                    src = cur.a;
+                    /* What a comparison with a constant says about A. */
+                    if (nt == 2 && BPF_SRC(pc->code) == BPF_K)
+                    {
+                        if (j == 0 && BPF_OP(pc->code) == BPF_JEQ)
+                        {
+                            cur.a.max = k;
+                            cur.a.exact = 1;
+                        }
+                        else if (j == 1 && BPF_OP(pc->code) == BPF_JGT && k < cur.a.max)
+                            cur.a.max = k;
+                        else if (j == 1 && BPF_OP(pc->code) == BPF_JGE && k > 0 && k - 1 < cur.a.max)
+                            cur.a.max = k - 1;
+                    }
+                    if ((target = pending[t[j]]) != NULL)
+                        bpf_state_join(target, &cur);
+                    else if ((target = malloc(sizeof(*target))) != NULL)
+                        *(pending[t[j]] = target) = cur;
+                    cur.a = src;
+                    if (target == NULL)
+                        goto done;
+                }
+                live = 0;
+                break;
+        }
+    }
+    rc = 0;
+
+done:
+    for (i = 0; i < len; i++)
+        free(pending[i]);
+    free(pending);
+    if (rc < 0)
+        memset(deps, 0, sizeof(*deps));
+    return rc;
+}
+#endif /* !KERNEL && !_KERNEL */
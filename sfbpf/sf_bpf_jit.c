@@ -0,0 +1,777 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+ * Native code generation for filter programs.
+ *
+ * sfbpf_jit_compile() translates a validated program into x86-64 machine
+ * code placed in its own executable mapping.  The generated function has
+ * exactly the semantics of bpf_filter_with_aux_data(): loads are bounds
+ * checked against buflen and converted from network byte order, anything
+ * out of range or a division by zero rejects the packet, and ancillary
+ * loads are answered from the aux data (or reject the packet without it).
+ * Table lookups call out to bpf_table_lookup().
+ *
+ * On other architectures, or where the system refuses to hand out an
+ * executable mapping, the handle runs a pre-decoded copy of the program
+ * (see bpf_decode()) instead, so callers never need to care whether the
+ * code was actually compiled.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) && !defined(WIN32)
+#include <sys/mman.h>
+#define BPF_JIT_X86_64
+#endif
+
+#include "sfbpf-int.h"
+
+typedef u_int (*bpf_jit_func)(const u_char *p, u_int wirelen, u_int buflen,
+                              const struct bpf_aux_data *aux_data);
+
+struct bpf_jit_program
+{
+    bpf_jit_func func;
+    u_char *image;
+    size_t image_size;
+    struct bpf_decoded_insn *decoded;
+    u_int len;
+    struct bpf_insn *insns;
+    u_int ntables;
+    struct bpf_table **tables;
+};
+
+#ifdef BPF_JIT_X86_64
+
+/*
+ * Register usage of the generated code.  Everything lives in caller-saved
+ * registers, and the scratch memory words sit in the red zone below the
+ * stack pointer, so no prologue or epilogue is needed:
+ *
+ *   rdi      packet pointer (argument)
+ *   esi      wirelen (argument)
+ *   r10      buflen, zero-extended (copied from edx, which DIV clobbers)
+ *   r11      aux_data (copied from rcx, which variable shifts clobber)
+ *   eax      A
+ *   r9d      X
+ *   rcx/rdx  scratch
+ *
+ * A table lookup is a call, so around it the stack pointer is moved below
+ * the scratch memory and the live argument registers are saved.
+ */
+#define JIT_MEM_DISP(k)     ((u_char) (-4 * BPF_MEMWORDS + 4 * (k)))
+
+/* Upper bound on the bytes emitted for any one instruction. */
+#define JIT_MAX_INSN_SIZE   64
+
+#define JIT_FIXUP_RET0      ((u_int) -1)
+
+struct jit_fixup
+{
+    u_int pos;                  /* Offset of the rel32 field in the image */
+    u_int target;               /* Instruction index or JIT_FIXUP_RET0 */
+};
+
+struct jit_state
+{
+    u_char *buf;
+    u_int pos;
+    struct jit_fixup *fixups;
+    u_int nfixups;
+    struct bpf_table * const *tables;
+};
+
+static inline void emit1(struct jit_state *js, u_char b)
+{
+    js->buf[js->pos++] = b;
+}
+
+static inline void emit2(struct jit_state *js, u_char b1, u_char b2)
+{
+    emit1(js, b1);
+    emit1(js, b2);
+}
+
+static inline void emit3(struct jit_state *js, u_char b1, u_char b2, u_char b3)
+{
+    emit1(js, b1);
+    emit1(js, b2);
+    emit1(js, b3);
+}
+
+static inline void emit4(struct jit_state *js, u_char b1, u_char b2, u_char b3, u_char b4)
+{
+    emit2(js, b1, b2);
+    emit2(js, b3, b4);
+}
+
+static inline void emit_u32(struct jit_state *js, bpf_u_int32 v)
+{
+    memcpy(js->buf + js->pos, &v, sizeof(v));
+    js->pos += sizeof(v);
+}
+
+static inline void emit_u64(struct jit_state *js, uint64_t v)
+{
+    memcpy(js->buf + js->pos, &v, sizeof(v));
+    js->pos += sizeof(v);
+}
+
+/* Emit the tail of a jump whose rel32 is resolved once all code is laid out. */
+static void emit_rel32(struct jit_state *js, u_int target)
+{
+    js->fixups[js->nfixups].pos = js->pos;
+    js->fixups[js->nfixups].target = target;
+    js->nfixups++;
+    emit_u32(js, 0);
+}
+
+static void emit_jmp(struct jit_state *js, u_int target)
+{
+    emit1(js, 0xe9);
+    emit_rel32(js, target);
+}
+
+static void emit_jcc(struct jit_state *js, u_char cc, u_int target)
+{
+    emit2(js, 0x0f, cc);
+    emit_rel32(js, target);
+}
+
+#define JCC_B       0x82
+#define JCC_AE      0x83
+#define JCC_E       0x84
+#define JCC_NE      0x85
+#define JCC_BE      0x86
+#define JCC_A       0x87
+
+/*
+ * Load size bytes at offset rcx of the packet into eax in host byte order,
+ * rejecting the packet if they are not all within buflen.  rcx holds a
+ * zero-extended 32-bit offset, so the 64-bit sum cannot wrap.
+ */
+static void emit_packet_load(struct jit_state *js, u_int size)
+{
+    emit4(js, 0x48, 0x8d, 0x51, (u_char) size);     /* lea rdx, [rcx + size] */
+    emit3(js, 0x49, 0x39, 0xd2);                    /* cmp r10, rdx */
+    emit_jcc(js, JCC_B, JIT_FIXUP_RET0);
+    switch (size)
+    {
+        case 4:
+            emit3(js, 0x8b, 0x04, 0x0f);            /* mov eax, [rdi + rcx] */
+            emit2(js, 0x0f, 0xc8);                  /* bswap eax */
+            break;
+
+        case 2:
+            emit4(js, 0x0f, 0xb7, 0x04, 0x0f);      /* movzx eax, word [rdi + rcx] */
+            emit4(js, 0x66, 0xc1, 0xc0, 0x08);      /* rol ax, 8 */
+            break;
+
+        default:
+            emit4(js, 0x0f, 0xb6, 0x04, 0x0f);      /* movzx eax, byte [rdi + rcx] */
+            break;
+    }
+}
+
+static int emit_aux_load(struct jit_state *js, int k)
+{
+    u_char disp;
+
+    switch (k - BPF_AUX_OFF)
+    {
+        case BPF_AUX_VLAN_TAG:
+            disp = offsetof(struct bpf_aux_data, vlan_tag);
+            break;
+
+        case BPF_AUX_VLAN_TAG_PRESENT:
+            disp = offsetof(struct bpf_aux_data, vlan_tag_present);
+            break;
+
+        default:
+            emit_jmp(js, JIT_FIXUP_RET0);
+            return 0;
+    }
+    emit3(js, 0x4d, 0x85, 0xdb);                    /* test r11, r11 */
+    emit_jcc(js, JCC_E, JIT_FIXUP_RET0);
+    emit4(js, 0x41, 0x0f, 0xb7, 0x43);              /* movzx eax, word [r11 + disp] */
+    emit1(js, disp);
+    if (k - BPF_AUX_OFF == BPF_AUX_VLAN_TAG_PRESENT)
+    {
+        emit2(js, 0x85, 0xc0);                      /* test eax, eax */
+        emit3(js, 0x0f, 0x95, 0xc0);                /* setne al */
+        emit3(js, 0x0f, 0xb6, 0xc0);                /* movzx eax, al */
+    }
+    return 0;
+}
+
+/*
+ * A <- bpf_table_lookup(table, A, p, buflen), rejecting the packet if that
+ * returns -1.  The call is aligned: entry left rsp 8 bytes off a 16-byte
+ * boundary, and 80 + 5 pushes put it back on one.
+ */
+static void emit_lookup(struct jit_state *js, const struct bpf_table *table)
+{
+    emit4(js, 0x48, 0x83, 0xec, 0x50);              /* sub rsp, 80 */
+    emit2(js, 0x57, 0x56);                          /* push rdi; push rsi */
+    emit2(js, 0x41, 0x51);                          /* push r9 */
+    emit2(js, 0x41, 0x52);                          /* push r10 */
+    emit2(js, 0x41, 0x53);                          /* push r11 */
+    emit3(js, 0x48, 0x89, 0xfa);                    /* mov rdx, rdi */
+    emit3(js, 0x44, 0x89, 0xd1);                    /* mov ecx, r10d */
+    emit2(js, 0x89, 0xc6);                          /* mov esi, eax */
+    emit2(js, 0x48, 0xbf);                          /* mov rdi, table */
+    emit_u64(js, (uint64_t) (uintptr_t) table);
+    emit2(js, 0x48, 0xb8);                          /* mov rax, bpf_table_lookup */
+    emit_u64(js, (uint64_t) (uintptr_t) bpf_table_lookup);
+    emit2(js, 0xff, 0xd0);                          /* call rax */
+    emit2(js, 0x41, 0x5b);                          /* pop r11 */
+    emit2(js, 0x41, 0x5a);                          /* pop r10 */
+    emit2(js, 0x41, 0x59);                          /* pop r9 */
+    emit2(js, 0x5e, 0x5f);                          /* pop rsi; pop rdi */
+    emit4(js, 0x48, 0x83, 0xc4, 0x50);              /* add rsp, 80 */
+    emit2(js, 0x85, 0xc0);                          /* test eax, eax */
+    emit_jcc(js, 0x88, JIT_FIXUP_RET0);             /* js ret0 */
+}
+
+static u_int jit_load_size(u_short code)
+{
+    switch (BPF_SIZE(code))
+    {
+        case BPF_W:
+            return 4;
+        case BPF_H:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Emit the code for a conditional jump whose comparison has already set the
+ * flags.  cc is the condition under which the jt branch is taken.
+ */
+static void emit_cond_jump(struct jit_state *js, u_int i, const struct bpf_insn *pc, u_char cc)
+{
+    u_int jt = i + 1 + pc->jt;
+    u_int jf = i + 1 + pc->jf;
+
+    if (pc->jt == pc->jf)
+    {
+        if (pc->jt != 0)
+            emit_jmp(js, jt);
+    }
+    else if (pc->jt == 0)
+        emit_jcc(js, cc ^ 1, jf);
+    else
+    {
+        emit_jcc(js, cc, jt);
+        if (pc->jf != 0)
+            emit_jmp(js, jf);
+    }
+}
+
+static int jit_emit_insn(struct jit_state *js, u_int i, const struct bpf_insn *pc)
+{
+    switch (pc->code)
+    {
+        case BPF_RET | BPF_K:
+            emit1(js, 0xb8);                        /* mov eax, k */
+            emit_u32(js, pc->k);
+            emit1(js, 0xc3);                        /* ret */
+            break;
+
+        case BPF_RET | BPF_A:
+            emit1(js, 0xc3);                        /* ret */
+            break;
+
+        case BPF_LD | BPF_W | BPF_ABS:
+        case BPF_LD | BPF_H | BPF_ABS:
+        case BPF_LD | BPF_B | BPF_ABS:
+            if ((int) pc->k < 0)
+                return emit_aux_load(js, (int) pc->k);
+            emit1(js, 0xb9);                        /* mov ecx, k */
+            emit_u32(js, pc->k);
+            emit_packet_load(js, jit_load_size(pc->code));
+            break;
+
+        case BPF_LD | BPF_W | BPF_IND:
+        case BPF_LD | BPF_H | BPF_IND:
+        case BPF_LD | BPF_B | BPF_IND:
+            emit3(js, 0x41, 0x8d, 0x89);            /* lea ecx, [r9 + k] */
+            emit_u32(js, pc->k);
+            emit_packet_load(js, jit_load_size(pc->code));
+            break;
+
+        case BPF_LD | BPF_W | BPF_LEN:
+            emit2(js, 0x89, 0xf0);                  /* mov eax, esi */
+            break;
+
+        case BPF_LDX | BPF_W | BPF_LEN:
+            emit3(js, 0x41, 0x89, 0xf1);            /* mov r9d, esi */
+            break;
+
+        case BPF_LD | BPF_IMM:
+            emit1(js, 0xb8);                        /* mov eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_LDX | BPF_IMM:
+            emit2(js, 0x41, 0xb9);                  /* mov r9d, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_LDX | BPF_MSH | BPF_B:
+            emit1(js, 0xb9);                        /* mov ecx, k */
+            emit_u32(js, pc->k);
+            emit4(js, 0x48, 0x8d, 0x51, 0x01);      /* lea rdx, [rcx + 1] */
+            emit3(js, 0x49, 0x39, 0xd2);            /* cmp r10, rdx */
+            emit_jcc(js, JCC_B, JIT_FIXUP_RET0);
+            emit4(js, 0x0f, 0xb6, 0x14, 0x0f);      /* movzx edx, byte [rdi + rcx] */
+            emit3(js, 0x83, 0xe2, 0x0f);            /* and edx, 0xf */
+            emit3(js, 0xc1, 0xe2, 0x02);            /* shl edx, 2 */
+            emit3(js, 0x41, 0x89, 0xd1);            /* mov r9d, edx */
+            break;
+
+        case BPF_LD | BPF_MEM:
+            emit4(js, 0x8b, 0x44, 0x24, JIT_MEM_DISP(pc->k));          /* mov eax, [rsp + d] */
+            break;
+
+        case BPF_LDX | BPF_MEM:
+            emit4(js, 0x44, 0x8b, 0x4c, 0x24);      /* mov r9d, [rsp + d] */
+            emit1(js, JIT_MEM_DISP(pc->k));
+            break;
+
+        case BPF_ST:
+            emit4(js, 0x89, 0x44, 0x24, JIT_MEM_DISP(pc->k));          /* mov [rsp + d], eax */
+            break;
+
+        case BPF_STX:
+            emit4(js, 0x44, 0x89, 0x4c, 0x24);      /* mov [rsp + d], r9d */
+            emit1(js, JIT_MEM_DISP(pc->k));
+            break;
+
+        case BPF_JMP | BPF_JA:
+            /* Validation lets the offset wrap, so follow it modulo 2^32. */
+            emit_jmp(js, i + 1 + pc->k);
+            break;
+
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_K:
+            emit1(js, 0x3d);                        /* cmp eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_JMP | BPF_JSET | BPF_K:
+            emit1(js, 0xa9);                        /* test eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+            emit3(js, 0x44, 0x39, 0xc8);            /* cmp eax, r9d */
+            break;
+
+        case BPF_JMP | BPF_JSET | BPF_X:
+            emit3(js, 0x44, 0x85, 0xc8);            /* test eax, r9d */
+            break;
+
+        case BPF_ALU | BPF_ADD | BPF_X:
+            emit3(js, 0x44, 0x01, 0xc8);            /* add eax, r9d */
+            break;
+
+        case BPF_ALU | BPF_SUB | BPF_X:
+            emit3(js, 0x44, 0x29, 0xc8);            /* sub eax, r9d */
+            break;
+
+        case BPF_ALU | BPF_MUL | BPF_X:
+            emit4(js, 0x41, 0x0f, 0xaf, 0xc1);      /* imul eax, r9d */
+            break;
+
+        case BPF_ALU | BPF_DIV | BPF_X:
+            emit3(js, 0x45, 0x85, 0xc9);            /* test r9d, r9d */
+            emit_jcc(js, JCC_E, JIT_FIXUP_RET0);
+            emit2(js, 0x31, 0xd2);                  /* xor edx, edx */
+            emit3(js, 0x41, 0xf7, 0xf1);            /* div r9d */
+            break;
+
+        case BPF_ALU | BPF_AND | BPF_X:
+            emit3(js, 0x44, 0x21, 0xc8);            /* and eax, r9d */
+            break;
+
+        case BPF_ALU | BPF_OR | BPF_X:
+            emit3(js, 0x44, 0x09, 0xc8);            /* or eax, r9d */
+            break;
+
+        case BPF_ALU | BPF_LSH | BPF_X:
+            emit3(js, 0x44, 0x89, 0xc9);            /* mov ecx, r9d */
+            emit2(js, 0xd3, 0xe0);                  /* shl eax, cl */
+            break;
+
+        case BPF_ALU | BPF_RSH | BPF_X:
+            emit3(js, 0x44, 0x89, 0xc9);            /* mov ecx, r9d */
+            emit2(js, 0xd3, 0xe8);                  /* shr eax, cl */
+            break;
+
+        case BPF_ALU | BPF_ADD | BPF_K:
+            emit1(js, 0x05);                        /* add eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_ALU | BPF_SUB | BPF_K:
+            emit1(js, 0x2d);                        /* sub eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_ALU | BPF_MUL | BPF_K:
+            emit2(js, 0x69, 0xc0);                  /* imul eax, eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_ALU | BPF_DIV | BPF_K:
+            if (pc->k == 0)
+            {
+                emit_jmp(js, JIT_FIXUP_RET0);
+                break;
+            }
+            emit2(js, 0x31, 0xd2);                  /* xor edx, edx */
+            emit1(js, 0xb9);                        /* mov ecx, k */
+            emit_u32(js, pc->k);
+            emit2(js, 0xf7, 0xf1);                  /* div ecx */
+            break;
+
+        case BPF_ALU | BPF_AND | BPF_K:
+            emit1(js, 0x25);                        /* and eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_ALU | BPF_OR | BPF_K:
+            emit1(js, 0x0d);                        /* or eax, k */
+            emit_u32(js, pc->k);
+            break;
+
+        case BPF_ALU | BPF_LSH | BPF_K:
+            emit3(js, 0xc1, 0xe0, (u_char) pc->k);  /* shl eax, k */
+            break;
+
+        case BPF_ALU | BPF_RSH | BPF_K:
+            emit3(js, 0xc1, 0xe8, (u_char) pc->k);  /* shr eax, k */
+            break;
+
+        case BPF_ALU | BPF_NEG:
+            emit2(js, 0xf7, 0xd8);                  /* neg eax */
+            break;
+
+        case BPF_MISC | BPF_TAX:
+            emit3(js, 0x41, 0x89, 0xc1);            /* mov r9d, eax */
+            break;
+
+        case BPF_MISC | BPF_TXA:
+            emit3(js, 0x44, 0x89, 0xc8);            /* mov eax, r9d */
+            break;
+
+        case BPF_MISC | BPF_LOOKUP:
+            emit_lookup(js, js->tables[pc->k]);
+            break;
+
+        default:
+            return -1;
+    }
+
+    switch (pc->code)
+    {
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_X:
+            emit_cond_jump(js, i, pc, JCC_A);
+            break;
+
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_X:
+            emit_cond_jump(js, i, pc, JCC_AE);
+            break;
+
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+            emit_cond_jump(js, i, pc, JCC_E);
+            break;
+
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_X:
+            emit_cond_jump(js, i, pc, JCC_NE);
+            break;
+    }
+    return 0;
+}
+
+/*
+ * Generate the machine code for the program into a fresh mapping and make
+ * it executable.  Returns -1 (leaving the program to the interpreter) if an
+ * instruction can't be translated or the mapping can't be made executable.
+ */
+static int jit_generate(struct bpf_jit_program *jit)
+{
+    struct jit_state js;
+    u_int *offsets;
+    size_t size;
+    u_int i, ret0;
+
+    size = (size_t) jit->len * JIT_MAX_INSN_SIZE + 16;
+    js.buf = malloc(size);
+    js.fixups = calloc(jit->len * 2 + 1, sizeof(struct jit_fixup));
+    offsets = calloc(jit->len, sizeof(u_int));
+    js.pos = 0;
+    js.nfixups = 0;
+    js.tables = jit->tables;
+    if (!js.buf || !js.fixups || !offsets)
+        goto fail;
+
+    emit3(&js, 0x41, 0x89, 0xd2);                   /* mov r10d, edx */
+    emit3(&js, 0x49, 0x89, 0xcb);                   /* mov r11, rcx */
+    emit2(&js, 0x31, 0xc0);                         /* xor eax, eax */
+    emit3(&js, 0x45, 0x31, 0xc9);                   /* xor r9d, r9d */
+
+    for (i = 0; i < jit->len; i++)
+    {
+        offsets[i] = js.pos;
+        if (jit_emit_insn(&js, i, &jit->insns[i]) < 0)
+            goto fail;
+    }
+
+    ret0 = js.pos;
+    emit2(&js, 0x31, 0xc0);                         /* xor eax, eax */
+    emit1(&js, 0xc3);                               /* ret */
+
+    for (i = 0; i < js.nfixups; i++)
+    {
+        u_int target = js.fixups[i].target;
+        bpf_int32 rel;
+
+        if (target == JIT_FIXUP_RET0)
+            rel = ret0 - (js.fixups[i].pos + 4);
+        else if (target < jit->len)
+            rel = offsets[target] - (js.fixups[i].pos + 4);
+        else
+            goto fail;
+        memcpy(js.buf + js.fixups[i].pos, &rel, sizeof(rel));
+    }
+
+    jit->image_size = js.pos;
+    jit->image = mmap(NULL, jit->image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->image == MAP_FAILED)
+    {
+        jit->image = NULL;
+        goto fail;
+    }
+    memcpy(jit->image, js.buf, jit->image_size);
+    if (mprotect(jit->image, jit->image_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(jit->image, jit->image_size);
+        jit->image = NULL;
+        goto fail;
+    }
+    /* ISO C can't cast an object pointer to a function pointer; copy it. */
+    memcpy(&jit->func, &jit->image, sizeof(jit->func));
+
+    free(offsets);
+    free(js.fixups);
+    free(js.buf);
+    return 0;
+
+fail:
+    free(offsets);
+    free(js.fixups);
+    free(js.buf);
+    return -1;
+}
+
+#endif /* BPF_JIT_X86_64 */
+
+#if defined(__GNUC__)
+#define BPF_PREFETCH(p)     __builtin_prefetch(p)
+#else
+#define BPF_PREFETCH(p)
+#endif
+
+/* Number of packets ahead of the current one to prefetch in a burst. */
+#define BURST_PREFETCH      4
+
+/*
+ * Prepare a program for sfbpf_filter_jit().  The instructions are copied
+ * and its lookup tables referenced, so the caller may free the program
+ * afterward.  Returns NULL if the program fails validation or memory runs
+ * out.
+ */
+DAQ_SO_PUBLIC struct bpf_jit_program *bpf_jit_compile(const struct bpf_program *program)
+{
+    struct bpf_jit_program *jit;
+    u_int i;
+
+    if (!program || !program->bf_insns ||
+        !bpf_validate_tables(program->bf_insns, program->bf_len, program->bf_tables ? program->bf_ntables : 0))
+        return NULL;
+
+    jit = calloc(1, sizeof(struct bpf_jit_program));
+    if (!jit)
+        return NULL;
+
+    jit->len = program->bf_len;
+    jit->insns = malloc(jit->len * sizeof(struct bpf_insn));
+    if (!jit->insns)
+    {
+        free(jit);
+        return NULL;
+    }
+    memcpy(jit->insns, program->bf_insns, jit->len * sizeof(struct bpf_insn));
+
+    if (program->bf_tables && program->bf_ntables)
+    {
+        jit->tables = malloc(program->bf_ntables * sizeof(struct bpf_table *));
+        if (!jit->tables)
+        {
+            free(jit->insns);
+            free(jit);
+            return NULL;
+        }
+        jit->ntables = program->bf_ntables;
+        for (i = 0; i < jit->ntables; i++)
+            jit->tables[i] = bpf_table_ref(program->bf_tables[i]);
+    }
+
+#ifdef BPF_JIT_X86_64
+    if (!getenv("SFBPF_NO_JIT") && jit_generate(jit) == 0)
+        return jit;
+#endif
+
+    /* Without native code, fall back on the pre-decoded interpreter if possible. */
+    jit->decoded = bpf_decode(jit->insns, jit->len);
+
+    return jit;
+}
+
+/*
+ * Returns nonzero if the program is run as native code rather than by the
+ * interpreter.
+ */
+DAQ_SO_PUBLIC int bpf_jit_native(const struct bpf_jit_program *jit)
+{
+    return (jit && jit->func);
+}
+
+DAQ_SO_PUBLIC u_int bpf_filter_jit_with_aux_data(const struct bpf_jit_program *jit, const u_char *p,
+                                                 u_int wirelen, u_int buflen,
+                                                 const struct bpf_aux_data *aux_data)
+{
+    if (jit->func)
+        return jit->func(p, wirelen, buflen, aux_data);
+    if (jit->decoded)
+        return bpf_filter_decoded(jit->decoded, jit->tables, p, wirelen, buflen, aux_data);
+    return bpf_filter_tables(jit->insns, jit->tables, p, wirelen, buflen, aux_data);
+}
+
+DAQ_SO_PUBLIC u_int bpf_filter_jit(const struct bpf_jit_program *jit, const u_char *p,
+                                   u_int wirelen, u_int buflen)
+{
+    return bpf_filter_jit_with_aux_data(jit, p, wirelen, buflen, NULL);
+}
+
+/*
+ * Filter a burst of n packets, storing each packet's result in results[] and
+ * returning the number accepted.  aux_data, if not NULL, holds the ancillary
+ * data of each packet; without it, programs that read ancillary data reject
+ * every packet.
+ *
+ * The program is run to completion on one packet after another rather than
+ * an instruction at a time across the burst: the native code a program is
+ * compiled to already costs less per packet than stepping many packets
+ * through an interpreter together would.  What the burst saves is choosing
+ * how to run the program once for all the packets, and the wait for their
+ * headers, the next few of which are prefetched while one is filtered.
+ */
+DAQ_SO_PUBLIC u_int bpf_filter_burst(const struct bpf_jit_program *jit, const u_char **pkts,
+                                     const u_int *wirelens, const u_int *buflens,
+                                     const struct bpf_aux_data *aux_data, u_int n, u_int *results)
+{
+    u_int i, accepted = 0;
+
+    for (i = 0; i < n && i < BURST_PREFETCH; i++)
+        BPF_PREFETCH(pkts[i]);
+
+    if (jit->func)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (i + BURST_PREFETCH < n)
+                BPF_PREFETCH(pkts[i + BURST_PREFETCH]);
+            results[i] = jit->func(pkts[i], wirelens[i], buflens[i], aux_data ? &aux_data[i] : NULL);
+            accepted += (results[i] != 0);
+        }
+    }
+    else if (jit->decoded)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (i + BURST_PREFETCH < n)
+                BPF_PREFETCH(pkts[i + BURST_PREFETCH]);
+            results[i] = bpf_filter_decoded(jit->decoded, jit->tables, pkts[i], wirelens[i], buflens[i],
+                                            aux_data ? &aux_data[i] : NULL);
+            accepted += (results[i] != 0);
+        }
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (i + BURST_PREFETCH < n)
+                BPF_PREFETCH(pkts[i + BURST_PREFETCH]);
+            results[i] = bpf_filter_tables(jit->insns, jit->tables, pkts[i], wirelens[i], buflens[i],
+                                           aux_data ? &aux_data[i] : NULL);
+            accepted += (results[i] != 0);
+        }
+    }
+
+    return accepted;
+}
+
+DAQ_SO_PUBLIC void bpf_jit_free(struct bpf_jit_program *jit)
+{
+    u_int i;
+
+    if (!jit)
+        return;
+#ifdef BPF_JIT_X86_64
+    if (jit->image)
+        munmap(jit->image, jit->image_size);
+#endif
+    for (i = 0; i < jit->ntables; i++)
+        bpf_table_unref(jit->tables[i]);
+    free(jit->tables);
+    free(jit->decoded);
+    free(jit->insns);
+    free(jit);
+}
@@ -100,6 +100,7 @@ static struct entry rvals[] = {
 static struct entry misc_ops[] = {
     { BPF_TAX, "TAX"},
     { BPF_TXA, "TXA"},
+    { BPF_LOOKUP, "LOOKUP"},
     { 0,       NULL }
 };
 
@@ -299,6 +300,9 @@ static void print_misc(struct bpf_insn *inst)
         case BPF_TXA:
             printf("A <- X");
             break;
+        case BPF_LOOKUP:
+            printf("A <- lookup table %d", inst->k);
+            break;
         default:
             printf("???");
             break;
@@ -0,0 +1,635 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+ * Lookup tables for filter programs.
+ *
+ * "host in {...}", "net in {...}" and "port in {...}" compile to a load of
+ * the field followed by a BPF_MISC|BPF_LOOKUP instruction naming one of the
+ * program's tables, so the cost of the test doesn't grow with the list.
+ *
+ * Exact-match tables are open-addressed hash sets with linear probing, kept
+ * at most half full.  An all-zero slot is empty, so whether the all-zero key
+ * is itself a member is recorded separately.
+ *
+ * Prefix tables are multibit tries in the style of DIR-24-8, with a root
+ * indexed by the first 16 bits of the address and 256-entry nodes for each
+ * further byte, so an IPv4 lookup takes at most three reads and an IPv6 one
+ * at most fifteen.  Each prefix is expanded to all the entries it covers at
+ * the level where it ends.  A filter only asks whether some prefix covers
+ * the address, not which, so an entry covered by a shorter prefix is simply
+ * a hit and anything below it is never consulted.
+ *
+ * Tables are immutable once the compiler has filled them in, and reference
+ * counted so that a program and the handles prepared from it can share them.
+ * The compiler also interns them, so instances that compile the same sets
+ * share one read-only copy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "sfbpf-int.h"
+
+struct bpf_table
+{
+    u_int refcnt;
+    u_int type;                 /* BPF_TABLE_* */
+    u_int key_len;              /* 4 or 16 */
+    u_int count;                /* Keys or prefixes inserted */
+    int interned;               /* On the intern list */
+    struct bpf_table *next;     /* Next on the intern list */
+
+    /* Hash sets */
+    u_int mask;                 /* Number of slots - 1 */
+    u_int shift;                /* 32 - log2(number of slots) */
+    int has_zero;               /* The all-zero key is a member */
+    u_char *slots;
+
+    /* Prefix tries */
+    bpf_u_int32 *nodes;         /* Root, then the other nodes */
+    u_int nnodes;               /* Nodes below the root */
+    u_int max_nodes;            /* Nodes allocated below the root */
+};
+
+#define TABLE_MIN_SLOTS     16
+
+/*
+ * A trie entry is a miss, a hit, or 2 + the number of the node below it.
+ */
+#define LPM_MISS            0
+#define LPM_HIT             1
+#define LPM_ROOT_BITS       16
+#define LPM_ROOT_SIZE       (1U << LPM_ROOT_BITS)
+#define LPM_NODE(t, e)      ((t)->nodes + LPM_ROOT_SIZE + ((size_t) (e) - 2) * 256)
+
+#define IS_LPM(t)           ((t)->type == BPF_TABLE_LPM4 || (t)->type == BPF_TABLE_LPM16)
+
+#if defined(__GNUC__)
+#define TABLE_REF(t)        __sync_add_and_fetch(&(t)->refcnt, 1)
+#define TABLE_UNREF(t)      __sync_sub_and_fetch(&(t)->refcnt, 1)
+#define INTERN_LOCK()       while (__sync_lock_test_and_set(&intern_lock, 1))
+#define INTERN_UNLOCK()     __sync_lock_release(&intern_lock)
+#else
+#define TABLE_REF(t)        (++(t)->refcnt)
+#define TABLE_UNREF(t)      (--(t)->refcnt)
+#define INTERN_LOCK()
+#define INTERN_UNLOCK()
+#endif
+
+/* Tables in use by compiled programs, for bpf_table_intern(). */
+static struct bpf_table *intern_list;
+static volatile int intern_lock;
+
+static const u_char zero_key[16];
+
+static inline u_int table_hash(const struct bpf_table *t, const u_char *key)
+{
+    bpf_u_int32 w[4], h;
+
+    if (t->key_len == 4)
+    {
+        memcpy(&h, key, 4);
+    }
+    else
+    {
+        memcpy(w, key, 16);
+        h = (w[0] * 0x85ebca6bU) ^ (w[1] * 0xc2b2ae35U) ^ (w[2] * 0x27d4eb2fU) ^ w[3];
+        h ^= h >> 15;
+    }
+    return (h * 0x9e3779b1U) >> t->shift;
+}
+
+/* Returns the slot holding key, or the empty slot where it would go. */
+static u_char *table_slot(const struct bpf_table *t, const u_char *key)
+{
+    u_int i = table_hash(t, key);
+    u_char *slot;
+
+    for (;; i = (i + 1) & t->mask)
+    {
+        slot = t->slots + (size_t) i * t->key_len;
+        if (!memcmp(slot, key, t->key_len) || !memcmp(slot, zero_key, t->key_len))
+            return slot;
+    }
+}
+
+static int table_resize(struct bpf_table *t, u_int nslots)
+{
+    u_char *old = t->slots;
+    u_int old_nslots = old ? t->mask + 1 : 0;
+    u_int i, bits;
+
+    t->slots = calloc(nslots, t->key_len);
+    if (!t->slots)
+    {
+        t->slots = old;
+        return -1;
+    }
+    for (bits = 0; (1U << bits) < nslots; bits++)
+        ;
+    t->mask = nslots - 1;
+    t->shift = 32 - bits;
+    for (i = 0; i < old_nslots; i++)
+    {
+        const u_char *key = old + (size_t) i * t->key_len;
+
+        if (memcmp(key, zero_key, t->key_len))
+            memcpy(table_slot(t, key), key, t->key_len);
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * Create an empty table of the given type, holding one reference.  Returns
+ * NULL if memory runs out.
+ */
+DAQ_SO_PRIVATE struct bpf_table *bpf_table_new(u_int type)
+{
+    struct bpf_table *t;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->refcnt = 1;
+    t->type = type;
+    t->key_len = (type == BPF_TABLE_HASH16 || type == BPF_TABLE_LPM16) ? 16 : 4;
+    if (IS_LPM(t))
+        t->nodes = calloc(LPM_ROOT_SIZE, sizeof(bpf_u_int32));
+    else
+        table_resize(t, TABLE_MIN_SLOTS);
+    if (!t->nodes && !t->slots)
+    {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void table_free(struct bpf_table *t)
+{
+    free(t->slots);
+    free(t->nodes);
+    free(t);
+}
+
+/* Returns the entry value of a new, empty node, or LPM_MISS if memory runs out. */
+static bpf_u_int32 lpm_new_node(struct bpf_table *t)
+{
+    bpf_u_int32 *nodes;
+    u_int max_nodes;
+
+    if (t->nnodes == t->max_nodes)
+    {
+        max_nodes = t->max_nodes ? 2 * t->max_nodes : 16;
+        nodes = realloc(t->nodes, (LPM_ROOT_SIZE + (size_t) max_nodes * 256) * sizeof(bpf_u_int32));
+        if (!nodes)
+            return LPM_MISS;
+        t->nodes = nodes;
+        t->max_nodes = max_nodes;
+    }
+    t->nnodes++;
+    memset(LPM_NODE(t, t->nnodes + 1), 0, 256 * sizeof(bpf_u_int32));
+    return t->nnodes + 1;
+}
+
+/*
+ * Make an entry and everything below it a hit.  A node already below the
+ * entry is filled with hits rather than cut off, so that every node stays
+ * in use whatever order the prefixes come in: a trie read back from an
+ * image may have no unreachable nodes.
+ */
+static void lpm_fill(struct bpf_table *t, bpf_u_int32 *entry)
+{
+    bpf_u_int32 *node;
+    u_int i;
+
+    if (*entry <= LPM_HIT)
+    {
+        *entry = LPM_HIT;
+        return;
+    }
+    node = LPM_NODE(t, *entry);
+    for (i = 0; i < 256; i++)
+        lpm_fill(t, &node[i]);
+}
+
+static int lpm_insert(struct bpf_table *t, const u_char *key, u_int plen)
+{
+    bpf_u_int32 *node = t->nodes;
+    bpf_u_int32 e;
+    u_int index = (key[0] << 8) | key[1];
+    u_int depth = LPM_ROOT_BITS;      /* Bits of the key consumed at this level */
+    u_int span, i;
+
+    for (;;)
+    {
+        if (plen <= depth)
+        {
+            span = 1U << (depth - plen);
+            index &= ~(span - 1);
+            for (i = 0; i < span; i++)
+                lpm_fill(t, &node[index + i]);
+            return 0;
+        }
+        e = node[index];
+        if (e == LPM_HIT)
+            return 0;
+        if (e == LPM_MISS)
+        {
+            /* The trie may move, so find this entry again afterward. */
+            size_t offset = (node - t->nodes) + index;
+
+            e = lpm_new_node(t);
+            if (e == LPM_MISS)
+                return -1;
+            t->nodes[offset] = e;
+        }
+        node = LPM_NODE(t, e);
+        index = key[depth / 8];
+        depth += 8;
+    }
+}
+
+/*
+ * Add a prefix of plen bits to a prefix table that isn't shared yet.  The
+ * key is in network byte order, and the bits past the prefix are ignored.
+ * Returns -1 if memory runs out.
+ */
+DAQ_SO_PRIVATE int bpf_table_insert_prefix(struct bpf_table *t, const void *key, u_int plen)
+{
+    if (plen > 8 * t->key_len)
+        plen = 8 * t->key_len;
+    if (lpm_insert(t, key, plen) < 0)
+        return -1;
+    t->count++;
+    return 0;
+}
+
+/*
+ * Add a key to a hash table that isn't shared yet.  Four-byte keys are in
+ * host byte order, as A holds them; 16-byte keys are as they appear in the
+ * packet.  Returns -1 if memory runs out.
+ */
+DAQ_SO_PRIVATE int bpf_table_insert(struct bpf_table *t, const void *key)
+{
+    u_char *slot;
+
+    if (!memcmp(key, zero_key, t->key_len))
+    {
+        t->has_zero = 1;
+        return 0;
+    }
+    if (2 * (t->count + 1) > t->mask + 1 && table_resize(t, 2 * (t->mask + 1)) < 0)
+        return -1;
+    slot = table_slot(t, key);
+    if (memcmp(slot, key, t->key_len))
+    {
+        memcpy(slot, key, t->key_len);
+        t->count++;
+    }
+    return 0;
+}
+
+/*
+ * Carry out a BPF_LOOKUP: returns 1 if the key is in the table (or covered
+ * by one of its prefixes) and 0 if not, or -1 if the packet should be
+ * rejected because a 16-byte key at offset a runs past the end of the
+ * captured data.
+ */
+DAQ_SO_PRIVATE int bpf_table_lookup(const struct bpf_table *t, bpf_u_int32 a, const u_char *p, u_int buflen)
+{
+    const u_char *key;
+    bpf_u_int32 e;
+    u_int i;
+
+    if (t->type == BPF_TABLE_HASH4)
+    {
+        const bpf_u_int32 *slots = (const bpf_u_int32 *) t->slots;
+
+        if (a == 0)
+            return t->has_zero;
+        for (i = (a * 0x9e3779b1U) >> t->shift;; i = (i + 1) & t->mask)
+        {
+            if (slots[i] == a)
+                return 1;
+            if (slots[i] == 0)
+                return 0;
+        }
+    }
+
+    if (t->type == BPF_TABLE_LPM4)
+    {
+        e = t->nodes[a >> 16];
+        if (e <= LPM_HIT)
+            return e;
+        e = LPM_NODE(t, e)[(a >> 8) & 0xff];
+        if (e <= LPM_HIT)
+            return e;
+        return LPM_NODE(t, e)[a & 0xff];
+    }
+
+    if (a > buflen || buflen - a < 16)
+        return -1;
+    key = p + a;
+
+    if (t->type == BPF_TABLE_LPM16)
+    {
+        /* Prefixes end by the last byte, so that level holds no nodes. */
+        e = t->nodes[(key[0] << 8) | key[1]];
+        for (i = 2; e > LPM_HIT; i++)
+            e = LPM_NODE(t, e)[key[i]];
+        return e;
+    }
+
+    if (!memcmp(key, zero_key, 16))
+        return t->has_zero;
+    for (i = table_hash(t, key);; i = (i + 1) & t->mask)
+    {
+        const u_char *slot = t->slots + (size_t) i * 16;
+
+        if (!memcmp(slot, key, 16))
+            return 1;
+        if (!memcmp(slot, zero_key, 16))
+            return 0;
+    }
+}
+
+/*
+ * Size in bytes of the keys of a table: 4 for keys taken from A, 16 for
+ * keys read from the packet at offset A.
+ */
+DAQ_SO_PRIVATE u_int bpf_table_key_len(const struct bpf_table *t)
+{
+    return t->key_len;
+}
+
+DAQ_SO_PRIVATE struct bpf_table *bpf_table_ref(struct bpf_table *t)
+{
+    TABLE_REF(t);
+    return t;
+}
+
+DAQ_SO_PRIVATE void bpf_table_unref(struct bpf_table *t)
+{
+    struct bpf_table **pt;
+
+    if (!t)
+        return;
+    if (!t->interned)
+    {
+        if (TABLE_UNREF(t) == 0)
+            table_free(t);
+        return;
+    }
+
+    /* The last reference to an interned table must leave the list before
+        bpf_table_intern() can hand it out again. */
+    INTERN_LOCK();
+    if (TABLE_UNREF(t) == 0)
+    {
+        for (pt = &intern_list; *pt != t; pt = &(*pt)->next)
+            ;
+        *pt = t->next;
+    }
+    else
+        t = NULL;
+    INTERN_UNLOCK();
+    if (t)
+        table_free(t);
+}
+
+static int table_equal(const struct bpf_table *a, const struct bpf_table *b)
+{
+    if (a->type != b->type || a->count != b->count)
+        return 0;
+    if (IS_LPM(a))
+        return (a->nnodes == b->nnodes &&
+                !memcmp(a->nodes, b->nodes, (LPM_ROOT_SIZE + (size_t) a->nnodes * 256) * sizeof(bpf_u_int32)));
+    return (a->mask == b->mask && a->has_zero == b->has_zero &&
+            !memcmp(a->slots, b->slots, (size_t) (a->mask + 1) * a->key_len));
+}
+
+/*
+ * Called with a table the caller has finished filling in.  If an identical
+ * table is already in use, releases this one and returns a reference to
+ * that; otherwise returns this one, which from now on may be shared.
+ */
+DAQ_SO_PRIVATE struct bpf_table *bpf_table_intern(struct bpf_table *t)
+{
+    struct bpf_table *o;
+
+    INTERN_LOCK();
+    for (o = intern_list; o; o = o->next)
+    {
+        if (table_equal(o, t))
+        {
+            TABLE_REF(o);
+            break;
+        }
+    }
+    if (!o)
+    {
+        t->interned = 1;
+        t->next = intern_list;
+        intern_list = t;
+    }
+    INTERN_UNLOCK();
+
+    if (o)
+    {
+        bpf_table_unref(t);
+        return o;
+    }
+    return t;
+}
+
+/*
+ * Table images, for the compiled-filter cache.  An image is the table's own
+ * layout in host byte order: four words giving the type, the number of keys
+ * or prefixes, whether the all-zero key is a member and the number of hash
+ * slots or trie nodes, followed by the slots or the trie.
+ */
+#define TABLE_IMAGE_WORDS   4
+
+/*
+ * Write the image of a table to buf, if not NULL.  Returns its size.
+ */
+DAQ_SO_PRIVATE size_t bpf_table_save(const struct bpf_table *t, u_char *buf)
+{
+    bpf_u_int32 hdr[TABLE_IMAGE_WORDS];
+    size_t size;
+
+    hdr[0] = t->type;
+    hdr[1] = t->count;
+    hdr[2] = t->has_zero;
+    if (IS_LPM(t))
+    {
+        hdr[3] = t->nnodes;
+        size = (LPM_ROOT_SIZE + (size_t) t->nnodes * 256) * sizeof(bpf_u_int32);
+    }
+    else
+    {
+        hdr[3] = t->mask + 1;
+        size = (size_t) (t->mask + 1) * t->key_len;
+    }
+    if (buf)
+    {
+        memcpy(buf, hdr, sizeof(hdr));
+        memcpy(buf + sizeof(hdr), IS_LPM(t) ? (const void *) t->nodes : (const void *) t->slots, size);
+    }
+    return sizeof(hdr) + size;
+}
+
+/*
+ * A hash set read from an image must have an empty slot to end every probe
+ * sequence, and each key must be where a lookup would look for it.
+ */
+static int table_check_hash(struct bpf_table *t)
+{
+    const u_char *slot;
+    u_int i, count = 0;
+
+    for (i = 0; i <= t->mask; i++)
+    {
+        slot = t->slots + (size_t) i * t->key_len;
+        if (!memcmp(slot, zero_key, t->key_len))
+            continue;
+        if (table_slot(t, slot) != slot)
+            return 0;
+        count++;
+    }
+    return count == t->count && 2 * count <= t->mask + 1;
+}
+
+/*
+ * A trie read from an image must be a tree whose nodes each consume one
+ * byte of the key, ending by its last byte.  Nodes are numbered in the
+ * order they were added, so a node's children always come after it.
+ */
+static int table_check_lpm(struct bpf_table *t)
+{
+    const bpf_u_int32 *node;
+    u_char *depth;
+    u_int n, i, child;
+    int ok = 0;
+
+    depth = calloc(t->nnodes ? t->nnodes : 1, sizeof(u_char));
+    if (!depth)
+        return 0;
+    for (i = 0; i < LPM_ROOT_SIZE; i++)
+    {
+        if (t->nodes[i] <= LPM_HIT)
+            continue;
+        child = t->nodes[i] - 2;
+        if (child >= t->nnodes || depth[child])
+            goto done;
+        depth[child] = LPM_ROOT_BITS / 8;
+    }
+    for (n = 0; n < t->nnodes; n++)
+    {
+        if (!depth[n])
+            goto done;
+        node = LPM_NODE(t, n + 2);
+        for (i = 0; i < 256; i++)
+        {
+            if (node[i] <= LPM_HIT)
+                continue;
+            child = node[i] - 2;
+            if (depth[n] + 1U >= t->key_len || child <= n || child >= t->nnodes || depth[child])
+                goto done;
+            depth[child] = depth[n] + 1;
+        }
+    }
+    ok = 1;
+
+done:
+    free(depth);
+    return ok;
+}
+
+/*
+ * Make a table, holding one reference, from an image of at most len bytes
+ * at buf, and set *used to the size of the image.  Returns NULL if the image
+ * is malformed or memory runs out.
+ */
+DAQ_SO_PRIVATE struct bpf_table *bpf_table_restore(const u_char *buf, size_t len, size_t *used)
+{
+    bpf_u_int32 hdr[TABLE_IMAGE_WORDS];
+    struct bpf_table *t;
+    size_t avail, size;
+    u_int bits;
+
+    if (len < sizeof(hdr))
+        return NULL;
+    memcpy(hdr, buf, sizeof(hdr));
+    if (hdr[0] > BPF_TABLE_LPM16)
+        return NULL;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->refcnt = 1;
+    t->type = hdr[0];
+    t->key_len = (t->type == BPF_TABLE_HASH16 || t->type == BPF_TABLE_LPM16) ? 16 : 4;
+    t->count = hdr[1];
+    t->has_zero = (hdr[2] != 0);
+
+    avail = len - sizeof(hdr);
+    if (IS_LPM(t))
+    {
+        if (avail / sizeof(bpf_u_int32) < LPM_ROOT_SIZE ||
+            (avail / sizeof(bpf_u_int32) - LPM_ROOT_SIZE) / 256 < hdr[3])
+            goto fail;
+        t->nnodes = t->max_nodes = hdr[3];
+        size = (LPM_ROOT_SIZE + (size_t) t->nnodes * 256) * sizeof(bpf_u_int32);
+        if (!(t->nodes = malloc(size)))
+            goto fail;
+        memcpy(t->nodes, buf + sizeof(hdr), size);
+        if (!table_check_lpm(t))
+            goto fail;
+    }
+    else
+    {
+        if (hdr[3] < TABLE_MIN_SLOTS || (hdr[3] & (hdr[3] - 1)) || avail / t->key_len < hdr[3])
+            goto fail;
+        for (bits = 0; (1U << bits) < hdr[3]; bits++)
+            ;
+        t->mask = hdr[3] - 1;
+        t->shift = 32 - bits;
+        size = (size_t) hdr[3] * t->key_len;
+        if (!(t->slots = malloc(size)))
+            goto fail;
+        memcpy(t->slots, buf + sizeof(hdr), size);
+        if (!table_check_hash(t))
+            goto fail;
+    }
+    *used = sizeof(hdr) + size;
+    return t;
+
+fail:
+    table_free(t);
+    return NULL;
+}
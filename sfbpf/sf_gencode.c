@@ -113,19 +113,25 @@ static const char rcsid[] =
 #define JMP(c) ((c)|BPF_JMP|BPF_K)
 
 /* Locals */
-static jmp_buf top_ctx;
-static char bpf_error_filter[PCAP_ERRBUF_SIZE + 1];
+static SFBPF_TLS jmp_buf top_ctx;
+static SFBPF_TLS char bpf_error_filter[PCAP_ERRBUF_SIZE + 1];
 
 /* Hack for updating VLAN, MPLS, and PPPoE offsets. */
 #ifdef WIN32
-static u_int orig_linktype = (u_int) - 1, orig_nl = (u_int) - 1, label_stack_depth = (u_int) - 1;
+static SFBPF_TLS u_int orig_linktype = (u_int) - 1, orig_nl = (u_int) - 1, label_stack_depth = (u_int) - 1;
 #else
-static u_int orig_linktype = -1U, orig_nl = -1U, label_stack_depth = -1U;
+static SFBPF_TLS u_int orig_linktype = -1U, orig_nl = -1U, label_stack_depth = -1U;
 #endif
 
+/* Number of "vlan" keywords seen so far in the expression. */
+static SFBPF_TLS u_int vlan_stack_depth;
+
+/* SFBPF_COMPILE_* flags for the current compile. */
+static SFBPF_TLS u_int compile_flags;
+
 /* XXX */
 #ifdef PCAP_FDDIPAD
-static int pcap_fddipad;
+static SFBPF_TLS int pcap_fddipad;
 #endif
 
 /* VARARGS */
@@ -146,7 +152,7 @@ static void init_regs(void);
 static int alloc_reg(void);
 static void free_reg(int);
 
-static struct block *root;
+static SFBPF_TLS struct block *root;
 
 /*
  * Value passed to gen_load_a() to indicate what the offset argument
@@ -171,7 +177,7 @@ enum e_offrel
  * it must be freed with freeaddrinfo().  This variable points to any
  * addrinfo structure that would need to be freed.
  */
-static struct addrinfo *ai;
+static SFBPF_TLS struct addrinfo *ai;
 #endif
 
 /*
@@ -182,16 +188,32 @@ static struct addrinfo *ai;
  *
  * XXX - this *is* in a library....
  */
-#define NCHUNKS 16
+/*
+ * Chunks are chained so that there's no limit on how large an
+ * expression can get; each is twice the size of the one before, up to
+ * CHUNKMAXSIZE, so the number of mallocs stays logarithmic in the size
+ * of small expressions and linear (in large steps) for huge ones.
+ */
 #define CHUNK0SIZE 1024
+#define CHUNKMAXSIZE (1024 * 1024)
 struct chunk
 {
-    u_int n_left;
+    struct chunk *next;
+    size_t size;
+    size_t n_left;
     void *m;
 };
 
-static struct chunk chunks[NCHUNKS];
-static int cur_chunk;
+static SFBPF_TLS struct chunk *chunks;
+
+/*
+ * Lookup tables made for sets in the expression being compiled; they're
+ * handed to the program if it compiles and released if it doesn't.
+ */
+static SFBPF_TLS struct bpf_table **tables;
+static SFBPF_TLS u_int ntables;
+
+static void free_tables(void);
 
 static void *newchunk(u_int);
 static void freechunks(void);
@@ -284,7 +306,6 @@ static void *newchunk(n)
      u_int n;
 {
     struct chunk *cp;
-    int k;
     size_t size;
 
 #ifndef __NetBSD__
@@ -295,20 +316,27 @@ static void *newchunk(n)
     n = ALIGN(n);
 #endif
 
-    cp = &chunks[cur_chunk];
-    if (n > cp->n_left)
+    cp = chunks;
+    if (cp == NULL || n > cp->n_left)
     {
-        ++cp, k = ++cur_chunk;
-        if (k >= NCHUNKS)
+        size = cp == NULL ? CHUNK0SIZE : cp->size;
+        if (size < CHUNKMAXSIZE)
+            size <<= 1;
+        if (size < n)
+            size = n;
+        cp = (struct chunk *) malloc(sizeof(*cp));
+        if (cp == NULL)
             bpf_error("out of memory");
-        size = CHUNK0SIZE << k;
-        cp->m = (void *) malloc(size);
+        cp->m = calloc(1, size);
         if (cp->m == NULL)
+        {
+            free(cp);
             bpf_error("out of memory");
-        memset((char *) cp->m, 0, size);
+        }
+        cp->size = size;
         cp->n_left = size;
-        if (n > size)
-            bpf_error("out of memory");
+        cp->next = chunks;
+        chunks = cp;
     }
     cp->n_left -= n;
     return (void *) ((char *) cp->m + cp->n_left);
@@ -316,15 +344,14 @@ static void *newchunk(n)
 
 static void freechunks()
 {
-    int i;
+    struct chunk *cp;
 
-    cur_chunk = 0;
-    for (i = 0; i < NCHUNKS; ++i)
-        if (chunks[i].m != NULL)
-        {
-            free(chunks[i].m);
-            chunks[i].m = NULL;
-        }
+    while ((cp = chunks) != NULL)
+    {
+        chunks = cp->next;
+        free(cp->m);
+        free(cp);
+    }
 }
 
 /*
@@ -377,19 +404,77 @@ static inline void syntax()
     bpf_error("syntax error in filter expression");
 }
 
-static bpf_u_int32 netmask;
-static int snaplen;
-int no_optimize;
+static SFBPF_TLS bpf_u_int32 netmask;
+static SFBPF_TLS int snaplen;
+SFBPF_TLS int no_optimize;
+
+/*
+ * While compiling a set of filters, the value returned for packets the
+ * one being parsed matches, and where those it doesn't match go.
+ */
+static SFBPF_TLS u_int match_class;
+static SFBPF_TLS struct block *next_filter;
+
+static int compile_filters(int, int, struct bpf_program *, const char **, u_int, int, int, bpf_u_int32, u_int, char *);
 
 DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_program *program, const char *buf, int optimize, bpf_u_int32 mask)
 {
-    extern int n_errors;
-    const char *volatile xbuf = buf;
+    return pcap_compile_flags(snaplen_arg, linktype_arg, program, buf, optimize, mask, 0);
+}
+
+DAQ_SO_PUBLIC int pcap_compile_flags(int snaplen_arg, int linktype_arg, struct bpf_program *program, const char *buf, int optimize, bpf_u_int32 mask, u_int flags)
+{
+    return pcap_compile_errbuf(snaplen_arg, linktype_arg, program, buf, optimize, mask, flags, NULL);
+}
+
+/*
+ * As above, but on failure the reason is copied to errbuf (if not NULL),
+ * which must hold SFBPF_ERRBUF_SIZE bytes.  The scanner and parser belong
+ * to this call and the rest of the compiler state is per thread, so any
+ * number of threads may compile at once.
+ */
+DAQ_SO_PUBLIC int pcap_compile_errbuf(int snaplen_arg, int linktype_arg, struct bpf_program *program, const char *buf, int optimize, bpf_u_int32 mask, u_int flags, char *errbuf)
+{
+    return compile_filters(snaplen_arg, linktype_arg, program, &buf, 1, 0, optimize, mask, flags, errbuf);
+}
+
+/*
+ * Compile n filters into one program that classifies packets: it returns
+ * 1 + the index of the first filter a packet matches, or 0 if it matches
+ * none.  Being one program, tests that the filters have in common are
+ * shared when it's optimized rather than repeated for each of them, but
+ * a load past the end of the packet ends it, so a packet cut short may
+ * go unclassified where a later filter alone would have matched it.  An
+ * error is prefixed with the index of the filter it was found in.
+ */
+DAQ_SO_PUBLIC int pcap_compile_set(int snaplen_arg, int linktype_arg, struct bpf_program *program, const char **filters, u_int n, int optimize, bpf_u_int32 mask, u_int flags, char *errbuf)
+{
+    if (n == 0)
+    {
+        snprintf(bpf_error_filter, PCAP_ERRBUF_SIZE, "no filters to compile");
+        if (errbuf)
+            strlcpy(errbuf, bpf_error_filter, PCAP_ERRBUF_SIZE);
+        return -1;
+    }
+    return compile_filters(snaplen_arg, linktype_arg, program, filters, n, 1, optimize, mask, flags, errbuf);
+}
+
+/*
+ * The filters are parsed last to first, so that each one's rejects can go
+ * to the one after it.
+ */
+static int compile_filters(int snaplen_arg, int linktype_arg, struct bpf_program *program, const char **bufs, u_int n, int classify, int optimize, bpf_u_int32 mask, u_int flags, char *errbuf)
+{
+    void *volatile scanner = NULL;
+    volatile u_int cur = n;
     int len;
+    u_int i;
 
+    compile_flags = flags;
     no_optimize = 0;
     n_errors = 0;
     root = NULL;
+    next_filter = NULL;
     init_regs();
     if (setjmp(top_ctx))
     {
@@ -400,8 +485,20 @@ DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_pro
             ai = NULL;
         }
 #endif
-        lex_cleanup();
+        lex_cleanup(scanner);
+        bpf_optimize_abort();
         freechunks();
+        free_tables();
+        if (classify && cur < n)
+        {
+            /* Room for the prefix and the whole error; strlcpy() cuts it. */
+            char msg[sizeof(bpf_error_filter) + 32];
+
+            snprintf(msg, sizeof(msg), "filter %u: %s", cur, bpf_error_filter);
+            strlcpy(bpf_error_filter, msg, PCAP_ERRBUF_SIZE);
+        }
+        if (errbuf)
+            strlcpy(errbuf, bpf_error_filter, PCAP_ERRBUF_SIZE);
         return (-1);
     }
 
@@ -411,29 +508,56 @@ DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_pro
     if (snaplen == 0)
     {
         snprintf(bpf_error_filter, PCAP_ERRBUF_SIZE, "snaplen of 0 rejects all packets");
+        if (errbuf)
+            strlcpy(errbuf, bpf_error_filter, PCAP_ERRBUF_SIZE);
         return -1;
     }
 
-    lex_init(xbuf ? xbuf : "");
-    init_linktype(linktype_arg);
-    (void) pcap_parse();
+    if (classify)
+        next_filter = gen_retblk(0);
+    while (cur > 0)
+    {
+        cur--;
+        match_class = cur + 1;
 
-    if (n_errors)
-        syntax();
+        /*
+         * "vlan", "mpls" and the like move the offsets for the rest of
+         * an expression, so each filter starts from the link layer's.
+         */
+        init_linktype(linktype_arg);
+
+        scanner = lex_init(bufs[cur] ? bufs[cur] : "");
+        if (scanner == NULL)
+            bpf_error("can't initialize the filter scanner");
+        root = NULL;
+        (void) pcap_parse(scanner);
+        lex_cleanup(scanner);
+        scanner = NULL;
+
+        if (n_errors)
+            syntax();
 
-    if (root == NULL)
-        root = gen_retblk(snaplen);
+        if (root == NULL)
+            root = gen_retblk(classify ? (int) match_class : snaplen);
+        next_filter = classify ? root : NULL;
+    }
+    cur = n;
 
     if (optimize && !no_optimize)
     {
         bpf_optimize(&root);
         if (root == NULL || (root->s.code == (BPF_RET | BPF_K) && root->s.k == 0))
-            bpf_error("expression rejects all packets");
+            bpf_error(classify ? "filters reject all packets" : "expression rejects all packets");
     }
     program->bf_insns = icode_to_fcode(root, &len);
     program->bf_len = len;
+    for (i = 0; i < ntables; i++)
+        tables[i] = bpf_table_intern(tables[i]);
+    program->bf_ntables = ntables;
+    program->bf_tables = tables;
+    ntables = 0;
+    tables = NULL;
 
-    lex_cleanup();
     freechunks();
     return (0);
 }
@@ -444,12 +568,22 @@ DAQ_SO_PUBLIC int pcap_compile(int snaplen_arg, int linktype_arg, struct bpf_pro
  */
 DAQ_SO_PUBLIC void pcap_freecode(struct bpf_program *program)
 {
+    u_int i;
+
     program->bf_len = 0;
     if (program->bf_insns != NULL)
     {
         free((char *) program->bf_insns);
         program->bf_insns = NULL;
     }
+    if (program->bf_tables != NULL)
+    {
+        for (i = 0; i < program->bf_ntables; i++)
+            bpf_table_unref(program->bf_tables[i]);
+        free(program->bf_tables);
+        program->bf_tables = NULL;
+    }
+    program->bf_ntables = 0;
 }
 
 /*
@@ -530,9 +664,18 @@ void finish_parse(p)
     if (ppi_dlt_check != NULL)
         gen_and(ppi_dlt_check, p);
 
-    backpatch(p, gen_retblk(snaplen));
-    p->sense = !p->sense;
-    backpatch(p, gen_retblk(0));
+    if (next_filter != NULL)
+    {
+        backpatch(p, gen_retblk(match_class));
+        p->sense = !p->sense;
+        backpatch(p, next_filter);
+    }
+    else
+    {
+        backpatch(p, gen_retblk(snaplen));
+        p->sense = !p->sense;
+        backpatch(p, gen_retblk(0));
+    }
     root = p->head;
 }
 
@@ -698,7 +841,7 @@ static struct block *gen_ncmp(offrel, offset, size, mask, jtype, reverse, v)
  * (For 802.11 with a variable-length radio header, we have to generate
  * code to compute that offset; off_ll is 0 in that case.)
  */
-static u_int off_ll;
+static SFBPF_TLS u_int off_ll;
 
 /*
  * If there's a variable-length header preceding the link-layer header,
@@ -707,7 +850,7 @@ static u_int off_ll;
  * header from the beginning of the raw packet data.  Otherwise,
  * "reg_off_ll" is -1.
  */
-static int reg_off_ll;
+static SFBPF_TLS int reg_off_ll;
 
 /*
  * This is the offset of the beginning of the MAC-layer header from
@@ -715,7 +858,7 @@ static int reg_off_ll;
  * It's usually 0, except for ATM LANE, where it's the offset, relative
  * to the beginning of the raw packet data, of the Ethernet header.
  */
-static u_int off_mac;
+static SFBPF_TLS u_int off_mac;
 
 /*
  * This is the offset of the beginning of the MAC-layer payload,
@@ -726,13 +869,13 @@ static u_int off_mac;
  * portion of that header), plus any prefix preceding the
  * link-layer header.
  */
-static u_int off_macpl;
+static SFBPF_TLS u_int off_macpl;
 
 /*
  * This is 1 if the offset of the beginning of the MAC-layer payload
  * from the beginning of the link-layer header is variable-length.
  */
-static int off_macpl_is_variable;
+static SFBPF_TLS int off_macpl_is_variable;
 
 /*
  * If the link layer has variable_length headers, "reg_off_macpl"
@@ -741,7 +884,7 @@ static int off_macpl_is_variable;
  * preceding the link-layer header.  Otherwise, "reg_off_macpl"
  * is -1.
  */
-static int reg_off_macpl;
+static SFBPF_TLS int reg_off_macpl;
 
 /*
  * "off_linktype" is the offset to information in the link-layer header
@@ -763,51 +906,51 @@ static int reg_off_macpl;
  *
  * It's set to -1 for no encapsulation, in which case, IP is assumed.
  */
-static u_int off_linktype;
+static SFBPF_TLS u_int off_linktype;
 
 /*
  * TRUE if "pppoes" appeared in the filter; it causes link-layer type
  * checks to check the PPP header, assumed to follow a LAN-style link-
  * layer header and a PPPoE session header.
  */
-static int is_pppoes = 0;
+static SFBPF_TLS int is_pppoes = 0;
 
 /*
  * TRUE if the link layer includes an ATM pseudo-header.
  */
-static int is_atm = 0;
+static SFBPF_TLS int is_atm = 0;
 
 /*
  * TRUE if "lane" appeared in the filter; it causes us to generate
  * code that assumes LANE rather than LLC-encapsulated traffic in SunATM.
  */
-static int is_lane = 0;
+static SFBPF_TLS int is_lane = 0;
 
 /*
  * These are offsets for the ATM pseudo-header.
  */
-static u_int off_vpi;
-static u_int off_vci;
-static u_int off_proto;
+static SFBPF_TLS u_int off_vpi;
+static SFBPF_TLS u_int off_vci;
+static SFBPF_TLS u_int off_proto;
 
 /*
  * These are offsets for the MTP2 fields.
  */
-static u_int off_li;
+static SFBPF_TLS u_int off_li;
 
 /*
  * These are offsets for the MTP3 fields.
  */
-static u_int off_sio;
-static u_int off_opc;
-static u_int off_dpc;
-static u_int off_sls;
+static SFBPF_TLS u_int off_sio;
+static SFBPF_TLS u_int off_opc;
+static SFBPF_TLS u_int off_dpc;
+static SFBPF_TLS u_int off_sls;
 
 /*
  * This is the offset of the first byte after the ATM pseudo_header,
  * or -1 if there is no ATM pseudo-header.
  */
-static u_int off_payload;
+static SFBPF_TLS u_int off_payload;
 
 /*
  * These are offsets to the beginning of the network-layer header.
@@ -833,10 +976,10 @@ static u_int off_payload;
  *	"off_nl_nosnap" is the offset if the packet is an 802.3 packet
  *	with an 802.2 header following it.
  */
-static u_int off_nl;
-static u_int off_nl_nosnap;
+static SFBPF_TLS u_int off_nl;
+static SFBPF_TLS u_int off_nl_nosnap;
 
-static int linktype;
+static SFBPF_TLS int linktype;
 
 static void init_linktype(type)
      int type;
@@ -881,9 +1024,7 @@ static void init_linktype(type)
     orig_linktype = -1;
     orig_nl = -1;
     label_stack_depth = 0;
-
-    reg_off_ll = -1;
-    reg_off_macpl = -1;
+    vlan_stack_depth = 0;
 
     switch (linktype)
     {
@@ -5286,6 +5427,721 @@ static struct block *gen_portrange6(port1, port2, ip_proto, dir)
 }
 #endif /* INET6 */
 
+/*
+ * Sets.  "host in {...}", "net in {...}" and "port in {...}" put the members
+ * into a lookup table, so the field is loaded and tested once however many
+ * there are, where the equivalent "or" chain compiles to a comparison per
+ * member.
+ */
+static u_int new_table(type)
+     u_int type;
+{
+    struct bpf_table **p;
+
+    p = (struct bpf_table **) realloc(tables, (ntables + 1) * sizeof(*p));
+    if (p == NULL)
+        bpf_error("out of memory");
+    tables = p;
+    tables[ntables] = bpf_table_new(type);
+    if (tables[ntables] == NULL)
+        bpf_error("out of memory");
+    return ntables++;
+}
+
+static void table_insert(table, key)
+     u_int table;
+     const void *key;
+{
+    if (bpf_table_insert(tables[table], key) < 0)
+        bpf_error("out of memory");
+}
+
+static void table_insert_prefix(table, key, plen)
+     u_int table;
+     const void *key;
+     u_int plen;
+{
+    if (bpf_table_insert_prefix(tables[table], key, plen) < 0)
+        bpf_error("out of memory");
+}
+
+static void free_tables()
+{
+    u_int i;
+
+    for (i = 0; i < ntables; i++)
+        bpf_table_unref(tables[i]);
+    free(tables);
+    tables = NULL;
+    ntables = 0;
+}
+
+/*
+ * Load a field and test whether its value is in a table of 4-byte keys.
+ */
+static struct block *gen_lookup(offrel, offset, size, table)
+     enum e_offrel offrel;
+     u_int offset, size, table;
+{
+    struct slist *s, *s2;
+    struct block *b;
+
+    s = gen_load_a(offrel, offset, size);
+    s2 = new_stmt(BPF_MISC | BPF_LOOKUP);
+    s2->s.k = table;
+    sappend(s, s2);
+
+    b = new_block(JMP(BPF_JGT));
+    b->stmts = s;
+    b->s.k = 0;
+    return b;
+}
+
+#ifdef INET6
+/*
+ * Test whether the IPv6 address at offset in the network-layer header is
+ * in a table of 16-byte keys.  The lookup is handed the address's offset
+ * in the packet rather than its value.
+ */
+static struct block *gen_lookup6(offset, table)
+     u_int offset, table;
+{
+    struct slist *s, *s2;
+    struct block *b;
+
+    s = gen_off_macpl();
+    if (s != NULL)
+    {
+        s2 = new_stmt(BPF_MISC | BPF_TXA);
+        sappend(s, s2);
+        s2 = new_stmt(BPF_ALU | BPF_ADD | BPF_K);
+        s2->s.k = off_nl + offset;
+        sappend(s, s2);
+    }
+    else
+    {
+        s = new_stmt(BPF_LD | BPF_IMM);
+        s->s.k = off_macpl + off_nl + offset;
+    }
+    s2 = new_stmt(BPF_MISC | BPF_LOOKUP);
+    s2->s.k = table;
+    sappend(s, s2);
+
+    b = new_block(JMP(BPF_JGT));
+    b->stmts = s;
+    b->s.k = 0;
+    return b;
+}
+#endif /* INET6 */
+
+static struct block *gen_hostsetop(table, dir, proto, src_off, dst_off)
+     u_int table;
+     int dir, proto;
+     u_int src_off, dst_off;
+{
+    struct block *b0, *b1;
+    u_int offset;
+
+    switch (dir)
+    {
+
+        case Q_SRC:
+            offset = src_off;
+            break;
+
+        case Q_DST:
+            offset = dst_off;
+            break;
+
+        case Q_AND:
+            b0 = gen_hostsetop(table, Q_SRC, proto, src_off, dst_off);
+            b1 = gen_hostsetop(table, Q_DST, proto, src_off, dst_off);
+            gen_and(b0, b1);
+            return b1;
+
+        case Q_OR:
+        case Q_DEFAULT:
+            b0 = gen_hostsetop(table, Q_SRC, proto, src_off, dst_off);
+            b1 = gen_hostsetop(table, Q_DST, proto, src_off, dst_off);
+            gen_or(b0, b1);
+            return b1;
+
+        default:
+            abort();
+    }
+    b0 = gen_linktype(proto);
+    b1 = gen_lookup(OR_NET, offset, BPF_W, table);
+    gen_and(b0, b1);
+    return b1;
+}
+
+#ifdef INET6
+static struct block *gen_hostsetop6(table, dir, src_off, dst_off)
+     u_int table;
+     int dir;
+     u_int src_off, dst_off;
+{
+    struct block *b0, *b1;
+    u_int offset;
+
+    switch (dir)
+    {
+
+        case Q_SRC:
+            offset = src_off;
+            break;
+
+        case Q_DST:
+            offset = dst_off;
+            break;
+
+        case Q_AND:
+            b0 = gen_hostsetop6(table, Q_SRC, src_off, dst_off);
+            b1 = gen_hostsetop6(table, Q_DST, src_off, dst_off);
+            gen_and(b0, b1);
+            return b1;
+
+        case Q_OR:
+        case Q_DEFAULT:
+            b0 = gen_hostsetop6(table, Q_SRC, src_off, dst_off);
+            b1 = gen_hostsetop6(table, Q_DST, src_off, dst_off);
+            gen_or(b0, b1);
+            return b1;
+
+        default:
+            abort();
+    }
+    /* The lookup reads the packet directly, so check the link type first. */
+    b0 = gen_linktype(ETHERTYPE_IPV6);
+    b1 = gen_lookup6(offset, table);
+    gen_and(b0, b1);
+    return b1;
+}
+#endif /* INET6 */
+
+static struct block *gen_hostset4(table, proto, dir)
+     u_int table;
+     int proto, dir;
+{
+    struct block *b0, *b1;
+
+    switch (proto)
+    {
+
+        case Q_DEFAULT:
+            b0 = gen_hostset4(table, Q_IP, dir);
+            /* As in gen_host(), no ARP or RARP inside MPLS. */
+            if (label_stack_depth == 0)
+            {
+                b1 = gen_hostset4(table, Q_ARP, dir);
+                gen_or(b0, b1);
+                b0 = gen_hostset4(table, Q_RARP, dir);
+                gen_or(b1, b0);
+            }
+            return b0;
+
+        case Q_IP:
+            return gen_hostsetop(table, dir, ETHERTYPE_IP, 12, 16);
+
+        case Q_RARP:
+            return gen_hostsetop(table, dir, ETHERTYPE_REVARP, 14, 24);
+
+        case Q_ARP:
+            return gen_hostsetop(table, dir, ETHERTYPE_ARP, 14, 24);
+
+        default:
+            abort();
+    }
+    /* NOTREACHED */
+}
+
+/*
+ * Test the addresses selected by proto and dir against t4 and/or t6, the
+ * tables of IPv4 and IPv6 members (-1 if there are none).
+ */
+static struct block *gen_addrset(t4, t6, proto, dir)
+     int t4, t6;
+     int proto, dir;
+{
+    struct block *b;
+#ifdef INET6
+    struct block *tmp;
+#endif
+
+    b = NULL;
+    if (t4 >= 0)
+        b = gen_hostset4(t4, proto, dir);
+#ifdef INET6
+    if (t6 >= 0)
+    {
+        tmp = gen_hostsetop6(t6, dir, 8, 24);
+        if (b)
+            gen_or(b, tmp);
+        b = tmp;
+    }
+#endif
+    return b;
+}
+
+static struct block *gen_hostset(list, proto, dir)
+     struct set_elem *list;
+     int proto, dir;
+{
+    struct set_elem *e;
+    int t4 = -1;
+    int want4, want6;
+    bpf_u_int32 v;
+#ifndef INET6
+    bpf_u_int32 **alist;
+#else
+    int t6 = -1;
+    struct addrinfo *res, *res0;
+    int found;
+#endif
+
+    want4 = (proto == Q_DEFAULT || proto == Q_IP || proto == Q_ARP || proto == Q_RARP);
+    want6 = (proto == Q_DEFAULT || proto == Q_IPV6);
+    if (!want4 && !want6)
+        bpf_error("illegal qualifier of host set");
+
+    for (e = list; e != NULL; e = e->next)
+    {
+        if (e->masklen >= 0)
+            bpf_error("Mask syntax for networks only");
+        switch (e->type)
+        {
+
+            case SET_ELEM_NUM:
+            case SET_ELEM_ADDR:
+                if (!want4)
+                    bpf_error("IPv4 address in ip6 host set");
+                v = e->v;
+                if (e->type == SET_ELEM_ADDR && __pcap_atoin(e->s, &v) != 32)
+                    bpf_error("'%s' is not a complete IPv4 address", e->s);
+                if (t4 < 0)
+                    t4 = new_table(BPF_TABLE_HASH4);
+                table_insert(t4, &v);
+                break;
+
+            case SET_ELEM_ADDR6:
+            case SET_ELEM_NAME:
+#ifndef INET6
+                if (e->type == SET_ELEM_ADDR6)
+                    bpf_error("IPv6 addresses not supported in this configuration");
+                alist = pcap_nametoaddr(e->s);
+                if (alist == NULL || *alist == NULL)
+                    bpf_error("unknown host '%s'", e->s);
+                if (t4 < 0)
+                    t4 = new_table(BPF_TABLE_HASH4);
+                while (*alist)
+                    table_insert(t4, *alist++);
+#else
+                res0 = pcap_nametoaddrinfo(e->s);
+                if (res0 == NULL)
+                    bpf_error("unknown host '%s'", e->s);
+                ai = res0;
+                found = 0;
+                for (res = res0; res; res = res->ai_next)
+                {
+                    if (res->ai_family == AF_INET && want4)
+                    {
+                        v = ntohl(((struct sockaddr_in *) res->ai_addr)->sin_addr.s_addr);
+                        if (t4 < 0)
+                            t4 = new_table(BPF_TABLE_HASH4);
+                        table_insert(t4, &v);
+                        found = 1;
+                    }
+                    else if (res->ai_family == AF_INET6 && want6)
+                    {
+                        if (t6 < 0)
+                            t6 = new_table(BPF_TABLE_HASH16);
+                        table_insert(t6, &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr);
+                        found = 1;
+                    }
+                }
+                ai = NULL;
+                freeaddrinfo(res0);
+                if (!found)
+                    bpf_error("unknown host '%s' for specified address family", e->s);
+#endif /* INET6 */
+                break;
+
+            default:
+                abort();
+        }
+    }
+
+#ifndef INET6
+    return gen_addrset(t4, -1, proto, dir);
+#else
+    return gen_addrset(t4, t6, proto, dir);
+#endif
+}
+
+/*
+ * As with "net", a network number or name short of four bytes is the
+ * network it names, 10 or 10.1 being 10.0.0.0/8 or 10.1.0.0/16.
+ */
+static struct block *gen_netset(list, proto, dir)
+     struct set_elem *list;
+     int proto, dir;
+{
+    struct set_elem *e;
+    int t4 = -1;
+    int want4, want6;
+    bpf_u_int32 v, mask, key;
+    int vlen, plen;
+#ifdef INET6
+    int t6 = -1;
+    struct addrinfo *res;
+    struct in6_addr *addr;
+    bpf_u_int32 *a, m[4];
+    int i;
+#endif
+
+    want4 = (proto == Q_DEFAULT || proto == Q_IP || proto == Q_ARP || proto == Q_RARP);
+    want6 = (proto == Q_DEFAULT || proto == Q_IPV6);
+    if (!want4 && !want6)
+        bpf_error("illegal qualifier of net set");
+
+    for (e = list; e != NULL; e = e->next)
+    {
+        switch (e->type)
+        {
+
+            case SET_ELEM_NUM:
+            case SET_ELEM_NAME:
+            case SET_ELEM_ADDR:
+                if (!want4)
+                    bpf_error("IPv4 network in ip6 net set");
+                if (e->type == SET_ELEM_ADDR)
+                {
+                    vlen = __pcap_atoin(e->s, &v);
+                    v <<= 32 - vlen;
+                }
+                else
+                {
+                    if (e->type == SET_ELEM_NUM)
+                        v = e->v;
+                    else if ((v = pcap_nametonetaddr(e->s)) == 0)
+                        bpf_error("unknown network '%s'", e->s);
+                    for (vlen = 32; v && (v & 0xff000000) == 0; vlen -= 8)
+                        v <<= 8;
+                }
+                plen = vlen;
+                if (e->masklen >= 0)
+                {
+                    if (e->masklen > 32)
+                        bpf_error("mask length must be <= 32");
+                    plen = e->masklen;
+                    mask = plen ? 0xffffffff << (32 - plen) : 0;
+                    if ((v & ~mask) != 0)
+                        bpf_error("non-network bits set in \"%s/%d\"", e->s, plen);
+                }
+                if (t4 < 0)
+                    t4 = new_table(BPF_TABLE_LPM4);
+                key = htonl(v);
+                table_insert_prefix(t4, &key, plen);
+                break;
+
+            case SET_ELEM_ADDR6:
+#ifndef INET6
+                bpf_error("IPv6 addresses not supported in this configuration");
+#else
+                if (!want6)
+                    bpf_error("IPv6 network in ip4 net set");
+                plen = (e->masklen >= 0) ? e->masklen : 128;
+                if (plen > 128)
+                    bpf_error("mask length must be <= 128");
+                res = pcap_nametoaddrinfo(e->s);
+                if (res == NULL)
+                    bpf_error("invalid ip6 address %s", e->s);
+                ai = res;
+                if (res->ai_next)
+                    bpf_error("%s resolved to multiple address", e->s);
+                addr = &((struct sockaddr_in6 *) res->ai_addr)->sin6_addr;
+
+                memset(m, 0, sizeof(m));
+                for (i = 0; i < plen; i += 32)
+                    m[i / 32] = htonl((plen - i) >= 32 ? 0xffffffff : (0xffffffff << (32 - (plen - i))));
+                a = (bpf_u_int32 *) addr;
+                if ((a[0] & ~m[0]) || (a[1] & ~m[1]) || (a[2] & ~m[2]) || (a[3] & ~m[3]))
+                    bpf_error("non-network bits set in \"%s/%d\"", e->s, plen);
+                if (t6 < 0)
+                    t6 = new_table(BPF_TABLE_LPM16);
+                table_insert_prefix(t6, addr, plen);
+                ai = NULL;
+                freeaddrinfo(res);
+#endif /* INET6 */
+                break;
+
+            default:
+                abort();
+        }
+    }
+
+#ifndef INET6
+    return gen_addrset(t4, -1, proto, dir);
+#else
+    return gen_addrset(t4, t6, proto, dir);
+#endif
+}
+
+static struct block *gen_portsetop(table, proto, dir)
+     u_int table;
+     int proto, dir;
+{
+    struct block *b0, *b1, *tmp;
+
+    /* ip proto 'proto' */
+    tmp = gen_cmp(OR_NET, 9, BPF_B, (bpf_int32) proto);
+    b0 = gen_ipfrag();
+    gen_and(tmp, b0);
+
+    switch (dir)
+    {
+        case Q_SRC:
+            b1 = gen_lookup(OR_TRAN_IPV4, 0, BPF_H, table);
+            break;
+
+        case Q_DST:
+            b1 = gen_lookup(OR_TRAN_IPV4, 2, BPF_H, table);
+            break;
+
+        case Q_OR:
+        case Q_DEFAULT:
+            tmp = gen_lookup(OR_TRAN_IPV4, 0, BPF_H, table);
+            b1 = gen_lookup(OR_TRAN_IPV4, 2, BPF_H, table);
+            gen_or(tmp, b1);
+            break;
+
+        case Q_AND:
+            tmp = gen_lookup(OR_TRAN_IPV4, 0, BPF_H, table);
+            b1 = gen_lookup(OR_TRAN_IPV4, 2, BPF_H, table);
+            gen_and(tmp, b1);
+            break;
+
+        default:
+            abort();
+    }
+    gen_and(b0, b1);
+
+    return b1;
+}
+
+#ifdef INET6
+static struct block *gen_portsetop6(table, proto, dir)
+     u_int table;
+     int proto, dir;
+{
+    struct block *b0, *b1, *tmp;
+
+    /* ip6 proto 'proto' */
+    b0 = gen_cmp(OR_NET, 6, BPF_B, (bpf_int32) proto);
+
+    switch (dir)
+    {
+        case Q_SRC:
+            b1 = gen_lookup(OR_TRAN_IPV6, 0, BPF_H, table);
+            break;
+
+        case Q_DST:
+            b1 = gen_lookup(OR_TRAN_IPV6, 2, BPF_H, table);
+            break;
+
+        case Q_OR:
+        case Q_DEFAULT:
+            tmp = gen_lookup(OR_TRAN_IPV6, 0, BPF_H, table);
+            b1 = gen_lookup(OR_TRAN_IPV6, 2, BPF_H, table);
+            gen_or(tmp, b1);
+            break;
+
+        case Q_AND:
+            tmp = gen_lookup(OR_TRAN_IPV6, 0, BPF_H, table);
+            b1 = gen_lookup(OR_TRAN_IPV6, 2, BPF_H, table);
+            gen_and(tmp, b1);
+            break;
+
+        default:
+            abort();
+    }
+    gen_and(b0, b1);
+
+    return b1;
+}
+#endif /* INET6 */
+
+static struct block *gen_porttable(table, ip_proto, dir)
+     u_int table;
+     int ip_proto, dir;
+{
+    struct block *b0, *b1, *tmp;
+
+    b0 = gen_linktype(ETHERTYPE_IP);
+
+    switch (ip_proto)
+    {
+        case IPPROTO_UDP:
+        case IPPROTO_TCP:
+        case IPPROTO_SCTP:
+            b1 = gen_portsetop(table, ip_proto, dir);
+            break;
+
+        case PROTO_UNDEF:
+            tmp = gen_portsetop(table, IPPROTO_TCP, dir);
+            b1 = gen_portsetop(table, IPPROTO_UDP, dir);
+            gen_or(tmp, b1);
+            tmp = gen_portsetop(table, IPPROTO_SCTP, dir);
+            gen_or(tmp, b1);
+            break;
+
+        default:
+            abort();
+    }
+    gen_and(b0, b1);
+    return b1;
+}
+
+#ifdef INET6
+static struct block *gen_porttable6(table, ip_proto, dir)
+     u_int table;
+     int ip_proto, dir;
+{
+    struct block *b0, *b1, *tmp;
+
+    b0 = gen_linktype(ETHERTYPE_IPV6);
+
+    switch (ip_proto)
+    {
+        case IPPROTO_UDP:
+        case IPPROTO_TCP:
+        case IPPROTO_SCTP:
+            b1 = gen_portsetop6(table, ip_proto, dir);
+            break;
+
+        case PROTO_UNDEF:
+            tmp = gen_portsetop6(table, IPPROTO_TCP, dir);
+            b1 = gen_portsetop6(table, IPPROTO_UDP, dir);
+            gen_or(tmp, b1);
+            tmp = gen_portsetop6(table, IPPROTO_SCTP, dir);
+            gen_or(tmp, b1);
+            break;
+
+        default:
+            abort();
+    }
+    gen_and(b0, b1);
+    return b1;
+}
+#endif /* INET6 */
+
+/*
+ * Named ports stand for their number whatever protocol the name belongs
+ * to, but must not contradict an explicit tcp, udp or sctp qualifier.
+ */
+static struct block *gen_portset(list, proto, dir)
+     struct set_elem *list;
+     int proto, dir;
+{
+    struct set_elem *e;
+    u_int table;
+    bpf_u_int32 v;
+    int port, real_proto;
+#ifdef INET6
+    struct block *b;
+#endif
+
+    if (proto == Q_UDP)
+        proto = IPPROTO_UDP;
+    else if (proto == Q_TCP)
+        proto = IPPROTO_TCP;
+    else if (proto == Q_SCTP)
+        proto = IPPROTO_SCTP;
+    else if (proto == Q_DEFAULT)
+        proto = PROTO_UNDEF;
+    else
+        bpf_error("illegal qualifier of 'port'");
+
+    table = new_table(BPF_TABLE_HASH4);
+    for (e = list; e != NULL; e = e->next)
+    {
+        switch (e->type)
+        {
+
+            case SET_ELEM_NUM:
+                if (e->v > 65535)
+                    bpf_error("illegal port number %u > 65535", e->v);
+                v = e->v;
+                break;
+
+            case SET_ELEM_NAME:
+                if (pcap_nametoport(e->s, &port, &real_proto) == 0)
+                    bpf_error("unknown port '%s'", e->s);
+                if (proto != PROTO_UNDEF && real_proto != PROTO_UNDEF && real_proto != proto)
+                    bpf_error("port '%s' is %s", e->s, real_proto == IPPROTO_TCP ? "tcp" :
+                              (real_proto == IPPROTO_UDP ? "udp" : "sctp"));
+                v = port;
+                break;
+
+            default:
+                bpf_error("'%s' is not a port", e->s);
+        }
+        table_insert(table, &v);
+    }
+
+#ifndef INET6
+    return gen_porttable(table, proto, dir);
+#else
+    b = gen_porttable(table, proto, dir);
+    gen_or(gen_porttable6(table, proto, dir), b);
+    return b;
+#endif /* INET6 */
+}
+
+/*
+ * Make one member of a set for the parser; masklen is -1 unless the member
+ * was written as a network with a mask length.
+ */
+struct set_elem *gen_set_elem(type, s, v, masklen)
+     int type;
+     const char *s;
+     bpf_u_int32 v;
+     int masklen;
+{
+    struct set_elem *e;
+
+    e = (struct set_elem *) newchunk(sizeof(*e));
+    e->type = type;
+    e->s = s;
+    e->v = v;
+    e->masklen = masklen;
+    e->next = NULL;
+    return e;
+}
+
+struct block *gen_set(list, q)
+     struct set_elem *list;
+     struct qual q;
+{
+    switch (q.addr)
+    {
+
+        case Q_DEFAULT:
+        case Q_HOST:
+            return gen_hostset(list, q.proto, q.dir);
+
+        case Q_NET:
+            return gen_netset(list, q.proto, q.dir);
+
+        case Q_PORT:
+            return gen_portset(list, q.proto, q.dir);
+
+        default:
+            bpf_error("sets can only hold hosts, networks or ports");
+    }
+    /* NOTREACHED */
+}
+
 static int lookup_proto(name, proto)
      register const char *name;
      register int proto;
@@ -6909,16 +7765,19 @@ struct arth *gen_arth(code, a0, a1)
  * Here we handle simple allocation of the scratch registers.
  * If too many registers are alloc'd, the allocator punts.
  */
-static int regused[BPF_MEMWORDS];
-static int curreg;
+static SFBPF_TLS int regused[BPF_MEMWORDS];
+static SFBPF_TLS int curreg;
 
 /*
- * Initialize the table of used registers and the current register.
+ * Initialize the table of used registers and the current register, and
+ * forget the registers given to variable link-layer offsets.
  */
 static void init_regs()
 {
     curreg = 0;
     memset(regused, 0, sizeof regused);
+    reg_off_ll = -1;
+    reg_off_macpl = -1;
 }
 
 /*
@@ -7743,6 +8602,24 @@ struct block *gen_vlan(vlan_num)
     {
 
         case DLT_EN10MB:
+            /*
+             * If the capture layer strips the outermost tag, test the
+             * ancillary copy of it.  The packet itself is untouched, so
+             * the offsets stay where they are.
+             */
+            if ((compile_flags & BPF_COMPILE_VLAN_AUX) && vlan_stack_depth++ == 0)
+            {
+                b0 = gen_cmp(OR_PACKET, BPF_AUX_OFF + BPF_AUX_VLAN_TAG_PRESENT, BPF_B, 1);
+
+                if (vlan_num >= 0)
+                {
+                    b1 = gen_mcmp(OR_PACKET, BPF_AUX_OFF + BPF_AUX_VLAN_TAG, BPF_H, (bpf_int32) vlan_num, 0x0fff);
+                    gen_and(b0, b1);
+                    b0 = b1;
+                }
+                break;
+            }
+
             /* check for VLAN */
             b0 = gen_cmp(OR_LINK, off_linktype, BPF_H, (bpf_int32) ETHERTYPE_8021Q);
 
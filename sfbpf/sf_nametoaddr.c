@@ -97,7 +97,7 @@ static inline int xdtoi(int);
 bpf_u_int32 **pcap_nametoaddr(const char *name)
 {
 #ifndef h_addr
-    static bpf_u_int32 *hlist[2];
+    static SFBPF_TLS bpf_u_int32 *hlist[2];
 #endif
     bpf_u_int32 **p;
     struct hostent *hp;
@@ -437,25 +437,17 @@ u_char *pcap_ether_aton(const char *s)
 }
 
 #ifndef HAVE_ETHER_HOSTTON
-/* Roll our own */
+/* Roll our own.  The file is opened anew on each call so that nothing is
+   left open in the threads that compile filters. */
 u_char *pcap_ether_hostton(const char *name)
 {
     register struct pcap_etherent *ep;
-    register u_char *ap;
-    static FILE *fp = NULL;
-    static int init = 0;
+    register u_char *ap = NULL;
+    FILE *fp;
 
-    if (!init)
-    {
-        fp = fopen(PCAP_ETHERS_FILE, "r");
-        ++init;
-        if (fp == NULL)
-            return (NULL);
-    }
-    else if (fp == NULL)
+    fp = fopen(PCAP_ETHERS_FILE, "r");
+    if (fp == NULL)
         return (NULL);
-    else
-        rewind(fp);
 
     while ((ep = pcap_next_etherent(fp)) != NULL)
     {
@@ -463,14 +455,12 @@ u_char *pcap_ether_hostton(const char *name)
         {
             ap = (u_char *) malloc(6);
             if (ap != NULL)
-            {
                 memcpy(ap, ep->addr, 6);
-                return (ap);
-            }
             break;
         }
     }
-    return (NULL);
+    fclose(fp);
+    return (ap);
 }
 #else
 
@@ -46,6 +46,7 @@ static const char rcsid[] =
 #endif /* WIN32 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <string.h>
@@ -60,15 +61,6 @@ static const char rcsid[] =
 extern int dflag;
 #endif
 
-#if defined(MSDOS) && !defined(__DJGPP__)
-extern int _w32_ffs(int mask);
-#define ffs _w32_ffs
-#endif
-
-#if defined(WIN32) && defined (_MSC_VER)
-int ffs(int mask);
-#endif
-
 /*
  * Represents a deleted instruction.
  */
@@ -90,19 +82,26 @@ int ffs(int mask);
  */
 #define AX_ATOM N_ATOMS
 
+/*
+ * Each pass takes time about linear in the number of blocks, but a pass
+ * over a graph much larger than this spends most of it missing the cache,
+ * and large filters take many passes.  Larger graphs are left unoptimized.
+ */
+#define OPT_MAX_BLOCKS 100000
+
 /*
  * A flag to indicate that further optimization is needed.
  * Iterative passes are continued until a given pass yields no
  * branch movement.
  */
-static int done;
+static SFBPF_TLS int done;
 
 /*
  * A block is marked if only if its mark equals the current mark.
  * Rather than traverse the code array, marking each item, 'cur_mark' is
  * incremented.  This automatically makes each element unmarked.
  */
-static int cur_mark;
+static SFBPF_TLS int cur_mark;
 #define isMarked(p) ((p)->mark == cur_mark)
 #define unMarkAll() cur_mark += 1
 #define Mark(p) ((p)->mark = cur_mark)
@@ -110,20 +109,23 @@ static int cur_mark;
 static void opt_init(struct block *);
 static void opt_cleanup(void);
 
-static void make_marks(struct block *);
-static void mark_code(struct block *);
+static struct block **walk_graph(struct block *, int, int, int *);
 
 static void intern_blocks(struct block *);
 
 static int eq_slist(struct slist *, struct slist *);
 
-static void find_levels_r(struct block *);
-
 static void find_levels(struct block *);
+static void dom_init(struct domnode *);
+static void dom_link(struct domnode *, struct domnode *);
+static struct domnode *dom_ancestor(struct domnode *, int);
+static struct domnode *dom_common(struct domnode *, struct domnode *);
+static int dom_number(struct domnode *);
+static inline int dominates(struct block *, struct block *);
 static void find_dom(struct block *);
-static void propedom(struct edge *);
 static void find_edom(struct block *);
-static void find_closure(struct block *);
+static void fold_index(void);
+static int fold_find(int, int, int, struct edge *);
 static int atomuse(struct stmt *);
 static int atomdef(struct stmt *);
 static void compute_local_ud(struct block *);
@@ -133,7 +135,18 @@ static int F(int, int, int);
 static inline void vstore(struct stmt *, int *, int, int);
 static void opt_blk(struct block *, int);
 static int use_conflict(struct block *, struct block *);
+static int fold_unique(struct block *);
+static struct foldrun *fold_run(struct block *);
+static void fold_run_merge(struct foldrun *, atomset, struct block *);
+static int fold_run_conflict(struct block *, struct foldrun *);
+static struct foldset *fold_set(struct block *);
+static int fold_set_false(struct foldset *, struct block *, struct edge *);
 static void opt_j(struct edge *);
+static void pull_init(struct block *);
+static struct pullrun *pull_run(struct block *, int);
+static inline int pull_dominates(struct block *, struct pullrun *);
+static void pull_forget(struct block *, int);
+static void pull_link(struct block *, int, struct block *);
 static void or_pullup(struct block *);
 static void and_pullup(struct block *);
 static void opt_blks(struct block *, int);
@@ -151,229 +164,484 @@ static void opt_deadstores(struct block *);
 static struct block *fold_edge(struct block *, struct edge *);
 static inline int eq_blk(struct block *, struct block *);
 static int slength(struct slist *);
-static int count_blocks(struct block *);
-static void number_blks_r(struct block *);
-static int count_stmts(struct block *);
-static int convert_code_r(struct block *);
+static int convert_code(struct block *);
 #ifdef BDEBUG
 static void opt_dump(struct block *);
 #endif
 
-static int n_blocks;
-struct block **blocks;
-static int n_edges;
-struct edge **edges;
+static SFBPF_TLS int n_blocks;
+SFBPF_TLS struct block **blocks;
+SFBPF_TLS struct block **levels;
 
 /*
- * A bit vector set representation of the dominators.
- * We round up the set size to the next power of two.
+ * Dominators are kept as trees rather than as sets, which would take space
+ * quadratic in the number of blocks.  The flow graph is acyclic and the
+ * levels order it topologically, so a node's immediate dominator is the
+ * nearest common ancestor of those of its predecessors.  Each node's jump
+ * pointer follows a skew-binary ladder up the tree, so that an ancestor at
+ * a given depth, and so the nearest common ancestor of two nodes, is found
+ * in a logarithmic number of steps.
  */
-static int nodewords;
-static int edgewords;
-struct block **levels;
-bpf_u_int32 *space;
-#define BITS_PER_WORD (8*sizeof(bpf_u_int32))
+static SFBPF_TLS struct domnode dom_root;
+static SFBPF_TLS struct domnode edom_root;
+static SFBPF_TLS struct domnode **dom_order;
+static SFBPF_TLS struct domnode **dom_stack;
+static SFBPF_TLS int n_edom;
+
+#define EDGE_OF(d) ((struct edge *) ((char *) (d) - offsetof(struct edge, edom)))
+
 /*
- * True if a is in uset {p}
+ * fold_edge() can only settle a branch from a dominating edge that leaves
+ * a block making the same comparison of the same value, or from the true
+ * edge of a test of that value for equality with another constant.  So
+ * that opt_j() needn't try every dominator of an edge, edges are indexed
+ * by those keys: the edges with a key are kept in preorder of the edge
+ * dominator tree, each linked to the nearest of its dominators that has
+ * the key too.
+ *
+ * All the edges of a chain that settle the branch the same way send it to
+ * the same block, so only the lowest numbered edge of each outcome is
+ * needed.  The edges of a comparison are split by whether they are true
+ * or false edges; the true edges of equality tests are split by their
+ * constant, and any with the branch's own constant are also found under
+ * the comparison's key.  Each entry keeps the lowest numbered edge of its
+ * chain and the lowest numbered one split from it.
  */
-#define SET_MEMBER(p, a) \
-((p)[(unsigned)(a) / BITS_PER_WORD] & (1 << ((unsigned)(a) % BITS_PER_WORD)))
+struct foldgroup
+{
+    int code;                   /* Branch opcode, FOLD_JEQ_TRUE, or 0 if unused */
+    int aval, oval;
+    int first, n;               /* Entries in fold_ents */
+};
+
+struct foldent
+{
+    struct edge *e;
+    int up;                     /* Entry of the nearest dominator with the key, or -1 */
+    int low;                    /* Entry of the lowest numbered edge up the chain */
+    int other;                  /* Same, split from low's, or -1 */
+};
+
+#define FOLD_JEQ_TRUE -1
+
+static SFBPF_TLS struct foldgroup *fold_groups;
+static SFBPF_TLS u_int fold_mask;
+static SFBPF_TLS struct foldent *fold_ents;
+static SFBPF_TLS int *fold_stack;
 
 /*
- * Add 'a' to uset p.
+ * A false edge from one equality test on a value to another is settled
+ * by the true edge of a third test of that value for some other constant.
+ * So in a chain of tests of a value for many constants, each the only
+ * test of its constant (as "host A or host B ..." makes), an edge that
+ * knows the value threads down the whole chain, and the chain gets as
+ * long as the filter.  opt_j() goes down such a chain a run at a time:
+ * each test of one keeps a later test of the run, with the registers used
+ * after the tests up to it and the block giving their values, or none if
+ * those differ.  The walks of a pass only go down to blocks whose edges
+ * are done, so what is kept holds for the pass.
  */
-#define SET_INSERT(p, a) \
-(p)[(unsigned)(a) / BITS_PER_WORD] |= (1 << ((unsigned)(a) % BITS_PER_WORD))
+struct foldrun
+{
+    struct block *last;         /* A later test of the run, or the test */
+    struct block *rep;          /* Gives the values of use after each of them */
+    atomset use;                /* Registers used after any of them */
+    int stamp;                  /* fold_epoch when found */
+};
+
+static SFBPF_TLS struct foldrun *fold_runs;
+static SFBPF_TLS struct foldrun **fold_run_stack;
+static SFBPF_TLS int fold_epoch;
 
 /*
- * Delete 'a' from uset p.
+ * Tests of a value for a few constants over and over, as each term of
+ * "net A and not port B or ..." makes of the link type and protocol, are
+ * not unique, so an edge that knows the value differs from all of those
+ * constants would still go down such a chain a test at a time.  So each
+ * test also keeps the run of tests down its false branches of the same
+ * value for at most FOLD_SET_MAX constants, with the constants.
  */
-#define SET_DELETE(p, a) \
-(p)[(unsigned)(a) / BITS_PER_WORD] &= ~(1 << ((unsigned)(a) % BITS_PER_WORD))
+#define FOLD_SET_MAX    8
+
+struct foldset
+{
+    struct foldrun run;
+    int n;                      /* Constants tested in the run */
+    int oval[FOLD_SET_MAX];
+};
+
+static SFBPF_TLS struct foldset *fold_sets;
+static SFBPF_TLS struct block **fold_set_stack;
+
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
 
 /*
- * a := a intersect b
+ * Level graph.  The levels go from 0 at the leaves to
+ * N_LEVELS at the root.  The levels[] array points to the
+ * first node of the level list, whose elements are linked
+ * with the 'link' field of the struct block.
  */
-#define SET_INTERSECT(a, b, n)\
-{\
-	register bpf_u_int32 *_x = a, *_y = b;\
-	register int _n = n;\
-	while (--_n >= 0) *_x++ &= *_y++;\
+static void find_levels(root)
+     struct block *root;
+{
+    struct block **order, *b;
+    int i, n;
+
+    memset((char *) levels, 0, n_blocks * sizeof(*levels));
+    unMarkAll();
+    order = walk_graph(root, 1, 0, &n);
+    for (i = 0; i < n; ++i)
+    {
+        b = order[i];
+        if (JT(b))
+            b->level = MAX(JT(b)->level, JF(b)->level) + 1;
+        else
+            b->level = 0;
+        b->link = levels[b->level];
+        levels[b->level] = b;
+    }
+    free(order);
+}
+
+static void dom_init(root)
+     struct domnode *root;
+{
+    memset(root, 0, sizeof(*root));
+    root->jump = root;
 }
 
 /*
- * a := a - b
+ * Add n to a dominator tree as a child of parent.
  */
-#define SET_SUBTRACT(a, b, n)\
-{\
-	register bpf_u_int32 *_x = a, *_y = b;\
-	register int _n = n;\
-	while (--_n >= 0) *_x++ &=~ *_y++;\
+static void dom_link(n, parent)
+     struct domnode *n, *parent;
+{
+    struct domnode *j = parent->jump;
+
+    n->parent = parent;
+    n->depth = parent->depth + 1;
+    if (parent->depth - j->depth == j->depth - j->jump->depth)
+        n->jump = j->jump;
+    else
+        n->jump = parent;
+    n->child = 0;
+    n->sibling = parent->child;
+    parent->child = n;
 }
 
 /*
- * a := a union b
+ * Return the ancestor of n at the given depth.
  */
-#define SET_UNION(a, b, n)\
-{\
-	register bpf_u_int32 *_x = a, *_y = b;\
-	register int _n = n;\
-	while (--_n >= 0) *_x++ |= *_y++;\
+static struct domnode *dom_ancestor(n, depth)
+     struct domnode *n;
+     int depth;
+{
+    while (n->depth > depth)
+        n = (n->jump->depth >= depth) ? n->jump : n->parent;
+    return n;
 }
 
-static uset all_dom_sets;
-static uset all_closure_sets;
-static uset all_edge_sets;
-
-#ifndef MAX
-#define MAX(a,b) ((a)>(b)?(a):(b))
-#endif
-
-static void find_levels_r(b)
-     struct block *b;
+/*
+ * Return the nearest common ancestor of a and b.
+ */
+static struct domnode *dom_common(a, b)
+     struct domnode *a, *b;
 {
-    int level;
-
-    if (isMarked(b))
-        return;
+    if (a->depth > b->depth)
+        a = dom_ancestor(a, b->depth);
+    else
+        b = dom_ancestor(b, a->depth);
+    while (a != b)
+    {
+        if (a->jump == b->jump)
+        {
+            a = a->parent;
+            b = b->parent;
+        }
+        else
+        {
+            a = a->jump;
+            b = b->jump;
+        }
+    }
+    return a;
+}
 
-    Mark(b);
-    b->link = 0;
+/*
+ * Number a dominator tree in preorder, leaving its nodes in that order
+ * in dom_order, and return how many there are.  Each subtree is numbered
+ * consecutively, so a node's post is the greatest pre among its
+ * children's posts and its own, and it's an ancestor of exactly the nodes
+ * whose pre lies between its pre and post.
+ */
+static int dom_number(root)
+     struct domnode *root;
+{
+    struct domnode *d, *c;
+    int i, n, sp;
 
-    if (JT(b))
+    n = sp = 0;
+    dom_stack[sp++] = root;
+    while (sp > 0)
     {
-        find_levels_r(JT(b));
-        find_levels_r(JF(b));
-        level = MAX(JT(b)->level, JF(b)->level) + 1;
+        d = dom_stack[--sp];
+        d->pre = d->post = n;
+        dom_order[n++] = d;
+        for (c = d->child; c; c = c->sibling)
+            dom_stack[sp++] = c;
     }
-    else
-        level = 0;
-    b->level = level;
-    b->link = levels[level];
-    levels[level] = b;
+    for (i = n - 1; i > 0; --i)
+    {
+        d = dom_order[i];
+        if (d->post > d->parent->post)
+            d->parent->post = d->post;
+    }
+    return n;
 }
 
 /*
- * Level graph.  The levels go from 0 at the leaves to
- * N_LEVELS at the root.  The levels[] array points to the
- * first node of the level list, whose elements are linked
- * with the 'link' field of the struct block.
+ * True if a dominates b.
  */
-static void find_levels(root)
-     struct block *root;
+static inline int dominates(a, b)
+     struct block *a, *b;
 {
-    memset((char *) levels, 0, n_blocks * sizeof(*levels));
-    unMarkAll();
-    find_levels_r(root);
+    return a->dom.pre <= b->dom.pre && b->dom.pre <= a->dom.post;
 }
 
 /*
- * Find dominator relationships.
- * Assumes graph has been leveled.
+ * Find dominator relationships, and number the tree of them for
+ * dominates().
+ * Assumes graph has been leveled and predecessors established.
  */
 static void find_dom(root)
      struct block *root;
 {
     int i;
     struct block *b;
-    bpf_u_int32 *x;
-
-    /*
-     * Initialize sets to contain all nodes.
-     */
-    x = all_dom_sets;
-    i = n_blocks * nodewords;
-    while (--i >= 0)
-        *x++ = ~0;
-    /* Root starts off empty. */
-    for (i = nodewords; --i >= 0;)
-        root->dom[i] = 0;
+    struct edge *ep;
+    struct domnode *d;
 
+    dom_init(&dom_root);
     /* root->level is the highest level no found. */
     for (i = root->level; i >= 0; --i)
     {
         for (b = levels[i]; b; b = b->link)
         {
-            SET_INSERT(b->dom, b->id);
-            if (JT(b) == 0)
-                continue;
-            SET_INTERSECT(JT(b)->dom, b->dom, nodewords);
-            SET_INTERSECT(JF(b)->dom, b->dom, nodewords);
+            ep = b->in_edges;
+            if (ep == 0)
+                d = &dom_root;
+            else
+            {
+                d = &ep->pred->dom;
+                while ((ep = ep->next) != 0)
+                    d = dom_common(d, &ep->pred->dom);
+            }
+            dom_link(&b->dom, d);
         }
     }
-}
-
-static void propedom(ep)
-     struct edge *ep;
-{
-    SET_INSERT(ep->edom, ep->id);
-    if (ep->succ)
-    {
-        SET_INTERSECT(ep->succ->et.edom, ep->edom, edgewords);
-        SET_INTERSECT(ep->succ->ef.edom, ep->edom, edgewords);
-    }
+    dom_number(&dom_root);
 }
 
 /*
- * Compute edge dominators.
+ * Compute edge dominators, and number the tree of them in preorder for
+ * fold_find().
  * Assumes graph has been leveled and predecessors established.
  */
 static void find_edom(root)
      struct block *root;
 {
     int i;
-    uset x;
     struct block *b;
+    struct edge *ep;
+    struct domnode *d;
 
-    x = all_edge_sets;
-    for (i = n_edges * edgewords; --i >= 0;)
-        x[i] = ~0;
-
+    dom_init(&edom_root);
     /* root->level is the highest level no found. */
-    memset(root->et.edom, 0, edgewords * sizeof(*(uset) 0));
-    memset(root->ef.edom, 0, edgewords * sizeof(*(uset) 0));
     for (i = root->level; i >= 0; --i)
     {
         for (b = levels[i]; b != 0; b = b->link)
         {
-            propedom(&b->et);
-            propedom(&b->ef);
+            ep = b->in_edges;
+            if (ep == 0)
+                d = &edom_root;
+            else
+            {
+                d = &ep->edom;
+                while ((ep = ep->next) != 0)
+                    d = dom_common(d, &ep->edom);
+            }
+            dom_link(&b->et.edom, d);
+            dom_link(&b->ef.edom, d);
+        }
+    }
+    n_edom = dom_number(&edom_root);
+}
+
+static struct foldgroup *fold_group(code, aval, oval, add)
+     int code, aval, oval, add;
+{
+    struct foldgroup *g;
+    u_int i;
+
+    i = ((u_int) code * 0x9e3779b1U) ^ ((u_int) aval * 0x85ebca6bU) ^ ((u_int) oval * 0xc2b2ae35U);
+    for (i ^= i >> 16;; i++)
+    {
+        g = &fold_groups[i & fold_mask];
+        if (g->code == 0)
+        {
+            if (!add)
+                return 0;
+            g->code = code;
+            g->aval = aval;
+            g->oval = oval;
+            return g;
         }
+        if (g->code == code && g->aval == aval && g->oval == oval)
+            return g;
     }
 }
 
+/* The value that splits the edges of a chain by outcome. */
+#define FOLD_SPLIT(g, e) ((g)->code == FOLD_JEQ_TRUE ? (e)->pred->oval : (e)->code > 0)
+
 /*
- * Find the backwards transitive closure of the flow graph.  These sets
- * are backwards in the sense that we find the set of nodes that reach
- * a given node, not the set of nodes that can be reached by a node.
- *
- * Assumes graph has been leveled.
+ * Fill in the low and other entries of fold_ents[i], whose up is known.
  */
-static void find_closure(root)
-     struct block *root;
+static void fold_lowest(g, i)
+     struct foldgroup *g;
+     int i;
 {
-    int i;
-    struct block *b;
+    struct foldent *f = &fold_ents[i];
+    struct foldent *u;
+    int v;
 
-    /*
-     * Initialize sets to contain no nodes.
-     */
-    memset((char *) all_closure_sets, 0, n_blocks * nodewords * sizeof(*all_closure_sets));
+    if (f->up < 0)
+    {
+        f->low = i;
+        f->other = -1;
+        return;
+    }
+    u = &fold_ents[f->up];
+    v = FOLD_SPLIT(g, f->e);
+    if (f->e->id < fold_ents[u->low].e->id)
+    {
+        f->low = i;
+        f->other = (v != FOLD_SPLIT(g, fold_ents[u->low].e)) ? u->low : u->other;
+    }
+    else
+    {
+        f->low = u->low;
+        f->other = u->other;
+        if (v != FOLD_SPLIT(g, fold_ents[u->low].e) && (f->other < 0 || f->e->id < fold_ents[f->other].e->id))
+            f->other = i;
+    }
+}
 
-    /* root->level is the highest level no found. */
-    for (i = root->level; i >= 0; --i)
+/*
+ * Index the edges reached this pass by their fold keys.  Must follow
+ * find_edom() and the opt_blk() pass that gives the blocks their values.
+ */
+static void fold_index()
+{
+    struct foldgroup *g;
+    struct edge *e;
+    struct block *b;
+    int i, j, n, sp, pass, total;
+
+    memset(fold_groups, 0, (fold_mask + 1) * sizeof(*fold_groups));
+    ++fold_epoch;
+    for (pass = 0; pass < 2; pass++)
     {
-        for (b = levels[i]; b; b = b->link)
+        /* Count the entries of each key, then fill them in preorder. */
+        for (i = 1; i < n_edom; i++)
         {
-            SET_INSERT(b->closure, b->id);
-            if (JT(b) == 0)
+            e = EDGE_OF(dom_order[i]);
+            if (e->succ == 0)
+                continue;
+            b = e->pred;
+            g = fold_group(b->s.code, b->val[A_ATOM], b->oval, 1);
+            if (pass == 0)
+                g->n++;
+            else
+            {
+                fold_ents[g->first + g->n].e = e;
+                g->n++;
+            }
+            if (e->code != (BPF_JMP | BPF_JEQ | BPF_K))
                 continue;
-            SET_UNION(JT(b)->closure, b->closure, nodewords);
-            SET_UNION(JF(b)->closure, b->closure, nodewords);
+            g = fold_group(FOLD_JEQ_TRUE, b->val[A_ATOM], 0, 1);
+            if (pass == 0)
+                g->n++;
+            else
+            {
+                fold_ents[g->first + g->n].e = e;
+                g->n++;
+            }
+        }
+        if (pass == 0)
+        {
+            total = 0;
+            for (j = 0; j <= (int) fold_mask; j++)
+            {
+                fold_groups[j].first = total;
+                total += fold_groups[j].n;
+                fold_groups[j].n = 0;
+            }
+        }
+    }
+
+    /* Link each entry to the innermost earlier one whose subtree holds it. */
+    for (j = 0; j <= (int) fold_mask; j++)
+    {
+        g = &fold_groups[j];
+        sp = 0;
+        for (i = g->first, n = g->first + g->n; i < n; i++)
+        {
+            e = fold_ents[i].e;
+            while (sp > 0 && fold_ents[fold_stack[sp - 1]].e->edom.post < e->edom.pre)
+                sp--;
+            fold_ents[i].up = (sp > 0) ? fold_stack[sp - 1] : -1;
+            fold_stack[sp++] = i;
+            fold_lowest(g, i);
         }
     }
 }
 
+/*
+ * Return the entry of the nearest edge with the given key that dominates
+ * ep (or is ep), or -1 if there is none.  The rest follow by way of up.
+ */
+static int fold_find(code, aval, oval, ep)
+     int code, aval, oval;
+     struct edge *ep;
+{
+    struct foldgroup *g;
+    int lo, hi, mid, pre;
+
+    g = fold_group(code, aval, oval, 0);
+    if (g == 0 || g->n == 0)
+        return -1;
+
+    /* Find the last entry at or before ep in preorder. */
+    pre = ep->edom.pre;
+    lo = g->first;
+    hi = g->first + g->n;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (fold_ents[mid].e->edom.pre <= pre)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    lo--;
+    while (lo >= g->first && fold_ents[lo].e->edom.post < pre)
+        lo = fold_ents[lo].up;
+    return (lo >= g->first) ? lo : -1;
+}
+
 /*
  * Return the register number that is used by s.  If A and X are both
  * used, return AX_ATOM.  If no register is used, return -1.
@@ -573,10 +841,11 @@ struct valnode
     struct valnode *next;
 };
 
-#define MODULUS 213
-static struct valnode *hashtbl[MODULUS];
-static int curval;
-static int maxval;
+/* Sized in opt_init() so that the chains stay short. */
+static SFBPF_TLS struct valnode **hashtbl;
+static SFBPF_TLS u_int hash_mask;
+static SFBPF_TLS int curval;
+static SFBPF_TLS int maxval;
 
 /* Integer constants mapped with the load immediate opcode. */
 #define K(i) F(BPF_LD|BPF_IMM|BPF_W, i, 0L)
@@ -587,16 +856,16 @@ struct vmapinfo
     bpf_int32 const_val;
 };
 
-struct vmapinfo *vmap;
-struct valnode *vnode_base;
-struct valnode *next_vnode;
+SFBPF_TLS struct vmapinfo *vmap;
+SFBPF_TLS struct valnode *vnode_base;
+SFBPF_TLS struct valnode *next_vnode;
 
 static void init_val()
 {
     curval = 0;
     next_vnode = vnode_base;
     memset((char *) vmap, 0, maxval * sizeof(*vmap));
-    memset((char *) hashtbl, 0, sizeof hashtbl);
+    memset((char *) hashtbl, 0, (hash_mask + 1) * sizeof(*hashtbl));
 }
 
 /* Because we really don't have an IR, this stuff is a little messy. */
@@ -608,8 +877,8 @@ static int F(code, v0, v1)
     int val;
     struct valnode *p;
 
-    hash = (u_int) code ^ (v0 << 4) ^ (v1 << 8);
-    hash %= MODULUS;
+    hash = (u_int) code ^ ((u_int) v0 * 0x9e3779b1U) ^ ((u_int) v1 * 0x85ebca6bU);
+    hash = (hash ^ (hash >> 16)) & hash_mask;
 
     for (p = hashtbl[hash]; p; p = p->next)
         if (p->code == code && p->v0 == v0 && p->v1 == v1)
@@ -1168,6 +1437,11 @@ static void opt_stmt(s, val, alter)
             vstore(s, &val[X_ATOM], val[A_ATOM], alter);
             break;
 
+        case BPF_MISC | BPF_LOOKUP:
+            v = F(s->code, val[A_ATOM], s->k);
+            vstore(s, &val[A_ATOM], v, alter);
+            break;
+
         case BPF_LDX | BPF_MEM:
             v = val[s->k];
             if (alter && vmap[v].is_const)
@@ -1423,11 +1697,193 @@ static struct block *fold_edge(child, ep)
     return 0;
 }
 
+/*
+ * True if b is an equality test that no other block makes.
+ */
+static int fold_unique(b)
+     struct block *b;
+{
+    struct foldgroup *g;
+
+    if (b->s.code != (BPF_JMP | BPF_JEQ | BPF_K))
+        return 0;
+    g = fold_group(b->s.code, b->val[A_ATOM], b->oval, 0);
+    return g != 0 && g->n == 2;
+}
+
+/*
+ * Add to r the registers in use, whose values rep gives.
+ */
+static void fold_run_merge(r, use, rep)
+     struct foldrun *r;
+     atomset use;
+     struct block *rep;
+{
+    int atom;
+
+    if (r->rep == 0 || use == 0)
+        return;
+    if (r->use == 0 || rep == 0)
+    {
+        r->use = use;
+        r->rep = rep;
+        return;
+    }
+    for (atom = 0; atom < N_ATOMS; ++atom)
+        if (ATOMELEM(use, atom) && r->rep->val[atom] != rep->val[atom])
+        {
+            r->rep = 0;
+            return;
+        }
+    r->use |= use;
+}
+
+/*
+ * Return the run of unique tests from b, with last set to its end.
+ */
+static struct foldrun *fold_run(b)
+     struct block *b;
+{
+    struct foldrun *r, *q;
+    struct block *n;
+    int sp = 0;
+
+    while (1)
+    {
+        r = &fold_runs[b->id];
+        if (r->stamp != fold_epoch)
+        {
+            r->last = b;
+            r->rep = JF(b);
+            r->use = JF(b)->out_use;
+            r->stamp = fold_epoch;
+        }
+        fold_run_stack[sp++] = r;
+        n = JF(r->last);
+        if (n->val[A_ATOM] != b->val[A_ATOM] || !fold_unique(n))
+            break;
+        b = n;
+    }
+    q = fold_run_stack[--sp];
+    while (sp > 0)
+    {
+        r = fold_run_stack[--sp];
+        r->last = q->last;
+        fold_run_merge(r, q->use, q->rep);
+        q = r;
+    }
+    return q;
+}
+
+/*
+ * Like use_conflict(), for the blocks after each test of the run r.
+ */
+static int fold_run_conflict(b, r)
+     struct block *b;
+     struct foldrun *r;
+{
+    int atom;
+
+    if (r->rep == 0)
+        return 1;
+    for (atom = 0; atom < N_ATOMS; ++atom)
+        if (ATOMELEM(r->use, atom) && b->val[atom] != r->rep->val[atom])
+            return 1;
+    return 0;
+}
+
+/*
+ * Return the run of tests from the equality test b down false branches,
+ * for as long as they test its value for at most FOLD_SET_MAX constants.
+ */
+static struct foldset *fold_set(b)
+     struct block *b;
+{
+    struct foldset *s, *q = 0;
+    struct block *n;
+    int i, sp = 0;
+
+    for (n = b;; n = JF(n))
+    {
+        s = &fold_sets[n->id];
+        if (s->run.stamp == fold_epoch)
+        {
+            q = s;
+            break;
+        }
+        fold_set_stack[sp++] = n;
+        if (JF(n)->s.code != n->s.code || JF(n)->val[A_ATOM] != n->val[A_ATOM])
+            break;
+    }
+    while (sp > 0)
+    {
+        n = fold_set_stack[--sp];
+        s = &fold_sets[n->id];
+        s->run.last = n;
+        s->run.rep = JF(n);
+        s->run.use = JF(n)->out_use;
+        s->run.stamp = fold_epoch;
+        s->n = 1;
+        s->oval[0] = n->oval;
+        if (q != 0)
+        {
+            for (i = 0; i < q->n && q->oval[i] != n->oval; ++i)
+                ;
+            if (q->n + (i == q->n) <= FOLD_SET_MAX)
+            {
+                s->n = q->n;
+                memcpy(s->oval, q->oval, q->n * sizeof(*q->oval));
+                if (i == q->n)
+                    s->oval[s->n++] = n->oval;
+                s->run.last = q->run.last;
+                fold_run_merge(&s->run, q->run.use, q->run.rep);
+            }
+        }
+        q = s;
+    }
+    return q;
+}
+
+/*
+ * True if the edges dominating ep show that child's value, tested by
+ * each test of the run s, differs from every constant of the run.
+ */
+static int fold_set_false(s, child, ep)
+     struct foldset *s;
+     struct block *child;
+     struct edge *ep;
+{
+    int i, j, oval;
+
+    i = fold_find(FOLD_JEQ_TRUE, child->val[A_ATOM], 0, ep);
+    if (i >= 0)
+    {
+        if (fold_ents[i].other >= 0)
+            return 0;
+        oval = fold_ents[fold_ents[i].low].e->pred->oval;
+        for (j = 0; j < s->n; ++j)
+            if (s->oval[j] == oval)
+                return 0;
+        return 1;
+    }
+    for (j = 0; j < s->n; ++j)
+    {
+        i = fold_find(child->s.code, child->val[A_ATOM], s->oval[j], ep);
+        if (i < 0 || fold_ents[i].other >= 0 || fold_ents[fold_ents[i].low].e->code > 0)
+            return 0;
+    }
+    return 1;
+}
+
 static void opt_j(ep)
      struct edge *ep;
 {
-    register int i, k;
+    register int i, j, k;
     register struct block *target;
+    struct block *child, *t;
+    struct edge *best;
+    struct foldrun *r;
+    struct foldset *s;
 
     if (JT(ep->succ) == 0)
         return;
@@ -1448,47 +1904,238 @@ static void opt_j(ep)
      * For each edge dominator that matches the successor of this
      * edge, promote the edge successor to the its grandchild.
      *
-     * XXX We violate the set abstraction here in favor a reasonably
-     * efficient loop.
+     * Only the dominators with one of the successor's fold keys can
+     * match, and of those only the lowest numbered of each outcome
+     * need be tried.  The lowest numbered one that works is used, as
+     * the scan of the dominators in edge order did.
      */
   top:
-    for (i = 0; i < edgewords; ++i)
+    child = ep->succ;
+    if (fold_unique(child) && fold_find(FOLD_JEQ_TRUE, child->val[A_ATOM], 0, ep) >= 0)
     {
-        register bpf_u_int32 x = ep->edom[i];
-
-        while (x != 0)
+        /*
+         * The value is known to be some other constant, so each test
+         * of the run would go to its false branch in turn.
+         */
+        r = fold_run(child);
+        if (!fold_run_conflict(ep->pred, r))
         {
-            k = ffs(x) - 1;
-            x &= ~(1 << k);
-            k += i * BITS_PER_WORD;
-
-            target = fold_edge(ep->succ, edges[k]);
-            /*
-             * Check that there is no data dependency between
+            done = 0;
+            ep->succ = JF(r->last);
+            if (JT(ep->succ) != 0)
+                goto top;
+            return;
+        }
+    }
+    if (child->s.code == (BPF_JMP | BPF_JEQ | BPF_K))
+    {
+        /* The value is known to be none of the constants of a run. */
+        s = fold_set(child);
+        if (s->run.last != child && fold_set_false(s, child, ep) && !fold_run_conflict(ep->pred, &s->run))
+        {
+            done = 0;
+            ep->succ = JF(s->run.last);
+            if (JT(ep->succ) != 0)
+                goto top;
+            return;
+        }
+    }
+    best = 0;
+    target = 0;
+    for (k = 0; k < 2; ++k)
+    {
+        if (k == 0)
+            i = fold_find(child->s.code, child->val[A_ATOM], child->oval, ep);
+        else if (child->s.code == (BPF_JMP | BPF_JEQ | BPF_K))
+            i = fold_find(FOLD_JEQ_TRUE, child->val[A_ATOM], 0, ep);
+        else
+            break;
+        if (i < 0)
+            continue;
+        for (j = fold_ents[i].low; j >= 0; j = (j == fold_ents[i].low) ? fold_ents[i].other : -1)
+        {
+            t = fold_edge(child, fold_ents[j].e);
+            /*
+             * Check that there is no data dependency between
              * nodes that will be violated if we move the edge.
              */
-            if (target != 0 && !use_conflict(ep->pred, target))
+            if (t != 0 && !use_conflict(ep->pred, t))
             {
-                done = 0;
-                ep->succ = target;
-                if (JT(target) != 0)
-                    /*
-                     * Start over unless we hit a leaf.
-                     */
-                    goto top;
-                return;
+                if (best == 0 || fold_ents[j].e->id < best->id)
+                {
+                    best = fold_ents[j].e;
+                    target = t;
+                }
             }
         }
     }
+    if (best != 0)
+    {
+        done = 0;
+        ep->succ = target;
+        if (JT(target) != 0)
+            /*
+             * Start over unless we hit a leaf.
+             */
+            goto top;
+    }
+}
+
+
+/*
+ * or_pullup() and and_pullup() walk down chains of blocks that branch to
+ * the same place on one side and fall through to the next on the other,
+ * looking for a block testing the value loaded before the chain.  Such
+ * chains get as long as the filter, and every block of one starts a walk,
+ * so the walks go a run of blocks at a time.  A run is the longest chain
+ * from a block of blocks with the same value and the same other branch;
+ * each block keeps a later block of its run, with the least and greatest
+ * preorder number in the dominator tree of the blocks up to it, so a run
+ * can be passed over, and checked to be dominated, in a few steps.
+ *
+ * A pullup only adds to a run at its end, or takes a block from its head,
+ * so what a block keeps stays true until a branch inside a run is moved or
+ * a block of a run gets another branch.  If nothing else branches to that
+ * block down the chain, only what it keeps is forgotten; otherwise, all
+ * of the runs of the chains are.  pull_runs[] has an entry for each block
+ * on the chains of or_pullup(), through false branches, then one for each
+ * on the chains of and_pullup(), through true branches.
+ */
+struct pullrun
+{
+    struct block *last;         /* A later block of the run, or the block */
+    int lo, hi;                 /* Least and greatest dom.pre up to last */
+    int stamp;                  /* pull_epoch[] when found */
+    int npreds;                 /* Blocks whose branch down the chain goes here */
+};
+
+#define PULL_NEXT(b, and) ((and) ? JT(b) : JF(b))
+#define PULL_OTHER(b, and) ((and) ? JF(b) : JT(b))
+#define PULL_RUN(b, and) (&pull_runs[(and) * n_blocks + (b)->id])
+
+static SFBPF_TLS struct pullrun *pull_runs;
+static SFBPF_TLS struct pullrun **pull_stack;
+static SFBPF_TLS int pull_epoch[2];
+
+/*
+ * Count the branches to each block and forget all runs, before the
+ * pullups of a pass.
+ */
+static void pull_init(root)
+     struct block *root;
+{
+    int i;
+    struct block *p;
+
+    for (i = 0; i < 2 * n_blocks; ++i)
+        pull_runs[i].npreds = 0;
+    for (i = root->level; i > 0; --i)
+    {
+        for (p = levels[i]; p; p = p->link)
+        {
+            PULL_RUN(JF(p), 0)->npreds++;
+            PULL_RUN(JT(p), 1)->npreds++;
+        }
+    }
+    ++pull_epoch[0];
+    ++pull_epoch[1];
+}
+
+/*
+ * Return the run from b down the chains of or_pullup() (and == 0) or of
+ * and_pullup() (and == 1), with last set to its end.  What the blocks on
+ * the way keep is brought up to date too.
+ */
+static struct pullrun *pull_run(b, and)
+     struct block *b;
+     int and;
+{
+    struct pullrun *r, *q;
+    struct block *n;
+    int sp = 0;
+
+    while (1)
+    {
+        r = PULL_RUN(b, and);
+        if (r->stamp != pull_epoch[and])
+        {
+            r->last = b;
+            r->lo = r->hi = b->dom.pre;
+            r->stamp = pull_epoch[and];
+        }
+        pull_stack[sp++] = r;
+        n = PULL_NEXT(r->last, and);
+        if (n == 0 || PULL_OTHER(n, and) != PULL_OTHER(b, and) || n->val[A_ATOM] != b->val[A_ATOM])
+            break;
+        b = n;
+    }
+    q = pull_stack[--sp];
+    while (sp > 0)
+    {
+        r = pull_stack[--sp];
+        r->last = q->last;
+        if (q->lo < r->lo)
+            r->lo = q->lo;
+        if (q->hi > r->hi)
+            r->hi = q->hi;
+        q = r;
+    }
+    return q;
+}
+
+/*
+ * True if b dominates every block of the run r.
+ */
+static inline int pull_dominates(b, r)
+     struct block *b;
+     struct pullrun *r;
+{
+    return b->dom.pre <= r->lo && r->hi <= b->dom.post;
 }
 
+/*
+ * Forget the runs down the chains of 'and' that p is in.
+ */
+static void pull_forget(p, and)
+     struct block *p;
+     int and;
+{
+    if (PULL_RUN(p, and)->npreds == 0)
+        PULL_RUN(p, and)->stamp = 0;
+    else
+        ++pull_epoch[and];
+}
+
+/*
+ * Point the true (jt) or false branch of p at b.
+ */
+static void pull_link(p, jt, b)
+     struct block *p;
+     int jt;
+     struct block *b;
+{
+    struct block **link = jt ? &JT(p) : &JF(p);
+    struct block *old = *link;
+
+    /* The chains of and_pullup() go through true branches. */
+    if (old != 0)
+    {
+        if (PULL_OTHER(old, jt) == PULL_OTHER(p, jt) && old->val[A_ATOM] == p->val[A_ATOM])
+            pull_forget(p, jt);
+        PULL_RUN(old, jt)->npreds--;
+    }
+    /* On the other chains, p's other branch changes. */
+    pull_forget(p, !jt);
+    PULL_RUN(b, jt)->npreds++;
+    *link = b;
+}
 
 static void or_pullup(b)
      struct block *b;
 {
     int val, at_top;
-    struct block *pull;
-    struct block **diffp, **samep;
+    struct block *pull, *diff, *same, *dprev, *sprev;
+    struct pullrun *r;
     struct edge *ep;
 
     ep = b->in_edges;
@@ -1504,59 +2151,74 @@ static void or_pullup(b)
         if (val != ep->pred->val[A_ATOM])
             return;
 
-    if (JT(b->in_edges->pred) == b)
-        diffp = &JT(b->in_edges->pred);
+    /*
+     * Find diff, the first block down the chain with another value, and
+     * the block before it.
+     */
+    dprev = b->in_edges->pred;
+    if (JT(dprev) == b)
+        diff = JT(dprev);
     else
-        diffp = &JF(b->in_edges->pred);
+        diff = JF(dprev);
 
     at_top = 1;
-    while (1)
+    if (diff != 0 && JT(diff) == JT(b) && diff->val[A_ATOM] == val)
     {
-        if (*diffp == 0)
-            return;
-
-        if (JT(*diffp) != JT(b))
+        r = pull_run(diff, 0);
+        if (!pull_dominates(b, r))
             return;
+        dprev = r->last;
+        diff = JF(dprev);
+        at_top = 0;
+    }
+    if (diff == 0)
+        return;
 
-        if (!SET_MEMBER((*diffp)->dom, b->id))
-            return;
+    if (JT(diff) != JT(b))
+        return;
 
-        if ((*diffp)->val[A_ATOM] != val)
-            break;
+    if (!dominates(b, diff))
+        return;
 
-        diffp = &JF(*diffp);
-        at_top = 0;
-    }
-    samep = &JF(*diffp);
+    /*
+     * Then same, the first block after it with val again.
+     */
+    sprev = diff;
     while (1)
     {
-        if (*samep == 0)
-            return;
-
-        if (JT(*samep) != JT(b))
+        same = JF(sprev);
+        if (same == 0)
             return;
 
-        if (!SET_MEMBER((*samep)->dom, b->id))
+        if (JT(same) != JT(b))
             return;
 
-        if ((*samep)->val[A_ATOM] == val)
+        if (same->val[A_ATOM] == val)
+        {
+            if (!dominates(b, same))
+                return;
             break;
+        }
+
+        r = pull_run(same, 0);
+        if (!pull_dominates(b, r))
+            return;
 
         /* XXX Need to check that there are no data dependencies
            between dp0 and dp1.  Currently, the code generator
            will not produce such dependencies. */
-        samep = &JF(*samep);
+        sprev = r->last;
     }
 #ifdef notdef
     /* XXX This doesn't cover everything. */
     for (i = 0; i < N_ATOMS; ++i)
-        if ((*samep)->val[i] != pred->val[i])
+        if (same->val[i] != pred->val[i])
             return;
 #endif
     /* Pull up the node. */
-    pull = *samep;
-    *samep = JF(pull);
-    JF(pull) = *diffp;
+    pull = same;
+    pull_link(sprev, 0, JF(pull));
+    pull_link(pull, 0, diff);
 
     /*
      * At the top of the chain, each predecessor needs to point at the
@@ -1566,15 +2228,10 @@ static void or_pullup(b)
     if (at_top)
     {
         for (ep = b->in_edges; ep != 0; ep = ep->next)
-        {
-            if (JT(ep->pred) == b)
-                JT(ep->pred) = pull;
-            else
-                JF(ep->pred) = pull;
-        }
+            pull_link(ep->pred, JT(ep->pred) == b, pull);
     }
     else
-        *diffp = pull;
+        pull_link(dprev, 0, pull);
 
     done = 0;
 }
@@ -1583,8 +2240,8 @@ static void and_pullup(b)
      struct block *b;
 {
     int val, at_top;
-    struct block *pull;
-    struct block **diffp, **samep;
+    struct block *pull, *diff, *same, *dprev, *sprev;
+    struct pullrun *r;
     struct edge *ep;
 
     ep = b->in_edges;
@@ -1599,59 +2256,74 @@ static void and_pullup(b)
         if (val != ep->pred->val[A_ATOM])
             return;
 
-    if (JT(b->in_edges->pred) == b)
-        diffp = &JT(b->in_edges->pred);
+    /*
+     * Find diff, the first block down the chain with another value, and
+     * the block before it.
+     */
+    dprev = b->in_edges->pred;
+    if (JT(dprev) == b)
+        diff = JT(dprev);
     else
-        diffp = &JF(b->in_edges->pred);
+        diff = JF(dprev);
 
     at_top = 1;
-    while (1)
+    if (diff != 0 && JF(diff) == JF(b) && diff->val[A_ATOM] == val)
     {
-        if (*diffp == 0)
-            return;
-
-        if (JF(*diffp) != JF(b))
+        r = pull_run(diff, 1);
+        if (!pull_dominates(b, r))
             return;
+        dprev = r->last;
+        diff = JT(dprev);
+        at_top = 0;
+    }
+    if (diff == 0)
+        return;
 
-        if (!SET_MEMBER((*diffp)->dom, b->id))
-            return;
+    if (JF(diff) != JF(b))
+        return;
 
-        if ((*diffp)->val[A_ATOM] != val)
-            break;
+    if (!dominates(b, diff))
+        return;
 
-        diffp = &JT(*diffp);
-        at_top = 0;
-    }
-    samep = &JT(*diffp);
+    /*
+     * Then same, the first block after it with val again.
+     */
+    sprev = diff;
     while (1)
     {
-        if (*samep == 0)
+        same = JT(sprev);
+        if (same == 0)
             return;
 
-        if (JF(*samep) != JF(b))
+        if (JF(same) != JF(b))
             return;
 
-        if (!SET_MEMBER((*samep)->dom, b->id))
-            return;
-
-        if ((*samep)->val[A_ATOM] == val)
+        if (same->val[A_ATOM] == val)
+        {
+            if (!dominates(b, same))
+                return;
             break;
+        }
+
+        r = pull_run(same, 1);
+        if (!pull_dominates(b, r))
+            return;
 
         /* XXX Need to check that there are no data dependencies
-           between diffp and samep.  Currently, the code generator
+           between diff and same.  Currently, the code generator
            will not produce such dependencies. */
-        samep = &JT(*samep);
+        sprev = r->last;
     }
 #ifdef notdef
     /* XXX This doesn't cover everything. */
     for (i = 0; i < N_ATOMS; ++i)
-        if ((*samep)->val[i] != pred->val[i])
+        if (same->val[i] != pred->val[i])
             return;
 #endif
     /* Pull up the node. */
-    pull = *samep;
-    *samep = JT(pull);
-    JT(pull) = *diffp;
+    pull = same;
+    pull_link(sprev, 1, JT(pull));
+    pull_link(pull, 1, diff);
 
     /*
      * At the top of the chain, each predecessor needs to point at the
@@ -1661,15 +2333,10 @@ static void and_pullup(b)
     if (at_top)
     {
         for (ep = b->in_edges; ep != 0; ep = ep->next)
-        {
-            if (JT(ep->pred) == b)
-                JT(ep->pred) = pull;
-            else
-                JF(ep->pred) = pull;
-        }
+            pull_link(ep->pred, JT(ep->pred) == b, pull);
     }
     else
-        *diffp = pull;
+        pull_link(dprev, 1, pull);
 
     done = 0;
 }
@@ -1684,7 +2351,6 @@ static void opt_blks(root, do_stmts)
     init_val();
     maxlevel = root->level;
 
-    find_inedges(root);
     for (i = maxlevel; i >= 0; --i)
         for (p = levels[i]; p; p = p->link)
             opt_blk(p, do_stmts);
@@ -1696,6 +2362,8 @@ static void opt_blks(root, do_stmts)
          */
         return;
 
+    fold_index();
+
     for (i = 1; i <= maxlevel; ++i)
     {
         for (p = levels[i]; p; p = p->link)
@@ -1706,6 +2374,7 @@ static void opt_blks(root, do_stmts)
     }
 
     find_inedges(root);
+    pull_init(root);
     for (i = 1; i <= maxlevel; ++i)
     {
         for (p = levels[i]; p; p = p->link)
@@ -1787,8 +2456,8 @@ static void opt_loop(root, do_stmts)
     {
         done = 1;
         find_levels(root);
+        find_inedges(root);
         find_dom(root);
-        find_closure(root);
         find_ud(root);
         find_edom(root);
         opt_blks(root, do_stmts);
@@ -1813,6 +2482,11 @@ void bpf_optimize(rootp)
     root = *rootp;
 
     opt_init(root);
+    if (n_blocks > OPT_MAX_BLOCKS)
+    {
+        opt_cleanup();
+        return;
+    }
     opt_loop(root, 0);
     opt_loop(root, 1);
     intern_blocks(root);
@@ -1834,31 +2508,6 @@ void bpf_optimize(rootp)
     opt_cleanup();
 }
 
-static void make_marks(p)
-     struct block *p;
-{
-    if (!isMarked(p))
-    {
-        Mark(p);
-        if (BPF_CLASS(p->s.code) != BPF_RET)
-        {
-            make_marks(JT(p));
-            make_marks(JF(p));
-        }
-    }
-}
-
-/*
- * Mark code array such that isMarked(i) is true
- * only for nodes that are alive.
- */
-static void mark_code(p)
-     struct block *p;
-{
-    cur_mark += 1;
-    make_marks(p);
-}
-
 /*
  * True iff the two stmt lists load the same value from the packet into
  * the accumulator.
@@ -1883,71 +2532,144 @@ static int eq_slist(x, y)
     }
 }
 
+/*
+ * The class of a block's successor while interning; see intern_blocks().
+ */
+#define CLASS_OF(b) ((b) ? (b)->link : 0)
+
+/*
+ * True iff two blocks, whose successors have been put into classes, have
+ * the same code and go to the same classes of blocks.
+ */
 static inline int eq_blk(b0, b1)
      struct block *b0, *b1;
 {
     if (b0->s.code == b1->s.code &&
-        b0->s.k == b1->s.k && b0->et.succ == b1->et.succ && b0->ef.succ == b1->ef.succ)
+        b0->s.k == b1->s.k &&
+        CLASS_OF(JT(b0)) == CLASS_OF(JT(b1)) && CLASS_OF(JF(b0)) == CLASS_OF(JF(b1)))
         return eq_slist(b0->stmts, b1->stmts);
     return 0;
 }
 
+/*
+ * Hash of what eq_blk() compares.
+ */
+static u_int hash_blk(b)
+     struct block *b;
+{
+    struct slist *s;
+    u_int h;
+
+    h = (u_int) b->s.code * 0x9e3779b1U ^ (u_int) b->s.k;
+    h = h * 0x85ebca6bU ^ (u_int) (size_t) CLASS_OF(JT(b));
+    h = h * 0x85ebca6bU ^ (u_int) (size_t) CLASS_OF(JF(b));
+    for (s = b->stmts; s; s = s->next)
+        if (s->s.code != NOP)
+            h = (h * 0xc2b2ae35U ^ (u_int) s->s.code) * 0x9e3779b1U ^ (u_int) s->s.k;
+    return h ^ (h >> 16);
+}
+
+/*
+ * Merge blocks that have the same code and go to the same places.
+ *
+ * Blocks are equal once their successors have been merged, so visiting
+ * them successors first puts each live block in its class in one pass;
+ * a block's link is the first member of its class found.  Each class is
+ * then represented by its highest numbered member, which is what
+ * repeatedly linking every block to the last block it matches and
+ * redirecting branches until nothing changes would end up with.
+ */
 static void intern_blocks(root)
      struct block *root;
 {
-    struct block *p;
-    int i, j;
-    int done1;                  /* don't shadow global */
-  top:
-    done1 = 1;
-    for (i = 0; i < n_blocks; ++i)
-        blocks[i]->link = 0;
-
-    mark_code(root);
+    struct block *p, **order, **table, **slot, **rep;
+    u_int mask, h;
+    int i, n;
+
+    for (mask = 1; mask < 2 * (u_int) n_blocks; mask <<= 1)
+        ;
+    table = (struct block **) calloc(mask, sizeof(*table));
+    rep = (struct block **) calloc(n_blocks, sizeof(*rep));
+    if (table == NULL || rep == NULL)
+        bpf_error("malloc");
+    mask--;
 
-    for (i = n_blocks - 1; --i >= 0;)
+    cur_mark += 1;
+    order = walk_graph(root, 1, 0, &n);
+    for (i = 0; i < n; ++i)
     {
-        if (!isMarked(blocks[i]))
-            continue;
-        for (j = i + 1; j < n_blocks; ++j)
+        p = order[i];
+        for (h = hash_blk(p);; h++)
         {
-            if (!isMarked(blocks[j]))
-                continue;
-            if (eq_blk(blocks[i], blocks[j]))
-            {
-                blocks[i]->link = blocks[j]->link ? blocks[j]->link : blocks[j];
+            slot = &table[h & mask];
+            if (*slot == 0 || eq_blk(p, *slot))
                 break;
-            }
         }
+        if (*slot == 0)
+            *slot = p;
+        p->link = *slot;
+        slot = &rep[p->link->id];
+        if (*slot == 0 || (*slot)->id < p->id)
+            *slot = p;
     }
-    for (i = 0; i < n_blocks; ++i)
+    for (i = 0; i < n; ++i)
     {
-        p = blocks[i];
+        p = order[i];
         if (JT(p) == 0)
             continue;
-        if (JT(p)->link)
-        {
-            done1 = 0;
-            JT(p) = JT(p)->link;
-        }
-        if (JF(p)->link)
-        {
-            done1 = 0;
-            JF(p) = JF(p)->link;
-        }
+        JT(p) = rep[JT(p)->link->id];
+        JF(p) = rep[JF(p)->link->id];
     }
-    if (!done1)
-        goto top;
+    for (i = 0; i < n; ++i)
+        order[i]->link = 0;
+    free(order);
+    free(rep);
+    free(table);
 }
 
 static void opt_cleanup()
 {
     free((void *) vnode_base);
     free((void *) vmap);
-    free((void *) edges);
-    free((void *) space);
+    free((void *) hashtbl);
+    free((void *) dom_order);
+    free((void *) dom_stack);
+    free((void *) fold_groups);
+    free((void *) fold_ents);
+    free((void *) fold_stack);
+    free((void *) fold_runs);
+    free((void *) fold_run_stack);
+    free((void *) fold_sets);
+    free((void *) fold_set_stack);
+    free((void *) pull_runs);
+    free((void *) pull_stack);
     free((void *) levels);
     free((void *) blocks);
+    vnode_base = NULL;
+    vmap = NULL;
+    hashtbl = NULL;
+    dom_order = NULL;
+    dom_stack = NULL;
+    fold_groups = NULL;
+    fold_ents = NULL;
+    fold_stack = NULL;
+    fold_runs = NULL;
+    fold_run_stack = NULL;
+    fold_sets = NULL;
+    fold_set_stack = NULL;
+    pull_runs = NULL;
+    pull_stack = NULL;
+    levels = NULL;
+    blocks = NULL;
+}
+
+/*
+ * Free what an optimization cut short by bpf_error() had allocated, so
+ * that the thread holds on to nothing between compiles.
+ */
+void bpf_optimize_abort()
+{
+    opt_cleanup();
 }
 
 /*
@@ -1965,67 +2687,73 @@ static int slength(s)
 }
 
 /*
- * Return the number of nodes reachable by 'p'.
- * All nodes should be initially unmarked.
+ * Walk the unmarked blocks reachable from root depth first, as a
+ * recursive walk would, marking them.  The flow graph of a large filter
+ * is too deep to recurse over, so this keeps its own stack.  Returns the
+ * blocks in the order they are first reached, or if postorder, in the
+ * order they are finished, taking the true branch first unless jf_first;
+ * *np is set to how many there are.  The caller frees the array.
  */
-static int count_blocks(p)
-     struct block *p;
-{
-    if (p == 0 || isMarked(p))
-        return 0;
-    Mark(p);
-    return count_blocks(JT(p)) + count_blocks(JF(p)) + 1;
-}
-
-/*
- * Do a depth first search on the flow graph, numbering the
- * the basic blocks, and entering them into the 'blocks' array.`
- */
-static void number_blks_r(p)
-     struct block *p;
+static struct block **walk_graph(root, postorder, jf_first, np)
+     struct block *root;
+     int postorder, jf_first;
+     int *np;
 {
-    int n;
+    struct block **order, **stack, **p, *b;
+    int n, nmarked, sp, size;
 
-    if (p == 0 || isMarked(p))
-        return;
-
-    Mark(p);
-    n = n_blocks++;
-    p->id = n;
-    blocks[n] = p;
-
-    number_blks_r(JT(p));
-    number_blks_r(JF(p));
-}
-
-/*
- * Return the number of stmts in the flowgraph reachable by 'p'.
- * The nodes should be unmarked before calling.
- *
- * Note that "stmts" means "instructions", and that this includes
- *
- *	side-effect statements in 'p' (slength(p->stmts));
- *
- *	statements in the true branch from 'p' (count_stmts(JT(p)));
- *
- *	statements in the false branch from 'p' (count_stmts(JF(p)));
- *
- *	the conditional jump itself (1);
- *
- *	an extra long jump if the true branch requires it (p->longjt);
- *
- *	an extra long jump if the false branch requires it (p->longjf).
- */
-static int count_stmts(p)
-     struct block *p;
-{
-    int n;
+    /*
+     * Each marked block adds one entry to the order and at most three
+     * to the stack, so both are sized by the number marked.
+     */
+    size = 64;
+    order = (struct block **) malloc(size * sizeof(*order));
+    stack = (struct block **) malloc((3 * size + 1) * sizeof(*stack));
+    if (order == NULL || stack == NULL)
+        bpf_error("malloc");
 
-    if (p == 0 || isMarked(p))
-        return 0;
-    Mark(p);
-    n = count_stmts(JT(p)) + count_stmts(JF(p));
-    return slength(p->stmts) + n + 1 + p->longjt + p->longjf;
+    /*
+     * A stacked block whose low address bit is set has had its
+     * successors walked and is finished when popped.
+     */
+    n = nmarked = sp = 0;
+    stack[sp++] = root;
+    while (sp > 0)
+    {
+        b = stack[--sp];
+        if ((size_t) b & 1)
+        {
+            order[n++] = (struct block *) ((size_t) b & ~(size_t) 1);
+            continue;
+        }
+        if (b == 0 || isMarked(b))
+            continue;
+        Mark(b);
+        if (++nmarked > size)
+        {
+            size *= 2;
+            p = (struct block **) realloc(order, size * sizeof(*order));
+            if (p == NULL)
+                bpf_error("malloc");
+            order = p;
+            p = (struct block **) realloc(stack, (3 * size + 1) * sizeof(*stack));
+            if (p == NULL)
+                bpf_error("malloc");
+            stack = p;
+        }
+        if (postorder)
+            stack[sp++] = (struct block *) ((size_t) b | 1);
+        else
+            order[n++] = b;
+        if (BPF_CLASS(b->s.code) != BPF_RET)
+        {
+            stack[sp++] = jf_first ? JT(b) : JF(b);
+            stack[sp++] = jf_first ? JF(b) : JT(b);
+        }
+    }
+    free(stack);
+    *np = n;
+    return order;
 }
 
 /*
@@ -2036,26 +2764,26 @@ static int count_stmts(p)
 static void opt_init(root)
      struct block *root;
 {
-    bpf_u_int32 *p;
     int i, n, max_stmts;
+    u_int size;
 
     /*
-     * First, count the blocks, so we can malloc an array to map
-     * block number to block.  Then, put the blocks into the array.
+     * Number the blocks in the order they're first reached, and put
+     * them into an array to map block number to block.
      */
     unMarkAll();
-    n = count_blocks(root);
-    blocks = (struct block **) calloc(n, sizeof(*blocks));
-    if (blocks == NULL)
-        bpf_error("malloc");
-    unMarkAll();
-    n_blocks = 0;
-    number_blks_r(root);
+    blocks = walk_graph(root, 0, 0, &n);
+    n_blocks = n;
+    for (i = 0; i < n; ++i)
+    {
+        register struct block *b = blocks[i];
 
-    n_edges = 2 * n_blocks;
-    edges = (struct edge **) calloc(n_edges, sizeof(*edges));
-    if (edges == NULL)
-        bpf_error("malloc");
+        b->id = i;
+        b->et.id = i;
+        b->ef.id = n_blocks + i;
+        b->et.pred = b;
+        b->ef.pred = b;
+    }
 
     /*
      * The number of levels is bounded by the number of nodes.
@@ -2064,43 +2792,31 @@ static void opt_init(root)
     if (levels == NULL)
         bpf_error("malloc");
 
-    edgewords = n_edges / (8 * sizeof(bpf_u_int32)) + 1;
-    nodewords = n_blocks / (8 * sizeof(bpf_u_int32)) + 1;
-
-    /* XXX */
-    space = (bpf_u_int32 *) malloc(2 * n_blocks * nodewords * sizeof(*space)
-                                   + n_edges * edgewords * sizeof(*space));
-    if (space == NULL)
+    /*
+     * The edge dominator tree has a node for each edge and its root, and
+     * each edge has at most two fold keys.
+     */
+    dom_order = (struct domnode **) malloc((2 * n_blocks + 1) * sizeof(*dom_order));
+    dom_stack = (struct domnode **) malloc((2 * n_blocks + 1) * sizeof(*dom_stack));
+    fold_ents = (struct foldent *) malloc(3 * n_blocks * sizeof(*fold_ents));
+    fold_stack = (int *) malloc(3 * n_blocks * sizeof(*fold_stack));
+    fold_runs = (struct foldrun *) calloc(n_blocks, sizeof(*fold_runs));
+    fold_run_stack = (struct foldrun **) malloc(n_blocks * sizeof(*fold_run_stack));
+    fold_sets = (struct foldset *) calloc(n_blocks, sizeof(*fold_sets));
+    fold_set_stack = (struct block **) malloc(n_blocks * sizeof(*fold_set_stack));
+    fold_epoch = 0;
+    pull_runs = (struct pullrun *) calloc(2 * n_blocks, sizeof(*pull_runs));
+    pull_stack = (struct pullrun **) malloc(n_blocks * sizeof(*pull_stack));
+    pull_epoch[0] = pull_epoch[1] = 0;
+    for (size = 1; size < 6 * (u_int) n_blocks; size <<= 1)
+        ;
+    fold_groups = (struct foldgroup *) malloc(size * sizeof(*fold_groups));
+    fold_mask = size - 1;
+    if (dom_order == NULL || dom_stack == NULL || fold_ents == NULL || fold_stack == NULL || fold_groups == NULL
+        || fold_runs == NULL || fold_run_stack == NULL || fold_sets == NULL || fold_set_stack == NULL
+        || pull_runs == NULL || pull_stack == NULL)
         bpf_error("malloc");
-    p = space;
-    all_dom_sets = p;
-    for (i = 0; i < n; ++i)
-    {
-        blocks[i]->dom = p;
-        p += nodewords;
-    }
-    all_closure_sets = p;
-    for (i = 0; i < n; ++i)
-    {
-        blocks[i]->closure = p;
-        p += nodewords;
-    }
-    all_edge_sets = p;
-    for (i = 0; i < n; ++i)
-    {
-        register struct block *b = blocks[i];
 
-        b->et.edom = p;
-        p += edgewords;
-        b->ef.edom = p;
-        p += edgewords;
-        b->et.id = i;
-        edges[i] = &b->et;
-        b->ef.id = n_blocks + i;
-        edges[n_blocks + i] = &b->ef;
-        b->et.pred = b;
-        b->ef.pred = b;
-    }
     max_stmts = 0;
     for (i = 0; i < n; ++i)
         max_stmts += slength(blocks[i]->stmts) + 1;
@@ -2114,6 +2830,12 @@ static void opt_init(root)
     vnode_base = (struct valnode *) calloc(maxval, sizeof(*vnode_base));
     if (vmap == NULL || vnode_base == NULL)
         bpf_error("malloc");
+    for (size = 256; size < (u_int) maxval; size <<= 1)
+        ;
+    hashtbl = (struct valnode **) calloc(size, sizeof(*hashtbl));
+    if (hashtbl == NULL)
+        bpf_error("malloc");
+    hash_mask = size - 1;
 }
 
 /*
@@ -2121,20 +2843,21 @@ static void opt_init(root)
  * into the array form that BPF requires.  'fstart' will point to
  * the malloc'd array while 'ftail' is used during the recursive traversal.
  */
-static struct bpf_insn *fstart;
-static struct bpf_insn *ftail;
+static SFBPF_TLS struct bpf_insn *fstart;
+static SFBPF_TLS struct bpf_insn *ftail;
 
 #ifdef BDEBUG
 int bids[1000];
 #endif
 
 /*
+ * Convert one block, whose successors have been converted already.
  * Returns true if successful.  Returns false if a branch has
  * an offset that is too large.  If so, we have marked that
  * branch so that on a subsequent iteration, it will be treated
  * properly.
  */
-static int convert_code_r(p)
+static int convert_code(p)
      struct block *p;
 {
     struct bpf_insn *dst;
@@ -2144,15 +2867,6 @@ static int convert_code_r(p)
     int extrajmps;              /* number of extra jumps inserted */
     struct slist **offset = NULL;
 
-    if (p == 0 || isMarked(p))
-        return (1);
-    Mark(p);
-
-    if (convert_code_r(JF(p)) == 0)
-        return (0);
-    if (convert_code_r(JT(p)) == 0)
-        return (0);
-
     slen = slength(p->stmts);
     dst = ftail -= (slen + 1 + p->longjt + p->longjf);
     /* inflate length by any extra jumps */
@@ -2321,17 +3035,32 @@ struct bpf_insn *icode_to_fcode(root, lenp)
      struct block *root;
      int *lenp;
 {
-    int n;
+    int i, n, nblocks, ok;
+    struct block **order, *p;
     struct bpf_insn *fp;
 
     /*
-     * Loop doing convert_code_r() until no branches remain
-     * with too-large offsets.
+     * Loop doing convert_code() until no branches remain
+     * with too-large offsets.  Branches only get longer as
+     * long jumps are added, so every branch found too long
+     * in a pass is marked before the next.
      */
     while (1)
     {
         unMarkAll();
-        n = *lenp = count_stmts(root);
+        order = walk_graph(root, 1, 1, &nblocks);
+
+        /*
+         * Count the instructions: side-effect statements, the
+         * branch itself, and any long jumps it needs.
+         */
+        n = 0;
+        for (i = 0; i < nblocks; ++i)
+        {
+            p = order[i];
+            n += slength(p->stmts) + 1 + p->longjt + p->longjf;
+        }
+        *lenp = n;
 
         fp = (struct bpf_insn *) malloc(sizeof(*fp) * n);
         if (fp == NULL)
@@ -2340,8 +3069,12 @@ struct bpf_insn *icode_to_fcode(root, lenp)
         fstart = fp;
         ftail = fp + n;
 
-        unMarkAll();
-        if (convert_code_r(root))
+        ok = 1;
+        for (i = 0; i < nblocks; ++i)
+            if (!convert_code(order[i]))
+                ok = 0;
+        free(order);
+        if (ok)
             break;
         free(fp);
     }
@@ -165,7 +165,7 @@ struct pcap_etherent *pcap_next_etherent(FILE * fp)
 {
     register int c, d, i;
     char *bp;
-    static struct pcap_etherent e;
+    static SFBPF_TLS struct pcap_etherent e;
 
     memset((char *) &e, 0, sizeof(e));
     do
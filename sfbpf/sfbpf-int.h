@@ -36,7 +36,18 @@
 #include "sfbpf.h"
 #include "sf-redefines.h"
 
-#define PCAP_ERRBUF_SIZE 256
+#define PCAP_ERRBUF_SIZE SFBPF_ERRBUF_SIZE
+
+/*
+ * There is no per-compile context object: compiler state that isn't
+ * carried in the scanner or parser is kept per thread, so a thread runs
+ * one compile at a time but threads can compile concurrently.
+ */
+#ifdef WIN32
+#define SFBPF_TLS __declspec(thread)
+#else
+#define SFBPF_TLS __thread
+#endif
 
 #ifndef strlcpy
 #define strlcpy(x, y, z) \
@@ -45,9 +56,43 @@
      strlen((y)))
 #endif
 
-int yylex(void);
 int sfbpf_strcasecmp(const char *s1, const char *s2);
 
+/*
+ * Version of the programs the compiler generates.  Bump it with any change
+ * to the code generator or the optimizer that changes their output, so
+ * that programs cached by an earlier version get compiled again.
+ */
+#define BPF_CODEGEN_VERSION 1
+
+u_int bpf_filter_tables(const struct bpf_insn *pc, struct bpf_table * const *tables, const u_char *p,
+                        u_int wirelen, u_int buflen, const struct bpf_aux_data *aux_data);
+int bpf_validate_tables(const struct bpf_insn *f, int len, u_int ntables);
+
+/* Pre-decoded programs, see sf_bpf_filter.c */
+struct bpf_decoded_insn;
+struct bpf_decoded_insn *bpf_decode(const struct bpf_insn *insns, u_int len);
+u_int bpf_filter_decoded(const struct bpf_decoded_insn *code, struct bpf_table * const *tables,
+                         const u_char *p, u_int wirelen, u_int buflen,
+                         const struct bpf_aux_data *aux_data);
+
+/* Lookup tables, see sf_bpf_table.c */
+#define BPF_TABLE_HASH4     0   /* Exact match on A */
+#define BPF_TABLE_HASH16    1   /* Exact match on 16 packet bytes at offset A */
+#define BPF_TABLE_LPM4      2   /* Prefix match on A */
+#define BPF_TABLE_LPM16     3   /* Prefix match on 16 packet bytes at offset A */
+
+struct bpf_table *bpf_table_new(u_int type);
+int bpf_table_insert(struct bpf_table *table, const void *key);
+int bpf_table_insert_prefix(struct bpf_table *table, const void *key, u_int plen);
+int bpf_table_lookup(const struct bpf_table *table, bpf_u_int32 a, const u_char *p, u_int buflen);
+u_int bpf_table_key_len(const struct bpf_table *table);
+struct bpf_table *bpf_table_ref(struct bpf_table *table);
+void bpf_table_unref(struct bpf_table *table);
+struct bpf_table *bpf_table_intern(struct bpf_table *table);
+size_t bpf_table_save(const struct bpf_table *table, u_char *buf);
+struct bpf_table *bpf_table_restore(const u_char *buf, size_t len, size_t *used);
+
 #define SFBPF_NETMASK_UNKNOWN        0xffffffff
 
 #endif /* _SFBPF_INT_H */
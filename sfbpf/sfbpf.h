@@ -78,12 +78,19 @@ typedef	u_int sfbpf_u_int32;
 #define SFBPF_MAXBUFSIZE 0x8000
 #define SFBPF_MINBUFSIZE 32
 
+/*
+ * Lookup table referenced by SFBPF_LOOKUP instructions (see below).
+ */
+struct sfbpf_table;
+
 /*
  * Structure for "pcap_compile()", "pcap_setfilter()", etc..
  */
 struct sfbpf_program {
 	u_int bf_len;
 	struct sfbpf_insn *bf_insns;
+	u_int bf_ntables;
+	struct sfbpf_table **bf_tables;	/* Tables for SFBPF_LOOKUP, or NULL */
 };
  
 /*
@@ -161,8 +168,17 @@ struct sfbpf_version {
 /* misc */
 #define SFBPF_MISCOP(code) ((code) & 0xf8)
 #define		SFBPF_TAX		0x00
+#define		SFBPF_LOOKUP	0x40
 #define		SFBPF_TXA		0x80
 
+/*
+ * SFBPF_MISC|SFBPF_LOOKUP sets A to 1 if a key is in table k of the program
+ * and to 0 if not.  For tables of 4-byte keys the key is A; for 16-byte keys
+ * (IPv6 addresses) it is the 16 bytes of the packet at offset A, and the
+ * packet is rejected if they weren't all captured.  sfbpf_filter() has no
+ * tables, so programs using them must be run with sfbpf_jit_compile().
+ */
+
 /*
  * The instruction data structure.
  */
@@ -179,11 +195,88 @@ struct sfbpf_insn {
 #define SFBPF_STMT(code, k) { (u_short)(code), 0, 0, k }
 #define SFBPF_JUMP(code, k, jt, jf) { (u_short)(code), jt, jf, k }
 
+/*
+ * Ancillary data loads.  An absolute load from SFBPF_AUX_OFF + one of the
+ * SFBPF_AUX_* offsets fetches metadata supplied alongside the packet instead
+ * of packet data.  The numbering matches Linux's SKF_AD_* so that programs
+ * using them can also be handed to the kernel as socket filters.
+ */
+#define SFBPF_AUX_OFF                   (-0x1000)
+#define SFBPF_AUX_VLAN_TAG              44
+#define SFBPF_AUX_VLAN_TAG_PRESENT      48
+
+struct sfbpf_aux_data {
+	u_short vlan_tag;               /* TCI of the VLAN tag stripped from the packet */
+	u_short vlan_tag_present;       /* Nonzero if a VLAN tag was stripped */
+};
+
+/*
+ * Flags for sfbpf_compile_flags().
+ *
+ * SFBPF_COMPILE_VLAN_AUX - The capture layer strips the outermost VLAN tag
+ *     from the packet and reports it as ancillary data, so the first "vlan"
+ *     in an expression tests that instead of the packet contents.
+ */
+#define SFBPF_COMPILE_VLAN_AUX          0x1
+
+/*
+ * Size of the error buffer passed to sfbpf_compile_errbuf(),
+ * sfbpf_compile_set() and sfbpf_compile_cached().
+ */
+#define SFBPF_ERRBUF_SIZE               256
+
+/*
+ * What a program reads, as worked out by sfbpf_analyze().
+ *
+ * max_offset is one past the last packet byte any load can touch, so a
+ * capture length of at least max_offset never makes the program reject a
+ * packet for want of data.  fixed has a bit set (LSB first) for each byte
+ * below SFBPF_DEPS_FIXED_BYTES that is read at an offset known at compile
+ * time; it shows which header fields the program looks at.
+ */
+#define SFBPF_DEPS_FIXED_BYTES          256
+
+struct sfbpf_deps {
+	sfbpf_u_int32 max_offset;
+	u_int flags;                    /* SFBPF_DEPS_* */
+	u_char fixed[SFBPF_DEPS_FIXED_BYTES / 8];
+};
+
+#define SFBPF_DEPS_UNBOUNDED            0x1     /* Some load has no useful bound; max_offset is 0xffffffff */
+#define SFBPF_DEPS_VARIABLE             0x2     /* Some load is at an offset computed from packet data */
+#define SFBPF_DEPS_LEN                  0x4     /* The wire length is read */
+#define SFBPF_DEPS_AUX                  0x8     /* Ancillary data is read */
+#define SFBPF_DEPS_TABLES               0x10    /* Lookup tables are used */
+
+/*
+ * A program prepared for repeated execution by sfbpf_jit_compile().  On
+ * x86-64 it is translated to native code; elsewhere (or if executable memory
+ * is unavailable) it is pre-decoded for a threaded interpreter.
+ *
+ * sfbpf_filter_burst() runs one over n packets, one packet after another,
+ * and returns how many it accepted.  aux_data is either NULL or an array of
+ * n entries, one per packet; with NULL, a program compiled with
+ * SFBPF_COMPILE_VLAN_AUX rejects every packet of the burst.
+ */
+struct sfbpf_jit_program;
+
 //#if __STDC__ || defined(__cplusplus)
 int sfbpf_compile(int snaplen_arg, int linktype_arg, struct sfbpf_program *program, const char *buf, int optimize, sfbpf_u_int32 mask);
+int sfbpf_compile_flags(int snaplen_arg, int linktype_arg, struct sfbpf_program *program, const char *buf, int optimize, sfbpf_u_int32 mask, u_int flags);
+int sfbpf_compile_errbuf(int snaplen_arg, int linktype_arg, struct sfbpf_program *program, const char *buf, int optimize, sfbpf_u_int32 mask, u_int flags, char *errbuf);
+int sfbpf_compile_set(int snaplen_arg, int linktype_arg, struct sfbpf_program *program, const char **filters, u_int n, int optimize, sfbpf_u_int32 mask, u_int flags, char *errbuf);
+int sfbpf_compile_cached(const char *cache_dir, int snaplen_arg, int linktype_arg, struct sfbpf_program *program, const char *buf, int optimize, sfbpf_u_int32 mask, u_int flags, char *errbuf);
 int sfbpf_validate(const struct sfbpf_insn *f, int len);
+int sfbpf_analyze(const struct sfbpf_program *program, struct sfbpf_deps *deps);
 u_int sfbpf_filter(const struct sfbpf_insn *pc, const u_char *p, u_int wirelen, u_int buflen);
+u_int sfbpf_filter_with_aux_data(const struct sfbpf_insn *pc, const u_char *p, u_int wirelen, u_int buflen, const struct sfbpf_aux_data *aux_data);
 void sfbpf_freecode(struct sfbpf_program *program);
+struct sfbpf_jit_program *sfbpf_jit_compile(const struct sfbpf_program *program);
+int sfbpf_jit_native(const struct sfbpf_jit_program *jit);
+u_int sfbpf_filter_jit(const struct sfbpf_jit_program *jit, const u_char *p, u_int wirelen, u_int buflen);
+u_int sfbpf_filter_jit_with_aux_data(const struct sfbpf_jit_program *jit, const u_char *p, u_int wirelen, u_int buflen, const struct sfbpf_aux_data *aux_data);
+u_int sfbpf_filter_burst(const struct sfbpf_jit_program *jit, const u_char **pkts, const u_int *wirelens, const u_int *buflens, const struct sfbpf_aux_data *aux_data, u_int n, u_int *results);
+void sfbpf_jit_free(struct sfbpf_jit_program *jit);
 void sfbpf_print(struct sfbpf_program *fp, int verbose);
 /*
 #else
@@ -0,0 +1,91 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfbpf_dlt.h"
+#include "corpus.h"
+
+const int corpus_dlts[CORPUS_NUM_DLTS] = { DLT_EN10MB, DLT_RAW, DLT_LINUX_SLL, DLT_NULL };
+
+FILE *corpus_open(const char *name, const char *mode)
+{
+    const char *srcdir = getenv("srcdir");
+    char path[1024];
+    FILE *fp;
+
+    if (srcdir)
+    {
+        snprintf(path, sizeof(path), "%s/tests/%s", srcdir, name);
+        if ((fp = fopen(path, mode)) != NULL)
+            return fp;
+    }
+    snprintf(path, sizeof(path), "tests/%s", name);
+    if ((fp = fopen(path, mode)) != NULL)
+        return fp;
+    return fopen(name, mode);
+}
+
+char **corpus_load(void)
+{
+    char line[4096];
+    char **filters = NULL;
+    size_t n = 0, len;
+    FILE *fp;
+
+    if ((fp = corpus_open("filters.txt", "r")) == NULL)
+    {
+        fprintf(stderr, "Can't open filters.txt; set srcdir to the sfbpf source directory.\n");
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        if (!strcmp(line, "\"\""))
+            line[0] = '\0';
+        filters = realloc(filters, (n + 2) * sizeof(*filters));
+        if (!filters || !(filters[n] = strdup(line)))
+        {
+            fprintf(stderr, "Out of memory reading filters.txt.\n");
+            exit(1);
+        }
+        filters[++n] = NULL;
+    }
+    fclose(fp);
+    if (n == 0)
+    {
+        fprintf(stderr, "No filters in filters.txt.\n");
+        free(filters);
+        return NULL;
+    }
+    return filters;
+}
+
+void corpus_free(char **filters)
+{
+    char **f;
+
+    for (f = filters; *f; f++)
+        free(*f);
+    free(filters);
+}
@@ -0,0 +1,42 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#ifndef _CORPUS_H
+#define _CORPUS_H
+
+#include <stdio.h>
+
+/*
+ * Open a file of the test directory, looking under $srcdir/tests (as set
+ * by make check) and then under tests/ and the current directory.
+ */
+FILE *corpus_open(const char *name, const char *mode);
+
+/*
+ * Read the filters of tests/filters.txt into a NULL terminated array.
+ * Returns NULL, having said why, if it can't be read.
+ */
+char **corpus_load(void);
+void corpus_free(char **filters);
+
+/* The link types every filter is compiled for. */
+extern const int corpus_dlts[];
+#define CORPUS_NUM_DLTS 4
+
+#endif /* _CORPUS_H */
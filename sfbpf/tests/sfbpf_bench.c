@@ -0,0 +1,157 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+ * Time sfbpf_compile() on large generated filters.
+ *
+ *   sfbpf_bench [-O level] [-s shape] [terms ...]
+ *
+ * Each shape is compiled as an "or" of the given numbers of terms (by
+ * default 1000, 10000 and 100000), with and without optimization unless
+ * -O picks one.  This is built by make check but not run by it.  The
+ * optimizer leaves graphs of more than 100000 blocks alone, so at -O1 the
+ * larger sizes time the unoptimized compile instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfbpf.h"
+#include "sfbpf_dlt.h"
+
+#define TERM_SIZE       64
+
+static const char *shapes[] = { "host", "port", "mixed", "net", NULL };
+static const int default_sizes[] = { 1000, 10000, 100000 };
+
+/* Write term k of the given shape to p. */
+static int bench_term(char *p, const char *shape, int k)
+{
+    if (!strcmp(shape, "port"))
+        return sprintf(p, "port %d", k % 65535 + 1);
+    if (!strcmp(shape, "mixed"))
+        return sprintf(p, "(ip src host 10.%d.%d.%d and tcp dst port %d)",
+                       (k >> 16) & 255, (k >> 8) & 255, k & 255, k % 1000 + 1);
+    if (!strcmp(shape, "net"))
+        return sprintf(p, "(net 10.%d.%d.0/24 and not port %d)", (k >> 8) & 255, k & 255, k % 100);
+    return sprintf(p, "host 10.%d.%d.%d", (k >> 16) & 255, (k >> 8) & 255, k & 255);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench(const char *shape, int n, int optimize)
+{
+    struct sfbpf_program prog;
+    char errbuf[SFBPF_ERRBUF_SIZE];
+    char *filter, *p;
+    double start;
+    int k;
+
+    if ((filter = malloc((size_t) n * TERM_SIZE + 1)) == NULL)
+    {
+        fprintf(stderr, "Out of memory for %d terms.\n", n);
+        return -1;
+    }
+    p = filter;
+    *p = '\0';
+    for (k = 0; k < n; k++)
+    {
+        if (k)
+            p += sprintf(p, " or ");
+        p += bench_term(p, shape, k);
+    }
+
+    start = now();
+    if (sfbpf_compile_errbuf(65535, DLT_EN10MB, &prog, filter, optimize, 0, 0, errbuf) < 0)
+    {
+        printf("%-6s %7d terms  -O%d  failed: %s\n", shape, n, optimize, errbuf);
+        free(filter);
+        return -1;
+    }
+    printf("%-6s %7d terms  -O%d  %8u insns  %9.3f s\n", shape, n, optimize, prog.bf_len, now() - start);
+    fflush(stdout);
+
+    sfbpf_freecode(&prog);
+    free(filter);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *shape = NULL;
+    int level = -1;
+    int i, s, optimize, n, ch, ret = 0;
+
+    while ((ch = getopt(argc, argv, "O:s:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'O':
+            level = atoi(optarg) != 0;
+            break;
+        case 's':
+            shape = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-O level] [-s host|port|mixed|net] [terms ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (s = 0; shape && shapes[s] && strcmp(shape, shapes[s]); s++)
+        ;
+    if (shape && !shapes[s])
+    {
+        fprintf(stderr, "Unknown shape %s.\n", shape);
+        return 1;
+    }
+
+    for (s = 0; shapes[s]; s++)
+    {
+        if (shape && strcmp(shape, shapes[s]))
+            continue;
+        for (optimize = 0; optimize < 2; optimize++)
+        {
+            if (level >= 0 && optimize != level)
+                continue;
+            if (optind < argc)
+            {
+                for (i = optind; i < argc; i++)
+                    if ((n = atoi(argv[i])) > 0 && bench(shapes[s], n, optimize) < 0)
+                        ret = 1;
+            }
+            else
+            {
+                for (i = 0; i < (int) (sizeof(default_sizes) / sizeof(*default_sizes)); i++)
+                    if (bench(shapes[s], default_sizes[i], optimize) < 0)
+                        ret = 1;
+            }
+        }
+    }
+    return ret;
+}
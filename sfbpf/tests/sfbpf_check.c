@@ -0,0 +1,453 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+ * Check that the ways sfbpf has of running a program agree.
+ *
+ * Every filter of filters.txt is compiled for each link type, with and
+ * without optimization (and for Ethernet, with the VLAN tag taken from
+ * ancillary data), as are some hand written programs using instructions
+ * the compiler doesn't generate.  Each is then run over sample packets,
+ * corrupted copies of them and every truncation of those, with and
+ * without ancillary data, by the reference interpreter sfbpf_filter(),
+ * by the native code from sfbpf_jit_compile(), by the threaded
+ * interpreter sfbpf_jit_compile() falls back to, and by
+ * sfbpf_filter_burst().  All of them must return the same.
+ *
+ * sfbpf_filter() has no lookup tables, so programs with sets are checked
+ * against the threaded interpreter instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfbpf.h"
+#include "sfbpf_dlt.h"
+#include "corpus.h"
+
+#define MAX_PKT         96
+#define NUM_CORRUPT     16
+#define BURST           64
+#define MAX_REPORTS     20
+
+/* Ethernet frames, from which the packets of the other link types are made. */
+static const u_char frames[][MAX_PKT] = {
+    /* IPv4 TCP SYN 10.0.0.1:12345 -> 10.0.0.2:80 */
+    { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 0x08, 0x00,
+      0x45, 0, 0, 40, 0, 0, 0, 0, 64, 6, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2,
+      0x30, 0x39, 0, 80, 0, 0, 0, 0, 0, 0, 0, 0, 0x50, 0x02, 0xff, 0xff, 0, 0, 0, 0 },
+    /* VLAN 100, IPv4 with options, UDP 192.168.1.1 -> 10.0.0.2:53 */
+    { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 0x81, 0x00, 0, 100, 0x08, 0x00,
+      0x46, 0, 0, 44, 0, 0, 0, 0, 64, 17, 0, 0, 192, 168, 1, 1, 10, 0, 0, 2,
+      1, 2, 3, 4, 0x04, 0x01, 0, 53, 0, 20, 0, 0 },
+    /* IPv6 TCP 2001:db8::1 -> fe80::2 port 8080 */
+    { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 7, 8, 9, 10, 11, 12, 0x86, 0xdd,
+      0x60, 0, 0, 0, 0, 20, 6, 64,
+      0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+      0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+      0, 22, 0x1f, 0x90, 0, 0, 0, 0, 0, 0, 0, 0, 0x50, 0x12, 0, 0, 0, 0, 0, 0 },
+    /* IPv4 ICMP echo 1.2.3.4 -> 224.0.0.1 */
+    { 1, 0, 0x5e, 0, 0, 1, 7, 8, 9, 10, 11, 12, 0x08, 0x00,
+      0x45, 0, 0, 28, 0, 0, 0x40, 0, 1, 1, 0, 0, 1, 2, 3, 4, 224, 0, 0, 1,
+      8, 0, 0, 0, 0, 1, 0, 1 },
+};
+
+#define NUM_FRAMES (sizeof(frames) / sizeof(frames[0]))
+
+static const struct sfbpf_aux_data aux_data[] = { { 100, 1 }, { 0, 0 }, { 0xfff, 1 } };
+
+#define NUM_AUX (sizeof(aux_data) / sizeof(aux_data[0]))
+
+struct packet
+{
+    u_char data[MAX_PKT + 16];
+    u_int len;
+};
+
+static struct packet packets[NUM_FRAMES * (NUM_CORRUPT + 1)];
+static u_int num_packets;
+
+static unsigned long num_programs, num_runs, num_failures;
+static unsigned long rand_state = 1;
+
+static u_int next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (u_int) (rand_state >> 16) & 0x7fff;
+}
+
+/* Length of the frame up to the last nonzero byte of its headers. */
+static u_int frame_len(const u_char *frame)
+{
+    u_int len = MAX_PKT;
+
+    while (len > 14 && frame[len - 1] == 0)
+        len--;
+    return (len + 6 < MAX_PKT) ? len + 6 : MAX_PKT;
+}
+
+/* Rewrite the Ethernet frame for the given link type. */
+static u_int make_packet(int dlt, const u_char *frame, u_int len, u_char *out)
+{
+    u_int type = (frame[12] << 8) | frame[13];
+    u_int hdr;
+
+    switch (dlt)
+    {
+    case DLT_RAW:
+        hdr = 0;
+        break;
+    case DLT_LINUX_SLL:
+        hdr = 16;
+        memset(out, 0, hdr);
+        out[3] = 1;
+        out[5] = 6;
+        memcpy(out + 6, frame + 6, 6);
+        out[14] = frame[12];
+        out[15] = frame[13];
+        break;
+    case DLT_NULL:
+        /* Address family in host byte order */
+        hdr = 4;
+        {
+            sfbpf_u_int32 af = (type == 0x86dd) ? 24 : 2;
+            memcpy(out, &af, sizeof(af));
+        }
+        break;
+    default:
+        memcpy(out, frame, len);
+        return len;
+    }
+    memcpy(out + hdr, frame + 14, len - 14);
+    return hdr + len - 14;
+}
+
+static void make_packets(int dlt)
+{
+    u_int i, j, k;
+
+    num_packets = 0;
+    rand_state = 1;
+    for (i = 0; i < NUM_FRAMES; i++)
+    {
+        struct packet *base = &packets[num_packets++];
+
+        memset(base->data, 0, sizeof(base->data));
+        base->len = make_packet(dlt, frames[i], frame_len(frames[i]), base->data);
+        for (j = 0; j < NUM_CORRUPT; j++)
+        {
+            struct packet *pkt = &packets[num_packets++];
+
+            *pkt = *base;
+            for (k = 1 + next_rand() % 4; k > 0; k--)
+                pkt->data[next_rand() % pkt->len] = next_rand();
+        }
+    }
+}
+
+static void report(const char *what, const char *how, const struct packet *pkt, u_int buflen, int aux, u_int expected, u_int got)
+{
+    num_failures++;
+    if (num_failures <= MAX_REPORTS)
+        printf("FAIL %s: %s returned %u, expected %u (packet %u, caplen %u, aux %d)\n",
+               what, how, got, expected, (u_int) (pkt - packets), buflen, aux);
+}
+
+static struct sfbpf_jit_program *jit_compile(const struct sfbpf_program *prog, int native)
+{
+    struct sfbpf_jit_program *jit;
+
+    if (!native)
+        setenv("SFBPF_NO_JIT", "1", 1);
+    jit = sfbpf_jit_compile(prog);
+    if (!native)
+        unsetenv("SFBPF_NO_JIT");
+    return jit;
+}
+
+/* A burst of packets with their expected results. */
+struct burst
+{
+    const u_char *pkts[BURST];
+    u_int wirelens[BURST], buflens[BURST], expect[BURST];
+    struct sfbpf_aux_data aux[BURST];
+    u_int n;
+};
+
+/* Run b through sfbpf_filter_burst(), with aux data if with_aux is set, and empty it. */
+static void run_burst(const struct sfbpf_jit_program *jit, struct burst *b, int with_aux, const char *what)
+{
+    u_int results[BURST];
+    u_int i, accepted, expect_accepted = 0;
+
+    memset(results, 0xa5, sizeof(results));
+    accepted = sfbpf_filter_burst(jit, b->pkts, b->wirelens, b->buflens, with_aux ? b->aux : NULL, b->n, results);
+    for (i = 0; i < b->n; i++)
+    {
+        if (results[i] != b->expect[i])
+        {
+            num_failures++;
+            if (num_failures <= MAX_REPORTS)
+                printf("FAIL %s: sfbpf_filter_burst() returned %u, expected %u (caplen %u%s)\n",
+                       what, results[i], b->expect[i], b->buflens[i], with_aux ? ", aux" : "");
+        }
+        if (b->expect[i])
+            expect_accepted++;
+    }
+    if (accepted != expect_accepted)
+    {
+        num_failures++;
+        if (num_failures <= MAX_REPORTS)
+            printf("FAIL %s: sfbpf_filter_burst() accepted %u, expected %u\n", what, accepted, expect_accepted);
+    }
+    b->n = 0;
+}
+
+static void check_program(const struct sfbpf_program *prog, const char *what)
+{
+    struct sfbpf_jit_program *jit, *threaded;
+    struct burst bursts[2], *b;
+    u_int i, buflen, wirelen;
+    int a;
+
+    num_programs++;
+    bursts[0].n = bursts[1].n = 0;
+    jit = jit_compile(prog, 1);
+    threaded = jit_compile(prog, 0);
+    if (!jit || !threaded)
+    {
+        num_failures++;
+        printf("FAIL %s: sfbpf_jit_compile() failed\n", what);
+        goto out;
+    }
+    if (sfbpf_jit_native(threaded))
+    {
+        num_failures++;
+        printf("FAIL %s: SFBPF_NO_JIT didn't select the threaded interpreter\n", what);
+    }
+
+    for (i = 0; i < num_packets; i++)
+    {
+        const struct packet *pkt = &packets[i];
+
+        for (buflen = 0; buflen <= pkt->len; buflen++)
+        {
+            /* Sometimes the wire length exceeds the captured length. */
+            wirelen = buflen + (buflen % 3) * 700;
+            for (a = -1; a < (int) NUM_AUX; a++)
+            {
+                const struct sfbpf_aux_data *aux = (a < 0) ? NULL : &aux_data[a];
+                u_int ref, got;
+
+                got = sfbpf_filter_jit_with_aux_data(threaded, pkt->data, wirelen, buflen, aux);
+                if (prog->bf_ntables)
+                    ref = got;
+                else
+                {
+                    ref = sfbpf_filter_with_aux_data(prog->bf_insns, pkt->data, wirelen, buflen, aux);
+                    if (got != ref)
+                        report(what, "threaded interpreter", pkt, buflen, a, ref, got);
+                }
+                got = sfbpf_filter_jit_with_aux_data(jit, pkt->data, wirelen, buflen, aux);
+                if (got != ref)
+                    report(what, sfbpf_jit_native(jit) ? "JIT" : "JIT fallback", pkt, buflen, a, ref, got);
+                num_runs++;
+
+                /* Packets without aux data and with it go in separate bursts. */
+                b = &bursts[aux != NULL];
+                b->pkts[b->n] = pkt->data;
+                b->wirelens[b->n] = wirelen;
+                b->buflens[b->n] = buflen;
+                if (aux)
+                    b->aux[b->n] = *aux;
+                b->expect[b->n] = ref;
+                if (++b->n == BURST)
+                    run_burst(jit, b, aux != NULL, what);
+            }
+        }
+    }
+    for (a = 0; a < 2; a++)
+        if (bursts[a].n)
+            run_burst(jit, &bursts[a], a, what);
+
+out:
+    if (jit)
+        sfbpf_jit_free(jit);
+    if (threaded)
+        sfbpf_jit_free(threaded);
+}
+
+static void check_filters(char **filters)
+{
+    struct sfbpf_program prog;
+    char errbuf[SFBPF_ERRBUF_SIZE];
+    char what[256];
+    int d, optimize, vlan_aux;
+    char **f;
+
+    for (d = 0; d < CORPUS_NUM_DLTS; d++)
+    {
+        make_packets(corpus_dlts[d]);
+        for (f = filters; *f; f++)
+        {
+            for (optimize = 0; optimize < 2; optimize++)
+            {
+                for (vlan_aux = 0; vlan_aux < 2; vlan_aux++)
+                {
+                    if (vlan_aux && corpus_dlts[d] != DLT_EN10MB)
+                        break;
+                    snprintf(what, sizeof(what), "\"%.160s\" (linktype %d, optimize %d%s)",
+                             *f, corpus_dlts[d], optimize, vlan_aux ? ", vlan aux" : "");
+                    if (sfbpf_compile_errbuf(MAX_PKT, corpus_dlts[d], &prog, *f, optimize, 0xffffff00,
+                                             vlan_aux ? SFBPF_COMPILE_VLAN_AUX : 0, errbuf) < 0)
+                    {
+                        /* Not every filter makes sense for every link type. */
+                        continue;
+                    }
+                    check_program(&prog, what);
+                    sfbpf_freecode(&prog);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Programs using what the compiler doesn't: backward jumps over stores,
+ * scratch memory, division by X (and by zero), MSH, indirect loads with
+ * offsets that wrap, ancillary data and the remaining ALU operations.
+ */
+static struct sfbpf_insn prog_alu[] = {
+    SFBPF_STMT(SFBPF_LD | SFBPF_IMM, 0),
+    SFBPF_STMT(SFBPF_ST, 3),
+    SFBPF_STMT(SFBPF_JMP | SFBPF_JA, 3),
+    SFBPF_STMT(SFBPF_LD | SFBPF_MEM, 3),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_ADD | SFBPF_K, 1),
+    SFBPF_STMT(SFBPF_ST, 3),
+    SFBPF_STMT(SFBPF_LD | SFBPF_MEM, 3),
+    SFBPF_JUMP(SFBPF_JMP | SFBPF_JGE | SFBPF_K, 5, 1, 0),
+    SFBPF_STMT(SFBPF_JMP | SFBPF_JA, 0),
+    SFBPF_STMT(SFBPF_LDX | SFBPF_MSH | SFBPF_B, 14),
+    SFBPF_STMT(SFBPF_LD | SFBPF_H | SFBPF_IND, 14),
+    SFBPF_STMT(SFBPF_STX, 15),
+    SFBPF_STMT(SFBPF_LDX | SFBPF_MEM, 15),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_DIV | SFBPF_X, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_MUL | SFBPF_K, 7),
+    SFBPF_STMT(SFBPF_MISC | SFBPF_TAX, 0),
+    SFBPF_STMT(SFBPF_LD | SFBPF_B | SFBPF_ABS, SFBPF_AUX_OFF + SFBPF_AUX_VLAN_TAG_PRESENT),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_LSH | SFBPF_K, 20),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_OR | SFBPF_X, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_NEG, 0),
+    SFBPF_STMT(SFBPF_LDX | SFBPF_W | SFBPF_LEN, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_SUB | SFBPF_X, 0),
+    SFBPF_JUMP(SFBPF_JMP | SFBPF_JSET | SFBPF_X, 0, 0, 1),
+    SFBPF_STMT(SFBPF_RET | SFBPF_A, 0),
+    SFBPF_STMT(SFBPF_LD | SFBPF_W | SFBPF_ABS, SFBPF_AUX_OFF + 12),
+    SFBPF_STMT(SFBPF_RET | SFBPF_K, 99),
+};
+
+static struct sfbpf_insn prog_div0[] = {
+    SFBPF_STMT(SFBPF_LDX | SFBPF_IMM, 0),
+    SFBPF_STMT(SFBPF_LD | SFBPF_B | SFBPF_ABS, 15),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_DIV | SFBPF_X, 0),
+    SFBPF_STMT(SFBPF_RET | SFBPF_K, 1),
+};
+
+static struct sfbpf_insn prog_ind[] = {
+    SFBPF_STMT(SFBPF_LD | SFBPF_H | SFBPF_ABS, SFBPF_AUX_OFF + SFBPF_AUX_VLAN_TAG),
+    SFBPF_STMT(SFBPF_MISC | SFBPF_TAX, 0),
+    SFBPF_STMT(SFBPF_LD | SFBPF_W | SFBPF_IND, 0xfffffff0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_RSH | SFBPF_X, 0),
+    SFBPF_JUMP(SFBPF_JMP | SFBPF_JGT | SFBPF_X, 0, 2, 0),
+    SFBPF_STMT(SFBPF_MISC | SFBPF_TXA, 0),
+    SFBPF_STMT(SFBPF_RET | SFBPF_A, 0),
+    SFBPF_STMT(SFBPF_LD | SFBPF_W | SFBPF_ABS, 0x7ffffffe),
+    SFBPF_STMT(SFBPF_RET | SFBPF_A, 0),
+};
+
+static struct sfbpf_insn prog_alu_k[] = {
+    SFBPF_STMT(SFBPF_LD | SFBPF_W | SFBPF_ABS, 26),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_AND | SFBPF_K, 0xff00ff00),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_RSH | SFBPF_K, 3),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_SUB | SFBPF_K, 0x10000),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_DIV | SFBPF_K, 3),
+    SFBPF_STMT(SFBPF_MISC | SFBPF_TAX, 0),
+    SFBPF_STMT(SFBPF_LD | SFBPF_W | SFBPF_LEN, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_MUL | SFBPF_X, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_AND | SFBPF_X, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_ADD | SFBPF_X, 0),
+    SFBPF_STMT(SFBPF_ALU | SFBPF_LSH | SFBPF_X, 0),
+    SFBPF_JUMP(SFBPF_JMP | SFBPF_JGE | SFBPF_X, 0, 0, 2),
+    SFBPF_JUMP(SFBPF_JMP | SFBPF_JEQ | SFBPF_X, 0, 2, 0),
+    SFBPF_STMT(SFBPF_RET | SFBPF_K, 0xffffffff),
+    SFBPF_STMT(SFBPF_RET | SFBPF_A, 0),
+    SFBPF_STMT(SFBPF_MISC | SFBPF_TXA, 0),
+    SFBPF_STMT(SFBPF_RET | SFBPF_A, 0),
+};
+
+#define PROG(p) { #p, sizeof(p) / sizeof(p[0]), p }
+
+static const struct
+{
+    const char *name;
+    u_int len;
+    struct sfbpf_insn *insns;
+} programs[] = {
+    PROG(prog_alu),
+    PROG(prog_div0),
+    PROG(prog_ind),
+    PROG(prog_alu_k),
+};
+
+static void check_programs(void)
+{
+    struct sfbpf_program prog;
+    u_int i;
+
+    make_packets(DLT_EN10MB);
+    memset(&prog, 0, sizeof(prog));
+    for (i = 0; i < sizeof(programs) / sizeof(programs[0]); i++)
+    {
+        prog.bf_len = programs[i].len;
+        prog.bf_insns = programs[i].insns;
+        if (!sfbpf_validate(prog.bf_insns, prog.bf_len))
+        {
+            num_failures++;
+            printf("FAIL %s: invalid program\n", programs[i].name);
+            continue;
+        }
+        check_program(&prog, programs[i].name);
+    }
+}
+
+int main(void)
+{
+    char **filters;
+
+    if ((filters = corpus_load()) == NULL)
+        return 1;
+
+    check_filters(filters);
+    check_programs();
+    corpus_free(filters);
+
+    printf("%lu programs, %lu runs, %lu failures\n", num_programs, num_runs, num_failures);
+    return num_failures != 0;
+}
@@ -0,0 +1,214 @@
+/*
+** Copyright (C) 2014 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+/*
+ * Check that the compiler still generates the code it did.
+ *
+ * Every filter of filters.txt is compiled for each link type, with and
+ * without optimization, as are chains of up to a few thousand terms of
+ * the kinds large generated filters are made of.  The length and a hash
+ * of each program must match those recorded in codegen.txt.  Changes to
+ * the compiler that aren't meant to change its output, such as making it
+ * faster, are checked this way; after one that is, "sfbpf_codegen -g"
+ * records the new code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfbpf.h"
+#include "sfbpf_dlt.h"
+#include "corpus.h"
+
+#define MAX_CHAIN       1535
+#define NUM_SHAPES      6
+#define MAX_REPORTS     20
+
+static FILE *expected;
+static int generate;
+static unsigned long num_programs, num_failures;
+static unsigned long rand_state = 1;
+
+static u_int next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (u_int) (rand_state >> 16) & 0x7fff;
+}
+
+/* FNV-1a over the instructions, byte by byte in a fixed order. */
+static u_int hash_program(const struct sfbpf_program *prog)
+{
+    const struct sfbpf_insn *insn;
+    u_char b[8];
+    u_int h = 2166136261U;
+    u_int i, j;
+
+    for (i = 0; i < prog->bf_len; i++)
+    {
+        insn = &prog->bf_insns[i];
+        b[0] = insn->code & 0xff;
+        b[1] = insn->code >> 8;
+        b[2] = insn->jt;
+        b[3] = insn->jf;
+        b[4] = insn->k & 0xff;
+        b[5] = (insn->k >> 8) & 0xff;
+        b[6] = (insn->k >> 16) & 0xff;
+        b[7] = insn->k >> 24;
+        for (j = 0; j < sizeof(b); j++)
+            h = (h ^ b[j]) * 16777619U;
+    }
+    return h;
+}
+
+/* Read the next line of codegen.txt that isn't a comment. */
+static int next_expected(char *line, size_t size)
+{
+    while (fgets(line, size, expected))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#')
+            return 1;
+    }
+    return 0;
+}
+
+static void check(const char *filter, const char *label, int dlt, int optimize)
+{
+    struct sfbpf_program prog;
+    char errbuf[SFBPF_ERRBUF_SIZE];
+    char line[512], want[512];
+
+    if (sfbpf_compile_errbuf(65535, dlt, &prog, filter, optimize, 0xffffff00, 0, errbuf) < 0)
+        snprintf(line, sizeof(line), "%d %d 0 00000000 %s", dlt, optimize, label);
+    else
+    {
+        snprintf(line, sizeof(line), "%d %d %u %08x %s", dlt, optimize, prog.bf_len, hash_program(&prog), label);
+        sfbpf_freecode(&prog);
+    }
+    num_programs++;
+
+    if (generate)
+    {
+        fprintf(expected, "%s\n", line);
+        return;
+    }
+    if (!next_expected(want, sizeof(want)))
+        strcpy(want, "(end of file)");
+    if (strcmp(line, want) != 0)
+    {
+        if (num_failures++ < MAX_REPORTS)
+            printf("FAIL got \"%s\", expected \"%s\"\n", line, want);
+    }
+}
+
+static void check_filters(char **filters)
+{
+    char label[256];
+    int d, optimize;
+    char **f;
+
+    for (f = filters; *f; f++)
+    {
+        snprintf(label, sizeof(label), "%.200s", **f ? *f : "\"\"");
+        for (d = 0; d < CORPUS_NUM_DLTS; d++)
+            for (optimize = 0; optimize < 2; optimize++)
+                check(*f, label, corpus_dlts[d], optimize);
+    }
+}
+
+/* Write term k of a chain of the given shape to p. */
+static int chain_term(char *p, int shape, int k)
+{
+    switch (shape)
+    {
+    case 0:
+        return sprintf(p, "host 10.0.%d.%d", k / 256, k % 256);
+    case 1:
+        return sprintf(p, "port %d", k + 1);
+    case 2:
+        return sprintf(p, "(ip src host 10.0.%d.%d and tcp dst port %d)", k / 256, k % 256, k % 50 + 1);
+    case 3:
+        return sprintf(p, "%s", (next_rand() & 1) ? "tcp" : "udp port 53");
+    case 4:
+        return sprintf(p, "(net 10.%d.0.0/16 and not port %u)", k % 256, next_rand() % 100);
+    default:
+        return sprintf(p, "(ip6 host 2001:db8::%x or vlan %d)", k, k % 4000);
+    }
+}
+
+static void check_chains(void)
+{
+    static char filter[MAX_CHAIN * 64];
+    char label[64];
+    char *p;
+    int shape, n, k, optimize;
+
+    for (shape = 0; shape < NUM_SHAPES; shape++)
+    {
+        for (n = 1; n <= MAX_CHAIN; n = n * 2 + 1)
+        {
+            p = filter;
+            for (k = 0; k < n; k++)
+            {
+                if (k)
+                    p += sprintf(p, (shape == 3 && k % 3 == 0) ? " and " : " or ");
+                p += chain_term(p, shape, k);
+            }
+            snprintf(label, sizeof(label), "chain %d of %d terms", shape, n);
+            for (optimize = 0; optimize < 2; optimize++)
+                check(filter, label, DLT_EN10MB, optimize);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char **filters;
+    char line[512];
+
+    generate = (argc > 1 && !strcmp(argv[1], "-g"));
+    if ((filters = corpus_load()) == NULL)
+        return 1;
+    if ((expected = corpus_open("codegen.txt", generate ? "w" : "r")) == NULL)
+    {
+        fprintf(stderr, "Can't open codegen.txt.\n");
+        return 1;
+    }
+    if (generate)
+        fprintf(expected, "# Written by sfbpf_codegen -g: link type, optimize, length and hash of\n"
+                "# the program, then the filter.\n");
+
+    check_filters(filters);
+    check_chains();
+    corpus_free(filters);
+
+    if (!generate && next_expected(line, sizeof(line)))
+    {
+        num_failures++;
+        printf("FAIL codegen.txt has more programs than were compiled\n");
+    }
+    fclose(expected);
+
+    if (generate)
+        printf("%lu programs written\n", num_programs);
+    else
+        printf("%lu programs, %lu differ\n", num_programs, num_failures);
+    return num_failures != 0;
+}